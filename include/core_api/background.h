@@ -3,6 +3,8 @@
 
 #include <yafray_config.h>
 
+#include <cstdint>
+
 #include "color.h"
 #include "ray.h"
 
@@ -10,6 +12,7 @@ __BEGIN_YAFRAY
 
 struct renderState_t;
 class light_t;
+class scene_t;
 
 class YAFRAYCORE_EXPORT background_t
 {
@@ -23,6 +26,14 @@ class YAFRAYCORE_EXPORT background_t
 		*/
 		virtual bool hasIBL() { return false; }
 		virtual bool shootsCaustic() { return false; }
+		//! prepares the background for rendering the scene, called before the lights are initialized
+		virtual void init(scene_t &scene) {}
+		/*! identifies what eval() returns, like texture_t::contentKey(): backgrounds with the same
+			key can share their light sampling tables. 0 if the background does not know */
+		virtual uint64_t contentKey() const { return 0; }
+		/*! the number of distinct values around (u) and from pole to pole (v) of the background,
+			0 if it has no such resolution */
+		virtual void resolution(int &u, int &v) const { u = v = 0; }
 		virtual ~background_t() {};
 };
 
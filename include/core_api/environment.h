@@ -101,6 +101,8 @@ class YAFRAYCORE_EXPORT renderEnvironment_t
 		virtual ~renderEnvironment_t();
 		
 	protected:
+		uint64_t paramsHash(const paraMap_t &params, uint64_t h) const;
+
 		std::list< sharedlibrary_t > 	pluginHandlers;
 		std::map<std::string,light_factory_t *> 	light_factory;
 		std::map<std::string,material_factory_t *> 	material_factory;
@@ -117,6 +119,7 @@ class YAFRAYCORE_EXPORT renderEnvironment_t
 		std::map<std::string,light_t *> 	light_table;
 		std::map<std::string,material_t *> 	material_table;
 		std::map<std::string,texture_t *> 	texture_table;
+		std::map<std::string,uint64_t> 	texture_hashes; //!< hash of each texture's parameters and content
 		std::map<std::string,object3d_t *> 	object_table;
 		std::map<std::string,camera_t *> 	camera_table;
 		std::map<std::string,background_t *> background_table;
@@ -31,6 +31,8 @@
 #include <core_api/environment.h>
 #include <utilities/image_buffers.h>
 #include <utilities/tiled_array.h>
+#include <deque>
+#include <atomic>
 
 #ifdef HAVE_OPENCV
 #include <opencv2/photo/photo.hpp>
@@ -50,6 +52,7 @@ __BEGIN_YAFRAY
 class progressBar_t;
 class renderPasses_t;
 class colorPasses_t;
+class filmTileBuffer_t;
 
 // Image types define
 #define IF_IMAGE 1
@@ -87,6 +90,7 @@ class YAFRAYCORE_EXPORT imageFilm_t
 			GAUSS,
 			LANCZOS
 		};
+		struct filmSnapshot_t;
 
 		/*! imageFilm_t Constructor */
 		imageFilm_t(int width, int height, int xstart, int ystart, colorOutput_t &out, float filterSize=1.0, filterType filt=BOX,
@@ -102,8 +106,9 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		int nextPass(int numView, bool adaptive_AA, std::string integratorName, bool skipNextPass = false);
 		/*! Return the next area to be rendered
 			CAUTION! This method MUST be threadsafe!
+			Each thread takes the areas from its own queue first and steals from the other threads' queues when it runs out.
 			\return false if no area is left to be handed out, true otherwise */
-		bool nextArea(int numView, renderArea_t &a);
+		bool nextArea(int numView, renderArea_t &a, int threadID = 0);
 		/*! Indicate that all pixels inside the area have been sampled for this pass */
 		void finishArea(int numView, renderArea_t &a);
 		/*! Output all pixels to the color output */
@@ -114,6 +119,7 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		bool doMoreSamples(int x, int y) const;
 		/*!	Add image sample; dx and dy describe the position in the pixel (x,y).
 			IMPORTANT: when a is given, all samples within a are assumed to come from the same thread!
+			Such samples are accumulated without locking in the tile buffer of a, which is merged into the image in finishArea.
 			use a=0 for contributions outside the area associated with current thread!
 		*/
 		void addSample(colorPasses_t &colorPasses, int x, int y, float dx, float dy, const renderArea_t *a = nullptr, int numSample = 0, int AA_pass_number = 0, float inv_AA_max_possible_samples = 0.1f);
@@ -162,6 +168,8 @@ class YAFRAYCORE_EXPORT imageFilm_t
         bool imageFilmLoad(const std::string &filename);
 		void imageFilmLoadAllInFolder();
         bool imageFilmSave();
+        void imageFilmSaveAsync();
+        void imageFilmSaveWait();
         void imageFilmFileBackup() const;
 		void imageFilmUpdateCheckInfo();
 		bool imageFilmLoadCheckOk() const;
@@ -178,10 +186,10 @@ class YAFRAYCORE_EXPORT imageFilm_t
         void setFilmAutoSaveIntervalPasses(int interval_passes) { filmAutoSaveIntervalPasses = interval_passes; }
         void resetFilmAutoSaveTimer() { filmAutoSaveTimer = 0.0; }
 
-		void generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement = 0, colorOutput_t * out2 = nullptr, int out2displacement = 0);
-		void generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement = 0, colorOutput_t * out2 = nullptr, int out2displacement = 0);
+		void generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement = 0, colorOutput_t * out2 = nullptr, int out2displacement = 0, const filmSnapshot_t *snapshot = nullptr);
+		void generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement = 0, colorOutput_t * out2 = nullptr, int out2displacement = 0, const filmSnapshot_t *snapshot = nullptr);
 		
-		rgba2DImage_t * getImagePassFromIntPassType(int intPassType);
+		rgba2DImage_t * getImagePassFromIntPassType(int intPassType, const filmSnapshot_t *snapshot = nullptr);
         int getImagePassIndexFromIntPassType(int intPassType);
         int getAuxImagePassIndexFromIntPassType(int intPassType);
         
@@ -194,6 +202,26 @@ class YAFRAYCORE_EXPORT imageFilm_t
 #endif
 
 	protected:
+		filmTileBuffer_t *acquireTileBuffer(const renderArea_t &a);
+		void mergeTileBuffer(const renderArea_t &a);
+		void releaseTileBuffers();
+		void scheduleAreas(bool useFlags);
+
+		filmSnapshot_t *takeFilmSnapshot(bool withDensity = false);
+		template<class Film> bool writeFilmFile(const Film &film, const std::string &filmPath) const;
+		void filmSaveWorker(filmSnapshot_t *snapshot, std::string filmPath);
+		void writeImages(int numView, int flags, colorOutput_t *out, const filmSnapshot_t *snapshot);
+		void imagesSaveAsync(int numView, colorOutput_t *out);
+		void imagesSaveWait();
+		void imagesSaveWorker(int numView, colorOutput_t *out, filmSnapshot_t *snapshot);
+
+		/*! Queue of area indices assigned to one render thread */
+		struct areaQueue_t
+		{
+			std::mutex mutx;
+			std::deque<int> areas;
+		};
+
 		std::vector<rgba2DImage_t*> imagePasses; //!< rgba color buffers for the render passes
 		std::vector<rgba2DImage_t*> auxImagePasses; //!< rgba color buffers for the auxiliary image passes
 		rgb2DImage_nw_t *densityImage; //!< storage for z-buffer channel
@@ -202,7 +230,7 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		int dpHeight; //!< height of the rendering parameters badge;
 		int w, h, cx0, cx1, cy0, cy1;
 		int area_cnt, completed_cnt;
-		volatile int next_area;
+		std::vector<areaQueue_t> areaQueues; //!< per thread queues of the areas to be rendered in the current pass
 		colorSpaces_t colorSpace = RAW_MANUAL_GAMMA;
 		float gamma = 1.f;
 		colorSpaces_t colorSpace2 = RAW_MANUAL_GAMMA;	//For optional secondary file output
@@ -216,6 +244,9 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		float AA_clamp_samples;
 		float filterw, tableScale;
 		float *filterTable;
+		int filterMargin; //!< maximum number of pixels a sample can contribute to outside its own pixel
+		std::vector<filmTileBuffer_t*> tileBuffers; //!< sample buffers of the areas handed out in the current pass, indexed by area id
+		std::vector<filmTileBuffer_t*> freeTileBuffers; //!< merged tile buffers kept for reuse, protected by splitterMutex
 		colorOutput_t *output;
 		// Thread mutes for shared access
 		std::mutex imageMutex, splitterMutex, outMutex, densityImageMutex;
@@ -255,6 +286,10 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		double filmAutoSaveTimer = 0.0; //Internal timer for Film AutoSave
 		int filmAutoSavePassCounter = 0;	//Internal counter for Film AutoSave
 		int filmAutoSaveIntervalPasses = 1;
+		std::thread filmSaveThread;	//!< Background thread writing the film autosave, so the render does not wait for the disk
+		std::atomic<bool> filmSaveInProgress {false};
+		std::thread imagesSaveThread;	//!< Background thread writing the timed images autosave
+		std::atomic<bool> imagesSaveInProgress {false};
 		
         struct filmload_check_t
         {
@@ -280,27 +315,29 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		
 		filmload_check_t filmload_check;
         
+		//! The film file contents after filmload_check. Shared by save(), load() and the autosave snapshot so the format is defined only here
+		template<class Archive, class Film> static void serializeFilmData(Archive & ar, Film & film)
+		{
+			ar & boost::serialization::make_nvp("samplingOffset", film.samplingOffset);
+			ar & boost::serialization::make_nvp("baseSamplingOffset", film.baseSamplingOffset);
+			ar & boost::serialization::make_nvp("computerNode", film.computerNode);
+			ar & boost::serialization::make_nvp("imagePasses", film.imagePasses);
+			ar & boost::serialization::make_nvp("auxImagePasses", film.auxImagePasses);
+		}
+
 		friend class boost::serialization::access;
 		template<class Archive> void save(Archive & ar, const unsigned int version) const
 		{
 			Y_DEBUG<<"FilmSave computerNode="<<computerNode<<" baseSamplingOffset="<<baseSamplingOffset<<" samplingOffset="<<samplingOffset<<yendl;
 			ar & BOOST_SERIALIZATION_NVP(filmload_check);
-			ar & BOOST_SERIALIZATION_NVP(samplingOffset);
-			ar & BOOST_SERIALIZATION_NVP(baseSamplingOffset);
-			ar & BOOST_SERIALIZATION_NVP(computerNode);
-			ar & BOOST_SERIALIZATION_NVP(imagePasses);
-			ar & BOOST_SERIALIZATION_NVP(auxImagePasses);
+			serializeFilmData(ar, *this);
 		}
 		template<class Archive> void load(Archive & ar, const unsigned int version)
 		{
 			ar & BOOST_SERIALIZATION_NVP(filmload_check);
 			if(imageFilmLoadCheckOk())
 			{
-				ar & BOOST_SERIALIZATION_NVP(samplingOffset);
-				ar & BOOST_SERIALIZATION_NVP(baseSamplingOffset);
-				ar & BOOST_SERIALIZATION_NVP(computerNode);
-				ar & BOOST_SERIALIZATION_NVP(imagePasses);
-				ar & BOOST_SERIALIZATION_NVP(auxImagePasses);
+				serializeFilmData(ar, *this);
 				session.setStatusRenderResumed();
 				Y_DEBUG<<"FilmLoad computerNode="<<computerNode<<" baseSamplingOffset="<<baseSamplingOffset<<" samplingOffset="<<samplingOffset<<yendl;
 			}
@@ -51,6 +51,7 @@ struct renderArea_t
 
 	int X,Y,W,H,realX,realY,realW,realH;
 	int sx0, sx1, sy0, sy1; //!< safe area, i.e. region unaffected by samples outside (needs to be set by ImageFilm_t)
+	int id = -1; //!< index of the area within the current pass, used by imageFilm_t to find the tile sample buffer
 //	std::vector<colorA_t> image;
 //	std::vector<float> depth;
 	std::vector<bool> resample;
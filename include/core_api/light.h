@@ -3,6 +3,7 @@
 #define Y_LIGHT_H
 
 #include "ray.h"
+#include "bound.h"
 #include "scene.h"
 
 __BEGIN_YAFRAY
@@ -26,11 +27,26 @@ struct lSample_t
 	surfacePoint_t *sp; //!< surface point on the light source, may only be complete enough to call other light methods with it!
 };
 
+/*! Where and in which directions a light emits, used to sort the lights into the light tree.
+	The emission normals lie within thetaO of axis, and light leaves a point at up to thetaE
+	from its normal (pi/2 for lambertian emitters, 0 for a sharp spot cone) */
+struct lightBound_t
+{
+	bound_t bound; //!< bound of the emitting points
+	vector3d_t axis;
+	float cosThetaO, cosThetaE;
+	bool twoSided; //!< emits along the reversed normals too
+};
+
 class light_t
 {
 	public:
 		//! allow for preprocessing when scene loading has finished
 		virtual void init(scene_t &scene) {}
+		//! true if init() only prepares the light and reads its mesh, so it may run alongside the init() of other such lights
+		virtual bool initInParallel() const { return false; }
+		//! runs after init() of all the lights, one light at a time, for changes to objects shared with the scene
+		virtual void postInit(scene_t &scene) {}
 		//! total energy emmitted during whole frame
 		virtual color_t totalEnergy() const = 0;
 		//! emit a photon
@@ -56,6 +72,8 @@ class light_t
 		//! get the pdf values for sampling point sp on the light and outgoing direction wo when emitting energy (emitSample, NOT illumSample)
 		/*! sp should've been generated from illumSample or emitSample, and may only be complete enough to call light functions! */
 		virtual void emitPdf(const surfacePoint_t &sp, const vector3d_t &wo, float &areaPdf, float &dirPdf, float &cos_wo) const { areaPdf=0.f; dirPdf=0.f; }
+		//! bound of the emission for the light tree, false for lights without a finite position (sun, background...)
+		virtual bool emissionBound(lightBound_t &b) const { return false; }
 		//! (preferred) number of samples for direct lighting
 		virtual int nSamples() const { return 8; }
 		virtual ~light_t() {}
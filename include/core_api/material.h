@@ -171,6 +171,9 @@ class YAFRAYCORE_EXPORT material_t
 		/*! Materials may have to do surface point specific (pre-)calculation that need extra storage.
 			returns the required amount of "userdata" memory for all the functions that require a render state */
 		size_t getReqMem() const { return reqMem; }
+		/*! the "userdata" memory used at a surface point including the data of the materials this one is
+			made of, which lies beyond getReqMem(). Copying this much keeps the state set up by initBSDF() */
+		virtual size_t getUserDataSize() const { return reqMem; }
 
 		/*! Get materials IOR (for refracted photons) */
 
@@ -223,6 +226,10 @@ class YAFRAYCORE_EXPORT material_t
 			if(mHighestSamplingFactor < mSamplingFactor) mHighestSamplingFactor = mSamplingFactor;
 		}
 		float getSamplingFactor() const { return mSamplingFactor; }
+		/*! hash of the parameters, shader nodes and textures the material was made from,
+			set by renderEnvironment_t::createMaterial(). Materials with the same hash shade alike */
+		void setParamsHash(uint64_t h) { paramsHash = h; }
+		uint64_t getParamsHash() const { return paramsHash; }
 		
 	protected:
 		/* small function to apply bump mapping to a surface point
@@ -251,6 +258,7 @@ class YAFRAYCORE_EXPORT material_t
         color_t mWireFrameColor = color_t(1.f); //!< Wireframe shading color
         
         float mSamplingFactor = 1.f;	//!< Material sampling factor, to allow some materials to receive more samples than others
+		uint64_t paramsHash = 0;	//!< Hash of the material description, see getParamsHash()
 		static float mHighestSamplingFactor;	//!< Class shared variable containing the highest material sampling factor. This is used to calculate the max. possible samples for the Sampling pass.        
 };
 
@@ -35,6 +35,14 @@ enum photonMapProcessing_t
 	PHOTONS_REUSE
 };
 
+//! how direct light is estimated where estimateAllDirectLight() is called
+enum lightSampling_t
+{
+	LIGHTS_ALL,		//!< every light, one light picked uniformly for path vertices
+	LIGHTS_UNIFORM,	//!< one light picked uniformly
+	LIGHTS_TREE		//!< one light picked through the scene light tree
+};
+
 class YAFRAYCORE_EXPORT mcIntegrator_t: public tiledIntegrator_t
 {
 	public:
@@ -43,8 +51,10 @@ class YAFRAYCORE_EXPORT mcIntegrator_t: public tiledIntegrator_t
 	protected:
 		/*! Estimates direct light from all sources in a mc fashion and completing MIS (Multiple Importance Sampling) for a given surface point */
 		virtual color_t estimateAllDirectLight(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo, colorPasses_t &colorPasses) const;
-		/*! Like previous but for only one random light source for a given surface point */
+		/*! Like previous but for only one random light source for a given surface point, picked uniformly or through the light tree */
 		virtual color_t estimateOneDirectLight(renderState_t &state, const surfacePoint_t &sp, vector3d_t wo, int n, colorPasses_t &colorPasses) const;
+		/*! Picks the light of estimateOneDirectLight(), weight is the inverse of the probability to pick it */
+		bool pickLight(renderState_t &state, const surfacePoint_t &sp, int &lnum, float &weight) const;
 		/*! Does the actual light estimation on a specific light for the given surface point */
 		virtual color_t doLightEstimation(renderState_t &state, light_t *light, const surfacePoint_t &sp, const vector3d_t &wo, const unsigned int &loffs, colorPasses_t &colorPasses) const;
 		/*! Does recursive mc raytracing with MIS (Multiple Importance Sampling) for a given surface point */
@@ -57,11 +67,17 @@ class YAFRAYCORE_EXPORT mcIntegrator_t: public tiledIntegrator_t
 		virtual color_t sampleAmbientOcclusion(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const;
 		virtual color_t sampleAmbientOcclusionPass(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const;
 		virtual color_t sampleAmbientOcclusionPassClay(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const;
-		virtual void causticWorker(photonMap_t * causticMap, int threadID, const scene_t *scene, unsigned int nCausPhotons, pdf1D_t *lightPowerD, int numLights, const std::string &integratorName, const std::vector<light_t *> &causLights, int causDepth, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot);
+		color_t traceAmbientOcclusion(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo, bool clay, bool transparent) const;
+		/*! Shadow tests for the rays of a chunk of light or AO samples */
+		void traceShadowStream(renderState_t &state, int n, const ray_t *rays, const bool *active, bool transparent,
+			bool *shadowed, color_t *scol, float &obj_index, float &mat_index, float *objIdx, float *matIdx) const;
+		virtual void causticWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &causticSlots, const scene_t *scene, pdf1D_t *lightPowerD, int numLights, const std::vector<light_t *> &causLights, int causDepth, progressBar_t *pb, int pbStep);
 
 		int rDepth; //! Ray depth
 		bool trShad; //! Use transparent shadows
 		int sDepth; //! Shadow depth for transparent shadows
+		bool rayStreams = true; //! Trace opaque shadow rays as streams
+		lightSampling_t lightSampling = LIGHTS_ALL; //! Direct light sampling strategy
 
 		bool usePhotonCaustics; //! Use photon caustics
 		unsigned int nCausPhotons; //! Number of caustic photons (to be shoot but it should be the target
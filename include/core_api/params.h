@@ -4,6 +4,7 @@
 #include "color.h"
 #include "vector3d.h"
 #include "matrix4.h"
+#include <utilities/hashUtils.h>
 
 #include <map>
 #include <string>
@@ -98,6 +99,33 @@ class YAFRAYCORE_EXPORT paraMap_t
 		void setMatrix(const std::string &key, const matrix4x4_t &m){ mdicc[key] = m; }
 		
 		void clear() { dicc.clear(); mdicc.clear(); }
+		//! hash of all the parameters by name, type and value, continuing the hash h
+		uint64_t hash(uint64_t h = Y_HASH_SEED) const
+		{
+			for(const auto &p : dicc)
+			{
+				h = hashBytes(p.first.data(), p.first.size(), h);
+				h = hashValue(p.second.type(), h);
+				std::string s;
+				int i;
+				bool b;
+				double f;
+				point3d_t pt;
+				colorA_t c;
+				if(p.second.getVal(s)) h = hashBytes(s.data(), s.size(), h);
+				else if(p.second.getVal(i)) h = hashValue(i, h);
+				else if(p.second.getVal(b)) h = hashValue(b, h);
+				else if(p.second.getVal(f)) h = hashValue(f, h);
+				else if(p.second.getVal(pt)) h = hashValue(pt, h);
+				else if(p.second.getVal(c)) h = hashValue(c, h);
+			}
+			for(const auto &m : mdicc)
+			{
+				h = hashBytes(m.first.data(), m.first.size(), h);
+				h = hashValue(m.second, h);
+			}
+			return h;
+		}
 		//! get the actualy parameter dictionary;
 		/*	Usefull e.g. to dump it to file, since we don't provide iterators etc (yet)... */
 		const std::map<std::string,parameter_t>* getDict() const{ return &dicc; }
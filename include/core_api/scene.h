@@ -10,8 +10,10 @@
 #include <vector>
 #include <core_api/matrix4.h>
 #include <core_api/renderpasses.h>
+#include <utilities/threadUtils.h>
 
 #define USER_DATA_SIZE 1024
+#define RAY_STREAM_SIZE 64 //!< rays of a stream traced together, longer streams are split
 
 // Object flags
 
@@ -36,6 +38,10 @@ class ray_t;
 class diffRay_t;
 class primitive_t;
 class triKdTree_t;
+class triBVH_t;
+class triInstanceTree_t;
+class lightTree_t;
+struct meshShape_t;
 template<class T> class kdTree_t;
 class triangle_t;
 class background_t;
@@ -112,6 +118,13 @@ __END_YAFRAY
 
 __BEGIN_YAFRAY
 
+//! ray acceleration structure used in triangle mode
+enum sceneAccelerator_t
+{
+	ACCEL_KDTREE,
+	ACCEL_BVH
+};
+
 /*! describes an instance of a scene, including all data and functionality to
 	create and render a whole scene on the lowest "layer".
 	Allocating, configuring and deallocating scene elements etc. however has
@@ -181,7 +194,9 @@ class YAFRAYCORE_EXPORT scene_t
 		void setAntialiasing(int numSamples, int numPasses, int incSamples, double threshold, float resampled_floor, float sample_multiplier_factor, float light_sample_multiplier_factor, float indirect_sample_multiplier_factor, bool detect_color_noise, int dark_detection_type, float dark_threshold_factor, int variance_edge_size, int variance_pixels, float clamp_samples, float clamp_indirect);
 		void setNumThreads(int threads);
 		void setNumThreadsPhotons(int threads_photons);
+		void setKdTreeBuildQuality(int quality, int bins);
 		void setMode(int m){ mode = m; }
+		void setAccelerator(int accel);
 		background_t* getBackground() const;
 		triangleObject_t* getMesh(objID_t id) const;
 		object3d_t* getObject(objID_t id) const;
@@ -189,6 +204,18 @@ class YAFRAYCORE_EXPORT scene_t
 		const camera_t* getCamera() const { return camera; }
 		imageFilm_t* getImageFilm() const { return imageFilm; }
 		bound_t getSceneBound() const;
+		//! the lights sorted for importance sampling, built by update()
+		const lightTree_t* getLightTree() const { return lightTree; }
+		/*! triangles, area distribution and BVH of a mesh for the lights shaped by it. Built on
+			the first request and shared by all such lights until the geometry changes; may be
+			called by several threads at once. nullptr if there is no such mesh */
+		const meshShape_t* getMeshShape(objID_t id);
+		/*! hash of the meshes: vertices, normals, triangles and instance transforms.
+			Equal for frames that share their geometry, used to validate cached photon maps */
+		uint64_t geometryHash() const;
+		/*! hash of the materials assigned to the mesh faces, by their parameters.
+			Equal for frames that share their materials, used to validate cached photon maps */
+		uint64_t materialHash() const;
 		int getNumThreads() const { return nthreads; }
 		int getNumThreadsPhotons() const { return nthreads_photons; }
 		int getSignals() const;
@@ -198,6 +225,13 @@ class YAFRAYCORE_EXPORT scene_t
 		bool intersect(const diffRay_t &ray, surfacePoint_t &sp) const;
 		bool isShadowed(renderState_t &state, const ray_t &ray, float &obj_index, float &mat_index) const;
 		bool isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, color_t &filt, float &obj_index, float &mat_index) const;
+		/*! ray stream of opaque shadow rays: the n rays are grouped by the octant of their direction
+			and the BVH traverses each group together, other trees test the rays one by one.
+			Each ray gets the same result as its single ray call would give, obj_index and
+			mat_index are written for shadowed rays */
+		void isShadowed(renderState_t &state, int n, const ray_t *rays, bool *shadowed, float *obj_index, float *mat_index) const;
+		//! true if isShadowed() on a stream is faster than single ray tests
+		bool tracesRayStreams() const { return mode == 0 && bvh != nullptr; }
 		const renderPasses_t* getRenderPasses() const;
 		bool pass_enabled(intPassTypes_t intPassType) const;
 
@@ -224,7 +258,17 @@ class YAFRAYCORE_EXPORT scene_t
         camera_t *camera;
 		imageFilm_t *imageFilm;
 		triKdTree_t *tree; //!< kdTree for triangle-only mode
+		triBVH_t *bvh; //!< BVH for triangle-only mode, replaces tree if selected
+		triInstanceTree_t *instTree; //!< two level tree of the instances in triangle-only mode
 		kdTree_t<primitive_t> *vtree; //!< kdTree for universal mode
+		lightTree_t *lightTree; //!< light hierarchy for direct light sampling
+		struct meshShapeSlot_t
+		{
+			std::once_flag built;
+			meshShape_t *shape = nullptr;
+		};
+		std::map<objID_t, meshShapeSlot_t> meshShapes;
+		std::mutex meshShapesMutex; //!< guards the map, not the building of the shapes
 		background_t *background;
 		surfaceIntegrator_t *surfIntegrator;
 		bound_t sceneBound; //!< bounding box of all (finite) scene geometry
@@ -245,7 +289,10 @@ class YAFRAYCORE_EXPORT scene_t
 		float AA_clamp_indirect;
 		int nthreads;
 		int nthreads_photons;
+		int kdBuildQuality; //!< kd-tree build quality, see kdBuildQuality_t
+		int kdBuildBins; //!< bins per axis for the binned split search, 0 = default of the build quality
 		int mode; //!< sets the scene mode (triangle-only, virtual primitives)
+		int accelerator; //!< ray acceleration structure of triangle mode, see sceneAccelerator_t
 		int signals;
 		const renderEnvironment_t *env;	//!< reference to the environment to which this scene belongs to
 		mutable std::mutex sig_mutex;
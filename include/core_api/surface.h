@@ -44,8 +44,8 @@ class intersectData_t
 		float b1 = 0.f;
 		float b2 = 0.f;
 		float t = 0.f;
-		const vector3d_t * edge1 = nullptr;
-		const vector3d_t * edge2 = nullptr;
+		vector3d_t edge1 = vector3d_t(0.f); //!< triangle edges, stay null for other primitives
+		vector3d_t edge2 = vector3d_t(0.f);
 };
 
 /*! This holds a sampled surface point's data
@@ -99,11 +99,11 @@ class YAFRAYCORE_EXPORT surfacePoint_t
 
 inline float surfacePoint_t::getDistToNearestEdge() const
 {
-	if(data.edge1 && data.edge2)
+	if(!data.edge1.null() && !data.edge2.null())
 	{
-		float edge1len = data.edge1->length();
-		float edge2len = data.edge2->length();
-		float edge12len = (*(data.edge1) + *(data.edge2)).length() * 0.5f;
+		float edge1len = data.edge1.length();
+		float edge2len = data.edge2.length();
+		float edge12len = (data.edge1 + data.edge2).length() * 0.5f;
 		
 		float edge1dist = data.b1 * edge1len;
 		float edge2dist = data.b2 * edge2len;
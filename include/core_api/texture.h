@@ -2,6 +2,7 @@
 #define Y_TEXTURE_H
 
 #include <yafray_config.h>
+#include <cstdint>
 #include "surface.h"
 #include <core_api/color_ramp.h>
 #include <core_api/imagehandler.h>
@@ -26,6 +27,10 @@ class YAFRAYCORE_EXPORT texture_t
 		virtual float getFloat(const point3d_t &p, mipMapParams_t * mmParams = nullptr) const { return applyIntensityContrastAdjustments(getRawColor(p, mmParams).col2bri()); }
 		virtual float getFloat(int x, int y, int z, mipMapParams_t * mmParams = nullptr) const { return applyIntensityContrastAdjustments(getRawColor(x, y, z, mmParams).col2bri()); }
 
+		/* colors at n points at once, for callers like volumes that need many lookups; procedural
+		   textures override it to evaluate their noise in batches */
+		virtual void getColors(const point3d_t *p, colorA_t *out, int n) const { for(int i=0; i<n; ++i) out[i] = getColor(p[i]); }
+
 		/* gives the number of values in each dimension for discrete textures */
 		virtual void resolution(int &x, int &y, int &z) const { x=0, y=0, z=0; }
 
@@ -40,6 +45,9 @@ class YAFRAYCORE_EXPORT texture_t
 		void colorRampAddItem(colorA_t color, float position) { color_ramp->add_item(color, position); }
 		virtual ~texture_t() { if(color_ramp) { delete color_ramp; color_ramp = nullptr; } }
 		int getInterpolationType() const { return intp_type; }
+		/*! identifies what the texture returns: textures with the same key return the same colors,
+			so tables built from them can be shared. 0 if the texture does not know */
+		uint64_t contentKey() const { return content_key; }
 	
 	protected:
 		float adj_intensity = 1.f;
@@ -53,6 +61,7 @@ class YAFRAYCORE_EXPORT texture_t
 		bool adjustments_set = false;
 		color_ramp_t * color_ramp = nullptr;
 		int intp_type = INTP_BILINEAR;
+		uint64_t content_key = 0;
 };
 
 inline void angmap(const point3d_t &p, float &u, float &v)
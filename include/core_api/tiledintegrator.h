@@ -5,6 +5,8 @@
 #include <core_api/integrator.h>
 #include <core_api/imagesplitter.h>
 #include <core_api/material.h>
+#include <utilities/threadUtils.h>
+#include <memory>
 
 __BEGIN_YAFRAY
 
@@ -62,6 +64,7 @@ class YAFRAYCORE_EXPORT tiledIntegrator_t: public surfaceIntegrator_t
 		float minDepth; //!< Distance between camera and the closest object on the scene
 		bool diffRaysEnabled;	//!< Differential rays enabled/disabled - for future motion blur / interference features
 		static std::vector<int> correlativeSampleNumber;  //!< Used to sample lights more uniformly when using estimateOneDirectLight
+		std::unique_ptr<threadPool_t> threadPool; //!< Render threads, kept alive between the passes of a render
 };
 
 __END_YAFRAY
@@ -2,6 +2,9 @@
 #define Y_VOLUMETRIC_H
 
 #include <map>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
 
 #include "ray.h"
 #include "color.h"
@@ -13,6 +16,17 @@ struct renderState_t;
 struct pSample_t;
 class light_t;
 
+/*! Transmittance from the points of a volume to a light, sampled at the centers of the cells
+	of a regular grid over the volume bound, stored contiguously with x varying fastest */
+struct attenuationGrid_t
+{
+	float &at(int x, int y, int z) { return values[x + nx * (y + ny * z)]; }
+	float at(int x, int y, int z) const { return values[x + nx * (y + ny * z)]; }
+	int nx = 0, ny = 0, nz = 0;
+	std::vector<float> values;
+	uint64_t key = 0; //!< the light, the volumes and the settings the grid was computed with
+};
+
 
 class volumeHandler_t
 {
@@ -34,9 +48,11 @@ class YAFRAYCORE_EXPORT VolumeRegion {
 		haveS_a = (s_a.energy() > 1e-4f);
 		haveS_s = (s_s.energy() > 1e-4f);
 		haveL_e = (l_e.energy() > 1e-4f);
-		attGridX = 8 * attgridScale;
-		attGridY = 8 * attgridScale;
-		attGridZ = 8 * attgridScale;
+		// 8 cells per scale step along the longest side, the cells are kept roughly cubic
+		float cellSize = std::max(bBox.longX(), std::max(bBox.longY(), bBox.longZ())) / (8 * attgridScale);
+		attGridX = (cellSize > 0.f) ? std::max(1, (int)(bBox.longX() / cellSize + 0.5f)) : 1;
+		attGridY = (cellSize > 0.f) ? std::max(1, (int)(bBox.longY() / cellSize + 0.5f)) : 1;
+		attGridZ = (cellSize > 0.f) ? std::max(1, (int)(bBox.longZ() / cellSize + 0.5f)) : 1;
 	}
 
 	virtual ~VolumeRegion(){}
@@ -48,7 +64,8 @@ class YAFRAYCORE_EXPORT VolumeRegion {
 		return sigma_a(p, v) + sigma_s(p, v);
 	}
 
-	float attenuation(const point3d_t p, light_t *l);
+	//! trilinear lookup of the attenuation grid of light l, 0 outside the volume or if there is no grid
+	float attenuation(const point3d_t p, const light_t *l) const;
 
 	// w_l: dir *from* the light, w_s: direction, into which should be scattered
 	virtual float p(const vector3d_t &w_l, const vector3d_t &w_s) {
@@ -57,6 +74,7 @@ class YAFRAYCORE_EXPORT VolumeRegion {
 		return 1.f / (4.f * M_PI) * (1.f - k * k) / ((1.f - kcostheta) * (1.f - kcostheta));
 	}
 
+	//! optical thickness along the ray, offset is a random number of the ray in [0,1), or 0 if the caller has none
 	virtual color_t tau(const ray_t &ray, float step, float offset) = 0;
 
 	bool intersect(const ray_t &ray, float& t0, float& t1) {
@@ -65,8 +83,12 @@ class YAFRAYCORE_EXPORT VolumeRegion {
 
 	bound_t getBB() { return bBox; }
 
-	std::map<light_t *, float*> attenuationGridMap;
-	int attGridX, attGridY, attGridZ; // FIXME: un-hardcode
+	std::map<const light_t *, attenuationGrid_t> attenuationGridMap;
+	int attGridX, attGridY, attGridZ; //!< cells of the attenuation grids along the axes
+	/*! identifies what the volume contains: volumes with the same key have the same density and
+		coefficients, so tables built from them are still valid. Set from the parameters of the
+		volume when it is created, plugins with data of their own start it from that data */
+	uint64_t content_key = 0;
 
 	protected:
 	bound_t bBox;
@@ -14,6 +14,7 @@
 #include <yafraycore/monitor.h>
 #include <yafraycore/timer.h>
 #include <yafraycore/spectrum.h>
+#include <yafraycore/irradiancecache.h>
 #include <utilities/sample_utils.h>
 
 
@@ -37,15 +38,24 @@ class YAFRAYPLUGIN_EXPORT photonIntegrator_t: public mcIntegrator_t
 		photonIntegrator_t(unsigned int dPhotons, unsigned int cPhotons, bool transpShad=false, int shadowDepth = 4, float dsRad = 0.1f, float cRad = 0.01f);
 		~photonIntegrator_t();
 		virtual bool preprocess();
+		virtual void prePass(int samples, int offset, bool adaptive);
 		virtual colorA_t integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &colorPasses, int additionalDepth = 0) const;
 		static integrator_t* factory(paraMap_t &params, renderEnvironment_t &render);
 		virtual void preGatherWorker(preGatherData_t * gdata, float dsRad, int nSearch);
-		virtual void causticWorker(photonMap_t * causticMap, int threadID, const scene_t *scene, unsigned int nCausPhotons, const pdf1D_t *lightPowerD, int numCLights, const std::string &integratorName, const std::vector<light_t *> &tmplights, int causDepth, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot, int maxBounces);
-		virtual void diffuseWorker(photonMap_t * diffuseMap, int threadID, const scene_t *scene, unsigned int nDiffusePhotons, const pdf1D_t *lightPowerD, int numDLights, const std::string &integratorName, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot, int maxBounces, bool finalGather, preGatherData_t &pgdat);
+		virtual void causticWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &causticSlots, const scene_t *scene, const pdf1D_t *lightPowerD, int numCLights, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, int maxBounces);
+		virtual void diffuseWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &diffuseSlots, chunkSlots_t<radData_t> &radSlots, const scene_t *scene, const pdf1D_t *lightPowerD, int numDLights, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, int maxBounces, bool finalGather);
 		virtual void photonMapKdTreeWorker(photonMap_t * photonMap);
+		virtual void irradiancePrepassWorker(std::atomic<int> *nextRow, int step, int threadID);
 
 	protected:
 		color_t finalGathering(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo, colorPasses_t &colorPasses) const;
+		/*! traces one final gather path starting with pRay and adds its radiance times throughput to pathCol.
+			hitDist is the length of the first segment, or a huge value when it hits nothing */
+		void gatherPath(renderState_t &state, ray_t &pRay, color_t throughput, unsigned int offs, colorPasses_t &tmpColorPasses, color_t &pathCol, float &hitDist) const;
+		/*! final gathering through the irradiance cache: interpolates the records around sp
+			or gathers a new record, only for surfaces reflecting diffusely on one side */
+		color_t cachedFinalGathering(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const;
+		void resetIrradianceCache();
 		
 		void enableCaustics(const bool caustics) { usePhotonCaustics = caustics; }
 		void enableDiffuse(const bool diffuse) { usePhotonDiffuse = diffuse; }
@@ -59,6 +69,10 @@ class YAFRAYPLUGIN_EXPORT photonIntegrator_t: public mcIntegrator_t
 		float dsRadius; //!< diffuse search radius
 		float lookupRad; //!< square radius to lookup radiance photons, as infinity is no such good idea ;)
 		float gatherDist; //!< minimum distance to terminate path tracing (unless gatherBounces is reached)
+		bool useIrradianceCache; //!< interpolate final gathering from irradiance records
+		float irrCacheError; //!< error threshold of the irradiance cache, lower is more accurate and slower
+		int irrCachePrepass; //!< pixel spacing of the prepass seeding the irradiance cache, 0 for no prepass
+		irradianceCache_t *irrCache;
 		friend class prepassWorker_t;
 };
 
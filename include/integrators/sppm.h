@@ -18,32 +18,86 @@
 #include <yafraycore/scr_halton.h>
 #include <yafraycore/hashgrid.h>
 #include <stdint.h>
+#include <atomic>
 
 __BEGIN_YAFRAY
 
-typedef struct _HitPoint // actually are per-pixel variable, use to record the sppm's shared statistics
+//! the per-pixel variables recording the sppm's shared statistics, as structure of arrays indexed by pixel
+struct HitPoints
 {
-	float radius2; // square search-radius, shrink during the passes
-	int64_t accPhotonCount; // record the total photon this pixel gathered
-	colorA_t accPhotonFlux; // accumulated flux
-	colorA_t constantRandiance; // record the direct light for this pixel
+	void resize(size_t n, float initialRadius2)
+	{
+		radius2.assign(n, initialRadius2);
+		accPhotonCount.assign(n, 0);
+		accPhotonFlux.assign(n, colorA_t(0.f));
+		constantRandiance.assign(n, colorA_t(0.f));
+		radiusSetted.assign(n, 0);
+	}
+	std::vector<float> radius2; // square search-radius, shrink during the passes
+	std::vector<int64_t> accPhotonCount; // record the total photon this pixel gathered
+	std::vector<colorA_t> accPhotonFlux; // accumulated flux
+	std::vector<colorA_t> constantRandiance; // record the direct light for this pixel
+	std::vector<unsigned char> radiusSetted; // used by IRE to direct whether the initial radius is set or not. Not vector<bool>, threads set different pixels
+};
+
+//! a surface point found by the eye path of a pixel, the photons of the pass are splatted on it
+typedef struct _VisiblePoint
+{
+	surfacePoint_t sp;
+	vector3d_t wo; // direction back along the eye path
+	color_t weight; // throughput of the eye path up to the point
+	float countWeight; // share of the path in the photon count of the pixel
+	u_int32 pixel;
+	bool caustics; // caustic photons are only gathered on diffuse surfaces
+	size_t udat, udatSize; // the material data set up by initBSDF(), in the userdata of the row
+}VisiblePoint;
+
+//! the visible points of a row of the film, with the material data they need to evaluate their BSDF
+struct VisibleRow
+{
+	size_t size() const { return points.size(); }
+	std::vector<VisiblePoint> points;
+	std::vector<unsigned char> userdata;
+};
 
-	bool radiusSetted; // used by IRE to direct whether the initial radius is set or not.
-}HitPoint;
+//! the visible points of a pass as structure of arrays
+struct VisiblePoints
+{
+	void resize(size_t n)
+	{
+		P.resize(n); radius2.resize(n); sp.resize(n); wo.resize(n);
+		weight.resize(n); countWeight.resize(n); pixel.resize(n); caustics.resize(n); udat.resize(n + 1);
+	}
+	size_t size() const { return pixel.size(); }
+	std::vector<point3d_t> P;
+	std::vector<float> radius2; // search radius of the pixel during the pass
+	std::vector<surfacePoint_t> sp;
+	std::vector<vector3d_t> wo;
+	std::vector<color_t> weight;
+	std::vector<float> countWeight;
+	std::vector<u_int32> pixel;
+	std::vector<unsigned char> caustics; // not vector<bool>, read by several threads
+	std::vector<size_t> udat; // start of the material data of each point in userdata, and its end
+	std::vector<unsigned char> userdata;
+};
+
+//! the camera sample of a pixel in the current pass, written by the eye pass for renderTile
+typedef struct _EyeSample
+{
+	float dx, dy, wt;
+	float depth; // distance of the first hit, for the depth passes
+	colorA_t constantRandiance; // the radiance from when the gather ray hit the lightsource
+}EyeSample;
 
-//used for gather ray to collect photon information
+//used for gather ray to collect the constant radiance, the photons are splatted later on
 typedef struct _GatherInfo
 {
-	int64_t photonCount;  // the number of photons that the gather ray collected
-	colorA_t photonFlux;   // the unnormalized flux of photons that the gather ray collected
 	colorA_t constantRandiance; // the radiance from when the gather ray hit the lightsource
 
-	_GatherInfo(): photonCount(0), photonFlux(0.f),constantRandiance(0.f){}
+	_GatherInfo(): constantRandiance(0.f){}
 
 	_GatherInfo & operator +=(const _GatherInfo &g)
 	{
-		photonCount += g.photonCount;
-		photonFlux += g.photonFlux;
 		constantRandiance += g.constantRandiance;
 		return (*this);
 	}
@@ -59,19 +113,26 @@ class YAFRAYPLUGIN_EXPORT SPPM: public mcIntegrator_t
 		/*! render a tile; only required by default implementation of render() */
 		virtual bool renderTile(int numView, renderArea_t &a, int n_samples, int offset, bool adaptive, int threadID, int AA_pass_number = 0);
 		virtual bool preprocess(); //not used for now
-		// not used now
+		/*! shoots the photons of the pass, traces the eye paths and splats the photons on their visible points */
 		virtual void prePass(int samples, int offset, bool adaptive);
 		/*! not used now, use traceGatherRay instead*/
 		virtual colorA_t integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &colorPasses, int additionalDepth = 0 /*, sampler_t &sam*/) const;
 		static integrator_t* factory(paraMap_t &params, renderEnvironment_t &render);
 		/*! initializing the things that PPM uses such as initial radius */
 		void initializePPM();
-		/*! based on integrate method to do the gatering trace, need double-check deadly. */
-		GatherInfo traceGatherRay(renderState_t &state, diffRay_t &ray, HitPoint &hp, colorPasses_t &colorPasses);
-		void photonWorker(photonMap_t * diffuseMap, photonMap_t * causticMap, int threadID, const scene_t *scene, unsigned int nPhotons, const pdf1D_t *lightPowerD, int numDLights, const std::string &integratorName, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot, int maxBounces, random_t & prng);
+		/*! based on integrate method to do the gatering trace, need double-check deadly. Appends the visible points of the path to vps */
+		GatherInfo traceGatherRay(renderState_t &state, diffRay_t &ray, u_int32 pixel, VisibleRow &vps, colorPasses_t &colorPasses);
+		/*! traces the eye paths of rows of the film, each row keeps its visible points on its own */
+		void eyeWorker(std::atomic<int> *nextRow, std::vector<VisibleRow> *rows, int offset, unsigned int seed, int threadID);
+		/*! adds the photons [start, end) to the pixels of the visible points they land on, caustic photons are
+			evaluated with all the BSDF components like the caustic gather used to */
+		void splatWorker(const std::vector<photon_t> *photons, u_int32 start, u_int32 end, bool caustic);
+		/*! shoots chunks of the photon paths of a pass, halStart is the position of hal1..hal4 at the start of the pass */
+		void photonWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &diffuseSlots, chunkSlots_t<photon_t> &causticSlots, const scene_t *scene, const pdf1D_t *lightPowerD, int numDLights, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, int maxBounces, unsigned int halStart, unsigned int seed);
 		
 	protected:
-		hashGrid_t  photonGrid; // the hashgrid for holding photons
+		hashGrid_t  photonGrid; // the hashgrid for holding photons, only used by the initial radius estimate now
+		hashGrid_t  causticGrid; // the hashgrid for holding caustic photons, only used by the initial radius estimate now
 		photonMap_t diffuseMap,causticMap; // photonmap
 		pdf1D_t *lightPowerD;
 		unsigned int nPhotons; //photon number to scatter
@@ -85,7 +146,12 @@ class YAFRAYPLUGIN_EXPORT SPPM: public mcIntegrator_t
 
 		Halton hal1, hal2, hal3, hal4, hal7, hal8, hal9, hal10; // halton sequence to do
 
-		std::vector<HitPoint>hitPoints; // per-pixel refine data
+		HitPoints hitPoints; // per-pixel refine data
+		VisiblePoints visiblePoints; // the visible points of the current pass
+		hitPointGrid_t visibleGrid; // spatial hash of visiblePoints for the photon splatting
+		std::vector<EyeSample> eyeSamples; // per-pixel camera samples of the current pass
+		std::vector<colorA_t> eyePasses; // the render passes of the camera samples, colorPasses.size() per pixel
+		std::vector<std::atomic<float> > passPhotons; // photon flux R, G, B and photon count splatted on each pixel in the current pass
 
 		unsigned int nRefined; // Debug info: Refined pixel per pass
 };
@@ -23,11 +23,13 @@
 
 #include <core_api/light.h>
 #include <core_api/environment.h>
+#include <memory>
 
 __BEGIN_YAFRAY
 
 class background_t;
 class pdf1D_t;
+struct bgDistribution_t;
 
 class bgLight_t : public light_t
 {
@@ -53,6 +55,7 @@ class bgLight_t : public light_t
 		float dir_pdf(const vector3d_t dir) const;
 		float CalcFromSample(float s1, float s2, float &u, float &v, bool inv = false) const;
 		float CalcFromDir(const vector3d_t &dir, float &u, float &v, bool inv = false) const;
+		std::shared_ptr<const bgDistribution_t> distribution; //!< owns uDist and vDist, may be shared with other lights
 		pdf1D_t **uDist, *vDist;
 		int samples;
 		point3d_t worldCenter;
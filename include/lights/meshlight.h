@@ -22,15 +22,14 @@
 #define Y_MESHLIGHT_H
 
 #include <core_api/light.h>
+#include <yafraycore/meshshape.h>
 
 __BEGIN_YAFRAY
 
 class triangleObject_t;
-class triangle_t;
-class pdf1D_t;
 class paraMap_t;
 class renderEnvironment_t;
-class triKdTree_t;
+struct meshShape_t;
 
 class meshLight_t : public light_t
 {
@@ -38,6 +37,8 @@ class meshLight_t : public light_t
 		meshLight_t(unsigned int msh, const color_t &col, int sampl, bool dbl_s=false, bool bLightEnabled=true, bool bCastShadows=true);
 		virtual ~meshLight_t();
 		virtual void init(scene_t &scene);
+		virtual bool initInParallel() const { return true; }
+		virtual void postInit(scene_t &scene);
 		virtual color_t totalEnergy() const;
 		virtual color_t emitPhoton(float s1, float s2, float s3, float s4, ray_t &ray, float &ipdf) const;
 		virtual color_t emitSample(vector3d_t &wo, lSample_t &s) const;
@@ -45,24 +46,24 @@ class meshLight_t : public light_t
 		virtual bool illumSample(const surfacePoint_t &sp, lSample_t &s, ray_t &wi) const;
 		virtual bool illuminate(const surfacePoint_t &sp, color_t &col, ray_t &wi)const { return false; }
 		virtual int nSamples() const { return samples; }
-		virtual bool canIntersect() const{ return tree!=0 /* false */ ; }
+		virtual bool canIntersect() const{ return shape && shape->tree; }
 		virtual bool intersect(const ray_t &ray, float &t, color_t &col, float &ipdf) const;
 		virtual float illumPdf(const surfacePoint_t &sp, const surfacePoint_t &sp_light) const;
 		virtual void emitPdf(const surfacePoint_t &sp, const vector3d_t &wi, float &areaPdf, float &dirPdf, float &cos_wo) const;
+		virtual bool emissionBound(lightBound_t &b) const;
 		static light_t *factory(paraMap_t &params, renderEnvironment_t &render);
 	protected:
-		void initIS();
+		void initIS(const meshShape_t *meshShape);
 		void sampleSurface(point3d_t &p, vector3d_t &n, float u, float v) const;
 		unsigned int objID;
 		bool doubleSided;
 		color_t color;
-		pdf1D_t *areaDist;
-		const triangle_t **tris;
 		int samples;
 		int nTris; //!< gives the array size of uDist
 		float area, invArea;
+		lightBound_t emitBound; //!< bound of the triangles and the cone of their normals
 		triangleObject_t *mesh;
-		triKdTree_t *tree;
+		const meshShape_t *shape; //!< owned by the scene, shared with other lights of the same mesh
 		//debug stuff:
 		int *stats;
 };
@@ -35,6 +35,7 @@ class blendMat_t: public nodeMaterial_t
 		virtual float getAlpha(const renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo)const;
 		virtual bool scatterPhoton(const renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wi, vector3d_t &wo, pSample_t &s) const;
 		virtual const volumeHandler_t* getVolumeHandler(bool inside)const;
+		virtual size_t getUserDataSize() const { return std::max(reqMem + mat1->getUserDataSize(), reqMem + mmem1 + mat2->getUserDataSize()); }
 		
 		static material_t* factory(paraMap_t &params, std::list<paraMap_t> &eparams, renderEnvironment_t &render);
 	protected:
@@ -24,6 +24,7 @@ class maskMat_t: public nodeMaterial_t
 								 bool &reflect, bool &refract, vector3d_t *const dir, color_t *const col)const;
 		virtual color_t emit(const renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo)const;
 		virtual float getAlpha(const renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo)const;
+		virtual size_t getUserDataSize() const { return std::max(reqMem, sizeof(bool) + std::max(mat1->getUserDataSize(), mat2->getUserDataSize())); }
 		static material_t* factory(paraMap_t &, std::list< paraMap_t > &, renderEnvironment_t &);
 		
 	protected:
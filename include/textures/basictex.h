@@ -17,11 +17,13 @@ class textureClouds_t : public texture_t
 		virtual ~textureClouds_t();
 		virtual colorA_t getColor(const point3d_t &p, mipMapParams_t * mmParams = nullptr) const;
 		virtual float getFloat(const point3d_t &p, mipMapParams_t * mmParams = nullptr) const;
+		virtual void getColors(const point3d_t *p, colorA_t *out, int n) const;
 		
 		virtual void getInterpolationStep(float &step) const { step = size; };
 
 		static texture_t *factory(paraMap_t &params,renderEnvironment_t &render);
 	protected:
+		float applyBias(float v) const;
 		int depth, bias;
 		float size;
 		bool hard;
@@ -123,6 +125,7 @@ class textureMusgrave_t : public texture_t
 
 		virtual colorA_t getColor(const point3d_t &p, mipMapParams_t * mmParams = nullptr) const;
 		virtual float getFloat(const point3d_t &p, mipMapParams_t * mmParams = nullptr) const;
+		virtual void getColors(const point3d_t *p, colorA_t *out, int n) const;
 		
 		virtual void getInterpolationStep(float &step) const { step = size; };
 
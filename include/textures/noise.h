@@ -8,12 +8,16 @@
 
 __BEGIN_YAFRAY
 
+#define NOISE_BATCH_SIZE 16 //!< points the batch kernels process per pass
+
 class YAFRAYPLUGIN_EXPORT noiseGenerator_t
 {
 public:
 	noiseGenerator_t() {}
 	virtual ~noiseGenerator_t() {}
 	virtual float operator() (const point3d_t &pt) const=0;
+	//! noise at n points at once, out[i] is the same as (*this)(pts[i])
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const { for(int i=0; i<n; ++i) out[i] = (*this)(pts[i]); }
 	// offset only added by blendernoise
 	virtual point3d_t offset(const point3d_t &pt) const { return pt; }
 };
@@ -26,6 +30,7 @@ public:
 	newPerlin_t() {}
 	virtual ~newPerlin_t() {}
 	virtual float operator() (const point3d_t &pt) const;
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const;
 private:
 	float fade(float t) const { return t*t*t*(t*(t*6 - 15) + 10); }
 	float grad(int hash, float x, float y, float z) const
@@ -54,6 +59,7 @@ public:
 	blenderNoise_t() {}
 	virtual ~blenderNoise_t() {}
 	virtual float operator() (const point3d_t &pt) const;
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const;
 	// offset texture point coordinates by one
 	virtual point3d_t offset(const point3d_t &pt) const { return pt+point3d_t(1.0, 1.0, 1.0); }
 };
@@ -62,6 +68,8 @@ public:
 // Voronoi, a.k.a. Worley/cellular basis
 
 typedef float (*distMetricFunc)(float x, float y, float z, float e);
+// sorted distances to the 4 closest feature points, with the metric compiled in
+typedef void (*featureDistFunc)(const point3d_t &pt, float e, float da[4]);
 // distance metrics as functors
 /*struct distanceMetric_t
 {
@@ -138,17 +146,20 @@ public:
 		//if (distfunc) { delete distfunc;  distfunc=nullptr; }
 	}
 	virtual float operator() (const point3d_t &pt) const;
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const;
 	float getDistance(int x, float da[4]) const { return da[x & 3]; }
 	point3d_t getPoint(int x, point3d_t pa[4]) const { return pa[x & 3]; }
 	void setMinkovskyExponent(float me) { mk_exp=me; }
 	void getFeatures(const point3d_t &pt, float da[4], point3d_t pa[4]) const;
 	void setDistM(dMetricType dm);
 protected:
+	float featureValue(const float da[4]) const;
 	voronoiType vType;
 	dMetricType dmType;
 	float mk_exp, w1, w2, w3,w4;
 //	distanceMetric_t* distfunc; //test...replace functors
 	distMetricFunc distfunc2;
+	featureDistFunc featureDists;
 //	mutable float da[4];			// distance array
 //	mutable point3d_t pa[4];	// feature point array
 };
@@ -171,6 +182,8 @@ public:
 	musgrave_t() {}
 	virtual ~musgrave_t() {}
 	virtual float operator() (const point3d_t &pt) const=0;
+	//! values at n points at once, out[i] is the same as (*this)(pts[i])
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const { for(int i=0; i<n; ++i) out[i] = (*this)(pts[i]); }
 };
 
 class YAFRAYPLUGIN_EXPORT fBm_t : public musgrave_t
@@ -180,6 +193,7 @@ public:
 			: H(_H), lacunarity(_lacu), octaves(_octs), nGen(_nGen) {}
 	virtual ~fBm_t() {}
 	virtual float operator() (const point3d_t &pt) const;
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const;
 protected:
 	float H, lacunarity, octaves;
 	const noiseGenerator_t* nGen;
@@ -228,6 +242,7 @@ public:
 			: H(_H), lacunarity(_lacu), octaves(_octs), offset(_offs), gain(_gain), nGen(_nGen) {}
 	virtual ~ridgedMFractal_t() {}
 	virtual float operator() (const point3d_t &pt) const;
+	virtual void evaluate(const point3d_t *pts, float *out, int n) const;
 protected:
 	float H, lacunarity, octaves, offset, gain;
 	const noiseGenerator_t* nGen;
@@ -237,6 +252,8 @@ protected:
 // basic turbulence, half amplitude, double frequency defaults
 // returns value in range (0,1)
 float YAFRAYPLUGIN_EXPORT turbulence(const noiseGenerator_t* ngen, const point3d_t &pt, int oct, float size, bool hard);
+// turbulence at n points at once, one octave of all points after the other
+void YAFRAYPLUGIN_EXPORT turbulence(const noiseGenerator_t* ngen, const point3d_t *pts, float *out, int n, int oct, float size, bool hard);
 // noise cell color (used with voronoi)
 colorA_t YAFRAYPLUGIN_EXPORT cellNoiseColor(const point3d_t &pt);
 
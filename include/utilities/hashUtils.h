@@ -0,0 +1,54 @@
+/****************************************************************************
+ *
+ * 		hashUtils.h: hashing of scene data
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Y_HASHUTILS_H
+#define Y_HASHUTILS_H
+
+#include <yafray_config.h>
+
+#include <cstdint>
+#include <cstddef>
+
+__BEGIN_YAFRAY
+
+#define Y_HASH_SEED 14695981039346656037ULL //!< FNV-1a offset basis, the hash of no data
+
+//! 64 bit FNV-1a hash of bytes, continuing the hash h of the data before them
+inline uint64_t hashBytes(const void *data, size_t bytes, uint64_t h = Y_HASH_SEED)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for(size_t i=0; i<bytes; ++i)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+//! hash of a plain value, like a float or a point, continuing the hash h
+template<class T> inline uint64_t hashValue(const T &v, uint64_t h = Y_HASH_SEED)
+{
+	return hashBytes(&v, sizeof(T), h);
+}
+
+__END_YAFRAY
+
+#endif // Y_HASHUTILS_H
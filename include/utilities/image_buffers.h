@@ -35,6 +35,8 @@
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/nvp.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/version.hpp>
 
 __BEGIN_YAFRAY
 
@@ -285,6 +287,8 @@ class rgba1010108_t
 		uint8_t a = 1;
 };
 
+/*! 2D image buffer stored in a single contiguous allocation, in rows (row-major order),
+	so scanline traversals access consecutive memory */
 template <class T> class generic2DBuffer_t
 {
 public:
@@ -292,70 +296,78 @@ public:
 	
 	generic2DBuffer_t(int w, int h) : width(w), height(h)
 	{
-		data.resize(width);
-		for(int i = 0; i < width; i++) data[i].resize(height);
+		data.resize((size_t) width * height);
 	}
 	
 	~generic2DBuffer_t()
 	{
-		if(data.size() > 0)
-		{
-			for(int i = 0; i < width; i++) data[i].clear();
-			data.clear();
-		}
+		data.clear();
 	}
 	
 	inline void clear()
 	{
-		if(data.size() > 0)
-		{
-			for(int i = 0; i < width; i++) data[i].clear();
-			data.clear();
-		}
-		data.resize(width);
-		for(int i = 0; i < width; i++) data[i].resize(height);
+		data.assign((size_t) width * height, T());
 	}
 
 	inline void resize_and_clear(int new_width, int new_height)
 	{
-		if(data.size() > 0)
-		{
-			for(int i = 0; i < width; i++) data[i].clear();
-			data.clear();
-		}
-		
 		width = new_width;
 		height = new_height;
 		
-		data.resize(width);
-		for(int i = 0; i < width; i++) data[i].resize(height);
+		data.assign((size_t) width * height, T());
 	}
 
 	inline T &operator()(int x, int y)
 	{
-		return data[x][y];
+		return data[(size_t) y * width + x];
 	}
 
 	inline const T &operator()(int x, int y) const
 	{
-		return data[x][y];
+		return data[(size_t) y * width + x];
 	}
+
+	//! Pointer to the first pixel of row y, the rest of the row follows it contiguously
+	inline T *getRow(int y) { return &data[(size_t) y * width]; }
+	inline const T *getRow(int y) const { return &data[(size_t) y * width]; }
 	
-	inline int getWidth() { return width; }
-	inline int getHeight() { return height; }
+	inline int getWidth() const { return width; }
+	inline int getHeight() const { return height; }
 		
 protected:
-	std::vector< std::vector< T > > data;
-	int width;
-	int height;
+	std::vector< T > data;
+	int width = 0;
+	int height = 0;
 
 	friend class boost::serialization::access;
-	template<class Archive> void serialize(Archive & ar, const unsigned int version)
+	template<class Archive> void save(Archive & ar, const unsigned int version) const
 	{
-		ar & BOOST_SERIALIZATION_NVP(data);
 		ar & BOOST_SERIALIZATION_NVP(width);
 		ar & BOOST_SERIALIZATION_NVP(height);
+		ar & BOOST_SERIALIZATION_NVP(data);
 	}
+	template<class Archive> void load(Archive & ar, const unsigned int version)
+	{
+		if(version == 0)	//Files saved before the buffers became contiguous store one vector per column, indexed [x][y]
+		{
+			std::vector< std::vector< T > > columns;
+			ar & boost::serialization::make_nvp("data", columns);
+			ar & BOOST_SERIALIZATION_NVP(width);
+			ar & BOOST_SERIALIZATION_NVP(height);
+			data.resize((size_t) width * height);
+			for(int x = 0; x < width; ++x)
+			{
+				for(int y = 0; y < height; ++y) data[(size_t) y * width + x] = columns[x][y];
+			}
+		}
+		else
+		{
+			ar & BOOST_SERIALIZATION_NVP(width);
+			ar & BOOST_SERIALIZATION_NVP(height);
+			ar & BOOST_SERIALIZATION_NVP(data);
+		}
+	}
+	BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
 template <class T> class genericScanlineBuffer_t
@@ -416,4 +428,18 @@ typedef generic2DBuffer_t<gray8_t>		grayOptimizedImage_nw_t; //!< Non-weighted g
 
 __END_YAFRAY
 
+namespace boost {
+namespace serialization {
+
+//! Serialization version of the 2D buffers: 0 = one vector per column (old film files), 1 = contiguous rows
+template<class T> struct version< yafaray::generic2DBuffer_t<T> >
+{
+	typedef mpl::int_<1> type;
+	typedef mpl::integral_c_tag tag;
+	BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+
+} // namespace serialization
+} // namespace boost
+
 #endif
@@ -3,6 +3,7 @@
 
 #include <core_api/ray.h>
 #include <algorithm>
+#include <vector>
 #include <string.h>
 
 __BEGIN_YAFRAY
@@ -84,8 +85,16 @@ void inline CumulateStep1dDF(const float *f, int nSteps, float *integral, float
 /*! class that holds a 1D probability distribution function (pdf) and is also able to
 	take samples from it. In order to do this the cumulative distribution function (cdf)
 	is also calculated on construction.
+	Discrete samples come from an alias table (Walker/Vose) in constant time, up to
+	PDF1D_MAX_ALIAS_STEPS steps. In larger tables a float sample has too few bits left
+	within a step for the alias test to be fair, so they search the cdf. Continuous
+	samples invert the cdf, which keeps neighbouring sample values in neighbouring steps
+	(stratified samples stay stratified); a guide table of one cdf position per 1/count
+	of the sample range narrows the search to the few steps within that range.
 */
 
+#define PDF1D_MAX_ALIAS_STEPS (1 << 14)
+
 class pdf1D_t
 {
 public:
@@ -99,15 +108,20 @@ public:
 		CumulateStep1dDF(func, n, &integral, cdf);
 		invIntegral = 1.f / integral;
 		invCount = 1.f / count;
+		buildGuide();
+		if(count <= PDF1D_MAX_ALIAS_STEPS) buildAlias();
+		else aliasProb = nullptr, alias = nullptr;
 	}
 	~pdf1D_t()
 	{
 		delete[] func, delete[] cdf;
+		delete[] guide, delete[] aliasProb, delete[] alias;
 	}
 	float Sample(float u, float *pdf)const
 	{
-		// Find surrounding cdf segments
-		float *ptr = std::lower_bound(cdf, cdf+count+1, u);
+		// Find surrounding cdf segments, the guide of u's range holds the first one that may contain u
+		int k = std::max(0, std::min((int)((double)u * count), count - 1));
+		float *ptr = std::lower_bound(cdf + guide[k], cdf + guide[k+1] + 1, u);
 		int index = (int) (ptr-cdf-1);
 		if(index<0) //Hopefully this should no longer be necessary from now on, as a minimum value slightly over 0.f has been set to the scrHalton function to avoid ptr and cdf to coincide (which caused index = -1)
 		{
@@ -121,19 +135,33 @@ public:
 	}
 	// take a discrete sample.
 	// determines an index in the array from which the CDF was taked from, rather than a sample in [0;1]
-	int DSample(float u, float *pdf)const
+	// uRemapped gets a fresh uniform value in [0;1) from what is left of u, e.g. to sample within the chosen step
+	int DSample(float u, float *pdf, float *uRemapped=nullptr)const
 	{
-		if(u == 0.f)
+		int index;
+		if(alias)
 		{
-			*pdf = func[0] * invIntegral;
-			return 0;
+			double ud = (double)u * count;
+			index = std::max(0, std::min((int)ud, count - 1));
+			float up = (float)(ud - index);
+			float q = aliasProb[index];
+			if(up < q)
+			{
+				if(uRemapped) *uRemapped = up / q;
+			}
+			else
+			{
+				if(uRemapped) *uRemapped = std::min((up - q) / (1.f - q), 0.99999994f);
+				index = alias[index];
+			}
 		}
-		float *ptr = std::lower_bound(cdf, cdf+count+1, u);
-		int index = (int) (ptr-cdf-1);
-		if(index<0)
+		else
 		{
-		    Y_ERROR << "Index out of bounds in pdf1D_t::Sample: index, u, ptr, cdf = " << index << ", " << u << ", " << ptr << ", " << cdf << yendl;
-		    index=0;
+			// the step with cdf[index] <= u < cdf[index+1], so steps without weight are never taken
+			int k = std::max(0, std::min((int)((double)u * count), count - 1));
+			const float *ptr = std::upper_bound(cdf + guide[k], cdf + guide[k+1] + 1, u);
+			index = std::max(0, std::min((int)(ptr - cdf - 1), count - 1));
+			if(uRemapped) *uRemapped = std::max(0.f, std::min((u - cdf[index]) / (cdf[index+1] - cdf[index]), 0.99999994f));
 		}
 		if(pdf) *pdf = func[index] * invIntegral;
 		return index;
@@ -142,6 +170,51 @@ public:
 	float *func, *cdf;
 	float integral, invIntegral, invCount;
 	int count;
+private:
+	void buildGuide()
+	{
+		guide = new int[count+1];
+		int p = 0;
+		for(int k=0; k<=count; ++k)
+		{
+			double t = (double)k / (double)count;
+			while(p < count && (double)cdf[p] < t) ++p;
+			guide[k] = p;
+		}
+	}
+	//! Vose's method: steps below the mean probability are topped up by one above it
+	void buildAlias()
+	{
+		aliasProb = new float[count];
+		alias = new int[count];
+		std::vector<double> p(count);
+		std::vector<int> small, large;
+		for(int i=0; i<count; ++i)
+		{
+			p[i] = (integral > 0.f) ? (double)func[i] / (double)integral : 1.0; // mean 1
+			if(p[i] < 1.0) small.push_back(i);
+			else large.push_back(i);
+		}
+		while(!small.empty() && !large.empty())
+		{
+			int s = small.back(), l = large.back();
+			small.pop_back();
+			aliasProb[s] = (float)p[s];
+			alias[s] = l;
+			p[l] = (p[l] + p[s]) - 1.0;
+			if(p[l] < 1.0)
+			{
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// what is left is (up to rounding) exactly the mean probability
+		for(int i : large) { aliasProb[i] = 1.f; alias[i] = i; }
+		for(int i : small) { aliasProb[i] = 1.f; alias[i] = i; }
+	}
+	int *guide; //!< first cdf entry of each 1/count of the sample range, count+1 entries
+	float *aliasProb; //!< probability to keep a step rather than take its alias, nullptr above PDF1D_MAX_ALIAS_STEPS
+	int *alias;
 };
 
 // rotate the coord-system D, U, V with minimum rotation so that D gets
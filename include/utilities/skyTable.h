@@ -0,0 +1,106 @@
+/****************************************************************************
+ *
+ * 		skyTable.h: precomputed lat-long table of an analytic sky
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Y_SKYTABLE_H
+#define Y_SKYTABLE_H
+
+#include <yafray_config.h>
+
+#include <core_api/color.h>
+#include <core_api/texture.h>
+#include <utilities/threadUtils.h>
+#include <vector>
+#include <functional>
+
+__BEGIN_YAFRAY
+
+/*! Sky colors in a float RGB lat-long table, laid out like spheremap(): u goes around the z axis,
+	v from the bottom (v=0) to the top (v=1). The texel centers sit at (x+0.5)/width, (y+0.5)/height,
+	lookups are bilinear, wrapping around in u and clamped at the poles */
+class skyTable_t
+{
+	public:
+		bool empty() const { return data.empty(); }
+		int getWidth() const { return width; }
+		int getHeight() const { return height; }
+
+		//! evaluates the sky for every texel, rows are shared out among the threads
+		void build(int w, int h, int threads, const std::function<color_t(const vector3d_t &)> &sky)
+		{
+			width = w;
+			height = h;
+			data.assign(3 * (size_t)w * h, 0.f);
+			auto buildRows = [this, &sky, threads](int first)
+			{
+				vector3d_t dir;
+				for(int y = first; y < height; y += threads)
+				{
+					float *row = &data[3 * (size_t)y * width];
+					for(int x = 0; x < width; x++)
+					{
+						invSpheremap(((float)x + 0.5f) / width, ((float)y + 0.5f) / height, dir);
+						color_t c = sky(dir);
+						row[3 * x] = c.R;
+						row[3 * x + 1] = c.G;
+						row[3 * x + 2] = c.B;
+					}
+				}
+			};
+			if(threads <= 1) buildRows(0);
+			else
+			{
+				threadPool_t pool(threads);
+				pool.run(buildRows);
+				pool.wait();
+			}
+		}
+
+		color_t lookup(const vector3d_t &dir) const
+		{
+			float u, v;
+			spheremap(dir, u, v);
+			float fx = u * width - 0.5f;
+			float fy = v * height - 0.5f;
+			int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+			float dx = fx - x0, dy = fy - y0;
+			int x1 = x0 + 1, y1 = y0 + 1;
+			if(x0 < 0) x0 += width;
+			if(x1 >= width) x1 -= width;
+			y0 = std::max(0, std::min(y0, height - 1));
+			y1 = std::max(0, std::min(y1, height - 1));
+			return (1.f - dy) * ((1.f - dx) * texel(x0, y0) + dx * texel(x1, y0)) +
+					dy * ((1.f - dx) * texel(x0, y1) + dx * texel(x1, y1));
+		}
+
+	protected:
+		color_t texel(int x, int y) const
+		{
+			const float *p = &data[3 * ((size_t)y * width + x)];
+			return color_t(p[0], p[1], p[2]);
+		}
+
+		int width = 0, height = 0;
+		std::vector<float> data;
+};
+
+__END_YAFRAY
+
+#endif // Y_SKYTABLE_H
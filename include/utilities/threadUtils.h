@@ -37,8 +37,77 @@
 	#include <condition_variable>
 #endif
 
+#include <vector>
+#include <functional>
+
 __BEGIN_YAFRAY
 
+/*! Fixed set of worker threads kept alive between jobs, so that the render passes
+	do not need to spawn and join their own threads every time.
+	run() hands the same job to every worker, each one receiving its own thread index.
+	Only one job can be in progress at a time: call wait() before the next run(). */
+class threadPool_t
+{
+	public:
+		threadPool_t(int nThreads)
+		{
+			for(int i=0; i<nThreads; ++i) workers.push_back(std::thread(&threadPool_t::workerLoop, this, i));
+		}
+		~threadPool_t()
+		{
+			std::unique_lock<std::mutex> lk(m);
+			stopping = true;
+			jobCV.notify_all();
+			lk.unlock();
+			for(auto& t : workers) t.join();
+		}
+		int size() const { return (int) workers.size(); }
+		//! Starts the job in all the workers and returns immediately
+		void run(const std::function<void(int)> &job)
+		{
+			std::unique_lock<std::mutex> lk(m);
+			currentJob = job;
+			pending = (int) workers.size();
+			++jobNumber;
+			jobCV.notify_all();
+		}
+		//! Blocks until all the workers have finished the current job
+		void wait()
+		{
+			std::unique_lock<std::mutex> lk(m);
+			while(pending > 0) doneCV.wait(lk);
+		}
+
+	protected:
+		void workerLoop(int threadID)
+		{
+			unsigned int lastJob = 0;
+			while(true)
+			{
+				std::function<void(int)> job;
+				{
+					std::unique_lock<std::mutex> lk(m);
+					while(!stopping && jobNumber == lastJob) jobCV.wait(lk);
+					if(stopping) return;
+					lastJob = jobNumber;
+					job = currentJob;
+				}
+				job(threadID);
+				std::unique_lock<std::mutex> lk(m);
+				if(--pending == 0) doneCV.notify_all();
+			}
+		}
+
+		std::vector<std::thread> workers;
+		std::mutex m;
+		std::condition_variable jobCV; //!< signals the workers that a new job (or the stop request) is available
+		std::condition_variable doneCV; //!< signals wait() that the last worker finished the current job
+		std::function<void(int)> currentJob;
+		unsigned int jobNumber = 0;
+		int pending = 0; //!< number of workers still running the current job
+		bool stopping = false;
+};
+
 __END_YAFRAY
 
 #endif
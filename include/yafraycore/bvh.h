@@ -0,0 +1,101 @@
+#ifndef __Y_BVH_H
+#define __Y_BVH_H
+
+#include <yafray_config.h>
+
+#include <vector>
+
+#include <utilities/y_alloc.h>
+#include <core_api/bound.h>
+#include <core_api/object3d.h>
+#include <yafraycore/meshtypes.h>
+#include <yafraycore/kdtree.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define Y_BVH_SSE 1
+#else
+	#define Y_BVH_SSE 0
+#endif
+
+__BEGIN_YAFRAY
+
+struct renderState_t;
+
+#define BVH_WIDTH 4 //!< children per node and triangles per leaf block
+#define BVH_MAX_DEPTH 64 //!< depth limit of the binary build tree, deeper nodes become leaves
+#define BVH_STREAM_SIZE 64 //!< most rays traversed together by one stream call
+
+/*! Node of the 4-wide BVH. The boxes of the four children are stored
+	as structure of arrays so one ray is tested against all of them at once.
+	Children with count 0 are inner nodes, otherwise child is the first
+	triangle block of a leaf; unused slots have child -1 and an empty box */
+struct bvhNode_t
+{
+	float bounds[2][3][BVH_WIDTH]; //!< [min/max][axis][child]
+	int child[BVH_WIDTH];
+	u_int32 count[BVH_WIDTH]; //!< number of triangle blocks of a leaf child
+};
+
+/*! Intersection data of four triangles in SoA layout: first vertex,
+	both edges and the bias factor, exactly as triangle_t::intersect uses them.
+	Unused lanes have a null triangle and an infinite bias, so they never hit */
+struct bvhTriBlock_t
+{
+	float a[3][BVH_WIDTH];
+	float edge1[3][BVH_WIDTH];
+	float edge2[3][BVH_WIDTH];
+	float epsilon[BVH_WIDTH];
+	const triangle_t *tri[BVH_WIDTH];
+};
+
+/*! Bounding volume hierarchy for triangle mode, an alternative to triKdTree_t
+	with the same intersection interface. A binary tree is built with binned SAH
+	and collapsed into 4-wide nodes, which are traversed with SSE box tests.
+	Each triangle is referenced exactly once, so leaves never need clipping and
+	transparent shadows do not have to filter duplicate hits */
+class YAFRAYCORE_EXPORT triBVH_t
+{
+public:
+	triBVH_t(const triangle_t **v, int np, float cost_ratio=1.f, int quality=KD_QUALITY_HIGH, int bins=0);
+	bool Intersect(const ray_t &ray, float dist, triangle_t **tr, float &Z, intersectData_t &data) const;
+	bool IntersectS(const ray_t &ray, float dist, triangle_t **tr, float shadow_bias) const;
+	/*! occlusion test of up to BVH_STREAM_SIZE rays traversed together, so each node is fetched
+		once for all the rays reaching it. Gives every ray the result of IntersectS,
+		rays already marked in occluded are skipped */
+	void IntersectS(int n, const ray_t *rays, const float *dist, triangle_t **tr, bool *occluded, float shadow_bias) const;
+	/*! transparent shadows; when tracing the tree of an instanced base mesh in object space,
+		instance makes the transparency be evaluated on the world space surface. If the ray is not
+		blocked, layers gets the transparent surfaces it passed, which the next tree traced for the
+		same ray takes off its maxDepth */
+	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias,
+		const triangleObjectInstance_t *instance=nullptr, int *layers=nullptr) const;
+	bound_t getBound(){ return treeBound; }
+	~triBVH_t();
+private:
+	struct buildNode_t;
+	int buildBinary(std::vector<buildNode_t> &bnodes, u_int32 first, u_int32 last, const bound_t &nodeBound, int depth);
+	int collapse(const std::vector<buildNode_t> &bnodes, int bIdx, const triangle_t **v,
+		std::vector<bvhNode_t> &qnodes, std::vector<bvhTriBlock_t> &qblocks);
+
+	float 		costRatio; 	//!< box test cost of a node divided by the triangle intersection cost
+	int 		numBins; 	//!< bins per axis of the binned SAH split search
+	int 		quality;
+	bound_t 	treeBound; 	//!< overall space the tree encloses
+	bvhNode_t 	*nodes;
+	bvhTriBlock_t *blocks;
+	u_int32 	nNodes, nBlocks;
+
+	// temporary build data
+	std::vector<u_int32> primIdx;
+	std::vector<bound_t> primBounds;
+	std::vector<point3d_t> centroids;
+	std::vector<u_int32> binCount, rightCount; //!< per bin scratch of the split search
+	std::vector<bound_t> binBound;
+	std::vector<float> rightArea;
+	int 		deepestLeaf;
+	u_int32 	nLeaves;
+	double 		sahCost; //!< area weighted SAH cost of the binary tree
+};
+
+__END_YAFRAY
+#endif	//__Y_BVH_H
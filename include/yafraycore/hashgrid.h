@@ -1,41 +1,106 @@
 #ifndef __Y_HASHGRID_H
 #define __Y_HASHGRID_H
 
-#include <list>
 #include <yafraycore/photon.h>
 
 __BEGIN_YAFRAY
 
+/*! Spatial hash of the photons of one SPPM pass. The photons are counting-sorted
+	by hash bucket, so the photons of a bucket are adjacent and a bucket is just
+	a range of the photon array. The number of buckets follows the number of photons */
 class YAFRAYCORE_EXPORT hashGrid_t
 {
 public:
-	hashGrid_t(){hashGrid = nullptr;}
+	hashGrid_t(): cellSize(1.f), invcellSize(1.f), gridSize(0) {}
 
-	hashGrid_t(double _cellSize, unsigned int _gridSize, bound_t _bBox);
+	hashGrid_t(float _cellSize, bound_t _bBox);
 
-	void setParm(double _cellSize, unsigned int _gridSize, bound_t _bBox);
+	void setParm(float _cellSize, bound_t _bBox);
 
 	void clear(); //remove all the photons in the grid;
 
-	void updateGrid(); //build the hashgrid
+	void updateGrid(int threads=1); //build the hashgrid
 
 	void pushPhoton(photon_t &p);
+	void swapVector(std::vector<photon_t> &vec) { photons.swap(vec); }
+	int nPhotons() const { return photons.size(); }
 
-	unsigned int gather(const point3d_t &P, foundPhoton_t *found, unsigned int K, float radius);
+	/*! same as photonMap_t::gather: finds up to K photons closest to P within sqrt(sqRadius)
+		and lowers sqRadius once K photons are found */
+	unsigned int gather(const point3d_t &P, foundPhoton_t *found, unsigned int K, float &sqRadius) const;
 
 private:
-	unsigned int Hash(const int ix, const int iy, const int iz) {
-		return (unsigned int)((ix * 73856093) ^ (iy * 19349663) ^ (iz * 83492791)) % gridSize;
+	unsigned int Hash(const int ix, const int iy, const int iz) const {
+		return ((u_int32)ix * 73856093u ^ (u_int32)iy * 19349663u ^ (u_int32)iz * 83492791u) & (gridSize - 1);
 	}
+	int cellCoord(float p, float a) const { return (int)std::floor((p - a) * invcellSize); }
+	void countWorker(u_int32 start, u_int32 end, u_int32 *cellIndex, u_int32 *counts) const;
+	void scatterWorker(u_int32 start, u_int32 end, const u_int32 *cellIndex, u_int32 *offsets, photon_t *sorted) const;
 
 public:
-	double cellSize, invcellSize;
-	unsigned int gridSize;
+	float cellSize, invcellSize;
+	unsigned int gridSize; //!< number of buckets, a power of two
 	bound_t bBox;
-	std::vector<photon_t>photons;
-	std::list<photon_t*> **hashGrid;
+	std::vector<photon_t>photons; //!< sorted by bucket after updateGrid()
+	std::vector<u_int32> cellStart; //!< first photon of each bucket, gridSize+1 entries
+};
+
+/*! Spatial hash of the hit points of an SPPM pass, the other way round from hashGrid_t:
+	a hit point is stored in the buckets of all the cells its search sphere overlaps,
+	so a photon finds every hit point it lands on in the one bucket of its own cell.
+	The entries are counting-sorted by bucket like in hashGrid_t and kept as structure
+	of arrays, a photon only reads the positions and radii it tests. Hit points whose
+	sphere overlaps too many cells are kept once in an overflow list after the buckets */
+class YAFRAYCORE_EXPORT hitPointGrid_t
+{
+public:
+	hitPointGrid_t(): cellSize(1.f), invcellSize(1.f), gridSize(0) {}
+
+	/*! rebuilds the grid over the n hit points at P with squared search radii radius2 */
+	void build(const point3d_t *P, const float *radius2, u_int32 n, float _cellSize, const bound_t &_bBox, int threads=1);
+	void clear();
+	u_int32 nEntries() const { return index.size(); }
+
+	//! calls proc(i) for every hit point i whose search sphere contains P
+	template <class Proc> void lookup(const point3d_t &P, Proc &proc) const
+	{
+		if(!gridSize) return;
+		u_int32 b = Hash(cellCoord(P.x, bBox.a.x), cellCoord(P.y, bBox.a.y), cellCoord(P.z, bBox.a.z));
+		lookupEntries(cellStart[b], cellStart[b+1], P, proc);
+		lookupEntries(cellStart[gridSize], index.size(), P, proc);
+	}
+
+private:
+	unsigned int Hash(const int ix, const int iy, const int iz) const {
+		return ((u_int32)ix * 73856093u ^ (u_int32)iy * 19349663u ^ (u_int32)iz * 83492791u) & (gridSize - 1);
+	}
+	int cellCoord(float p, float a) const { return (int)std::floor((p - a) * invcellSize); }
+	template <class Proc> void lookupEntries(u_int32 start, u_int32 end, const point3d_t &P, Proc &proc) const
+	{
+		for(u_int32 e=start; e<end; ++e)
+		{
+			float dx = x[e] - P.x, dy = y[e] - P.y, dz = z[e] - P.z;
+			if(dx*dx + dy*dy + dz*dz < r2[e]) proc(index[e]);
+		}
+	}
+	void setEntry(u_int32 e, const point3d_t &P, float radius2, u_int32 i)
+	{
+		x[e] = P.x; y[e] = P.y; z[e] = P.z;
+		r2[e] = radius2;
+		index[e] = i;
+	}
+	u_int32 buckets(const point3d_t &P, float radius2, std::vector<u_int32> &out) const;
+	void countWorker(u_int32 start, u_int32 end, const point3d_t *P, const float *radius2, u_int32 *counts, std::vector<u_int32> *overflow) const;
+	void scatterWorker(u_int32 start, u_int32 end, const point3d_t *P, const float *radius2, u_int32 *offsets);
+
+	float cellSize, invcellSize;
+	unsigned int gridSize; //!< number of buckets, a power of two
+	bound_t bBox;
+	std::vector<float> x, y, z, r2; //!< position and squared radius of the hit point of each entry
+	std::vector<u_int32> index; //!< hit point of each entry
+	std::vector<u_int32> cellStart; //!< first entry of each bucket, gridSize+1 entries, the overflow list starts at cellStart[gridSize]
 };
 
 
 __END_YAFRAY
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,71 @@
+#ifndef __Y_INSTANCETREE_H
+#define __Y_INSTANCETREE_H
+
+#include <yafray_config.h>
+
+#include <map>
+#include <vector>
+
+#include <core_api/bound.h>
+#include <core_api/matrix4.h>
+#include <yafraycore/meshtypes.h>
+#include <yafraycore/kdtree.h>
+
+__BEGIN_YAFRAY
+
+struct renderState_t;
+class triBVH_t;
+
+/*! Two level acceleration structure for the instances of triangle mode.
+	Each base mesh gets one object space tree (kd-tree or BVH, like the rest
+	of the scene) that all its instances share. A small BVH over the world
+	bounds of the instances finds the ones a ray passes, and the ray is then
+	transformed into their object space to trace the shared tree.
+	So memory and build time grow with the unique geometry, not with the
+	number of instances. Hits return the base triangle and the instance it
+	was found in, the surface has to be computed by the instance */
+class YAFRAYCORE_EXPORT triInstanceTree_t
+{
+public:
+	triInstanceTree_t(const std::vector<const triangleObjectInstance_t *> &insts, int accelerator, int threads=1, int quality=KD_QUALITY_HIGH, int bins=0);
+	bool Intersect(const ray_t &ray, float dist, triangle_t **tr, const triangleObjectInstance_t **inst, float &Z, intersectData_t &data) const;
+	bool IntersectS(const ray_t &ray, float dist, triangle_t **tr, const triangleObjectInstance_t **inst, float shadow_bias) const;
+	//! transparent shadows, the instances the ray passes share maxDepth like the triangle trees do
+	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, const triangleObjectInstance_t **inst,
+		color_t &filt, float shadow_bias) const;
+	bound_t getBound(){ return treeBound; }
+	~triInstanceTree_t();
+private:
+	//! object space tree of a base mesh, only one of them is built
+	struct baseTree_t
+	{
+		triKdTree_t *tree;
+		triBVH_t *bvh;
+	};
+	struct instance_t
+	{
+		const triangleObjectInstance_t *obj;
+		const baseTree_t *base;
+		matrix4x4_t worldToObj;
+		bound_t bound; //!< world space bound
+		point3d_t center;
+	};
+	//! node of the top level tree, the left child directly follows its parent
+	struct node_t
+	{
+		bound_t bound;
+		u_int32 rightChild; //!< 0 for leaves
+		u_int32 first, count; //!< range of a leaf in instances
+	};
+	u_int32 buildTree(u_int32 first, u_int32 last, int depth);
+	void toObject(const instance_t &inst, const ray_t &ray, ray_t &objRay) const;
+
+	std::map<const triangleObject_t *, baseTree_t> baseTrees;
+	std::vector<instance_t> instances;
+	std::vector<node_t> nodes;
+	bound_t treeBound;
+	int deepestLeaf;
+};
+
+__END_YAFRAY
+#endif	//__Y_INSTANCETREE_H
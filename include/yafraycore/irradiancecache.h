@@ -0,0 +1,60 @@
+#ifndef Y_IRRADIANCECACHE_H
+#define Y_IRRADIANCECACHE_H
+
+#include <yafray_config.h>
+
+#include <core_api/color.h>
+#include <core_api/vector3d.h>
+#include <yafraycore/octree.h>
+#include <atomic>
+
+__BEGIN_YAFRAY
+
+/*! Irradiance at a surface point with its rotational and translational gradients,
+	one gradient vector per color channel (Ward & Heckbert, "Irradiance Gradients").
+	E is the mean radiance over the cosine weighted hemisphere, i.e. the irradiance
+	divided by pi, so a lambertian surface reflects its diffuse color times E */
+struct irradianceRecord_t
+{
+	point3d_t P;
+	vector3d_t N;
+	color_t E;
+	float R; //!< harmonic mean distance of the hemisphere samples, clamped to the cache spacing
+	vector3d_t rotGrad[3];
+	vector3d_t transGrad[3];
+};
+
+/*! World space cache of irradiance records, interpolated with Ward's error
+	metric: a record is used at a point if its distance divided by R plus the
+	normal deviation stays below the error threshold. Any number of threads may
+	add records and interpolate at the same time */
+class YAFRAYCORE_EXPORT irradianceCache_t
+{
+	public:
+		/*! error is Ward's a, lower values make more records; record distances are clamped to
+			[minSpacing, maxSpacing] so corners and open spaces still get a sane number of records */
+		irradianceCache_t(const bound_t &sceneBound, float error, float minSpacing, float maxSpacing);
+		/*! interpolates the records valid at P, false if there are none */
+		bool interpolate(const point3d_t &P, const vector3d_t &N, color_t &E) const;
+		/*! theta and phi strata of a record made of about the given number of samples */
+		static void strata(int samples, int &M, int &N);
+		/*! direction of the hemisphere sample in theta stratum j and phi stratum k, jittered by s1, s2 */
+		static vector3d_t sampleDir(const vector3d_t &N, const vector3d_t &U, const vector3d_t &V, int j, int k, int M, int Nphi, float s1, float s2);
+		/*! builds a record from the radiance L and the hit distance dist of the M*Nphi samples
+			(sample j*Nphi+k, missed rays should have a huge but finite distance) */
+		irradianceRecord_t makeRecord(const point3d_t &P, const vector3d_t &N, const vector3d_t &U, const vector3d_t &V,
+				int M, int Nphi, const color_t *L, const float *dist) const;
+		void add(const irradianceRecord_t &rec);
+		int nRecords() const { return records; }
+		float getError() const { return a; }
+
+	private:
+		octree_t<irradianceRecord_t> tree;
+		float a, invA;
+		float minSpacing, maxSpacing;
+		std::atomic<int> records;
+};
+
+__END_YAFRAY
+
+#endif // Y_IRRADIANCECACHE_H
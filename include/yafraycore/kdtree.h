@@ -4,20 +4,62 @@
 #include <yafray_config.h>
 
 #include <algorithm>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include <utilities/y_alloc.h>
+#include <utilities/threadUtils.h>
 #include <core_api/bound.h>
 #include <core_api/object3d.h>
 #include <yafraycore/meshtypes.h>
 
 __BEGIN_YAFRAY
 
-extern int Kd_inodes, Kd_leaves, _emptyKd_leaves, Kd_prims;
-
 struct renderState_t;
 
 #define PRIM_DAT_SIZE 32
 
+/*! How hard the kd-tree builders look for the best split of each node.
+	High bins big nodes finely and sweeps all edges of the small ones,
+	fast only uses coarse binning: quicker to build, slower to trace */
+enum kdBuildQuality_t
+{
+	KD_QUALITY_FAST,
+	KD_QUALITY_MEDIUM,
+	KD_QUALITY_HIGH
+};
+
+inline const char *kdBuildQualityName(int quality)
+{
+	switch(quality)
+	{
+		case KD_QUALITY_FAST: return "fast";
+		case KD_QUALITY_MEDIUM: return "medium";
+		default: return "high";
+	}
+}
+
+/*! Build statistics. Every build task counts its own and they are summed
+	up once the whole tree is finished */
+struct kdBuildStats_t
+{
+	void add(const kdBuildStats_t &s)
+	{
+		inodes += s.inodes; leaves += s.leaves; emptyLeaves += s.emptyLeaves; prims += s.prims;
+		clip += s.clip; badClip += s.badClip; nullClip += s.nullClip; earlyOut += s.earlyOut;
+		depthLimitReached += s.depthLimitReached; badSplits += s.badSplits;
+		deepestLeaf = std::max(deepestLeaf, s.deepestLeaf);
+	}
+	int inodes = 0, leaves = 0, emptyLeaves = 0, prims = 0;
+	int clip = 0, badClip = 0, nullClip = 0, earlyOut = 0;
+	int depthLimitReached = 0, badSplits = 0;
+	int deepestLeaf = 0;
+};
+
 // ============================================================
 /*! kd-tree nodes, kept as small as possible
     double precision float and/or 64 bit system: 12bytes
@@ -26,27 +68,27 @@ struct renderState_t;
 class kdTreeNode
 {
 public:
-	void createLeaf(u_int32 *primIdx, int np, const triangle_t **prims, MemoryArena &arena)
+	void createLeaf(u_int32 *primIdx, int np, MemoryArena &arena, kdBuildStats_t &stats)
 	{
 		primitives = 0;
 		flags = np << 2;
 		flags |= 3;
 		if(np>1)
 		{
-			primitives = (triangle_t **)arena.Alloc(np * sizeof(triangle_t *));
-			for(int i=0;i<np;i++) primitives[i] = (triangle_t *)prims[primIdx[i]];
-			Kd_prims+=np; //stat
+			primitives = (u_int32 *)arena.Alloc(np * sizeof(u_int32));
+			for(int i=0;i<np;i++) primitives[i] = primIdx[i];
+			stats.prims+=np; //stat
 		}
 		else if(np==1)
 		{
-			onePrimitive = (triangle_t *)prims[primIdx[0]];
-			Kd_prims++; //stat
+			onePrimitive = primIdx[0];
+			stats.prims++; //stat
 		}
-		else _emptyKd_leaves++; //stat
-		Kd_leaves++; //stat
+		else stats.emptyLeaves++; //stat
+		stats.leaves++; //stat
 	}
-	void createInterior(int axis, float d)
-	{	division = d; flags = (flags & ~3) | axis; Kd_inodes++; }
+	void createInterior(int axis, float d, kdBuildStats_t &stats)
+	{	division = d; flags = (flags & ~3) | axis; stats.inodes++; }
 	float 	SplitPos() const { return division; }
 	int 	SplitAxis() const { return flags & 3; }
 	int 	nPrimitives() const { return flags >> 2; }
@@ -57,12 +99,218 @@ public:
 	union
 	{
 		float 			division;		//!< interior: division plane position
-		triangle_t** 	primitives;		//!< leaf: list of primitives
-		triangle_t*		onePrimitive;	//!< leaf: direct inxex of one primitive
+		u_int32* 		primitives;		//!< leaf: list of indices into the packed triangles of the tree
+		u_int32			onePrimitive;	//!< leaf: direct inxex of one primitive
 	};
 	u_int32	flags;		//!< 2bits: isLeaf, axis; 30bits: nprims (leaf) or index of right child
 };
 
+// ============================================================
+/*! One subtree of a kd-tree under construction. Each task writes its nodes
+	into its own array, so subtrees can be built by several threads at once.
+	A child handed over to another task leaves a placeholder node behind,
+	which kdSpliceTask() replaces with the nodes of that task afterwards.
+*/
+template<class NodeT> struct kdBuildTask_t
+{
+	kdBuildTask_t() = default;
+	kdBuildTask_t(const kdBuildTask_t &) = delete;
+	~kdBuildTask_t() { if(nodes) y_free(nodes); }
+	//! makes sure there is room for one more node
+	void reserveNode()
+	{
+		if(nextFreeNode < allocatedNodesCount) return;
+		u_int32 newCount = allocatedNodesCount ? 2*allocatedNodesCount : 256;
+		newCount = (newCount > 0x100000) ? allocatedNodesCount+0x80000 : newCount;
+		NodeT *n = (NodeT *) y_memalign(64, newCount * sizeof(NodeT));
+		if(nodes)
+		{
+			memcpy(n, nodes, allocatedNodesCount * sizeof(NodeT));
+			y_free(nodes);
+		}
+		nodes = n;
+		allocatedNodesCount = newCount;
+	}
+	//! number of nodes of this task and all its subtrees, without the placeholders
+	u_int32 totalNodes() const
+	{
+		u_int32 n = nextFreeNode - subtrees.size();
+		for(auto &sub : subtrees) n += sub.second->totalNodes();
+		return n;
+	}
+
+	// subtree to build
+	std::vector<u_int32> primNums;
+	bound_t bound;
+	int depth = 0, badRefines = 0;
+	// result
+	NodeT *nodes = nullptr;
+	u_int32 nextFreeNode = 0, allocatedNodesCount = 0;
+	std::map<u_int32, kdBuildTask_t*> subtrees; //!< placeholder node => task that built it
+	kdBuildStats_t stats;
+	// working memory, only valid while the task is being built
+	MemoryArena *arena = nullptr; //!< leaf primitive lists, one arena per build thread
+	int *clip = nullptr; // indicate clip plane(s) for current level
+	char *cdata = nullptr; // clipping data...
+	bound_t *clipBounds = nullptr; //!< bounds of the clipped primitives of the current node
+};
+
+/*! Build tasks shared by the build threads. Tasks are handed out in the order
+	they were created, so the big subtrees near the root are started first.
+	pop() returns nullptr once no task is pending and none is running, as no
+	more tasks can be created at that point */
+template<class NodeT> struct kdBuildQueue_t
+{
+	kdBuildTask_t<NodeT> *newTask()
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		tasks.emplace_back();
+		return &tasks.back();
+	}
+	void push(kdBuildTask_t<NodeT> *task)
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		pending.push_back(task);
+		cv.notify_one();
+	}
+	/*! next task to build, nullptr once all are done. While waiting for one, the
+		thread helps with the jobs of parallelFor() */
+	kdBuildTask_t<NodeT> *pop()
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		while(true)
+		{
+			if(!pending.empty()) break;
+			if(runHelperJob(lk)) continue;
+			if(running == 0) return nullptr;
+			cv.wait(lk);
+		}
+		kdBuildTask_t<NodeT> *task = pending.front();
+		pending.pop_front();
+		++running;
+		return task;
+	}
+	void finished()
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		if(--running == 0 && pending.empty()) cv.notify_all();
+	}
+	/*! Runs job(0) to job(count-1) from a build thread. Only threads of the build that are waiting
+		for a task take some of them, the calling thread runs the rest, so no threads are added */
+	void parallelFor(int count, const std::function<void(int)> &job)
+	{
+		helperJob_t h;
+		h.job = &job;
+		h.count = count;
+		std::unique_lock<std::mutex> lk(mutx);
+		helpers.push_back(&h);
+		cv.notify_all();
+		while(h.next < h.count)
+		{
+			int i = h.next++;
+			lk.unlock();
+			job(i);
+			lk.lock();
+			++h.done;
+		}
+		helpers.erase(std::find(helpers.begin(), helpers.end(), &h));
+		while(h.done < h.count) cv.wait(lk);
+	}
+
+	std::mutex mutx;
+	std::condition_variable cv;
+	std::deque<kdBuildTask_t<NodeT> > tasks; //!< all tasks, the first one is the root
+	std::deque<kdBuildTask_t<NodeT> *> pending;
+	int running = 0;
+
+	private:
+	struct helperJob_t
+	{
+		const std::function<void(int)> *job;
+		int count, next = 0, done = 0;
+	};
+	//! takes one job of a parallelFor() if there is any left, called with the lock held
+	bool runHelperJob(std::unique_lock<std::mutex> &lk)
+	{
+		for(helperJob_t *h : helpers)
+		{
+			if(h->next >= h->count) continue;
+			int i = h->next++;
+			lk.unlock();
+			(*h->job)(i);
+			lk.lock();
+			if(++h->done == h->count) cv.notify_all();
+			return true;
+		}
+		return false;
+	}
+	std::vector<helperJob_t *> helpers;
+};
+
+template<class NodeT> void kdSpliceNode(const kdBuildTask_t<NodeT> &task, u_int32 idx, NodeT *out, u_int32 &next);
+
+/*! Copies the nodes of a task and of all its subtrees to out[next...], in the same
+	depth-first order a single threaded build would have written them */
+template<class NodeT> void kdSpliceTask(const kdBuildTask_t<NodeT> &task, NodeT *out, u_int32 &next)
+{
+	if(!task.subtrees.empty())
+	{
+		kdSpliceNode(task, 0, out, next);
+		return;
+	}
+	memcpy(out + next, task.nodes, task.nextFreeNode * sizeof(NodeT));
+	for(u_int32 i=next; i<next+task.nextFreeNode; ++i)
+	{
+		if(!out[i].IsLeaf()) out[i].setRightChild(out[i].getRightChild() + next);
+	}
+	next += task.nextFreeNode;
+}
+
+template<class NodeT> void kdSpliceNode(const kdBuildTask_t<NodeT> &task, u_int32 idx, NodeT *out, u_int32 &next)
+{
+	auto sub = task.subtrees.find(idx);
+	if(sub != task.subtrees.end())
+	{
+		kdSpliceTask(*sub->second, out, next);
+		return;
+	}
+	const NodeT &node = task.nodes[idx];
+	u_int32 curNode = next++;
+	out[curNode] = node;
+	if(node.IsLeaf()) return;
+	kdSpliceNode(task, idx+1, out, next);
+	out[curNode].setRightChild(next);
+	kdSpliceNode(task, node.getRightChild(), out, next);
+}
+
+template<class NodeT> double kdNodeSAHCost(const NodeT *nodes, u_int32 idx, const bound_t &nodeBound, float costRatio)
+{
+	const NodeT &node = nodes[idx];
+	double dx = nodeBound.longX(), dy = nodeBound.longY(), dz = nodeBound.longZ();
+	double area = dx*dy + dx*dz + dy*dz;
+	if(node.IsLeaf()) return area * node.nPrimitives();
+	bound_t boundL = nodeBound, boundR = nodeBound;
+	switch(node.SplitAxis())
+	{
+		case 0: boundL.setMaxX(node.SplitPos()); boundR.setMinX(node.SplitPos()); break;
+		case 1: boundL.setMaxY(node.SplitPos()); boundR.setMinY(node.SplitPos()); break;
+		case 2: boundL.setMaxZ(node.SplitPos()); boundR.setMinZ(node.SplitPos()); break;
+	}
+	return area * costRatio + kdNodeSAHCost(nodes, idx+1, boundL, costRatio)
+		+ kdNodeSAHCost(nodes, node.getRightChild(), boundR, costRatio);
+}
+
+/*! SAH cost of a finished tree, in units of one primitive intersection test:
+	the traversal and intersection costs of all nodes, weighted by the
+	probability of a random ray through the tree bound hitting them */
+template<class NodeT> float kdTreeSAHCost(const NodeT *nodes, const bound_t &treeBound, float costRatio)
+{
+	double dx = treeBound.longX(), dy = treeBound.longY(), dz = treeBound.longZ();
+	double area = dx*dy + dx*dz + dy*dz;
+	if(area <= 0.0) return 0.f;
+	return (float) (kdNodeSAHCost(nodes, 0, treeBound, costRatio) / area);
+}
+
 /*! Serves to store the lower and upper bound edges of the primitives
 	for the cost funtion */
 
@@ -128,19 +376,28 @@ class YAFRAYCORE_EXPORT triKdTree_t
 {
 public:
 	triKdTree_t(const triangle_t **v, int np, int depth=-1, int leafSize=2,
-			float cost_ratio=0.35, float emptyBonus=0.33);
+			float cost_ratio=0.35, float emptyBonus=0.33, int threads=1, int quality=KD_QUALITY_HIGH, int bins=0);
 	bool Intersect(const ray_t &ray, float dist, triangle_t **tr, float &Z, intersectData_t &data) const;
 //	bool IntersectDBG(const ray_t &ray, float dist, triangle_t **tr, float &Z) const;
 	bool IntersectS(const ray_t &ray, float dist, triangle_t **tr, float shadow_bias) const;
-	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias) const;
+	/*! transparent shadows; when tracing the tree of an instanced base mesh in object space,
+		instance makes the transparency be evaluated on the world space surface. If the ray is not
+		blocked, layers gets the transparent surfaces it passed, which the next tree traced for the
+		same ray takes off its maxDepth */
+	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias,
+		const triangleObjectInstance_t *instance=nullptr, int *layers=nullptr) const;
 //	bool IntersectO(const point3d_t &from, const vector3d_t &ray, float dist, triangle_t **tr, float &Z) const;
 	bound_t getBound(){ return treeBound; }
 	~triKdTree_t();
 private:
-	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, splitCost_t &split);
+	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float bonus, splitCost_t &split);
+	void pigeonAxisCost(int axis, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float bonus, splitCost_t &split);
 	void minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
-		const bound_t *allBounds, boundEdge *edges[3], splitCost_t &split);
-	int buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		const bound_t *allBounds, boundEdge *edges[3], float bonus, kdBuildStats_t &stats, splitCost_t &split);
+	void buildTask(kdBuildTask_t<kdTreeNode> &task, MemoryArena &arena);
+	void deferSubtree(kdBuildTask_t<kdTreeNode> &task, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		int depth, int badRefines);
+	int buildTree(kdBuildTask_t<kdTreeNode> &task, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
 		u_int32 *leftPrims, u_int32 *rightPrims, boundEdge *edges[3],
 		u_int32 rightMemSize, int depth, int badRefines );
 	
@@ -150,14 +407,18 @@ private:
 	int 		maxDepth;
 	unsigned int maxLeafSize;
 	bound_t 	treeBound; 	//!< overall space the tree encloses
-	MemoryArena primsArena;
+	std::vector<std::unique_ptr<MemoryArena> > primsArenas; //!< leaf primitive lists, one arena per build thread
 	kdTreeNode 	*nodes;
+	packedTriangle_t *packedPrims; //!< intersection data of the prims, in the order of the v array
 	
 	// those are temporary actually, to keep argument counts bearable
 	const triangle_t **prims;
 	bound_t *allBounds;
-	int *clip; // indicate clip plane(s) for current level
-	char *cdata; // clipping data...
+	int buildThreads;
+	int numBins; //!< bins per axis of the binned split search
+	u_int32 sweepMaxPrims; //!< nodes up to this size get the exact split search, bigger ones are binned
+	u_int32 taskMinPrims; //!< children with at least this many prims are built as separate tasks, 0 = single threaded build
+	kdBuildQueue_t<kdTreeNode> *buildQueue;
 	
 	// some statistics:
 	int depthLimitReached, NumBadSplits;
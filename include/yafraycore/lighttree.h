@@ -0,0 +1,64 @@
+#ifndef Y_LIGHTTREE_H
+#define Y_LIGHTTREE_H
+
+#include <yafray_config.h>
+
+#include <vector>
+#include <utilities/y_alloc.h>
+#include <core_api/light.h>
+
+__BEGIN_YAFRAY
+
+/*! Emission bound of a light or a group of lights with their total power */
+struct lightTreeBound_t: public lightBound_t
+{
+	float power;
+	//! the union of both bounds, the cones are merged to the smallest cone holding both
+	void include(const lightTreeBound_t &b);
+	/*! a conservative guess of the light reaching P with normal N: the power over the squared
+		distance, scaled by the cosines of the angles between P and the closest directions of the
+		emission cone and between N and the closest direction to the bound. N may be zero */
+	float importance(const point3d_t &P, const vector3d_t &N) const;
+};
+
+struct lightTreeNode_t
+{
+	lightTreeBound_t bound;
+	u_int32 child; //!< second child of an interior node (the first one follows the node), light of a leaf
+	bool leaf;
+};
+
+/*! Bounding volume hierarchy of the lights for direct lighting, after Conty Estevez & Kulla,
+	"Importance Sampling of Many Lights with Adaptive Tree Splitting". A light is picked by
+	walking down the tree, choosing each child by its importance for the shaded point.
+	The nodes are split with the surface area orientation heuristic. Lights without a finite
+	bound (sun, directional and background lights) cannot be placed in the tree, they are picked
+	uniformly with the same probability as the whole tree */
+class YAFRAYCORE_EXPORT lightTree_t
+{
+	public:
+		lightTree_t(const std::vector<light_t *> &lights);
+		/*! picks a light for the point P with normal N, returns its index in the lights
+			the tree was built from and its probability in pdf; -1 if no light can reach P */
+		int sample(const point3d_t &P, const vector3d_t &N, float s, float &pdf) const;
+		int nTreeLights() const { return treeLights; }
+		int nInfiniteLights() const { return infiniteLights.size(); }
+		int nNodes() const { return nodes.size(); }
+
+	private:
+		struct buildLight_t
+		{
+			lightTreeBound_t bound;
+			point3d_t centroid;
+			u_int32 light;
+		};
+		u_int32 build(buildLight_t *lights, u_int32 n);
+
+		std::vector<lightTreeNode_t> nodes;
+		std::vector<u_int32> infiniteLights;
+		u_int32 treeLights;
+};
+
+__END_YAFRAY
+
+#endif // Y_LIGHTTREE_H
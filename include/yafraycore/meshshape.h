@@ -0,0 +1,32 @@
+#ifndef Y_MESHSHAPE_H
+#define Y_MESHSHAPE_H
+
+#include <yafray_config.h>
+
+#include <vector>
+
+__BEGIN_YAFRAY
+
+class triangleObject_t;
+class triangle_t;
+class triBVH_t;
+class pdf1D_t;
+
+/*! What the lights shaped by a mesh (mesh lights and background portals) need of it:
+	its triangles, a distribution to pick them by area and a BVH to intersect them.
+	The scene builds one per mesh on first request and shares it among the lights */
+struct YAFRAYCORE_EXPORT meshShape_t
+{
+	meshShape_t(triangleObject_t *mesh);
+	~meshShape_t();
+	int nTris() const { return (int)tris.size(); }
+
+	std::vector<const triangle_t *> tris;
+	pdf1D_t *areaDist; //!< nullptr if the mesh has no triangles
+	double area;
+	triBVH_t *tree; //!< nullptr if the mesh has no triangles
+};
+
+__END_YAFRAY
+
+#endif // Y_MESHSHAPE_H
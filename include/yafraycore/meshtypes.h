@@ -77,6 +77,8 @@ class YAFRAYCORE_EXPORT triangleObject_t: public object3d_t
 		triangle_t* addTriangle(const triangle_t &t);
 		
 		virtual void finish();
+		//! instances are not flattened into the scene tree, they reference the tree of their base mesh
+		virtual bool isInstance() const { return false; }
 
         inline virtual vector3d_t getVertexNormal(int index) const
         {
@@ -110,10 +112,17 @@ class YAFRAYCORE_EXPORT triangleObjectInstance_t: public triangleObject_t
 		triangleObjectInstance_t(triangleObject_t *base, matrix4x4_t obj2World);
 		/*! the number of primitives the object holds. Primitive is an element
 			that by definition can perform ray-triangle intersection */
-		virtual int numPrimitives() const { return triangles.size(); }
+		virtual int numPrimitives() const { return mBase->triangles.size(); }
+		/*! creates the world space triangles on first use, only needed when
+			something like a mesh light has to access them directly */
 		virtual int getPrimitives(const triangle_t **prims);
 		
 		virtual void finish();
+		virtual bool isInstance() const { return true; }
+		triangleObject_t* getBase() const { return mBase; }
+		const matrix4x4_t& getObjToWorld() const { return objToWorld; }
+		//! surface point of a hit on the base triangle tri, hit is in world space
+		void getSurface(surfacePoint_t &sp, const triangle_t *tri, const point3d_t &hit, intersectData_t &data) const;
 
         inline virtual vector3d_t getVertexNormal(int index) const
         {
@@ -1,25 +1,43 @@
-
 #ifndef Y_OCTREE_H
 #define Y_OCTREE_H
 
-#include <yafraycore/ccthreads.h>
 #include <core_api/bound.h>
-#include <iostream>
+#include <atomic>
 
 __BEGIN_YAFRAY
 
+/*! Data item of an octree node. Items are only ever added in front of the
+	list of a node, so a reader holding the head can walk it without a lock */
+template <class NodeData> struct octEntry_t
+{
+	octEntry_t(const NodeData &d, octEntry_t *n): data(d), next(n) {}
+	NodeData data;
+	octEntry_t *next;
+};
+
 template <class NodeData> struct octNode_t
 {
-	octNode_t() {
-		for (int i = 0; i < 8; ++i)	children[i] = 0;
+	octNode_t(): data(nullptr) {
+		for (int i = 0; i < 8; ++i)	children[i] = nullptr;
 	}
 	~octNode_t() {
-		for (int i = 0; i < 8; ++i)	delete children[i];
+		for (int i = 0; i < 8; ++i)	delete children[i].load(std::memory_order_relaxed);
+		octEntry_t<NodeData> *e = data.load(std::memory_order_relaxed);
+		while(e)
+		{
+			octEntry_t<NodeData> *next = e->next;
+			delete e;
+			e = next;
+		}
 	}
-	octNode_t *children[8];
-	std::vector<NodeData> data;
+	std::atomic<octNode_t *> children[8];
+	std::atomic<octEntry_t<NodeData> *> data;
 };
 
+/*! Octree of items with a spatial extent, an item is stored in every node of the
+	size of its bound that it overlaps. Any number of threads may add and look up
+	items at the same time: new children and items are published with a single
+	compare and swap and nothing is ever removed before the tree is destroyed */
 template <class NodeData> class octree_t
 {
 public:
@@ -29,34 +47,45 @@ public:
 	}
 	void add(const NodeData &dat, const bound_t &bound)
 	{
-		lock.writeLock();
 		recursiveAdd(&root, treeBound, dat, bound,
 			(bound.a - bound.g).lengthSqr() );
-		lock.unlock();
 	}
+	//! calls process(p, item) for the items of all the nodes containing p, until process returns false
 	template <class LookupProc>
-	void lookup(const point3d_t &p, LookupProc &process)
+	void lookup(const point3d_t &p, LookupProc &process) const
 	{
-		lock.readLock();
 		if (!treeBound.includes(p)) return;
 		recursiveLookup(&root, treeBound, p, process);
-		lock.unlock();
 	}
+	const bound_t &getBound() const { return treeBound; }
 private:
 	void recursiveAdd(octNode_t<NodeData> *node, const bound_t &nodeBound,
 		const NodeData &dataItem, const bound_t &dataBound, float diag2,
 		int depth = 0);
 	template <class LookupProc>
-	void recursiveLookup(octNode_t<NodeData> *node, const bound_t &nodeBound, const point3d_t &P,
-			LookupProc &process);
+	void recursiveLookup(const octNode_t<NodeData> *node, const bound_t &nodeBound, const point3d_t &P,
+			LookupProc &process) const;
+	static bound_t childBound(const bound_t &nodeBound, const point3d_t &center, int child);
 	// octree_t Private Data
 	int maxDepth;
 	bound_t treeBound;
 	octNode_t<NodeData> root;
-	rwlock_t lock;
 };
 
 // octree_t Method Definitions
+template <class NodeData>
+bound_t octree_t<NodeData>::childBound(const bound_t &nodeBound, const point3d_t &center, int child)
+{
+	bound_t b;
+	b.a.x = (child & 1) ? nodeBound.a.x : center.x;
+	b.g.x = (child & 1) ? center.x : nodeBound.g.x;
+	b.a.y = (child & 2) ? nodeBound.a.y : center.y;
+	b.g.y = (child & 2) ? center.y : nodeBound.g.y;
+	b.a.z = (child & 4) ? nodeBound.a.z : center.z;
+	b.g.z = (child & 4) ? center.z : nodeBound.g.z;
+	return b;
+}
+
 template <class NodeData>
 void octree_t<NodeData>::recursiveAdd(
 		octNode_t<NodeData> *node, const bound_t &nodeBound,
@@ -66,7 +95,8 @@ void octree_t<NodeData>::recursiveAdd(
 	// Possibly add data item to current octree node
 	if( (nodeBound.a - nodeBound.g).lengthSqr() < diag2 || depth == maxDepth )
 	{
-		node->data.push_back(dataItem);
+		octEntry_t<NodeData> *entry = new octEntry_t<NodeData>(dataItem, node->data.load(std::memory_order_relaxed));
+		while(!node->data.compare_exchange_weak(entry->next, entry, std::memory_order_release, std::memory_order_relaxed));
 		return;
 	}
 	// Otherwise add data item to octree children
@@ -79,49 +109,37 @@ void octree_t<NodeData>::recursiveAdd(
 	if(dataBound.g.y <= center.y) over[0] = over[1] = over[4] = over[5] = false;
 	if(dataBound.a.z > center.z)  over[4] = over[5] = over[6] = over[7] = false;
 	if(dataBound.g.z <= center.z) over[0] = over[1] = over[2] = over[3] = false;
-	
+
 	for (int child = 0; child < 8; ++child)
 	{
 		if (!over[child]) continue;
-		if (!node->children[child])
-			node->children[child] = new octNode_t<NodeData>;
-		// Compute _childBound_ for octree child _child_
-		bound_t childBound;
-		childBound.a.x = (child & 1) ? nodeBound.a.x : center.x;
-		childBound.g.x = (child & 1) ? center.x : nodeBound.g.x;
-		childBound.a.y = (child & 2) ? nodeBound.a.y : center.y;
-		childBound.g.y = (child & 2) ? center.y : nodeBound.g.y;
-		childBound.a.z = (child & 4) ? nodeBound.a.z : center.z;
-		childBound.g.z = (child & 4) ? center.z : nodeBound.g.z;
-		recursiveAdd(node->children[child], childBound,
+		octNode_t<NodeData> *c = node->children[child].load(std::memory_order_acquire);
+		if (!c)
+		{
+			// another thread may create the same child, the first one wins
+			octNode_t<NodeData> *newNode = new octNode_t<NodeData>;
+			if(node->children[child].compare_exchange_strong(c, newNode, std::memory_order_acq_rel)) c = newNode;
+			else delete newNode;
+		}
+		recursiveAdd(c, childBound(nodeBound, center, child),
 		           dataItem, dataBound, diag2, depth+1);
 	}
 }
 
 template <class NodeData> template <class LookupProc>
 void octree_t<NodeData>::recursiveLookup(
-		octNode_t<NodeData> *node, const bound_t &nodeBound,
-		const point3d_t &p, LookupProc &process)
+		const octNode_t<NodeData> *node, const bound_t &nodeBound,
+		const point3d_t &p, LookupProc &process) const
 {
-	for (unsigned int i = 0; i < node->data.size(); ++i)
-		if( ! process(p, node->data[i]) ) return;
+	for (const octEntry_t<NodeData> *e = node->data.load(std::memory_order_acquire); e; e = e->next)
+		if( ! process(p, e->data) ) return;
 	// Determine which octree child node _p_ is inside
 	point3d_t center = nodeBound.center();
 	int child = (p.x > center.x ? 0 : 1) +
-				(p.y > center.y ? 0 : 2) + 
+				(p.y > center.y ? 0 : 2) +
 				(p.z > center.z ? 0 : 4);
-	if (node->children[child])
-	{
-		// Compute _childBound_ for octree child _child_
-		bound_t childBound;
-		childBound.a.x = (child & 1) ? nodeBound.a.x : center.x;
-		childBound.g.x = (child & 1) ? center.x : nodeBound.g.x;
-		childBound.a.y = (child & 2) ? nodeBound.a.y : center.y;
-		childBound.g.y = (child & 2) ? center.y : nodeBound.g.y;
-		childBound.a.z = (child & 4) ? nodeBound.a.z : center.z;
-		childBound.g.z = (child & 4) ? center.z : nodeBound.g.z;
-		recursiveLookup(node->children[child], childBound, p, process);
-	}
+	const octNode_t<NodeData> *c = node->children[child].load(std::memory_order_acquire);
+	if (c) recursiveLookup(c, childBound(nodeBound, center, child), p, process);
 }
 
 __END_YAFRAY
@@ -6,6 +6,9 @@
 
 #include "pkdtree.h"
 #include <core_api/color.h>
+#include <yafraycore/monitor.h>
+#include <atomic>
+#include <thread>
 
 #include <boost/archive/xml_iarchive.hpp>
 #include <boost/archive/xml_oarchive.hpp>
@@ -132,6 +135,7 @@ class photon_t
 
 struct radData_t
 {
+	radData_t(): use(true) {}
 	radData_t(point3d_t &p, vector3d_t n): pos(p), normal(n), use(true) {}
 	point3d_t pos;
 	vector3d_t normal;
@@ -151,24 +155,110 @@ struct foundPhoton_t
 	float dis;
 };
 
+#define PHOTON_CHUNK_SIZE 1024 //!< photon paths a shooting thread takes at once
+#define PHOTON_MERGE_THREAD_SLOTS 256 //!< least chunk slots each thread copies when merging
+
+/*! Work distribution of a multithreaded photon shooting pass. Threads take chunks
+	of PHOTON_CHUNK_SIZE consecutive paths from an atomic counter, so the work stays
+	balanced without any lock. Errors are only counted here and logged once the
+	threads are joined */
+class photonChunks_t
+{
+	public:
+		photonChunks_t(unsigned int paths): nPaths(paths), nChunks((paths + PHOTON_CHUNK_SIZE - 1) / PHOTON_CHUNK_SIZE),
+			next(0), shot(0), nanPaths(0), sampleError(false) {}
+		//! takes the next chunk, its paths are [start, end); false once all chunks are taken
+		bool take(unsigned int &chunk, unsigned int &start, unsigned int &end)
+		{
+			if(sampleError.load(std::memory_order_relaxed)) return false;
+			chunk = next.fetch_add(1, std::memory_order_relaxed);
+			if(chunk >= nChunks) return false;
+			start = chunk * PHOTON_CHUNK_SIZE;
+			end = std::min(nPaths, start + PHOTON_CHUNK_SIZE);
+			return true;
+		}
+		//! counts the paths of a finished chunk, the progress bar is only locked if a step is completed
+		void done(unsigned int start, unsigned int end, progressBar_t *pb, int pbStep)
+		{
+			shot.fetch_add(end - start, std::memory_order_relaxed);
+			int steps = end / pbStep - start / pbStep;
+			if(steps > 0)
+			{
+				pb->mutx.lock();
+				pb->update(steps);
+				pb->mutx.unlock();
+			}
+		}
+		unsigned int nPaths, nChunks;
+		std::atomic<unsigned int> next;
+		std::atomic<unsigned int> shot; //!< paths shot by all threads
+		std::atomic<unsigned int> nanPaths; //!< paths stopped because of a NaN photon color
+		std::atomic<bool> sampleError; //!< a light could not be sampled, stops all threads
+};
+
+/*! Output of a chunked shooting pass, one slot per chunk, so each thread only
+	writes to the slots of the chunks it took. merge() places the slots by a prefix
+	sum over their sizes, which gives the order a single thread would produce */
+template<class T> class chunkSlots_t
+{
+	public:
+		chunkSlots_t(unsigned int nChunks): slots(nChunks) {}
+		std::vector<T> &operator[](unsigned int chunk) { return slots[chunk]; }
+		//! appends all slots to v in chunk order
+		void merge(std::vector<T> &v, int threads)
+		{
+			std::vector<size_t> offset(slots.size() + 1);
+			offset[0] = v.size();
+			for(size_t i=0; i<slots.size(); ++i) offset[i+1] = offset[i] + slots[i].size();
+			v.resize(offset[slots.size()]);
+			threads = std::max(1, std::min(threads, (int)(slots.size() / PHOTON_MERGE_THREAD_SLOTS)));
+			size_t per = (slots.size() + threads - 1) / threads;
+			std::vector<std::thread> workers;
+			for(int t=1; t<threads; ++t)
+			{
+				workers.push_back(std::thread(&chunkSlots_t::copy, this, std::min(slots.size(), t*per), std::min(slots.size(), (t+1)*per), std::cref(offset), v.data()));
+			}
+			copy(0, std::min(slots.size(), per), offset, v.data());
+			for(auto& w : workers) w.join();
+		}
+	private:
+		void copy(size_t first, size_t last, const std::vector<size_t> &offset, T *dest)
+		{
+			for(size_t i=first; i<last; ++i)
+			{
+				std::copy(slots[i].begin(), slots[i].end(), dest + offset[i]);
+				std::vector<T>().swap(slots[i]);
+			}
+		}
+		std::vector<std::vector<T> > slots;
+};
+
+struct photonMapFile_t;
+
 class YAFRAYCORE_EXPORT photonMap_t
 {
 	public:
 		photonMap_t(): paths(0), updated(false), searchRadius(1.), tree(nullptr){ }
 		photonMap_t(const std::string &mapname, int threads): paths(0), updated(false), searchRadius(1.), tree(nullptr), name(mapname),threadsPKDtree(threads) { }
-		~photonMap_t(){ if(tree) delete tree; }
+		~photonMap_t();
 		void setNumPaths(int n){ paths=n; }
 		void setName(const std::string &mapname) { name = mapname; }
 		void setNumThreadsPKDtree(int threads){ threadsPKDtree = threads; }
 		int nPaths() const{ return paths; }
-		int nPhotons() const{ return photons.size(); }
+		int nPhotons() const{ return photons.size() + nFilePhotons; }
 		void pushPhoton(photon_t &p) { photons.push_back(p); updated=false; }
 		void swapVector(std::vector<photon_t> &vec) { photons.swap(vec); updated=false; }
 		void appendVector(std::vector<photon_t> &vec, unsigned int curr) { photons.insert(std::end(photons), std::begin(vec), std::end(vec)); updated=false; paths += curr;}
+		//! appends the photons of a chunked shooting pass in path order
+		void appendChunks(chunkSlots_t<photon_t> &slots, unsigned int curr, int threads) { slots.merge(photons, threads); updated=false; paths += curr; }
 		void reserveMemory(size_t numPhotons) { photons.reserve(numPhotons); }
 		void updateTree();
-		void clear(){ photons.clear(); delete tree; tree = nullptr; updated=false; }
+		void clear();
 		bool ready() const { return updated; }
+		/*! fingerprint of the scene and parameters the map was generated for, see photonMapFingerprint().
+			A cleared map has fingerprint 0 */
+		void setFingerprint(uint64_t f) { fingerprint = f; }
+		uint64_t getFingerprint() const { return fingerprint; }
 	//	void gather(const point3d_t &P, std::vector< foundPhoton_t > &found, unsigned int K, float &sqRadius) const;
 		int gather(const point3d_t &P, foundPhoton_t *found, unsigned int K, float &sqRadius) const;
 		const photon_t* findNearest(const point3d_t &P, const vector3d_t &n, float dist) const;
@@ -180,9 +270,16 @@ class YAFRAYCORE_EXPORT photonMap_t
 		bool updated;
 		float searchRadius;
 		kdtree::pointKdTree<photon_t> *tree;
+		kdtree::pointKdTree<photon_t> *spareTree = nullptr; //!< tree of the cleared photons, rebuilt in place by the next updateTree()
 		std::string name;
 		int threadsPKDtree = 1;
+		uint64_t fingerprint = 0;
+		photonMapFile_t *file = nullptr; //!< memory mapped map file holding the photons and the tree arrays
+		const photon_t *filePhotons = nullptr; //!< photons of the mapped file in leaf order, used instead of photons
+		u_int32 nFilePhotons = 0;
 
+		friend bool photonMapLoad(photonMap_t * map, const std::string &filename, uint64_t fingerprint, bool debugXMLformat);
+		friend bool photonMapSave(const photonMap_t * map, const std::string &filename, bool debugXMLformat);
 		friend class boost::serialization::access;
 		template<class Archive> void serialize(Archive & ar, const unsigned int version)
 		{
@@ -192,6 +289,7 @@ class YAFRAYCORE_EXPORT photonMap_t
 			ar & BOOST_SERIALIZATION_NVP(searchRadius);
 			ar & BOOST_SERIALIZATION_NVP(name);
 			ar & BOOST_SERIALIZATION_NVP(threadsPKDtree);
+			ar & BOOST_SERIALIZATION_NVP(fingerprint);
 			ar & BOOST_SERIALIZATION_NVP(tree);
 		}
 };
@@ -232,7 +330,16 @@ struct eliminatePhoton_t
 };
 
 
-YAFRAYCORE_EXPORT bool photonMapLoad(photonMap_t * map, const std::string &filename, bool debugXMLformat = false);
+class scene_t;
+
+/*! Hash of everything a photon map depends on: the scene geometry, the materials and their
+	assignment to the faces, the lights and the photon parameters of the integrator, given as
+	text in params. Maps are only loaded or reused for the fingerprint they were made for */
+YAFRAYCORE_EXPORT uint64_t photonMapFingerprint(const scene_t *scene, const std::string &params);
+
+/*! Loads a map saved by photonMapSave(). The binary format is mapped into memory and used in
+	place, it is rejected if it was made for another fingerprint or by an incompatible build */
+YAFRAYCORE_EXPORT bool photonMapLoad(photonMap_t * map, const std::string &filename, uint64_t fingerprint, bool debugXMLformat = false);
 
 YAFRAYCORE_EXPORT bool photonMapSave(const photonMap_t * map, const std::string &filename, bool debugXMLformat = false);
 
@@ -5,27 +5,40 @@
 
 #include <utilities/y_alloc.h>
 #include <core_api/bound.h>
+#include <utilities/threadUtils.h>
 #include <algorithm>
 #include <vector>
+#include <deque>
 
 #include <boost/serialization/nvp.hpp>
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/array.hpp>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define Y_PKD_SSE 1
+	#include <emmintrin.h>
+#else
+	#define Y_PKD_SSE 0
+#endif
+
 __BEGIN_YAFRAY
 
 namespace kdtree {
 
 #define KD_MAX_STACK 64
 #define NON_REC_LOOKUP 1
+#define PKD_LEAF_SIZE 4 //!< most elements per leaf, the distances of a leaf are computed at once
+#define PKD_TASK_MIN_ELEMENTS 4096 //!< smaller subtrees are built by the thread that split their parent
 
+/*! Node of the point kd-tree. Leaves refer to a range of the elements
+	stored in leaf order by the tree, so no element is reached through the node itself */
 template <class T>
 struct kdNode
 {
-	void createLeaf(const T *d)
+	void createLeaf(u_int32 first, u_int32 count)
 	{
-		flags = 3;
-		data = d;
+		flags = 3 | (count << 2);
+		firstElement = first;
 	}
 	void createInterior(int axis, float d)
 	{
@@ -41,7 +54,7 @@ struct kdNode
 	union
 	{
 		float division;
-		const T *data;
+		u_int32 firstElement; //!< first element of a leaf in leaf order
 	};
 	u_int32	flags;
 
@@ -49,7 +62,7 @@ struct kdNode
 	template<class Archive> void serialize(Archive & ar, const unsigned int version)
 	{
 		ar & BOOST_SERIALIZATION_NVP(flags);
-		if(IsLeaf()) ar & BOOST_SERIALIZATION_NVP(data);
+		if(IsLeaf()) ar & BOOST_SERIALIZATION_NVP(firstElement);
 		else ar & BOOST_SERIALIZATION_NVP(division);
 	}
 };
@@ -64,31 +77,109 @@ template<class NodeData> struct CompareNode
 	}
 };
 
+/*! Subtree of a point kd-tree still to be built. The size of a balanced subtree
+	gives its node count, so every task knows where its nodes go in the tree */
+struct pkdBuildTask_t
+{
+	u_int32 start, end; //!< range of the elements
+	bound_t bound;
+	u_int32 node; //!< index of the root node of the subtree
+};
+
+/*! Pending subtrees shared by the build threads, the same scheme as kdBuildQueue_t: the
+	subtrees are handed out in the order they were split off, so the big ones are started first,
+	and pop() returns false once no task is pending and none is running */
+struct pkdBuildQueue_t
+{
+	void push(const pkdBuildTask_t &task)
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		pending.push_back(task);
+		cv.notify_one();
+	}
+	bool pop(pkdBuildTask_t &task)
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		while(pending.empty() && running > 0) cv.wait(lk);
+		if(pending.empty()) return false;
+		task = pending.front();
+		pending.pop_front();
+		++running;
+		return true;
+	}
+	void finished()
+	{
+		std::unique_lock<std::mutex> lk(mutx);
+		if(--running == 0 && pending.empty()) cv.notify_all();
+	}
+
+	std::mutex mutx;
+	std::condition_variable cv;
+	std::deque<pkdBuildTask_t> pending;
+	int running = 0;
+};
+
+/*! Balanced kd-tree over points, the leaves hold up to PKD_LEAF_SIZE elements.
+	The element pointers and the positions (as structure of arrays) are kept in
+	leaf order, so a leaf is tested with one pass over adjacent memory and only the
+	elements inside the lookup radius are handed to the lookup process.
+	build() can be called again for new data, the arrays of the previous build are
+	reused whenever they are large enough */
 template <class T>
 class pointKdTree
 {
 	public:
-		pointKdTree() {};
+		pointKdTree(): nodes(nullptr), elements(nullptr), elementPos(nullptr), nElements(0), nextFreeNode(0), ownsArrays(true) {};
 		pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads=1);
-		~pointKdTree(){ if(nodes) y_free(nodes); }
+		/*! tree over the arrays of a tree built before (see getNodes() and getPositions()),
+			with its n elements in leaf order in dat. Only the element pointers are allocated,
+			the other arrays are used in place and have to outlive the tree */
+		pointKdTree(const kdNode<T> *treeNodes, u_int32 nNodes, const T *dat, const float *pos, u_int32 n, const bound_t &bound);
+		~pointKdTree()
+		{
+			if(ownsArrays)
+			{
+				if(nodes) y_free(nodes);
+				if(elementPos) y_free(elementPos);
+			}
+			delete[] elements;
+		}
+		//! (re)builds the tree over dat, numThreads threads take the subtrees of at least PKD_TASK_MIN_ELEMENTS elements
+		void build(const std::vector<T> &dat, const std::string &mapName, int numThreads=1);
+		//! nodes of a balanced tree over n elements, 2*leaves-1
+		static u_int32 subtreeNodes(u_int32 n);
 		template<class LookupProc> void lookup(const point3d_t &p, const LookupProc &proc, float &maxDistSquared) const;
 		double lookupStat()const{ return double(Y_PROCS)/double(Y_LOOKUPS); } //!< ratio of photons tested per lookup call
+		/*! sorts dat, the vector the tree was built from, into the leaf order of the tree
+			and points the tree to the sorted elements, so elements close in the tree are close in memory */
+		void reorder(std::vector<T> &dat);
+		const kdNode<T> *getNodes() const { return nodes; }
+		u_int32 nNodes() const { return nextFreeNode; }
+		//! element positions in leaf order, see elementPos
+		const float *getPositions() const { return elementPos; }
+		u_int32 nPositions() const { return 3 * (nElements + PKD_LEAF_SIZE); }
+		const bound_t &getBound() const { return treeBound; }
 	protected:
 		template<class LookupProc> void recursiveLookup(const point3d_t &p, const LookupProc &proc, float &maxDistSquared, int nodeNum) const;
+		void leafDistances(const kdNode<T> *leaf, const point3d_t &p, float *dist2) const;
+		void storePositions();
 		struct KdStack
 		{
 			const kdNode<T> *node; //!< pointer to far child
 			float s; 		//!< the split val of parent node
 			int axis; 		//!< the split axis of parent node
 		};
-		void buildTree(u_int32 start, u_int32 end, bound_t &nodeBound, const T **prims);
-		void buildTreeWorker(u_int32 start, u_int32 end, bound_t &nodeBound, const T **prims, int level, uint32_t & localNextFreeNode, kdNode<T> * localNodes);
+		static void leafCounts(u_int32 n, u_int32 &leavesN, u_int32 &leavesN1);
+		void buildSubtree(pkdBuildTask_t task, pkdBuildQueue_t *queue);
+		void buildWorker(pkdBuildQueue_t *queue);
 		kdNode<T> *nodes;
+		const T **elements; //!< elements in leaf order
+		float *elementPos; //!< x, y and z of the elements in leaf order, each array padded to full leaves
 		u_int32 nElements, nextFreeNode;
+		u_int32 nodesCapacity = 0, elementsCapacity = 0; //!< allocated sizes of nodes, and of elements and elementPos
 		bound_t treeBound;
 		mutable unsigned int Y_LOOKUPS, Y_PROCS;
-		int maxLevelThreads = 0;  //max level where we will launch threads. We will try to launch at least as many threads as scene threads parameter
-		std::mutex mutx;
+		bool ownsArrays; //!< false if nodes and elementPos belong to someone else
 
 		friend class boost::serialization::access;
 		template<class Archive> void save(Archive & ar, const unsigned int version) const
@@ -99,6 +190,7 @@ class pointKdTree
 			ar & BOOST_SERIALIZATION_NVP(Y_LOOKUPS);
 			ar & BOOST_SERIALIZATION_NVP(Y_PROCS);
 			ar & boost::serialization::make_array(nodes, nextFreeNode);
+			ar & boost::serialization::make_array(elements, nElements);
 		}
 		template<class Archive> void load(Archive & ar, const unsigned int version)
 		{
@@ -107,19 +199,39 @@ class pointKdTree
 			ar & BOOST_SERIALIZATION_NVP(treeBound);
 			ar & BOOST_SERIALIZATION_NVP(Y_LOOKUPS);
 			ar & BOOST_SERIALIZATION_NVP(Y_PROCS);	
-			nodes = (kdNode<T> *)y_memalign(64, 4*nElements*sizeof(kdNode<T>)); //actually we could allocate one less...2n-1
+			nodes = (kdNode<T> *)y_memalign(64, nextFreeNode*sizeof(kdNode<T>));
+			nodesCapacity = nextFreeNode;
 			ar & boost::serialization::make_array(nodes, nextFreeNode);
+			elements = new const T*[nElements];
+			elementsCapacity = nElements;
+			ar & boost::serialization::make_array(elements, nElements);
+			storePositions();
 		}
 		
 		BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
 template<class T>
-pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads)
+pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads):
+	nodes(nullptr), elements(nullptr), elementPos(nullptr), nElements(0), nextFreeNode(0), ownsArrays(true)
+{
+	build(dat, mapName, numThreads);
+}
+
+template<class T>
+void pointKdTree<T>::build(const std::vector<T> &dat, const std::string &mapName, int numThreads)
 {
 	Y_LOOKUPS=0; Y_PROCS=0;
 	nextFreeNode = 0;
 	nElements = dat.size();
+	if(!ownsArrays)
+	{
+		// the arrays of a mapped file are not ours to reuse
+		nodes = nullptr;
+		elementPos = nullptr;
+		nodesCapacity = 0;
+		ownsArrays = true;
+	}
 	
 	if(nElements == 0)
 	{
@@ -127,9 +239,22 @@ pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapNam
 		return;
 	}
 	
-	nodes = (kdNode<T> *)y_memalign(64, 4*nElements*sizeof(kdNode<T>)); //actually we could allocate one less...2n-1
-	
-	const T **elements = new const T*[nElements];
+	u_int32 nNodes = subtreeNodes(nElements);
+	if(nNodes > nodesCapacity)
+	{
+		if(nodes) y_free(nodes);
+		nodes = (kdNode<T> *)y_memalign(64, nNodes*sizeof(kdNode<T>));
+		nodesCapacity = nNodes;
+	}
+	// the build partitions the elements in place, which leaves them in leaf order
+	if(nElements > elementsCapacity)
+	{
+		delete[] elements;
+		if(elementPos) y_free(elementPos);
+		elements = new const T*[nElements];
+		elementPos = (float *)y_memalign(64, 3*(nElements + PKD_LEAF_SIZE)*sizeof(float));
+		elementsCapacity = nElements;
+	}
 	
 	for(u_int32 i=0; i<nElements; ++i) elements[i] = &dat[i];
 	
@@ -137,110 +262,157 @@ pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapNam
 	
 	for(u_int32 i=1; i<nElements; ++i) treeBound.include(dat[i].pos);
 	
-	maxLevelThreads = (int) std::ceil(std::log2((float) numThreads)); //in how many pkdtree levels we will spawn threads, so we create at least as many threads as scene threads parameter (or more)
-	int realThreads = (int) pow(2.f, maxLevelThreads); //real amount of threads we will create during pkdtree creation depending on the maximum level where we will generate threads
+	numThreads = std::max(1, std::min(numThreads, (int)(nElements / PKD_TASK_MIN_ELEMENTS)));
 	
-	Y_INFO << "pointKdTree: Starting " << mapName << " recusive tree build for " << nElements << " elements [using " << realThreads << " threads]" << yendl;
+	Y_INFO << "pointKdTree: Starting " << mapName << " tree build for " << nElements << " elements [using " << numThreads << " threads]" << yendl;
 
-	buildTree(0, nElements, treeBound, elements);
+	pkdBuildTask_t root = { 0, nElements, treeBound, 0 };
+	if(numThreads == 1) buildSubtree(root, nullptr);
+	else
+	{
+		pkdBuildQueue_t queue;
+		queue.push(root);
+		std::vector<std::thread> workers;
+		for(int i=1; i<numThreads; ++i) workers.push_back(std::thread(&pointKdTree<T>::buildWorker, this, &queue));
+		buildWorker(&queue);
+		for(auto& w : workers) w.join();
+	}
+	nextFreeNode = nNodes;
+	
+	storePositions();
 	
 	Y_VERBOSE << "pointKdTree: " << mapName << " tree built." << yendl;
+}
+
+/*! leavesN and leavesN1 are the leaves of balanced trees over n and n+1 elements. A tree over n
+	elements has subtrees over n/2 and n-n/2, so each level only needs two neighbouring sizes */
+template<class T>
+void pointKdTree<T>::leafCounts(u_int32 n, u_int32 &leavesN, u_int32 &leavesN1)
+{
+	if(n <= PKD_LEAF_SIZE)
+	{
+		leavesN = 1;
+		leavesN1 = (n + 1 <= PKD_LEAF_SIZE) ? 1 : 2;
+		return;
+	}
+	u_int32 a, b;
+	leafCounts(n / 2, a, b);
+	if(n & 1) { leavesN = a + b; leavesN1 = 2 * b; }
+	else { leavesN = 2 * a; leavesN1 = a + b; }
+}
 
-	delete[] elements;
+template<class T>
+u_int32 pointKdTree<T>::subtreeNodes(u_int32 n)
+{
+	u_int32 leaves, dummy;
+	leafCounts(n, leaves, dummy);
+	return 2 * leaves - 1;
 }
 
 template<class T>
-void pointKdTree<T>::buildTree(u_int32 start, u_int32 end, bound_t &nodeBound, const T **prims)
+pointKdTree<T>::pointKdTree(const kdNode<T> *treeNodes, u_int32 nNodes, const T *dat, const float *pos, u_int32 n, const bound_t &bound)
 {
-	buildTreeWorker(start, end, nodeBound, prims, 0, nextFreeNode, nodes);
+	Y_LOOKUPS=0; Y_PROCS=0;
+	// the arrays are never written after a build, so they can be read-only memory
+	nodes = const_cast<kdNode<T> *>(treeNodes);
+	nextFreeNode = nNodes;
+	elementPos = const_cast<float *>(pos);
+	nElements = n;
+	treeBound = bound;
+	ownsArrays = false;
+	elements = new const T*[nElements];
+	for(u_int32 i=0; i<nElements; ++i) elements[i] = &dat[i];
 }
 
 template<class T>
-void pointKdTree<T>::buildTreeWorker(u_int32 start, u_int32 end, bound_t &nodeBound, const T **prims, int level, uint32_t & localNextFreeNode, kdNode<T> * localNodes)
+void pointKdTree<T>::storePositions()
 {
-	++level;
-	if(end - start == 1)
+	u_int32 stride = nElements + PKD_LEAF_SIZE;
+	if(!elementPos) elementPos = (float *)y_memalign(64, 3*stride*sizeof(float));
+	for(int axis=0; axis<3; ++axis)
 	{
-		localNodes[localNextFreeNode].createLeaf(prims[start]);
-		localNextFreeNode++;
-		--level;
-		return;
+		float *pos = elementPos + axis*stride;
+		for(u_int32 i=0; i<nElements; ++i) pos[i] = elements[i]->pos[axis];
+		for(u_int32 i=nElements; i<stride; ++i) pos[i] = 0.f;
 	}
-	int splitAxis = nodeBound.largestAxis();
-	int splitEl = (start+end)/2;
-	std::nth_element(&prims[start], &prims[splitEl],
-					&prims[end], CompareNode<T>(splitAxis));
-	u_int32 curNode = localNextFreeNode;
-	float splitPos = prims[splitEl]->pos[splitAxis];
-	localNodes[curNode].createInterior(splitAxis, splitPos);
-	++localNextFreeNode;
-	bound_t boundL = nodeBound, boundR = nodeBound;
-	switch(splitAxis){
-		case 0: boundL.setMaxX(splitPos); boundR.setMinX(splitPos); break;
-		case 1: boundL.setMaxY(splitPos); boundR.setMinY(splitPos); break;
-		case 2: boundL.setMaxZ(splitPos); boundR.setMinZ(splitPos); break;
+}
+
+template<class T>
+void pointKdTree<T>::reorder(std::vector<T> &dat)
+{
+	std::vector<T> sorted;
+	sorted.reserve(nElements);
+	for(u_int32 i=0; i<nElements; ++i) sorted.push_back(*elements[i]);
+	dat.swap(sorted);
+	for(u_int32 i=0; i<nElements; ++i) elements[i] = &dat[i];
+}
+
+/*! Squared distances from p to all elements of a leaf, lanes past the leaf size are undefined */
+template<class T>
+inline void pointKdTree<T>::leafDistances(const kdNode<T> *leaf, const point3d_t &p, float *dist2) const
+{
+	u_int32 stride = nElements + PKD_LEAF_SIZE;
+	const float *x = elementPos + leaf->firstElement;
+	const float *y = x + stride;
+	const float *z = y + stride;
+#if Y_PKD_SSE && PKD_LEAF_SIZE == 4
+	__m128 dx = _mm_sub_ps(_mm_loadu_ps(x), _mm_set1_ps(p.x));
+	__m128 dy = _mm_sub_ps(_mm_loadu_ps(y), _mm_set1_ps(p.y));
+	__m128 dz = _mm_sub_ps(_mm_loadu_ps(z), _mm_set1_ps(p.z));
+	_mm_storeu_ps(dist2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+#else
+	for(int i=0; i<PKD_LEAF_SIZE; ++i)
+	{
+		float dx = x[i] - p.x, dy = y[i] - p.y, dz = z[i] - p.z;
+		dist2[i] = dx*dx + dy*dy + dz*dz;
 	}
-	
-	if (level <= maxLevelThreads)  //launch threads for the first "x" levels to try to match (at least) the scene threads parameter
+#endif
+}
+
+/*! Builds the subtree of a task, the left subtrees big enough are handed to the queue and the
+	right ones are built in place. The nodes are laid out as by a recursive build: the left child
+	follows its parent, the right child follows the left subtree, whichever thread builds them */
+template<class T>
+void pointKdTree<T>::buildSubtree(pkdBuildTask_t task, pkdBuildQueue_t *queue)
+{
+	while(task.end - task.start > PKD_LEAF_SIZE)
 	{
-		//<< recurse below child >>
-		uint32_t nextFreeNode1 = 0;
-		kdNode<T> * nodes1 = (kdNode<T> *)y_memalign(64, 4 * (splitEl - start)*sizeof(kdNode<T>));
-		std::thread * belowWorker = new std::thread(&pointKdTree<T>::buildTreeWorker, this, start, splitEl, std::ref(boundL), prims, level, std::ref(nextFreeNode1), nodes1);
-
-		//<< recurse above child >>
-		uint32_t nextFreeNode2 = 0;
-		kdNode<T> * nodes2 = (kdNode<T> *)y_memalign(64, 4 * (end - splitEl)*sizeof(kdNode<T>));
-		std::thread * aboveWorker = new std::thread(&pointKdTree<T>::buildTreeWorker, this, splitEl, end, std::ref(boundR), prims, level, std::ref(nextFreeNode2), nodes2);
-
-		belowWorker->join();
-		aboveWorker->join();
-		delete belowWorker;
-		delete aboveWorker;
-
-		if (nodes1)
-		{
-			for (uint32_t i = 0; i < nextFreeNode1; ++i)
-			{
-				localNodes[i + localNextFreeNode] = nodes1[i];
-				if (!localNodes[i + localNextFreeNode].IsLeaf())
-				{
-					uint32_t right_child = localNodes[i + localNextFreeNode].getRightChild();
-					localNodes[i + localNextFreeNode].setRightChild(right_child + localNextFreeNode);
-				}
-			}
-			y_free(nodes1);
-		}
+		int splitAxis = task.bound.largestAxis();
+		u_int32 splitEl = (task.start+task.end)/2;
+		std::nth_element(&elements[task.start], &elements[splitEl],
+						&elements[task.end], CompareNode<T>(splitAxis));
+		float splitPos = elements[splitEl]->pos[splitAxis];
+		kdNode<T> &node = nodes[task.node];
+		node.createInterior(splitAxis, splitPos);
+		u_int32 rightChild = task.node + 1 + subtreeNodes(splitEl - task.start);
+		node.setRightChild(rightChild);
 
-		if (nodes2)
-		{
-			for (uint32_t i = 0; i < nextFreeNode2; ++i)
-			{
-				localNodes[i + localNextFreeNode + nextFreeNode1] = nodes2[i];
-				if (!localNodes[i + localNextFreeNode + nextFreeNode1].IsLeaf())
-				{
-					uint32_t right_child = localNodes[i + localNextFreeNode + nextFreeNode1].getRightChild();
-					localNodes[i + localNextFreeNode + nextFreeNode1].setRightChild(right_child + localNextFreeNode + nextFreeNode1);
-				}
-			}
-			y_free(nodes2);
+		pkdBuildTask_t left = { task.start, splitEl, task.bound, task.node + 1 };
+		switch(splitAxis){
+			case 0: left.bound.setMaxX(splitPos); task.bound.setMinX(splitPos); break;
+			case 1: left.bound.setMaxY(splitPos); task.bound.setMinY(splitPos); break;
+			case 2: left.bound.setMaxZ(splitPos); task.bound.setMinZ(splitPos); break;
 		}
+		if(queue && splitEl - task.start >= PKD_TASK_MIN_ELEMENTS) queue->push(left);
+		else buildSubtree(left, queue);
 
-		localNodes[curNode].setRightChild (localNextFreeNode + nextFreeNode1);
-		localNextFreeNode = localNextFreeNode + nextFreeNode1 + nextFreeNode2;
+		task.start = splitEl;
+		task.node = rightChild;
 	}
-	else  //for the rest of the levels in the tree, don't launch more threads, do normal "sequential" operation
+	nodes[task.node].createLeaf(task.start, task.end - task.start);
+}
+
+template<class T>
+void pointKdTree<T>::buildWorker(pkdBuildQueue_t *queue)
+{
+	pkdBuildTask_t task;
+	while(queue->pop(task))
 	{
-		//<< recurse below child >>
-		buildTreeWorker(start, splitEl, boundL, prims, level, localNextFreeNode, localNodes);
-		//<< recurse above child >>
-		localNodes[curNode].setRightChild (localNextFreeNode);
-		buildTreeWorker(splitEl, end, boundR, prims, level, localNextFreeNode, localNodes);
+		buildSubtree(task, queue);
+		queue->finished();
 	}
-	--level;
 }
 
-
 template<class T> template<class LookupProc> 
 void pointKdTree<T>::lookup(const point3d_t &p, const LookupProc &proc, float &maxDistSquared) const
 {
@@ -276,19 +448,22 @@ void pointKdTree<T>::lookup(const point3d_t &p, const LookupProc &proc, float &m
 		}
 
 		// Hand leaf-data kd-tree to processing function
-		vector3d_t v = currNode->data->pos - p;
-		float dist2 = v.lengthSqr();
-
-		if (dist2 < maxDistSquared)
+		float leafDist2[PKD_LEAF_SIZE];
+		leafDistances(currNode, p, leafDist2);
+		const T **leafElements = elements + currNode->firstElement;
+		for(int i=0, n=currNode->nPrimitives(); i<n; ++i)
 		{
-			++Y_PROCS;
-			proc(currNode->data, dist2, maxDistSquared);
+			if (leafDist2[i] < maxDistSquared)
+			{
+				++Y_PROCS;
+				proc(leafElements[i], leafDist2[i], maxDistSquared);
+			}
 		}
 		
 		if(!stack[stackPtr].node) return; // stack empty, done.
 		//radius probably lowered so we may pop additional elements:
 		int axis = stack[stackPtr].axis;
-		dist2 = p[axis] - stack[stackPtr].s;
+		float dist2 = p[axis] - stack[stackPtr].s;
 		dist2 *= dist2;
 
 		while(dist2 > maxDistSquared)
@@ -318,12 +493,15 @@ void pointKdTree<T>::recursiveLookup(const point3d_t &p, const LookupProc &proc,
 	const kdNode<T> *currNode = &nodes[nodeNum];
 	if(currNode->IsLeaf())
 	{
-		vector3d_t v = currNode->data->pos - p;
-		float dist2 = v.lengthSqr();
-		if (dist2 < maxDistSquared)
+		float leafDist2[PKD_LEAF_SIZE];
+		leafDistances(currNode, p, leafDist2);
+		for(int i=0, n=currNode->nPrimitives(); i<n; ++i)
 		{
-			proc(currNode->data, dist2, maxDistSquared);
-			++Y_PROCS;
+			if (leafDist2[i] < maxDistSquared)
+			{
+				proc(elements[currNode->firstElement + i], leafDist2[i], maxDistSquared);
+				++Y_PROCS;
+			}
 		}
 		return;
 	}
@@ -13,8 +13,6 @@
 
 __BEGIN_YAFRAY
 
-extern int Kd_inodes, Kd_leaves, _emptyKd_leaves, Kd_prims, _clip, _bad_clip, _null_clip, _early_out;
-
 struct renderState_t;
 
 #define PRIM_DAT_SIZE 32
@@ -27,7 +25,7 @@ struct renderState_t;
 template<class T> class rkdTreeNode
 {
 public:
-	void createLeaf(u_int32 *primIdx, int np, const T **prims, MemoryArena &arena)
+	void createLeaf(u_int32 *primIdx, int np, const T **prims, MemoryArena &arena, kdBuildStats_t &stats)
 	{
 		primitives = nullptr;
 		flags = np << 2;
@@ -36,18 +34,18 @@ public:
 		{
 			primitives = (T **)arena.Alloc(np * sizeof(T *));
 			for(int i=0;i<np;i++) primitives[i] = (T *)prims[primIdx[i]];
-			Kd_prims+=np; //stat
+			stats.prims+=np; //stat
 		}
 		else if(np==1)
 		{
 			onePrimitive = (T *)prims[primIdx[0]];
-			Kd_prims++; //stat
+			stats.prims++; //stat
 		}
-		else _emptyKd_leaves++; //stat
-		Kd_leaves++; //stat
+		else stats.emptyLeaves++; //stat
+		stats.leaves++; //stat
 	}
-	void createInterior(int axis, float d)
-	{	division = d; flags = (flags & ~3) | axis; Kd_inodes++; }
+	void createInterior(int axis, float d, kdBuildStats_t &stats)
+	{	division = d; flags = (flags & ~3) | axis; stats.inodes++; }
 	float 	SplitPos() const { return division; }
 	int 	SplitAxis() const { return flags & 3; }
 	int 	nPrimitives() const { return flags >> 2; }
@@ -81,7 +79,7 @@ template<class T> class YAFRAYCORE_EXPORT kdTree_t
 {
 public:
 	kdTree_t(const T **v, int np, int depth=-1, int leafSize=2,
-			float cost_ratio=0.35, float emptyBonus=0.33);
+			float cost_ratio=0.35, float emptyBonus=0.33, int threads=1, int quality=KD_QUALITY_HIGH, int bins=0);
 	bool Intersect(const ray_t &ray, float dist, T **tr, float &Z, intersectData_t &data) const;
 //	bool IntersectDBG(const ray_t &ray, float dist, triangle_t **tr, float &Z) const;
 	bool IntersectS(const ray_t &ray, float dist, T **tr, float shadow_bias) const;
@@ -90,10 +88,14 @@ public:
 	bound_t getBound(){ return treeBound; }
 	~kdTree_t();
 private:
-	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, splitCost_t &split);
+	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float bonus, splitCost_t &split);
+	void pigeonAxisCost(int axis, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float bonus, splitCost_t &split);
 	void minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
-		const bound_t *allBounds, boundEdge *edges[3], splitCost_t &split);
-	int buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		const bound_t *allBounds, boundEdge *edges[3], float bonus, kdBuildStats_t &stats, splitCost_t &split);
+	void buildTask(kdBuildTask_t<rkdTreeNode<T> > &task, MemoryArena &arena);
+	void deferSubtree(kdBuildTask_t<rkdTreeNode<T> > &task, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		int depth, int badRefines);
+	int buildTree(kdBuildTask_t<rkdTreeNode<T> > &task, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
 		u_int32 *leftPrims, u_int32 *rightPrims, boundEdge *edges[3],
 		u_int32 rightMemSize, int depth, int badRefines );
 	
@@ -103,14 +105,17 @@ private:
 	int 		maxDepth;
 	unsigned int maxLeafSize;
 	bound_t 	treeBound; 	//!< overall space the tree encloses
-	MemoryArena primsArena;
+	std::vector<std::unique_ptr<MemoryArena> > primsArenas; //!< leaf primitive lists, one arena per build thread
 	rkdTreeNode<T> 	*nodes;
 	
 	// those are temporary actually, to keep argument counts bearable
 	const T **prims;
 	bound_t *allBounds;
-	int *clip; // indicate clip plane(s) for current level
-	char *cdata; // clipping data...
+	int buildThreads;
+	int numBins; //!< bins per axis of the binned split search
+	u_int32 sweepMaxPrims; //!< nodes up to this size get the exact split search, bigger ones are binned
+	u_int32 taskMinPrims; //!< children with at least this many prims are built as separate tasks, 0 = single threaded build
+	kdBuildQueue_t<rkdTreeNode<T> > *buildQueue;
 	
 	// some statistics:
 	int depthLimitReached, NumBadSplits;
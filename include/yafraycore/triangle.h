@@ -31,8 +31,8 @@ class YAFRAYCORE_EXPORT triangle_t
 	friend class triangleInstance_t;
 
 	public:
-		triangle_t(): pa(-1), pb(-1), pc(-1), na(-1), nb(-1), nc(-1), mesh(nullptr), intersectionBiasFactor(0.f), edge1(0.f), edge2(0.f) { /* Empty */ }
-        triangle_t(int ia, int ib, int ic, triangleObject_t* m): pa(ia), pb(ib), pc(ic), na(-1), nb(-1), nc(-1), mesh(m), intersectionBiasFactor(0.f), edge1(0.f), edge2(0.f) {  updateIntersectionCachedValues(); }
+		triangle_t(): pa(-1), pb(-1), pc(-1), na(-1), nb(-1), nc(-1), mesh(nullptr) { /* Empty */ }
+        triangle_t(int ia, int ib, int ic, triangleObject_t* m): pa(ia), pb(ib), pc(ic), na(-1), nb(-1), nc(-1), mesh(m) { /* Empty */ }
 		virtual bool intersect(const ray_t &ray, float *t, intersectData_t &data) const;
 		virtual bound_t getBound() const;
 		virtual bool intersectsBound(exBound_t &eb) const;
@@ -45,7 +45,8 @@ class YAFRAYCORE_EXPORT triangle_t
 		virtual void sample(float s1, float s2, point3d_t &p, vector3d_t &n) const;
 
 		virtual vector3d_t getNormal() const{ return vector3d_t(normal); }
-		void setVertexIndices(int a, int b, int c){ pa=a, pb=b, pc=c; updateIntersectionCachedValues(); }
+		virtual void getVertices(point3d_t &a, point3d_t &b, point3d_t &c) const;
+		void setVertexIndices(int a, int b, int c){ pa=a, pb=b, pc=c; }
 		void setMaterial(const material_t *m) { material = m; }
 		void setNormals(int a, int b, int c){ na=a, nb=b, nc=c; }
 		virtual void recNormal();
@@ -60,7 +61,6 @@ class YAFRAYCORE_EXPORT triangle_t
             return out;
         }
         virtual const triangleObject_t* getMesh() const { return mesh; }
-        virtual void updateIntersectionCachedValues();
 
 	private:
 		int pa, pb, pc; //!< indices in point array, referenced in mesh.
@@ -69,8 +69,22 @@ class YAFRAYCORE_EXPORT triangle_t
 		vector3d_t normal; //!< the geometric normal
         const triangleObject_t* mesh;
 		size_t selfIndex;
-		float intersectionBiasFactor;	//!< Intersection Bias factor based on longest edge to reduce 
-		vector3d_t edge1, edge2;
+};
+
+/*! Intersection-only copy of a triangle, 48 bytes: first vertex, both edges
+	and the bias factor of the Möller-Trumbore test. Trees keep these apart
+	from the shading data of triangle_t, so a leaf test reads one cache line
+	and neither the mesh vertices nor a virtual function */
+struct packedTriangle_t
+{
+	void set(const point3d_t &pa, const point3d_t &pb, const point3d_t &pc, const triangle_t *t);
+	void set(const triangle_t *t);
+	bool intersect(const ray_t &ray, float *t, intersectData_t &data) const;
+
+	point3d_t a;
+	vector3d_t edge1, edge2;
+	float epsilon; //!< intersection bias based on the longest edge
+	const triangle_t *tri;
 };
 
 class YAFRAYCORE_EXPORT triangleInstance_t: public triangle_t
@@ -80,7 +94,7 @@ class YAFRAYCORE_EXPORT triangleInstance_t: public triangle_t
 
 	public:
 		triangleInstance_t(): mBase(nullptr), mesh(nullptr) { }
-        triangleInstance_t(triangle_t* base, triangleObjectInstance_t* m): mBase(base), mesh(m) { updateIntersectionCachedValues();}
+        triangleInstance_t(triangle_t* base, triangleObjectInstance_t* m): mBase(base), mesh(m) { /* Empty */ }
 		virtual bool intersect(const ray_t &ray, float *t, intersectData_t &data) const;
 		virtual bound_t getBound() const;
 		virtual bool intersectsBound(exBound_t &eb) const;
@@ -93,8 +107,8 @@ class YAFRAYCORE_EXPORT triangleInstance_t: public triangle_t
 		virtual void sample(float s1, float s2, point3d_t &p, vector3d_t &n) const;
 
 		virtual vector3d_t getNormal() const;
+		virtual void getVertices(point3d_t &a, point3d_t &b, point3d_t &c) const;
 		virtual void recNormal() { /* Empty */ };
-		virtual void updateIntersectionCachedValues();
 
 	private:
         const triangle_t* mBase;
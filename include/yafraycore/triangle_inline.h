@@ -7,45 +7,31 @@
 	"triangle.h" and "triangle_inline.h" directly.
 */
 
-inline void triangle_t::updateIntersectionCachedValues()
-{
-	point3d_t const& a = mesh->getVertex(pa);
-	point3d_t const& b = mesh->getVertex(pb);
-	point3d_t const& c = mesh->getVertex(pc);
-
-	edge1 = b - a;
-	edge2 = c - a;
+// packedTriangle_t inlined functions
 
-	intersectionBiasFactor = 0.1f * MIN_RAYDIST * std::max(edge1.length(), edge2.length());
+inline void packedTriangle_t::set(const point3d_t &pa, const point3d_t &pb, const point3d_t &pc, const triangle_t *t)
+{
+	a = pa;
+	edge1 = pb - pa;
+	edge2 = pc - pa;
+	epsilon = 0.1f * MIN_RAYDIST * std::max(edge1.length(), edge2.length());
+	tri = t;
 }
 
-
-inline void triangleInstance_t::updateIntersectionCachedValues()
+inline void packedTriangle_t::set(const triangle_t *t)
 {
-	point3d_t const& a = mesh->getVertex(mBase->pa);
-	point3d_t const& b = mesh->getVertex(mBase->pb);
-	point3d_t const& c = mesh->getVertex(mBase->pc);
-
-	edge1 = b - a;
-	edge2 = c - a;
-
-	intersectionBiasFactor = 0.1f * MIN_RAYDIST * std::max(edge1.length(), edge2.length());
+	point3d_t pa, pb, pc;
+	t->getVertices(pa, pb, pc);
+	set(pa, pb, pc, t);
 }
 
-
-inline bool triangle_t::intersect(const ray_t &ray, float *t, intersectData_t &data) const
+inline bool packedTriangle_t::intersect(const ray_t &ray, float *t, intersectData_t &data) const
 {
 	// Tomas Möller and Ben Trumbore ray intersection scheme
 	// Getting the barycentric coordinates of the hit point
-    // const point3d_t &a=mesh->points[pa], &b=mesh->points[pb], &c=mesh->points[pc];
-
-	point3d_t const& a = mesh->getVertex(pa);
-
 	vector3d_t pvec = ray.dir ^ edge2;
 	float det = edge1 * pvec;
 
-	float epsilon = intersectionBiasFactor;
-	
 	if(det > -epsilon && det < epsilon) return false;
 
 	float inv_det = 1.f / det;
@@ -66,11 +52,20 @@ inline bool triangle_t::intersect(const ray_t &ray, float *t, intersectData_t &d
 	data.b1 = u;
 	data.b2 = v;
 	data.b0 = 1 - u - v;
-	data.edge1 = &edge1;
-	data.edge2 = &edge2;
+	data.edge1 = edge1;
+	data.edge2 = edge2;
 	return true;
 }
 
+// triangle_t inlined functions
+
+inline bool triangle_t::intersect(const ray_t &ray, float *t, intersectData_t &data) const
+{
+	packedTriangle_t packed;
+	packed.set(mesh->getVertex(pa), mesh->getVertex(pb), mesh->getVertex(pc), this);
+	return packed.intersect(ray, t, data);
+}
+
 inline bound_t triangle_t::getBound() const
 {
     point3d_t const& a = mesh->getVertex(pa);
@@ -105,6 +100,13 @@ inline bool triangle_t::intersectsBound(exBound_t &eb) const
 	return triBoxOverlap(eb.center, eb.halfSize, tPoints);
 }
 
+inline void triangle_t::getVertices(point3d_t &a, point3d_t &b, point3d_t &c) const
+{
+	a = mesh->getVertex(pa);
+	b = mesh->getVertex(pb);
+	c = mesh->getVertex(pc);
+}
+
 inline void triangle_t::recNormal()
 {
     point3d_t const& a = mesh->getVertex(pa);
@@ -118,38 +120,9 @@ inline void triangle_t::recNormal()
 
 inline bool triangleInstance_t::intersect(const ray_t &ray, float *t, intersectData_t &data) const
 {
-	// Tomas Möller and Ben Trumbore ray intersection scheme
-	// Getting the barycentric coordinates of the hit point
-    point3d_t const& a = mesh->getVertex(mBase->pa);
-
-	vector3d_t pvec = ray.dir ^ edge2;
-	float det = edge1 * pvec;
-
-	float epsilon = intersectionBiasFactor;
-	
-	if(det > -epsilon && det < epsilon) return false;
-
-	float inv_det = 1.f / det;
-	vector3d_t tvec = ray.from - a;
-	float u = (tvec*pvec) * inv_det;
-
-	if (u < 0.f || u > 1.f) return false;
-
-	vector3d_t qvec = tvec^edge1;
-	float v = (ray.dir*qvec) * inv_det;
-
-	if ((v<0.f) || ((u+v)>1.f) ) return false;
-
-	*t = edge2 * qvec * inv_det;
-
-	if(*t < epsilon) return false;
-
-	data.b1 = u;
-	data.b2 = v;
-	data.b0 = 1 - u - v;
-	data.edge1 = &edge1;
-	data.edge2 = &edge2;
-	return true;
+	packedTriangle_t packed;
+	packed.set(mesh->getVertex(mBase->pa), mesh->getVertex(mBase->pb), mesh->getVertex(mBase->pc), this);
+	return packed.intersect(ray, t, data);
 }
 
 inline bound_t triangleInstance_t::getBound() const
@@ -190,3 +163,10 @@ inline vector3d_t triangleInstance_t::getNormal() const
 {
 	return vector3d_t(mesh->objToWorld * mBase->normal).normalize();
 }
+
+inline void triangleInstance_t::getVertices(point3d_t &a, point3d_t &b, point3d_t &c) const
+{
+	a = mesh->getVertex(mBase->pa);
+	b = mesh->getVertex(mBase->pb);
+	c = mesh->getVertex(mBase->pc);
+}
@@ -24,6 +24,9 @@
 #include <utilities/ColorConv.h>
 #include <utilities/spectralData.h>
 #include <utilities/curveUtils.h>
+#include <utilities/skyTable.h>
+#include <utilities/hashUtils.h>
+#include <yafraycore/timer.h>
 
 __BEGIN_YAFRAY
 
@@ -31,13 +34,16 @@ class darkSkyBackground_t: public background_t
 {
 	public:
 		darkSkyBackground_t(const point3d_t dir, float turb, float pwr, float skyBright, bool clamp, float av, float bv, float cv, float dv, float ev,
-							float altitude, bool night, float exp, bool genc, ColorSpaces cs, bool ibl, bool with_caustic);
+							float altitude, bool night, float exp, bool genc, ColorSpaces cs, bool ibl, bool with_caustic, int tableRes);
 		virtual color_t operator() (const ray_t &ray, renderState_t &state, bool from_postprocessed=false) const;
 		virtual color_t eval(const ray_t &ray, bool from_postprocessed=false) const;
 		virtual ~darkSkyBackground_t();
 		static background_t *factory(paraMap_t &,renderEnvironment_t &);
 		bool hasIBL() { return withIBL; }
 		bool shootsCaustic() { return shootCaustic; }
+		virtual void init(scene_t &scene);
+		virtual uint64_t contentKey() const { return key; }
+		virtual void resolution(int &u, int &v) const { u = skyTable.getWidth(); v = skyTable.getHeight(); }
 		color_t getAttenuatedSunColor();
 
 	protected:
@@ -62,12 +68,20 @@ class darkSkyBackground_t: public background_t
 		bool withIBL;
 		bool shootCaustic;
 		bool shootDiffuse;
+		int skyTableRes; //!< height of the baked sky table, 0 to evaluate the sky model for every ray
+		skyTable_t skyTable;
+		uint64_t key;
 };
 
 darkSkyBackground_t::darkSkyBackground_t(const point3d_t dir, float turb, float pwr, float skyBright, bool clamp,float av, float bv, float cv, float dv, float ev,
-										float altitude, bool night, float exp, bool genc, ColorSpaces cs, bool ibl, bool with_caustic):
-									   power(pwr * skyBright), skyBrightness(skyBright), convert(clamp, genc, cs, exp), alt(altitude), nightSky(night), withIBL(ibl), shootCaustic(with_caustic)
+										float altitude, bool night, float exp, bool genc, ColorSpaces cs, bool ibl, bool with_caustic, int tableRes):
+									   power(pwr * skyBright), skyBrightness(skyBright), convert(clamp, genc, cs, exp), alt(altitude), nightSky(night), withIBL(ibl), shootCaustic(with_caustic), skyTableRes(tableRes)
 {
+	key = hashValue(dir);
+	for(float f : {turb, pwr, skyBright, av, bv, cv, dv, ev, altitude, exp}) key = hashValue(f, key);
+	for(bool b : {clamp, night, genc}) key = hashValue(b, key);
+	key = hashValue(cs, key);
+	key = hashValue(tableRes, key);
 
 
 	std::string act = "";
@@ -242,16 +256,32 @@ inline color_t darkSkyBackground_t::getSkyCol(const ray_t &ray) const
 
 color_t darkSkyBackground_t::operator() (const ray_t &ray, renderState_t &state, bool from_postprocessed) const
 {
-	color_t ret = getSkyCol(ray);
+	color_t ret = skyTable.empty() ? getSkyCol(ray) : skyTable.lookup(ray.dir);
 	return ret;
 }
 
 color_t darkSkyBackground_t::eval(const ray_t &ray, bool from_postprocessed) const
 {
-	color_t ret = getSkyCol(ray)  * power;
+	color_t ret = (skyTable.empty() ? getSkyCol(ray) : skyTable.lookup(ray.dir)) * power;
 	return ret;
 }
 
+void darkSkyBackground_t::init(scene_t &scene)
+{
+	if(skyTableRes <= 0 || !skyTable.empty()) return;
+
+	timer_t bakeTimer;
+	bakeTimer.addEvent("bake");
+	bakeTimer.start("bake");
+	skyTable.build(2 * skyTableRes, skyTableRes, scene.getNumThreads(), [this](const vector3d_t &dir)
+	{
+		ray_t ray(point3d_t(0.f), dir);
+		return getSkyCol(ray);
+	});
+	bakeTimer.stop("bake");
+	Y_VERBOSE << "DarkSky: " << 2 * skyTableRes << "x" << skyTableRes << " sky table baked in " << bakeTimer.getTime("bake") << "s" << yendl;
+}
+
 background_t *darkSkyBackground_t::factory(paraMap_t &params,renderEnvironment_t &render)
 {
 	point3d_t dir(1,1,1);
@@ -274,6 +304,8 @@ background_t *darkSkyBackground_t::factory(paraMap_t &params,renderEnvironment_t
 	float exp = 1.f;
 	bool castShadows = true;
 	bool castShadowsSun = true;
+	bool useSkyTable = false;
+	int skyTableRes = 512;
 
 	Y_VERBOSE << "DarkSky: Begin" << yendl;
 
@@ -306,6 +338,10 @@ background_t *darkSkyBackground_t::factory(paraMap_t &params,renderEnvironment_t
 
 	params.getParam("night", night);
 
+	params.getParam("sky_table", useSkyTable); //Bake the sky into a lat-long table instead of evaluating it for every ray
+	params.getParam("sky_table_res", skyTableRes);
+	if(!useSkyTable) skyTableRes = 0;
+
 	ColorSpaces colorS = cieRGB_E_CS;
 	if(cs == "CIE (E)") colorS = cieRGB_E_CS;
 	else if(cs == "CIE (D50)") colorS = cieRGB_D50_CS;
@@ -319,7 +355,7 @@ background_t *darkSkyBackground_t::factory(paraMap_t &params,renderEnvironment_t
 	}
 
 	darkSkyBackground_t *darkSky = new darkSkyBackground_t(dir, turb, power, bright, clamp, av, bv, cv, dv, ev,
-																altitude, night, exp, gammaEnc, colorS, bgl, caus);
+																altitude, night, exp, gammaEnc, colorS, bgl, caus, skyTableRes);
 
 	if (add_sun && radToDeg(fAcos(dir.z)) < 100.0)
 	{
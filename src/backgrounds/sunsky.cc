@@ -25,6 +25,9 @@
 #include <core_api/params.h>
 #include <core_api/scene.h>
 #include <core_api/light.h>
+#include <utilities/skyTable.h>
+#include <utilities/hashUtils.h>
+#include <yafraycore/timer.h>
 
 __BEGIN_YAFRAY
 
@@ -38,13 +41,16 @@ color_t ComputeAttenuatedSunlight(float theta, int turbidity);
 class sunskyBackground_t: public background_t
 {
 	public:
-		sunskyBackground_t(const point3d_t dir, float turb, float a_var, float b_var, float c_var, float d_var, float e_var, float pwr, bool ibl, bool with_caustic);
+		sunskyBackground_t(const point3d_t dir, float turb, float a_var, float b_var, float c_var, float d_var, float e_var, float pwr, bool ibl, bool with_caustic, int tableRes);
 		virtual color_t operator() (const ray_t &ray, renderState_t &state, bool from_postprocessed=false) const;
 		virtual color_t eval(const ray_t &ray, bool from_postprocessed=false) const;
 		virtual ~sunskyBackground_t();
 		static background_t *factory(paraMap_t &,renderEnvironment_t &);
 		bool hasIBL() { return withIBL; }
 		bool shootsCaustic() { return shootCaustic; }
+		virtual void init(scene_t &scene);
+		virtual uint64_t contentKey() const { return key; }
+		virtual void resolution(int &u, int &v) const { u = skyTable.getWidth(); v = skyTable.getHeight(); }
 	protected:
 		color_t getSkyCol(const ray_t &ray) const;
 		vector3d_t sunDir;
@@ -59,10 +65,17 @@ class sunskyBackground_t: public background_t
 		bool withIBL;
 		bool shootCaustic;
 		bool shootDiffuse;
+		int skyTableRes; //!< height of the baked sky table, 0 to evaluate the sky model for every ray
+		skyTable_t skyTable;
+		uint64_t key;
 };
 
-sunskyBackground_t::sunskyBackground_t(const point3d_t dir, float turb, float a_var, float b_var, float c_var, float d_var, float e_var, float pwr, bool ibl, bool with_caustic): power(pwr), withIBL(ibl), shootCaustic(with_caustic)
+sunskyBackground_t::sunskyBackground_t(const point3d_t dir, float turb, float a_var, float b_var, float c_var, float d_var, float e_var, float pwr, bool ibl, bool with_caustic, int tableRes):
+	power(pwr), withIBL(ibl), shootCaustic(with_caustic), skyTableRes(tableRes)
 {
+	key = hashValue(dir);
+	for(float f : {turb, a_var, b_var, c_var, d_var, e_var, pwr}) key = hashValue(f, key);
+	key = hashValue(tableRes, key);
 	sunDir.set(dir.x, dir.y, dir.z);
 	sunDir.normalize();
 	thetaS = fAcos(sunDir.z);
@@ -194,12 +207,28 @@ inline color_t sunskyBackground_t::getSkyCol(const ray_t &ray) const
 
 color_t sunskyBackground_t::operator() (const ray_t &ray, renderState_t &state, bool from_postprocessed) const
 {
-	return power * getSkyCol(ray);
+	return power * (skyTable.empty() ? getSkyCol(ray) : skyTable.lookup(ray.dir));
 }
 
 color_t sunskyBackground_t::eval(const ray_t &ray, bool from_postprocessed) const
 {
-	return power * getSkyCol(ray);
+	return power * (skyTable.empty() ? getSkyCol(ray) : skyTable.lookup(ray.dir));
+}
+
+void sunskyBackground_t::init(scene_t &scene)
+{
+	if(skyTableRes <= 0 || !skyTable.empty()) return;
+
+	timer_t bakeTimer;
+	bakeTimer.addEvent("bake");
+	bakeTimer.start("bake");
+	skyTable.build(2 * skyTableRes, skyTableRes, scene.getNumThreads(), [this](const vector3d_t &dir)
+	{
+		ray_t ray(point3d_t(0.f), dir);
+		return getSkyCol(ray);
+	});
+	bakeTimer.stop("bake");
+	Y_VERBOSE << "Sunsky: " << 2 * skyTableRes << "x" << skyTableRes << " sky table baked in " << bakeTimer.getTime("bake") << "s" << yendl;
 }
 
 background_t *sunskyBackground_t::factory(paraMap_t &params,renderEnvironment_t &render)
@@ -217,6 +246,8 @@ background_t *sunskyBackground_t::factory(paraMap_t &params,renderEnvironment_t
 	bool castShadowsSun = true;
 	bool caus = true;
 	bool diff = true;
+	bool useSkyTable = false;	// bake the sky into a lat-long table instead of evaluating it for every ray
+	int skyTableRes = 512;
 
 	params.getParam("from", dir);
 	params.getParam("turbidity", turb);
@@ -241,7 +272,11 @@ background_t *sunskyBackground_t::factory(paraMap_t &params,renderEnvironment_t
 	params.getParam("with_caustic", caus);
 	params.getParam("with_diffuse", diff);
 
-	background_t *new_sunsky = new sunskyBackground_t(dir, turb, av, bv, cv, dv, ev, power, bgl, true);
+	params.getParam("sky_table", useSkyTable);
+	params.getParam("sky_table_res", skyTableRes);
+	if(!useSkyTable) skyTableRes = 0;
+
+	background_t *new_sunsky = new sunskyBackground_t(dir, turb, av, bv, cv, dv, ev, power, bgl, true, skyTableRes);
 
 	if(bgl)
 	{
@@ -28,6 +28,7 @@
 #include <core_api/light.h>
 
 #include <utilities/sample_utils.h>
+#include <utilities/hashUtils.h>
 
 __BEGIN_YAFRAY
 
@@ -47,6 +48,8 @@ class textureBackground_t: public background_t
 		static background_t *factory(paraMap_t &,renderEnvironment_t &);
 		bool hasIBL() { return withIBL; }
 		bool shootsCaustic() { return shootCaustic; }
+		virtual uint64_t contentKey() const;
+		virtual void resolution(int &u, int &v) const;
 		
 	protected:
 		const texture_t *tex;
@@ -70,6 +73,7 @@ class constBackground_t: public background_t
 		static background_t *factory(paraMap_t &params,renderEnvironment_t &render);
 		bool hasIBL() { return withIBL; }
 		bool shootsCaustic() { return shootCaustic; }
+		virtual uint64_t contentKey() const { return hashValue(color); }
 	protected:
 		color_t color;
 		bool withIBL;
@@ -136,6 +140,33 @@ color_t textureBackground_t::eval(const ray_t &ray, bool use_ibl_blur) const
 	return power * ret;
 }
 
+uint64_t textureBackground_t::contentKey() const
+{
+	if(!tex->contentKey()) return 0;
+	uint64_t h = hashValue(tex->contentKey());
+	h = hashValue(project, h);
+	h = hashValue(power, h);
+	h = hashValue(rotation, h);
+	return hashValue(IBL_Blur_mipmap_level, h);
+}
+
+void textureBackground_t::resolution(int &u, int &v) const
+{
+	int x, y, z;
+	tex->resolution(x, y, z);
+	if(project == angular)
+	{
+		// a radius of the probe spans pi, rather oversample as its axis is not the one of the sphere map
+		v = std::max(x, y);
+		u = 2 * v;
+	}
+	else
+	{
+		u = x;
+		v = y;
+	}
+}
+
 background_t* textureBackground_t::factory(paraMap_t &params,renderEnvironment_t &render)
 {
 	texture_t *tex=nullptr;
@@ -0,0 +1,119 @@
+/****************************************************************************
+ *
+ * 		pdf1d_bench.cc: microbenchmark of the pdf1D_t sampling
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*	Times pdf1D_t::DSample() (alias table, guided cdf search above PDF1D_MAX_ALIAS_STEPS)
+	and pdf1D_t::Sample() (guided cdf search) against a plain binary search over the cdf,
+	like both did before, for table sizes from 1k to 16M steps. The weights look like
+	an environment map: mostly dim, 5% zeros and 0.1% very bright steps.
+
+	usage: yafaray-bench-pdf1d [draws per table size, default 4194304]
+*/
+
+#include <yafray_config.h>
+#include <utilities/sample_utils.h>
+#include <utilities/mcqmc.h>
+#include <yafraycore/timer.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace::yafaray;
+
+//! the results of the timed loops go here, so they are not optimized away
+static volatile double sink = 0.0;
+
+//! the step of the cdf containing u, found by a binary search over the whole cdf
+static inline int cdfSearch(const pdf1D_t &d, float u)
+{
+	const float *ptr = std::lower_bound(d.cdf, d.cdf + d.count + 1, u);
+	return std::max(0, std::min((int)(ptr - d.cdf - 1), d.count - 1));
+}
+
+//! nanoseconds per draw of the event
+static double nsPerDraw(yafaray::timer_t &timer, const std::string &name, size_t draws)
+{
+	return timer.getTime(name) * 1e9 / (double)draws;
+}
+
+int main(int argc, char **argv)
+{
+	size_t draws = 1 << 22;
+	if(argc > 1) draws = std::max(1L, std::atol(argv[1]));
+
+	const int sizes[] = { 1000, 1 << 14, 1 << 18, 1 << 22, 1 << 24 };
+
+	std::vector<float> u(draws);
+	random_t prng(123);
+	for(size_t i=0; i<draws; ++i) u[i] = prng();
+
+	std::printf("%10s %10s %22s %22s\n", "n", "build", "DSample cdf/DSample", "Sample cdf/Sample");
+
+	for(int n : sizes)
+	{
+		std::vector<float> f(n);
+		random_t wprng(n);
+		for(int i=0; i<n; ++i)
+		{
+			float r = wprng();
+			if(r < 0.05f) f[i] = 0.f;
+			else if(r < 0.051f) f[i] = 1000.f * wprng();
+			else f[i] = 0.1f + wprng();
+		}
+
+		yafaray::timer_t timer;
+		timer.addEvent("build");
+		timer.start("build");
+		pdf1D_t d(&f[0], n);
+		timer.stop("build");
+
+		double sum = 0.0;
+		float pdf = 0.f;
+		const char *events[] = { "dcdf", "dalias", "scdf", "sguide" };
+		for(const char *e : events) timer.addEvent(e);
+
+		timer.start("dcdf");
+		for(size_t i=0; i<draws; ++i) sum += cdfSearch(d, u[i]);
+		timer.stop("dcdf");
+
+		timer.start("dalias");
+		for(size_t i=0; i<draws; ++i) sum += d.DSample(u[i], &pdf);
+		timer.stop("dalias");
+
+		timer.start("scdf");
+		for(size_t i=0; i<draws; ++i)
+		{
+			int k = cdfSearch(d, u[i]);
+			sum += k + (u[i] - d.cdf[k]) / (d.cdf[k+1] - d.cdf[k]);
+		}
+		timer.stop("scdf");
+
+		timer.start("sguide");
+		for(size_t i=0; i<draws; ++i) sum += d.Sample(u[i], &pdf);
+		timer.stop("sguide");
+
+		sink = sum + pdf;
+
+		std::printf("%10d %8.1fms %10.1f / %6.1f ns %10.1f / %6.1f ns\n", n, timer.getTime("build") * 1000.0,
+			nsPerDraw(timer, "dcdf", draws), nsPerDraw(timer, "dalias", draws),
+			nsPerDraw(timer, "scdf", draws), nsPerDraw(timer, "sguide", draws));
+	}
+	return 0;
+}
@@ -0,0 +1,203 @@
+/****************************************************************************
+ *
+ * 		ray_bench.cc: ray throughput of the scene accelerator
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*	Builds the BVH of an XML scene and prints the rays per second of single ray
+	intersect(), single ray isShadowed() and the isShadowed() ray stream, on one thread.
+	The shadow rays are segments between points of the scene bound: "incoherent" joins
+	random points, "coherent" sends each RAY_STREAM_SIZE rays from one point to a small
+	region, like the light samples of one shading point. The stream must give the same
+	result as the single rays, the rays where they differ are counted.
+
+	usage: yafaray-bench-rays scene.xml [rays per set, default 1048576] [plugin path]
+*/
+
+#include <yafray_config.h>
+#include <core_api/scene.h>
+#include <core_api/environment.h>
+#include <core_api/surface.h>
+#include <core_api/imagefilm.h>
+#include <core_api/output.h>
+#include <yafraycore/xmlparser.h>
+#include <yafraycore/timer.h>
+#include <utilities/mcqmc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace::yafaray;
+
+//! the results of the timed loops go here, so they are not optimized away
+static volatile int sink = 0;
+
+//! the scene needs an image film to be updated, nothing is rendered to it
+class nullOutput_t : public colorOutput_t
+{
+	public:
+		virtual bool putPixel(int numView, int x, int y, const renderPasses_t *renderPasses, int idx, const colorA_t &color, bool alpha = true) { return true; }
+		virtual bool putPixel(int numView, int x, int y, const renderPasses_t *renderPasses, const std::vector<colorA_t> &colExtPasses, bool alpha = true) { return true; }
+		virtual void flush(int numView, const renderPasses_t *renderPasses) {}
+		virtual void flushArea(int numView, int x0, int y0, int x1, int y1, const renderPasses_t *renderPasses) {}
+};
+
+static point3d_t randomPoint(const bound_t &b, random_t &prng)
+{
+	return point3d_t(b.a.x + prng() * (b.g.x - b.a.x), b.a.y + prng() * (b.g.y - b.a.y), b.a.z + prng() * (b.g.z - b.a.z));
+}
+
+static ray_t segment(const point3d_t &from, const point3d_t &to)
+{
+	vector3d_t dir = to - from;
+	float len = dir.length();
+	if(len <= 0.f) return ray_t(from, vector3d_t(0.f, 0.f, 1.f), 0.f, 0.f);
+	return ray_t(from, dir / len, 0.f, len);
+}
+
+//! millions of rays per second of the event
+static double mraysPerSecond(yafaray::timer_t &timer, const std::string &name, size_t rays)
+{
+	return (double)rays / timer.getTime(name) * 1e-6;
+}
+
+static void traceRays(const scene_t &scene, const char *setName, const std::vector<ray_t> &rays)
+{
+	size_t n = rays.size();
+	renderState_t state;
+	std::vector<float> objIndex(n, 0.f), matIndex(n, 0.f);
+	std::vector<char> single(n);
+	bool *stream = new bool[n];
+	int count = 0;
+
+	yafaray::timer_t timer;
+	const char *events[] = { "intersect", "single", "stream" };
+	for(const char *e : events) timer.addEvent(e);
+
+	timer.start("intersect");
+	for(size_t k=0; k<n; ++k)
+	{
+		surfacePoint_t sp;
+		ray_t ray(rays[k].from, rays[k].dir);
+		count += scene.intersect(ray, sp);
+	}
+	timer.stop("intersect");
+
+	timer.start("single");
+	for(size_t k=0; k<n; ++k) single[k] = scene.isShadowed(state, rays[k], objIndex[k], matIndex[k]);
+	timer.stop("single");
+
+	timer.start("stream");
+	scene.isShadowed(state, (int)n, &rays[0], stream, &objIndex[0], &matIndex[0]);
+	timer.stop("stream");
+
+	size_t shadowed = 0, mismatches = 0;
+	for(size_t k=0; k<n; ++k)
+	{
+		shadowed += stream[k];
+		mismatches += ((bool)single[k] != stream[k]);
+	}
+	sink = count;
+	delete[] stream;
+
+	double singleRate = mraysPerSecond(timer, "single", n), streamRate = mraysPerSecond(timer, "stream", n);
+	std::printf("%12s %9zu %8.1f%% %12.2f %12.2f %12.2f %8.2fx %10zu\n", setName, n, 100.0 * shadowed / n,
+		mraysPerSecond(timer, "intersect", n), singleRate, streamRate, streamRate / singleRate, mismatches);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2)
+	{
+		std::printf("usage: %s scene.xml [rays per set] [plugin path]\n", argv[0]);
+		return 1;
+	}
+	size_t nRays = (argc > 2) ? std::max(1L, std::atol(argv[2])) : (1 << 20);
+	std::string ppath = (argc > 3) ? argv[3] : "";
+
+	yafLog.setConsoleMasterVerbosity("warning");
+	yafLog.setLogMasterVerbosity("mute");
+
+	renderEnvironment_t *env = new renderEnvironment_t();
+	if(!env->getPluginPath(ppath))
+	{
+		std::printf("no plugin path found\n");
+		return 1;
+	}
+	env->loadPlugins(ppath);
+
+	scene_t *scene = new scene_t(env);
+	env->setScene(scene);
+	paraMap_t render;
+	if(!parse_xml_file(argv[1], scene, env, render, "LinearRGB", 1.f))
+	{
+		std::printf("could not load %s\n", argv[1]);
+		return 1;
+	}
+	render["logging_saveLog"] = false;
+	render["logging_saveHTML"] = false;
+	nullOutput_t out;
+	if(!env->setupScene(*scene, render, out))
+	{
+		std::printf("could not set up %s\n", argv[1]);
+		return 1;
+	}
+	const std::map<std::string, camera_t *> *cameras = env->getCameraTable();
+	if(cameras->empty())
+	{
+		std::printf("no camera in %s\n", argv[1]);
+		return 1;
+	}
+	// the scene is updated like scene_t::render() does it for the first view
+	scene->setCamera(cameras->begin()->second);
+	scene->setAccelerator(ACCEL_BVH);
+	if(!scene->update() || !scene->tracesRayStreams())
+	{
+		std::printf("no BVH for the geometry of %s\n", argv[1]);
+		return 1;
+	}
+
+	bound_t bound = scene->getSceneBound();
+	random_t prng(123);
+
+	std::vector<ray_t> incoherent(nRays);
+	for(size_t k=0; k<nRays; ++k) incoherent[k] = segment(randomPoint(bound, prng), randomPoint(bound, prng));
+
+	// each stream goes from one point to a box of 5% of the scene size, like an area light
+	vector3d_t lightSize = 0.05f * (bound.g - bound.a);
+	std::vector<ray_t> coherent(nRays);
+	for(size_t first=0; first<nRays; first+=RAY_STREAM_SIZE)
+	{
+		point3d_t from = randomPoint(bound, prng);
+		point3d_t center = randomPoint(bound, prng);
+		bound_t light(center - 0.5f * lightSize, center + 0.5f * lightSize);
+		for(size_t k=first; k<std::min(nRays, first + RAY_STREAM_SIZE); ++k) coherent[k] = segment(from, randomPoint(light, prng));
+	}
+
+	std::printf("%12s %9s %9s %12s %12s %12s %9s %10s\n", "set", "rays", "shadowed", "intersect", "isShadowed", "stream", "speedup", "mismatches");
+	std::printf("%12s %9s %9s %12s %12s %12s\n", "", "", "", "Mrays/s", "Mrays/s", "Mrays/s");
+	traceRays(*scene, "incoherent", incoherent);
+	traceRays(*scene, "coherent", coherent);
+
+	imageFilm_t *film = scene->getImageFilm();
+	env->clearAll();
+	delete film;
+	delete scene;
+	delete env;
+	return 0;
+}
@@ -0,0 +1,149 @@
+/****************************************************************************
+ *
+ * 		render_bench.cc: render throughput against the number of threads
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*	Renders an XML scene with 1, 2, 4... up to the given number of threads and prints the
+	camera samples per second of each, with the speedup over one thread. The scene is
+	rendered in a single AA pass, so every pixel takes AA_minsamples samples, and the
+	pixels go to an output that drops them, so no image is encoded or written.
+	The photons are shot with as many threads, so for the photon mapping integrators the
+	prepass time and its speedup give the scaling of the photon shooting.
+
+	usage: yafaray-bench-render scene.xml [max threads, default: all cores] [plugin path]
+*/
+
+#include <yafray_config.h>
+#include <core_api/scene.h>
+#include <core_api/environment.h>
+#include <core_api/imagefilm.h>
+#include <core_api/output.h>
+#include <yafraycore/xmlparser.h>
+#include <yafraycore/timer.h>
+#include <yafraycore/monitor.h>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace::yafaray;
+
+//! takes the pixels of the film and drops them
+class nullOutput_t : public colorOutput_t
+{
+	public:
+		virtual bool putPixel(int numView, int x, int y, const renderPasses_t *renderPasses, int idx, const colorA_t &color, bool alpha = true) { return true; }
+		virtual bool putPixel(int numView, int x, int y, const renderPasses_t *renderPasses, const std::vector<colorA_t> &colExtPasses, bool alpha = true) { return true; }
+		virtual void flush(int numView, const renderPasses_t *renderPasses) {}
+		virtual void flushArea(int numView, int x0, int y0, int x1, int y1, const renderPasses_t *renderPasses) {}
+};
+
+//! keeps the progress of the render off the console
+class silentProgressBar_t : public progressBar_t
+{
+	public:
+		virtual void init(int totalSteps = 100) { nSteps = totalSteps; doneSteps = 0; }
+		virtual void update(int steps = 1) { doneSteps += steps; }
+		virtual void done() { doneSteps = nSteps; }
+		virtual void setTag(const char* text) { tag = text; }
+		virtual void setTag(std::string text) { tag = text; }
+		virtual std::string getTag() const { return tag; }
+		virtual float getPercent() const { return (nSteps > 0) ? 100.f * doneSteps / nSteps : 0.f; }
+		virtual float getTotalSteps() const { return nSteps; }
+	protected:
+		int nSteps = 0, doneSteps = 0;
+		std::string tag;
+};
+
+//! renders the scene once with the given threads, false if the scene could not be set up
+static bool renderScene(renderEnvironment_t *env, const char *xmlFile, int threads, double &prepass, double &seconds, double &samples)
+{
+	scene_t *scene = new scene_t(env);
+	env->setScene(scene);
+	paraMap_t render;
+	if(!parse_xml_file(xmlFile, scene, env, render, "LinearRGB", 1.f)) return false;
+
+	render["threads"] = threads;
+	render["threads_photons"] = threads;
+	render["AA_passes"] = 1;
+	render["logging_saveLog"] = false;
+	render["logging_saveHTML"] = false;
+	int AA_samples = 1;
+	render.getParam("AA_minsamples", AA_samples);
+
+	nullOutput_t out;
+	// the film owns the progress bar
+	if(!env->setupScene(*scene, render, out, new silentProgressBar_t)) return false;
+	session.setInteractive(false);
+	session.setStatusRenderStarted();
+	scene->render();
+
+	imageFilm_t *film = scene->getImageFilm();
+	prepass = std::max(0.0, gTimer.getTime("prepass")); // -1 if the integrator has no prepass
+	seconds = gTimer.getTime("rendert");
+	samples = (double)film->getTotalPixels() * AA_samples;
+
+	env->clearAll();
+	delete film;
+	delete scene;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2)
+	{
+		std::printf("usage: %s scene.xml [max threads] [plugin path]\n", argv[0]);
+		return 1;
+	}
+	int maxThreads = (argc > 2) ? std::atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+	maxThreads = std::max(1, maxThreads);
+	std::string ppath = (argc > 3) ? argv[3] : "";
+
+	yafLog.setConsoleMasterVerbosity("warning");
+	yafLog.setLogMasterVerbosity("mute");
+
+	renderEnvironment_t *env = new renderEnvironment_t();
+	if(!env->getPluginPath(ppath))
+	{
+		std::printf("no plugin path found\n");
+		return 1;
+	}
+	env->loadPlugins(ppath);
+
+	std::printf("%8s %10s %9s %10s %14s %9s %11s\n", "threads", "prepass", "speedup", "render", "samples/s", "speedup", "efficiency");
+
+	double basePrepass = 0.0, baseRate = 0.0;
+	for(int threads = 1; ; threads = std::min(2 * threads, maxThreads))
+	{
+		double prepass = 0.0, seconds = 0.0, samples = 0.0;
+		if(!renderScene(env, argv[1], threads, prepass, seconds, samples))
+		{
+			std::printf("could not render %s\n", argv[1]);
+			return 1;
+		}
+		double rate = samples / seconds;
+		if(threads == 1) basePrepass = prepass, baseRate = rate;
+		std::printf("%8d %9.2fs %8.2fx %9.2fs %14.0f %8.2fx %10.0f%%\n", threads, prepass, (prepass > 0.0) ? basePrepass / prepass : 1.0,
+			seconds, rate, rate / baseRate, 100.0 * rate / (baseRate * threads));
+		if(threads == maxThreads) break;
+	}
+
+	delete env;
+	return 0;
+}
@@ -91,9 +91,9 @@ bool exrHandler_t::saveToFile(const std::string &name, int imgIndex)
 	Imf::Array2D<Imf::Rgba> pixels;
 	pixels.resizeErase(h, w);
 
-	for(int i = 0; i < w; ++i)
+	for(int j = 0; j < h; ++j)
 	{
-		for(int j = 0; j < h; ++j)
+		for(int i = 0; i < w; ++i)
 		{
 			colorA_t col = imgBuffer.at(imgIndex)->getColor(i, j);
 			pixels[j][i].r = col.R;
@@ -185,9 +185,9 @@ bool exrHandler_t::saveToFileMultiChannel(const std::string &name, const renderP
 		pixels.push_back(new Imf::Array2D<Imf::Rgba>);
 		pixels.at(idx)->resizeErase(h0, w0);
 
-		for(int i = 0; i < w0; ++i)
+		for(int j = 0; j < h0; ++j)
 		{
-			for(int j = 0; j < h0; ++j)
+			for(int i = 0; i < w0; ++i)
 			{
 				colorA_t col = imgBuffer.at(idx)->getColor(i, j);
 				(*pixels.at(idx))[j][i].r = col.R;
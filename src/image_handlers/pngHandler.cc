@@ -404,9 +404,9 @@ void pngHandler_t::readFromStructs(png_structp pngPtr, png_infop infoPtr)
 	if(bitDepth == 8) divisor = inv8;
 	else if(bitDepth == 16) divisor = inv16;
 
-	for(int x = 0; x < m_width; x++)
+	for(int y = 0; y < m_height; y++)
 	{
-		for(int y = 0; y < m_height; y++)
+		for(int x = 0; x < m_width; x++)
 		{
 			colorA_t color;
 			
@@ -27,7 +27,7 @@ class YAFRAYPLUGIN_EXPORT EmissionIntegrator : public volumeIntegrator_t
 		
 		for (unsigned int i = 0; i < listVR.size(); i++)
 		{
-			result *= listVR.at(i)->tau(ray, 0, 0);
+			result *= listVR.at(i)->tau(ray, 0, (*state.prng)());
 		}
 		
 		result = colorA_t(fExp(-result.getR()), fExp(-result.getG()), fExp(-result.getB()));
@@ -69,7 +69,7 @@ class YAFRAYPLUGIN_EXPORT EmissionIntegrator : public volumeIntegrator_t
 			for (int i = 0; i < N; ++i)
 			{
 				ray_t stepRay(ray.from + (ray.dir * pos), ray.dir, 0, step, 0);
-				color_t stepTau = vr->tau(stepRay, 0, 0);
+				color_t stepTau = vr->tau(stepRay, 0, (*state.prng)());
 				Tr *= colorA_t(fExp(-stepTau.getR()), fExp(-stepTau.getG()), fExp(-stepTau.getB()));
 				result += Tr * vr->emission(stepRay.from, stepRay.dir);
 				pos += step;
@@ -8,8 +8,12 @@
 #include <yafraycore/photon.h>
 #include <utilities/mcqmc.h>
 #include <yafraycore/scr_halton.h>
+#include <utilities/hashUtils.h>
+#include <utilities/threadUtils.h>
 #include <vector>
 #include <stack>
+#include <atomic>
+#include <algorithm>
 
 __BEGIN_YAFRAY
 
@@ -36,6 +40,68 @@ public:
 		Y_PARAMS << "SingleScatter: stepSize: " << stepSize << " adaptive: " << adaptive << " optimize: " << optimize << yendl;
 	}
 
+	//! transmittance from p to the light along lightRay through all the volumes
+	float lightTransmittance(const ray_t &ray) const
+	{
+		ray_t lightRay(ray);
+		lightRay.tmin = scene->shadowBias;
+		if (lightRay.tmax < 0.f) lightRay.tmax = 1e10; // infinitely distant light
+
+		color_t lightstepTau(0.f);
+		for (unsigned int j = 0; j < VRSize; j++)
+		{
+			VolumeRegion* vr2 = listVR.at(j);
+			lightstepTau += vr2->tau(lightRay, stepSize, 0.0f);
+		}
+		return fExp(-lightstepTau.energy());
+	}
+
+	/*! the ray from p to the light used for the attenuation grids, false if p is not lit.
+		Area lights are sampled at the center of their sample domain */
+	bool gridLightRay(const light_t *l, const point3d_t &p, ray_t &lightRay) const
+	{
+		surfacePoint_t sp;
+		sp.P = p;
+		lightRay.from = p;
+		if (l->diracLight())
+		{
+			color_t lcol(0.0);
+			return l->illuminate(sp, lcol, lightRay);
+		}
+		lSample_t ls;
+		ls.s1 = 0.5f;
+		ls.s2 = 0.5f;
+		return l->illumSample(sp, ls, lightRay);
+	}
+
+	/*! what the attenuation grid of light l in volume vr depends on: the rays to the light from
+		the corners and the center of the volume, the grid, the contents of all the volumes and the
+		step size. The grid is only computed again if this changes */
+	uint64_t attenuationKey(const light_t *l, VolumeRegion *vr, uint64_t volumesKey) const
+	{
+		uint64_t h = hashValue(l, volumesKey);
+		h = hashValue(vr, h);
+		h = hashValue(vr->content_key, h);
+		h = hashValue(vr->attGridX, h);
+		h = hashValue(vr->attGridY, h);
+		h = hashValue(vr->attGridZ, h);
+		bound_t bb = vr->getBB();
+		for (int i = 0; i < 9; ++i)
+		{
+			point3d_t p = (i == 8) ? 0.5f * (bb.a + bb.g) :
+				point3d_t((i & 1) ? bb.g.x : bb.a.x, (i & 2) ? bb.g.y : bb.a.y, (i & 4) ? bb.g.z : bb.a.z);
+			ray_t lightRay;
+			bool lit = gridLightRay(l, p, lightRay);
+			h = hashValue(lit, h);
+			if (lit)
+			{
+				h = hashValue(lightRay.dir, h);
+				h = hashValue(lightRay.tmax, h);
+			}
+		}
+		return h;
+	}
+
 	virtual bool preprocess()
 	{
 		Y_INFO << "SingleScatter: Preprocessing..." << yendl;
@@ -53,99 +119,93 @@ public:
 		
 		if (optimize)
 		{
+			uint64_t volumesKey = hashValue(stepSize);
+			volumesKey = hashValue(scene->shadowBias, volumesKey);
 			for (unsigned int i = 0; i < VRSize; i++)
 			{
-				VolumeRegion* vr = listVR.at(i);
-				bound_t bb = vr->getBB();
+				volumesKey = hashValue(listVR.at(i), volumesKey);
+				volumesKey = hashValue(listVR.at(i)->content_key, volumesKey);
+				volumesKey = hashValue(listVR.at(i)->getBB(), volumesKey);
+			}
 
+			// the grids to compute, the others are still valid from the last render
+			struct gridJob_t
+			{
+				bound_t bound;
+				const light_t *light;
+				attenuationGrid_t *grid;
+			};
+			std::vector<gridJob_t> jobs;
+			for (unsigned int i = 0; i < VRSize; i++)
+			{
+				VolumeRegion* vr = listVR.at(i);
 				int xSize = vr->attGridX;
 				int ySize = vr->attGridY;
 				int zSize = vr->attGridZ;
 
-				float xSizeInv = 1.f/(float)xSize;
-				float ySizeInv = 1.f/(float)ySize;
-				float zSizeInv = 1.f/(float)zSize;
+				Y_PARAMS << "SingleScatter: volume, attGridMaps with size: " << xSize << " " << ySize << " " << zSize << yendl;
+
+				// forget the grids of lights that left the scene
+				for(auto g = vr->attenuationGridMap.begin(); g != vr->attenuationGridMap.end(); )
+				{
+					if(std::find(lights.begin(), lights.end(), g->first) == lights.end()) g = vr->attenuationGridMap.erase(g);
+					else ++g;
+				}
 
-				Y_PARAMS << "SingleScatter: volume, attGridMaps with size: " << xSize << " " << ySize << " " << xSize << std::endl;
-			
 				for(auto l=lights.begin(); l!=lights.end(); ++l)
 				{
-					color_t lcol(0.0);
+					attenuationGrid_t &grid = vr->attenuationGridMap[*l];
+					uint64_t key = attenuationKey(*l, vr, volumesKey);
+					if (grid.key == key && !grid.values.empty()) continue;
+					grid.key = key;
+					grid.nx = xSize;
+					grid.ny = ySize;
+					grid.nz = zSize;
+					grid.values.assign(xSize * ySize * zSize, 0.f);
+					jobs.push_back(gridJob_t{vr->getBB(), *l, &grid});
+				}
+			}
 
-					float* attenuationGrid = (float*)malloc(xSize * ySize * zSize * sizeof(float));
-					vr->attenuationGridMap[(*l)] = attenuationGrid;
+			// z slices of all the grids are shared out among the threads
+			std::vector<int> firstSlice(jobs.size() + 1, 0);
+			for (size_t j = 0; j < jobs.size(); ++j) firstSlice[j + 1] = firstSlice[j] + jobs[j].grid->nz;
+			int nSlices = firstSlice.back();
+			Y_VERBOSE << "SingleScatter: computing " << jobs.size() << " attenuation grids, " << lights.size() * VRSize - jobs.size() << " reused" << yendl;
 
-					for (int z = 0; z < zSize; ++z)
+			std::atomic<int> nextSlice(0);
+			auto computeSlices = [this, &jobs, &firstSlice, &nextSlice, nSlices](int threadID)
+			{
+				for (int s = nextSlice++; s < nSlices; s = nextSlice++)
+				{
+					size_t j = std::upper_bound(firstSlice.begin(), firstSlice.end(), s) - firstSlice.begin() - 1;
+					const light_t *l = jobs[j].light;
+					attenuationGrid_t &grid = *jobs[j].grid;
+					const bound_t &bb = jobs[j].bound;
+					int z = s - firstSlice[j];
+					for (int y = 0; y < grid.ny; ++y)
 					{
-						for (int y = 0; y < ySize; ++y)
+						for (int x = 0; x < grid.nx; ++x)
 						{
-							for (int x = 0; x < xSize; ++x)
-							{
-								// generate the world position inside the grid
-								point3d_t p(bb.longX() * xSizeInv * x + bb.a.x,
-											bb.longY() * ySizeInv * y + bb.a.y,
-											bb.longZ() * zSizeInv * z + bb.a.z);
-
-								surfacePoint_t sp;
-								sp.P = p;
-								
-								ray_t lightRay;
-
-								lightRay.from = sp.P;
-
-								// handle lights with delta distribution, e.g. point and directional lights
-								if( (*l)->diracLight() )
-								{
-									bool ill = (*l)->illuminate(sp, lcol, lightRay);
-									lightRay.tmin = scene->shadowBias;
-									if (lightRay.tmax < 0.f) lightRay.tmax = 1e10; // infinitely distant light
+							// the world position of the cell center, where attenuation() expects the value
+							point3d_t p(bb.longX() * (x + 0.5f) / grid.nx + bb.a.x,
+										bb.longY() * (y + 0.5f) / grid.ny + bb.a.y,
+										bb.longZ() * (z + 0.5f) / grid.nz + bb.a.z);
 
-									// transmittance from the point p in the volume to the light (i.e. how much light reaches p)
-									color_t lightstepTau(0.f);
-									if (ill)
-									{
-										for (unsigned int j = 0; j < VRSize; j++)
-										{
-											VolumeRegion* vr2 = listVR.at(j);
-											lightstepTau += vr2->tau(lightRay, stepSize, 0.0f);
-										}
-									}
-
-									float lightTr = fExp(-lightstepTau.energy());
-									attenuationGrid[x + y * xSize + ySize * xSize * z] = lightTr;
-								}
-								else // area light and suchlike
-								{
-									float lightTr = 0;
-									int n = (*l)->nSamples() >> 1; // samples / 2
-									if (n < 1) n = 1;
-									lSample_t ls;
-									for(int i=0; i<n; ++i)
-									{
-										ls.s1 = 0.5f; //(*state.prng)();
-										ls.s2 = 0.5f; //(*state.prng)();
-
-										(*l)->illumSample(sp, ls, lightRay);
-										lightRay.tmin = scene->shadowBias;
-										if (lightRay.tmax < 0.f) lightRay.tmax = 1e10; // infinitely distant light
-
-										// transmittance from the point p in the volume to the light (i.e. how much light reaches p)
-										color_t lightstepTau(0.f);
-										for (unsigned int j = 0; j < VRSize; j++)
-										{
-											VolumeRegion* vr2 = listVR.at(j);
-											lightstepTau += vr2->tau(lightRay, stepSize, 0.0f);
-										}
-										lightTr += fExp(-lightstepTau.energy());
-									}
-
-									attenuationGrid[x + y * xSize + ySize * xSize * z] = lightTr / (float)n;
-								}
-							}
+							ray_t lightRay;
+							// transmittance from the point p in the volume to the light (i.e. how much light reaches p)
+							grid.at(x, y, z) = gridLightRay(l, p, lightRay) ? lightTransmittance(lightRay) : 1.f;
 						}
 					}
 				}
+			};
+			int threads = std::min(scene->getNumThreads(), nSlices);
+			if (threads > 1)
+			{
+				threadPool_t pool(threads);
+				pool.run(computeSlices);
+				pool.wait();
 			}
+			else computeSlices(0);
 		}
 
 		return true;
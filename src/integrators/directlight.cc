@@ -69,6 +69,7 @@ bool directLighting_t::preprocess()
 		set << "ShadowDepth=" << sDepth << "  ";
 	}
 	set << "RayDepth=" << rDepth << "  ";
+	if(lightSampling != LIGHTS_ALL) set << "LightSampling=" << ((lightSampling == LIGHTS_TREE) ? "tree" : "uniform") << "  ";
 
 	if(useAmbientOcclusion)
 	{
@@ -208,6 +209,7 @@ colorA_t directLighting_t::integrate(renderState_t &state, diffRay_t &ray, color
 integrator_t* directLighting_t::factory(paraMap_t &params, renderEnvironment_t &render)
 {
 	bool transpShad=false;
+	bool rayStreams=true;
 	bool caustics=false;
 	bool do_AO=false;
 	int shadowDepth=5;
@@ -220,10 +222,12 @@ integrator_t* directLighting_t::factory(paraMap_t &params, renderEnvironment_t &
 	bool bg_transp = false;
 	bool bg_transp_refract = false;
 	std::string photon_maps_processing_str = "generate";
+	std::string light_sampling_str = "all";
 
 	params.getParam("raydepth", raydepth);
 	params.getParam("transpShad", transpShad);
 	params.getParam("shadowDepth", shadowDepth);
+	params.getParam("ray_streams", rayStreams);
 	params.getParam("caustics", caustics);
 	params.getParam("photons", photons);
 	params.getParam("caustic_mix", search);
@@ -236,8 +240,10 @@ integrator_t* directLighting_t::factory(paraMap_t &params, renderEnvironment_t &
 	params.getParam("bg_transp", bg_transp);
 	params.getParam("bg_transp_refract", bg_transp_refract);
 	params.getParam("photon_maps_processing", photon_maps_processing_str);
+	params.getParam("light_sampling", light_sampling_str);
 
 	directLighting_t *inte = new directLighting_t(transpShad, shadowDepth, raydepth);
+	inte->rayStreams = rayStreams;
 	// caustic settings
 	inte->usePhotonCaustics = caustics;
 	inte->nCausPhotons = photons;
@@ -257,6 +263,9 @@ integrator_t* directLighting_t::factory(paraMap_t &params, renderEnvironment_t &
 	else if(photon_maps_processing_str == "load") inte->photonMapProcessing = PHOTONS_LOAD;
 	else if(photon_maps_processing_str == "reuse-previous") inte->photonMapProcessing = PHOTONS_REUSE;
 	else inte->photonMapProcessing = PHOTONS_GENERATE_ONLY;
+
+	if(light_sampling_str == "uniform") inte->lightSampling = LIGHTS_UNIFORM;
+	else if(light_sampling_str == "tree") inte->lightSampling = LIGHTS_TREE;
 	
 	return inte;
 }
@@ -86,6 +86,7 @@ bool pathIntegrator_t::preprocess()
 		set << "ShadowDepth=" << sDepth << "  ";
 	}
 	set << "RayDepth=" << rDepth << " npaths=" << nPaths << " bounces=" << maxBounces << " min_bounces=" << russianRouletteMinBounces << " ";
+	if(lightSampling != LIGHTS_ALL) set << "LightSampling=" << ((lightSampling == LIGHTS_TREE) ? "tree" : "uniform") << "  ";
 	
 	bool success = true;
 	traceCaustics = false;
@@ -375,6 +376,7 @@ colorA_t pathIntegrator_t::integrate(renderState_t &state, diffRay_t &ray, color
 integrator_t* pathIntegrator_t::factory(paraMap_t &params, renderEnvironment_t &render)
 {
 	bool transpShad=false, noRec=false;
+	bool rayStreams=true;
 	int shadowDepth = 5;
 	int path_samples = 32;
 	int bounces = 3;
@@ -388,10 +390,12 @@ integrator_t* pathIntegrator_t::factory(paraMap_t &params, renderEnvironment_t &
 	bool bg_transp = false;
 	bool bg_transp_refract = false;
 	std::string photon_maps_processing_str = "generate";
+	std::string light_sampling_str = "all";
 	
 	params.getParam("raydepth", raydepth);
 	params.getParam("transpShad", transpShad);
 	params.getParam("shadowDepth", shadowDepth);
+	params.getParam("ray_streams", rayStreams);
 	params.getParam("path_samples", path_samples);
 	params.getParam("bounces", bounces);
 	params.getParam("russian_roulette_min_bounces", russian_roulette_min_bounces);
@@ -403,8 +407,10 @@ integrator_t* pathIntegrator_t::factory(paraMap_t &params, renderEnvironment_t &
 	params.getParam("AO_distance", AO_dist);
 	params.getParam("AO_color", AO_col);
 	params.getParam("photon_maps_processing", photon_maps_processing_str);
+	params.getParam("light_sampling", light_sampling_str);
 	
 	pathIntegrator_t* inte = new pathIntegrator_t(transpShad, shadowDepth);
+	inte->rayStreams = rayStreams;
 	if(params.getParam("caustic_type", cMethod))
 	{
 		bool usePhotons=false;
@@ -444,6 +450,9 @@ integrator_t* pathIntegrator_t::factory(paraMap_t &params, renderEnvironment_t &
 	else if(photon_maps_processing_str == "load") inte->photonMapProcessing = PHOTONS_LOAD;
 	else if(photon_maps_processing_str == "reuse-previous") inte->photonMapProcessing = PHOTONS_REUSE;
 	else inte->photonMapProcessing = PHOTONS_GENERATE_ONLY;
+
+	if(light_sampling_str == "uniform") inte->lightSampling = LIGHTS_UNIFORM;
+	else if(light_sampling_str == "tree") inte->lightSampling = LIGHTS_TREE;
 	
 	return inte;
 }
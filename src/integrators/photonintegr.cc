@@ -24,6 +24,7 @@
 #include <yafraycore/scr_halton.h>
 
 #include <sstream>
+#include <limits>
 #include <iomanip>
 
 __BEGIN_YAFRAY
@@ -94,26 +95,26 @@ photonIntegrator_t::photonIntegrator_t(unsigned int dPhotons, unsigned int cPhot
 	causRadius = cRad;
 	rDepth = 6;
 	maxBounces = 5;
+	useIrradianceCache = false;
+	irrCacheError = 0.2f;
+	irrCachePrepass = 8;
+	irrCache = nullptr;
 	integratorName = "PhotonMap";
 	integratorShortName = "PM";
 }
 
 photonIntegrator_t::~photonIntegrator_t()
 {
-	// Empty
+	delete irrCache;
 }
 
 
-void photonIntegrator_t::causticWorker(photonMap_t * causticMap, int threadID, const scene_t *scene, unsigned int nCausPhotons, const pdf1D_t *lightPowerD, int numCLights, const std::string &integratorName, const std::vector<light_t *> &tmplights, int causDepth, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot, int maxBounces)
+void photonIntegrator_t::causticWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &causticSlots, const scene_t *scene, const pdf1D_t *lightPowerD, int numCLights, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, int maxBounces)
 {
 	ray_t ray;
 	float lightNumPdf, lightPdf, s1, s2, s3, s4, s5, s6, s7, sL;
 	color_t pcol;
 
-	//shoot photons
-	bool done=false;
-	unsigned int curr=0;
-	
 	surfacePoint_t sp;
 	renderState_t state;
 	unsigned char userdata[USER_DATA_SIZE+7];
@@ -121,293 +122,244 @@ void photonIntegrator_t::causticWorker(photonMap_t * causticMap, int threadID, c
 	state.cam = scene->getCamera();
 
 	float fNumLights = (float)numCLights;
-	unsigned int nCausPhotons_thread = 1 + ( (nCausPhotons - 1) / scene->getNumThreadsPhotons() );
-
-	std::vector<photon_t> localCausticPhotons;
-	localCausticPhotons.clear();
-	localCausticPhotons.reserve(nCausPhotons_thread);
+	float invCaustPhotons = 1.f / (float)chunks.nPaths;
 
-	float invCaustPhotons = 1.f / (float)nCausPhotons;
-	
-	while(!done)
+	//shoot photons
+	unsigned int chunk, start, end;
+	while(chunks.take(chunk, start, end))
 	{
-		unsigned int haltoncurr = curr + nCausPhotons_thread * threadID;
-
-		state.chromatic = true;
-		state.wavelength = scrHalton(5,haltoncurr);
+		if(scene->getSignals() & Y_SIG_ABORT) return;
 
-		s1 = RI_vdC(haltoncurr);
-		s2 = scrHalton(2, haltoncurr);
-		s3 = scrHalton(3, haltoncurr);
-		s4 = scrHalton(4, haltoncurr);
+		std::vector<photon_t> &localCausticPhotons = causticSlots[chunk];
 
-		sL = float(haltoncurr) * invCaustPhotons;
-		int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
-		
-		if(lightNum >= numCLights)
+		for(unsigned int haltoncurr = start; haltoncurr < end; ++haltoncurr)
 		{
-			causticMap->mutx.lock();
-			Y_ERROR << integratorName << ": lightPDF sample error! " << sL << "/" << lightNum << yendl;
-			causticMap->mutx.unlock();
-			return;
-		}
+			state.chromatic = true;
+			state.wavelength = scrHalton(5,haltoncurr);
 
-		pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
-		ray.tmin = scene->rayMinDist;
-		ray.tmax = -1.0;
-		pcol *= fNumLights*lightPdf/lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
-		if(pcol.isBlack())
-		{
-			++curr;
-			done = (curr >= nCausPhotons_thread);
-			continue;
-		}
-		int nBounces=0;
-		bool causticPhoton = false;
-		bool directPhoton = true;
-		const material_t *material = nullptr;
-		BSDF_t bsdfs;
+			s1 = RI_vdC(haltoncurr);
+			s2 = scrHalton(2, haltoncurr);
+			s3 = scrHalton(3, haltoncurr);
+			s4 = scrHalton(4, haltoncurr);
 
-		while( scene->intersect(ray, sp) )
-		{
-			if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
+			sL = float(haltoncurr) * invCaustPhotons;
+			int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
+
+			if(lightNum >= numCLights)
 			{
-				causticMap->mutx.lock();
-				Y_WARNING << integratorName << ": NaN  on photon color for light" << lightNum + 1 << "." << yendl;
-				causticMap->mutx.unlock();
-				continue;
+				chunks.sampleError = true;
+				return;
 			}
-			
-			color_t transm(1.f);
-			color_t vcol(0.f);
-			const volumeHandler_t* vol = nullptr;
-			
-			if(material)
+
+			pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
+			ray.tmin = scene->rayMinDist;
+			ray.tmax = -1.0;
+			pcol *= fNumLights*lightPdf/lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
+			if(pcol.isBlack()) continue;
+
+			int nBounces=0;
+			bool causticPhoton = false;
+			bool directPhoton = true;
+			const material_t *material = nullptr;
+			BSDF_t bsdfs;
+
+			while( scene->intersect(ray, sp) )
 			{
-				if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * -ray.dir < 0)))
+				if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
 				{
-					if(vol->transmittance(state, ray, vcol)) transm = vcol;
+					++chunks.nanPaths;
+					break;
 				}
-			}
-			
-			vector3d_t wi = -ray.dir, wo;
-			material = sp.material;
-			material->initBSDF(state, sp, bsdfs);
 
-			if(bsdfs & BSDF_DIFFUSE)
-			{
-				if(causticPhoton)
+				color_t transm(1.f);
+				color_t vcol(0.f);
+				const volumeHandler_t* vol = nullptr;
+
+				if(material)
 				{
-					photon_t np(wi, sp.P, pcol);
-					localCausticPhotons.push_back(np);
+					if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * -ray.dir < 0)))
+					{
+						if(vol->transmittance(state, ray, vcol)) transm = vcol;
+					}
+				}
+
+				vector3d_t wi = -ray.dir, wo;
+				material = sp.material;
+				material->initBSDF(state, sp, bsdfs);
+
+				if(bsdfs & BSDF_DIFFUSE)
+				{
+					if(causticPhoton)
+					{
+						photon_t np(wi, sp.P, pcol);
+						localCausticPhotons.push_back(np);
+					}
 				}
-			}
-			
-			// need to break in the middle otherwise we scatter the photon and then discard it => redundant
-			if(nBounces == maxBounces) break;
-			// scatter photon
-			int d5 = 3*nBounces + 5;
 
-			s5 = scrHalton(d5, haltoncurr);
-			s6 = scrHalton(d5+1, haltoncurr);
-			s7 = scrHalton(d5+2, haltoncurr);
+				// need to break in the middle otherwise we scatter the photon and then discard it => redundant
+				if(nBounces == maxBounces) break;
+				// scatter photon
+				int d5 = 3*nBounces + 5;
 
-			pSample_t sample(s5, s6, s7, BSDF_ALL, pcol, transm);
+				s5 = scrHalton(d5, haltoncurr);
+				s6 = scrHalton(d5+1, haltoncurr);
+				s7 = scrHalton(d5+2, haltoncurr);
 
-			bool scattered = material->scatterPhoton(state, sp, wi, wo, sample);
-			if(!scattered) break; //photon was absorped.
+				pSample_t sample(s5, s6, s7, BSDF_ALL, pcol, transm);
 
-			pcol = sample.color;
+				bool scattered = material->scatterPhoton(state, sp, wi, wo, sample);
+				if(!scattered) break; //photon was absorped.
 
-			causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
-							((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
-			directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
-			
-			if(state.chromatic && (sample.sampledFlags & BSDF_DISPERSIVE))
-			{
-				state.chromatic=false;
-				color_t wl_col;
-				wl2rgb(state.wavelength, wl_col);
-				pcol *= wl_col;
+				pcol = sample.color;
+
+				causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
+								((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
+				directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
+
+				if(state.chromatic && (sample.sampledFlags & BSDF_DISPERSIVE))
+				{
+					state.chromatic=false;
+					color_t wl_col;
+					wl2rgb(state.wavelength, wl_col);
+					pcol *= wl_col;
+				}
+
+				ray.from = sp.P;
+				ray.dir = wo;
+				ray.tmin = scene->rayMinDist;
+				ray.tmax = -1.0;
+				++nBounces;
 			}
-			
-			ray.from = sp.P;
-			ray.dir = wo;
-			ray.tmin = scene->rayMinDist;
-			ray.tmax = -1.0;
-			++nBounces;
 		}
-		++curr;
-		if(curr % pbStep == 0)
-		{
-			pb->mutx.lock();
-			pb->update();
-			pb->mutx.unlock();
-			if(scene->getSignals() & Y_SIG_ABORT) { return; }
-		}
-		done = (curr >= nCausPhotons_thread);
+		chunks.done(start, end, pb, pbStep);
 	}
-	causticMap->mutx.lock();
-	causticMap->appendVector(localCausticPhotons, curr);
-	totalPhotonsShot += curr;
-	causticMap->mutx.unlock();
 }
 
-void photonIntegrator_t::diffuseWorker(photonMap_t * diffuseMap, int threadID, const scene_t *scene, unsigned int nDiffusePhotons, const pdf1D_t *lightPowerD, int numDLights, const std::string &integratorName, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot, int maxBounces, bool finalGather, preGatherData_t &pgdat)
+void photonIntegrator_t::diffuseWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &diffuseSlots, chunkSlots_t<radData_t> &radSlots, const scene_t *scene, const pdf1D_t *lightPowerD, int numDLights, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, int maxBounces, bool finalGather)
 {
 	ray_t ray;
 	float lightNumPdf, lightPdf, s1, s2, s3, s4, s5, s6, s7, sL;
 	color_t pcol;
 
-	//shoot photons
-	bool done=false;
-	unsigned int curr=0;
-	
 	surfacePoint_t sp;
 	renderState_t state;
 	unsigned char userdata[USER_DATA_SIZE+7];
 	state.userdata = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
 	state.cam = scene->getCamera();
-	
-	float fNumLights = (float)numDLights;
-
-	unsigned int nDiffusePhotons_thread = 1 + ( (nDiffusePhotons - 1) / scene->getNumThreadsPhotons() );
 
-	std::vector<photon_t> localDiffusePhotons;
-	std::vector<radData_t> localRadPoints;
+	float fNumLights = (float)numDLights;
+	float invDiffPhotons = 1.f / (float)chunks.nPaths;
 
-	localDiffusePhotons.clear();
-	localDiffusePhotons.reserve(nDiffusePhotons_thread);
-	localRadPoints.clear();
-	
-	float invDiffPhotons = 1.f / (float)nDiffusePhotons;
-	
-	while(!done)
+	//shoot photons
+	unsigned int chunk, start, end;
+	while(chunks.take(chunk, start, end))
 	{
-		unsigned int haltoncurr = curr + nDiffusePhotons_thread * threadID;
+		if(scene->getSignals() & Y_SIG_ABORT) return;
 
-		s1 = RI_vdC(haltoncurr);
-		s2 = scrHalton(2, haltoncurr);
-		s3 = scrHalton(3, haltoncurr);
-		s4 = scrHalton(4, haltoncurr);
+		std::vector<photon_t> &localDiffusePhotons = diffuseSlots[chunk];
+		std::vector<radData_t> &localRadPoints = radSlots[chunk];
+		// the radiance photon subset of a chunk does not depend on the thread shooting it
+		random_t prng(chunk * 2654435761u + 123);
 
-		sL = float(haltoncurr) * invDiffPhotons;
-		int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
-		if(lightNum >= numDLights)
+		for(unsigned int haltoncurr = start; haltoncurr < end; ++haltoncurr)
 		{
-			diffuseMap->mutx.lock();
-			Y_ERROR << integratorName << ": lightPDF sample error! " << sL << "/" << lightNum << yendl;
-			diffuseMap->mutx.unlock();
-			return;
-		}
+			s1 = RI_vdC(haltoncurr);
+			s2 = scrHalton(2, haltoncurr);
+			s3 = scrHalton(3, haltoncurr);
+			s4 = scrHalton(4, haltoncurr);
+
+			sL = float(haltoncurr) * invDiffPhotons;
+			int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
+			if(lightNum >= numDLights)
+			{
+				chunks.sampleError = true;
+				return;
+			}
 
-		pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
-		ray.tmin = scene->rayMinDist;
-		ray.tmax = -1.0;
-		pcol *= fNumLights*lightPdf/lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
-		
-		if(pcol.isBlack())
-		{
-			++curr;
-			done = (curr >= nDiffusePhotons_thread);
-			continue;
-		}
+			pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
+			ray.tmin = scene->rayMinDist;
+			ray.tmax = -1.0;
+			pcol *= fNumLights*lightPdf/lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
+			if(pcol.isBlack()) continue;
 
-		int nBounces=0;
-		bool causticPhoton = false;
-		bool directPhoton = true;
-		const material_t *material = nullptr;
-		BSDF_t bsdfs;
+			int nBounces=0;
+			bool causticPhoton = false;
+			bool directPhoton = true;
+			const material_t *material = nullptr;
+			BSDF_t bsdfs;
 
-		while( scene->intersect(ray, sp) )
-		{
-			if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
+			while( scene->intersect(ray, sp) )
 			{
-				diffuseMap->mutx.lock();
-				Y_WARNING << integratorName << ": NaN  on photon color for light" << lightNum + 1 << "." << yendl;
-				diffuseMap->mutx.unlock();
-				continue;
-			}
-			
-			color_t transm(1.f);
-			color_t vcol(0.f);
-			const volumeHandler_t* vol = nullptr;
-			
-			if(material)
-			{
-				if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * -ray.dir < 0)))
+				if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
 				{
-					if(vol->transmittance(state, ray, vcol)) transm = vcol;
+					++chunks.nanPaths;
+					break;
 				}
-			}
-			
-			vector3d_t wi = -ray.dir, wo;
-			material = sp.material;
-			material->initBSDF(state, sp, bsdfs);
-			
-			if(bsdfs & (BSDF_DIFFUSE))
-			{
-				//deposit photon on surface
-				if(!causticPhoton)
+
+				color_t transm(1.f);
+				color_t vcol(0.f);
+				const volumeHandler_t* vol = nullptr;
+
+				if(material)
 				{
-					photon_t np(wi, sp.P, pcol);
-					localDiffusePhotons.push_back(np);
+					if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * -ray.dir < 0)))
+					{
+						if(vol->transmittance(state, ray, vcol)) transm = vcol;
+					}
 				}
-				// create entry for radiance photon:
-				// don't forget to choose subset only, face normal forward; geometric vs. smooth normal?
-				if(finalGather && ourRandom() < 0.125 && !causticPhoton )
+
+				vector3d_t wi = -ray.dir, wo;
+				material = sp.material;
+				material->initBSDF(state, sp, bsdfs);
+
+				if(bsdfs & (BSDF_DIFFUSE))
 				{
-					vector3d_t N = FACE_FORWARD(sp.Ng, sp.N, wi);
-					radData_t rd(sp.P, N);
-					rd.refl = material->getReflectivity(state, sp, BSDF_DIFFUSE | BSDF_GLOSSY | BSDF_REFLECT);
-					rd.transm = material->getReflectivity(state, sp, BSDF_DIFFUSE | BSDF_GLOSSY | BSDF_TRANSMIT);
-					localRadPoints.push_back(rd);
+					//deposit photon on surface
+					if(!causticPhoton)
+					{
+						photon_t np(wi, sp.P, pcol);
+						localDiffusePhotons.push_back(np);
+					}
+					// create entry for radiance photon:
+					// don't forget to choose subset only, face normal forward; geometric vs. smooth normal?
+					if(finalGather && prng() < 0.125 && !causticPhoton )
+					{
+						vector3d_t N = FACE_FORWARD(sp.Ng, sp.N, wi);
+						radData_t rd(sp.P, N);
+						rd.refl = material->getReflectivity(state, sp, BSDF_DIFFUSE | BSDF_GLOSSY | BSDF_REFLECT);
+						rd.transm = material->getReflectivity(state, sp, BSDF_DIFFUSE | BSDF_GLOSSY | BSDF_TRANSMIT);
+						localRadPoints.push_back(rd);
+					}
 				}
-			}
-			// need to break in the middle otherwise we scatter the photon and then discard it => redundant
-			if(nBounces == maxBounces) break;
-			// scatter photon
-			int d5 = 3*nBounces + 5;
-
-			s5 = scrHalton(d5, haltoncurr);
-			s6 = scrHalton(d5+1, haltoncurr);
-			s7 = scrHalton(d5+2, haltoncurr);
-			
-			pSample_t sample(s5, s6, s7, BSDF_ALL, pcol, transm);
+				// need to break in the middle otherwise we scatter the photon and then discard it => redundant
+				if(nBounces == maxBounces) break;
+				// scatter photon
+				int d5 = 3*nBounces + 5;
 
-			bool scattered = material->scatterPhoton(state, sp, wi, wo, sample);
-			if(!scattered) break; //photon was absorped.
+				s5 = scrHalton(d5, haltoncurr);
+				s6 = scrHalton(d5+1, haltoncurr);
+				s7 = scrHalton(d5+2, haltoncurr);
 
-			pcol = sample.color;
+				pSample_t sample(s5, s6, s7, BSDF_ALL, pcol, transm);
 
-			causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
-							((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
-			directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
+				bool scattered = material->scatterPhoton(state, sp, wi, wo, sample);
+				if(!scattered) break; //photon was absorped.
 
-			ray.from = sp.P;
-			ray.dir = wo;
-			ray.tmin = scene->rayMinDist;
-			ray.tmax = -1.0;
-			++nBounces;
-		}
-		++curr;
-		if(curr % pbStep == 0)
-		{
-			pb->mutx.lock();
-			pb->update();
-			pb->mutx.unlock();
-			if(scene->getSignals() & Y_SIG_ABORT) { return; }
+				pcol = sample.color;
+
+				causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
+								((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
+				directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
+
+				ray.from = sp.P;
+				ray.dir = wo;
+				ray.tmin = scene->rayMinDist;
+				ray.tmax = -1.0;
+				++nBounces;
+			}
 		}
-		done = (curr >= nDiffusePhotons_thread);
+		chunks.done(start, end, pb, pbStep);
 	}
-	diffuseMap->mutx.lock();
-	diffuseMap->appendVector(localDiffusePhotons, curr);
-	totalPhotonsShot += curr;
-	diffuseMap->mutx.unlock();
-	
-	pgdat.mutx.lock();
-	pgdat.rad_points.insert(std::end(pgdat.rad_points), std::begin(localRadPoints), std::end(localRadPoints));
-	pgdat.mutx.unlock();
 }
 
 void photonIntegrator_t::photonMapKdTreeWorker(photonMap_t * photonMap)
@@ -436,6 +388,7 @@ bool photonIntegrator_t::preprocess()
 		set << "ShadowDepth=" << sDepth << "  ";
 	}
 	set << "RayDepth=" << rDepth << "  ";
+	if(lightSampling != LIGHTS_ALL) set << "LightSampling=" << ((lightSampling == LIGHTS_TREE) ? "tree" : "uniform") << "  ";
 
 	background = scene->getBackground();
 	lights = scene->lights;
@@ -454,7 +407,12 @@ bool photonIntegrator_t::preprocess()
 	if(finalGather)
 	{
 		set << " FG paths=" << nPaths << " bounces=" << gatherBounces << "  ";
+		if(useIrradianceCache) set << "cache error=" << irrCacheError << "  ";
 	}
+
+	std::stringstream photonParams;
+	photonParams << "photonintegr" << usePhotonCaustics << usePhotonDiffuse << finalGather << " " << nCausPhotons << " " << causDepth << " " << nDiffusePhotons << " " << maxBounces << " " << dsRadius << " " << nDiffuseSearch;
+	uint64_t fingerprint = photonMapFingerprint(scene, photonParams.str());
 		
 	if(photonMapProcessing == PHOTONS_LOAD)
 	{
@@ -466,8 +424,8 @@ bool photonIntegrator_t::preprocess()
 		{
 			pb->setTag("Loading caustic photon map from file...");
 			std::string filename = session.getPathImageOutput() + "_caustic.photonmap";
-			Y_INFO << integratorName << ": Loading caustic photon map from: " << filename << ". If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!" << yendl;
-			if(photonMapLoad(session.causticMap, filename)) Y_VERBOSE << integratorName << ": Caustic map loaded." << yendl;
+			Y_INFO << integratorName << ": Loading caustic photon map from: " << filename << yendl;
+			if(photonMapLoad(session.causticMap, filename, fingerprint)) Y_VERBOSE << integratorName << ": Caustic map loaded." << yendl;
 			else causticMapFailedLoad = true;
 		}
 
@@ -475,8 +433,8 @@ bool photonIntegrator_t::preprocess()
 		{
 			pb->setTag("Loading diffuse photon map from file...");
 			std::string filename = session.getPathImageOutput() + "_diffuse.photonmap";
-			Y_INFO << integratorName << ": Loading diffuse photon map from: " << filename << ". If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!"  << yendl;
-			if(photonMapLoad(session.diffuseMap, filename)) Y_VERBOSE << integratorName << ": Diffuse map loaded." << yendl;
+			Y_INFO << integratorName << ": Loading diffuse photon map from: " << filename << yendl;
+			if(photonMapLoad(session.diffuseMap, filename, fingerprint)) Y_VERBOSE << integratorName << ": Diffuse map loaded." << yendl;
 			else diffuseMapFailedLoad = true;
 		}
 
@@ -484,8 +442,8 @@ bool photonIntegrator_t::preprocess()
 		{
 			pb->setTag("Loading FG radiance photon map from file...");
 			std::string filename = session.getPathImageOutput() + "_fg_radiance.photonmap";
-			Y_INFO << integratorName << ": Loading FG radiance photon map from: " << filename << ". If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!"  << yendl;
-			if(photonMapLoad(session.radianceMap, filename)) Y_VERBOSE << integratorName << ": FG radiance map loaded." << yendl;
+			Y_INFO << integratorName << ": Loading FG radiance photon map from: " << filename << yendl;
+			if(photonMapLoad(session.radianceMap, filename, fingerprint)) Y_VERBOSE << integratorName << ": FG radiance map loaded." << yendl;
 			else fgRadianceMapFailedLoad = true;
 		}
 		
@@ -500,32 +458,47 @@ bool photonIntegrator_t::preprocess()
 	{
 		if(usePhotonCaustics)
 		{
-			Y_INFO << integratorName << ": Reusing caustics photon map from memory. If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!" << yendl;
+			Y_INFO << integratorName << ": Reusing caustics photon map from memory." << yendl;
 			if(session.causticMap->nPhotons() == 0)
 			{
 				Y_WARNING << integratorName << ": Caustic photon map enabled but empty, cannot be reused: changing to Generate mode." << yendl;
 				photonMapProcessing = PHOTONS_GENERATE_ONLY;
 			}
+			else if(session.causticMap->getFingerprint() != fingerprint)
+			{
+				Y_WARNING << integratorName << ": Caustic photon map was made for a different scene or photon settings, cannot be reused: changing to Generate mode." << yendl;
+				photonMapProcessing = PHOTONS_GENERATE_ONLY;
+			}
 		}
 
 		if(usePhotonDiffuse)
 		{
-			Y_INFO << integratorName << ": Reusing diffuse photon map from memory. If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!" << yendl;
+			Y_INFO << integratorName << ": Reusing diffuse photon map from memory." << yendl;
 			if(session.diffuseMap->nPhotons() == 0)
 			{
 				Y_WARNING << integratorName << ": Diffuse photon map enabled but empty, cannot be reused: changing to Generate mode." << yendl;
 				photonMapProcessing = PHOTONS_GENERATE_ONLY;
 			}
+			else if(session.diffuseMap->getFingerprint() != fingerprint)
+			{
+				Y_WARNING << integratorName << ": Diffuse photon map was made for a different scene or photon settings, cannot be reused: changing to Generate mode." << yendl;
+				photonMapProcessing = PHOTONS_GENERATE_ONLY;
+			}
 		}
 
 		if(finalGather)
 		{
-			Y_INFO << integratorName << ": Reusing FG radiance photon map from memory. If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!" << yendl;
+			Y_INFO << integratorName << ": Reusing FG radiance photon map from memory." << yendl;
 			if(session.radianceMap->nPhotons() == 0)
 			{
 				Y_WARNING << integratorName << ": FG radiance photon map enabled but empty, cannot be reused: changing to Generate mode." << yendl;
 				photonMapProcessing = PHOTONS_GENERATE_ONLY;
 			}
+			else if(session.radianceMap->getFingerprint() != fingerprint)
+			{
+				Y_WARNING << integratorName << ": FG radiance photon map was made for a different scene or photon settings, cannot be reused: changing to Generate mode." << yendl;
+				photonMapProcessing = PHOTONS_GENERATE_ONLY;
+			}
 		}
 	}
 
@@ -541,6 +514,8 @@ bool photonIntegrator_t::preprocess()
 
 	if(photonMapProcessing == PHOTONS_LOAD || photonMapProcessing == PHOTONS_REUSE)
 	{
+		resetIrradianceCache();
+
 		gTimer.stop("prepass");
 		Y_INFO << integratorName << ": Photonmap building time: " << std::fixed << std::setprecision(1) << gTimer.getTime("prepass") << "s" << yendl;
 
@@ -636,15 +611,29 @@ bool photonIntegrator_t::preprocess()
 
 		int nThreads = scene->getNumThreadsPhotons();
 
-		nDiffusePhotons = std::max((unsigned int) nThreads, (nDiffusePhotons / nThreads) * nThreads); //rounding the number of diffuse photons so it's a number divisible by the number of threads (distribute uniformly among the threads). At least 1 photon per thread
-		
-		Y_PARAMS << integratorName << ": Shooting "<<nDiffusePhotons<<" photons across " << nThreads << " threads (" << (nDiffusePhotons / nThreads) << " photons/thread)"<< yendl;
+		Y_PARAMS << integratorName << ": Shooting "<<nDiffusePhotons<<" photons across " << nThreads << " threads in chunks of " << PHOTON_CHUNK_SIZE << yendl;
 		
 		if(nThreads >= 2)
 		{
+			photonChunks_t chunks(nDiffusePhotons);
+			chunkSlots_t<photon_t> diffuseSlots(chunks.nChunks);
+			chunkSlots_t<radData_t> radSlots(chunks.nChunks);
 			std::vector<std::thread> threads;
-			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::diffuseWorker, this, session.diffuseMap, i, scene, nDiffusePhotons, lightPowerD, numDLights, std::ref(integratorName), tmplights, pb, pbStep, std::ref(curr), maxBounces, finalGather, std::ref(pgdat)));
+			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::diffuseWorker, this, std::ref(chunks), std::ref(diffuseSlots), std::ref(radSlots), scene, lightPowerD, numDLights, tmplights, pb, pbStep, maxBounces, finalGather));
 			for(auto& t : threads) t.join();
+
+			if(chunks.nanPaths > 0) Y_WARNING << integratorName << ": NaN on photon color, " << chunks.nanPaths << " photon paths stopped." << yendl;
+			if(chunks.sampleError)
+			{
+				Y_ERROR << integratorName << ": lightPDF sample error! ... stopping now." << yendl;
+				delete lightPowerD;
+				pb->done();
+				if(!intpb) delete pb;
+				return false;
+			}
+			curr = chunks.shot;
+			session.diffuseMap->appendChunks(diffuseSlots, curr, nThreads);
+			radSlots.merge(pgdat.rad_points, nThreads);
 		}
 		else
 		{
@@ -668,6 +657,8 @@ bool photonIntegrator_t::preprocess()
 				{
 					Y_ERROR << integratorName << ": lightPDF sample error! " << sL << "/" << lightNum << "... stopping now." << yendl;
 					delete lightPowerD;
+					pb->done();
+					if(!intpb) delete pb;
 					return false;
 				}
 
@@ -851,16 +842,27 @@ bool photonIntegrator_t::preprocess()
 
 		int nThreads = scene->getNumThreadsPhotons();
 
-		nCausPhotons = std::max((unsigned int) nThreads, (nCausPhotons / nThreads) * nThreads); //rounding the number of diffuse photons so it's a number divisible by the number of threads (distribute uniformly among the threads). At least 1 photon per thread
-		
-		Y_PARAMS << integratorName << ": Shooting "<<nCausPhotons<<" photons across " << nThreads << " threads (" << (nCausPhotons / nThreads) << " photons/thread)"<< yendl;
-
+		Y_PARAMS << integratorName << ": Shooting "<<nCausPhotons<<" photons across " << nThreads << " threads in chunks of " << PHOTON_CHUNK_SIZE << yendl;
 
 		if(nThreads >= 2)
 		{
+			photonChunks_t chunks(nCausPhotons);
+			chunkSlots_t<photon_t> causticSlots(chunks.nChunks);
 			std::vector<std::thread> threads;
-			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::causticWorker, this, session.causticMap, i, scene, nCausPhotons, lightPowerD, numCLights, std::ref(integratorName), tmplights, causDepth, pb, pbStep, std::ref(curr), maxBounces));
+			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::causticWorker, this, std::ref(chunks), std::ref(causticSlots), scene, lightPowerD, numCLights, tmplights, pb, pbStep, maxBounces));
 			for(auto& t : threads) t.join();
+
+			if(chunks.nanPaths > 0) Y_WARNING << integratorName << ": NaN on photon color, " << chunks.nanPaths << " photon paths stopped." << yendl;
+			if(chunks.sampleError)
+			{
+				Y_ERROR << integratorName << ": lightPDF sample error! ... stopping now." << yendl;
+				delete lightPowerD;
+				pb->done();
+				if(!intpb) delete pb;
+				return false;
+			}
+			curr = chunks.shot;
+			session.causticMap->appendChunks(causticSlots, curr, nThreads);
 		}
 		else		
 		{
@@ -886,6 +888,8 @@ bool photonIntegrator_t::preprocess()
 				{
 					Y_ERROR << integratorName << ": lightPDF sample error! "<<sL<<"/"<<lightNum<<"... stopping now." << yendl;
 					delete lightPowerD;
+					pb->done();
+					if(!intpb) delete pb;
 					return false;
 				}
 
@@ -1022,8 +1026,6 @@ bool photonIntegrator_t::preprocess()
 		Y_VERBOSE << integratorName << ": Diffuse photon map: done." << yendl;
 	}
 
-	if (!intpb) delete pb;
-
 	if(usePhotonDiffuse && finalGather) //create radiance map:
 	{
 		// == remove too close radiance points ==//
@@ -1073,6 +1075,11 @@ bool photonIntegrator_t::preprocess()
 		Y_VERBOSE << integratorName << ": Caustic photon map: done." << yendl;
 	}
 
+	// the maps are complete, later frames with the same fingerprint can load or reuse them
+	session.diffuseMap->setFingerprint(fingerprint);
+	session.causticMap->setFingerprint(fingerprint);
+	session.radianceMap->setFingerprint(fingerprint);
+
 	if(photonMapProcessing == PHOTONS_GENERATE_AND_SAVE)
 	{
 		if( usePhotonDiffuse )
@@ -1100,6 +1107,10 @@ bool photonIntegrator_t::preprocess()
 		}
 	}
 
+	if (!intpb) delete pb;
+
+	resetIrradianceCache();
+
 	gTimer.stop("prepass");
 	Y_INFO << integratorName << ": Photonmap building time: " << std::fixed << std::setprecision(1) << gTimer.getTime("prepass") << "s" << " (" << scene->getNumThreadsPhotons() << " thread(s))" << yendl;
 
@@ -1117,29 +1128,21 @@ bool photonIntegrator_t::preprocess()
 // precondition: initBSDF of current spot has been called!
 color_t photonIntegrator_t::finalGathering(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo, colorPasses_t &colorPasses) const
 {
+	if(irrCache && !(sp.material->getFlags() & BSDF_TRANSMIT)) return cachedFinalGathering(state, sp, wo);
+
 	color_t pathCol(0.0);
-	void *first_udat = state.userdata;
-	unsigned char userdata[USER_DATA_SIZE+7];
-	void *n_udat = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
-	const volumeHandler_t *vol;
-	color_t vcol(0.f);
 	float W = 0.f;
+	float hitDist;
 
 	colorPasses_t tmpColorPasses(scene->getRenderPasses());
 	
 	int nSampl = (int) ceilf(std::max(1, nPaths/state.rayDivision)*AA_indirect_sample_multiplier);
 	for(int i=0; i<nSampl; ++i)
 	{
-		color_t throughput( 1.0 );
-		float length=0;
-		surfacePoint_t hit=sp;
-		vector3d_t pwo = wo;
 		ray_t pRay;
-		BSDF_t matBSDFs;
-		bool did_hit;
 		const material_t *p_mat = sp.material;
 		unsigned int offs = nPaths * state.pixelSample + state.samplingOffs + i; // some redundancy here...
-		color_t lcol, scol;
+		color_t scol;
 		// "zero'th" FG bounce:
 		float s1 = RI_vdC(offs);
 		float s2 = scrHalton(2, offs);
@@ -1150,115 +1153,241 @@ color_t photonIntegrator_t::finalGathering(renderState_t &state, const surfacePo
 		}
 
 		sample_t s(s1, s2, BSDF_DIFFUSE|BSDF_REFLECT|BSDF_TRANSMIT); // glossy/dispersion/specular done via recursive raytracing
-		scol = p_mat->sample(state, hit, pwo, pRay.dir, s, W);
+		scol = p_mat->sample(state, sp, wo, pRay.dir, s, W);
 
 		scol *= W;
 		if(scol.isBlack()) continue;
 
 		pRay.tmin = scene->rayMinDist;
 		pRay.tmax = -1.0;
-		pRay.from = hit.P;
-		throughput = scol;
-		
-		if( !(did_hit = scene->intersect(pRay, hit)) ) continue; //hit background
+		pRay.from = sp.P;
+		gatherPath(state, pRay, scol, offs, tmpColorPasses, pathCol, hitDist);
+	}
+	return pathCol / (float)nSampl;
+}
+
+void photonIntegrator_t::gatherPath(renderState_t &state, ray_t &pRay, color_t throughput, unsigned int offs, colorPasses_t &tmpColorPasses, color_t &pathCol, float &hitDist) const
+{
+	void *first_udat = state.userdata;
+	unsigned char userdata[USER_DATA_SIZE+7];
+	void *n_udat = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
+	const volumeHandler_t *vol;
+	color_t vcol(0.f);
+	float W = 0.f;
+	float length=0;
+	surfacePoint_t hit;
+	vector3d_t pwo;
+	BSDF_t matBSDFs;
+	bool did_hit;
+	color_t lcol, scol;
+	float s1, s2;
+
+	if( !(did_hit = scene->intersect(pRay, hit)) ) //hit background
+	{
+		hitDist = std::numeric_limits<float>::max();
+		return;
+	}
+	
+	const material_t *p_mat = hit.material;
+	length = hitDist = pRay.tmax;
+	state.userdata = n_udat;
+	matBSDFs = p_mat->getFlags();
+	bool has_spec = matBSDFs & BSDF_SPECULAR;
+	bool caustic = false;
+	bool close = length < gatherDist;
+	bool do_bounce = close || has_spec;
+	// further bounces construct a path just as with path tracing:
+	for(int depth=0; depth<gatherBounces && do_bounce; ++depth)
+	{
+		int d4 = 4*depth;
+		pwo = -pRay.dir;
+		p_mat->initBSDF(state, hit, matBSDFs);
 		
-		p_mat = hit.material;
-		length = pRay.tmax;
-		state.userdata = n_udat;
-		matBSDFs = p_mat->getFlags();
-		bool has_spec = matBSDFs & BSDF_SPECULAR;
-		bool caustic = false;
-		bool close = length < gatherDist;
-		bool do_bounce = close || has_spec;
-		// further bounces construct a path just as with path tracing:
-		for(int depth=0; depth<gatherBounces && do_bounce; ++depth)
+		if((matBSDFs & BSDF_VOLUMETRIC) && (vol=p_mat->getVolumeHandler(hit.N * pwo < 0)))
 		{
-			int d4 = 4*depth;
-			pwo = -pRay.dir;
-			p_mat->initBSDF(state, hit, matBSDFs);
-			
-			if((matBSDFs & BSDF_VOLUMETRIC) && (vol=p_mat->getVolumeHandler(hit.N * pwo < 0)))
-			{
-				if(vol->transmittance(state, pRay, vcol)) throughput *= vcol;
-			}
-	
-			if(matBSDFs & (BSDF_DIFFUSE))
+			if(vol->transmittance(state, pRay, vcol)) throughput *= vcol;
+		}
+
+		if(matBSDFs & (BSDF_DIFFUSE))
+		{
+			if(close)
 			{
-				if(close)
-				{
-					lcol = estimateOneDirectLight(state, hit, pwo, offs, tmpColorPasses);
-				}
-				else if(caustic)
-				{
-					vector3d_t sf = FACE_FORWARD(hit.Ng, hit.N, pwo);
-					const photon_t *nearest = session.radianceMap->findNearest(hit.P, sf, lookupRad);
-					if(nearest) lcol = nearest->color();
-				}
-				
-				if(close || caustic)
-				{
-					if(matBSDFs & BSDF_EMIT) lcol += p_mat->emit(state, hit, pwo);
-					pathCol += lcol*throughput;
-				}
+				lcol = estimateOneDirectLight(state, hit, pwo, offs, tmpColorPasses);
 			}
-			
-			s1 = scrHalton(d4+3, offs);
-			s2 = scrHalton(d4+4, offs);
-
-			if(state.rayDivision > 1)
+			else if(caustic)
 			{
-				s1 = addMod1(s1, state.dc1);
-				s2 = addMod1(s2, state.dc2);
+				vector3d_t sf = FACE_FORWARD(hit.Ng, hit.N, pwo);
+				const photon_t *nearest = session.radianceMap->findNearest(hit.P, sf, lookupRad);
+				if(nearest) lcol = nearest->color();
 			}
 			
-			sample_t sb(s1, s2, (close) ? BSDF_ALL : BSDF_ALL_SPECULAR | BSDF_FILTER);
-			scol = p_mat->sample(state, hit, pwo, pRay.dir, sb, W);
-			
-			if( sb.pdf <= 1.0e-6f)
+			if(close || caustic)
 			{
-				did_hit=false;
-				break;
+				if(matBSDFs & BSDF_EMIT) lcol += p_mat->emit(state, hit, pwo);
+				pathCol += lcol*throughput;
 			}
+		}
+		
+		s1 = scrHalton(d4+3, offs);
+		s2 = scrHalton(d4+4, offs);
+
+		if(state.rayDivision > 1)
+		{
+			s1 = addMod1(s1, state.dc1);
+			s2 = addMod1(s2, state.dc2);
+		}
+		
+		sample_t sb(s1, s2, (close) ? BSDF_ALL : BSDF_ALL_SPECULAR | BSDF_FILTER);
+		scol = p_mat->sample(state, hit, pwo, pRay.dir, sb, W);
+		
+		if( sb.pdf <= 1.0e-6f)
+		{
+			did_hit=false;
+			break;
+		}
 
-			scol *= W;
+		scol *= W;
 
-			pRay.tmin = scene->rayMinDist;
-			pRay.tmax = -1.0;
-			pRay.from = hit.P;
-			throughput *= scol;
-			did_hit = scene->intersect(pRay, hit);
-			
-			if(!did_hit) //hit background
-			{
-				 if(caustic && background && background->hasIBL() && background->shootsCaustic())
-				 {
-					pathCol += throughput * (*background)(pRay, state, true);
-				 }
-				 break;
-			}
-			
-			p_mat = hit.material;
-			length += pRay.tmax;
-			caustic = (caustic || !depth) && (sb.sampledFlags & (BSDF_SPECULAR | BSDF_FILTER));
-			close =  length < gatherDist;
-			do_bounce = caustic || close;
+		pRay.tmin = scene->rayMinDist;
+		pRay.tmax = -1.0;
+		pRay.from = hit.P;
+		throughput *= scol;
+		did_hit = scene->intersect(pRay, hit);
+		
+		if(!did_hit) //hit background
+		{
+			 if(caustic && background && background->hasIBL() && background->shootsCaustic())
+			 {
+				pathCol += throughput * (*background)(pRay, state, true);
+			 }
+			 break;
 		}
 		
-		if(did_hit)
+		p_mat = hit.material;
+		length += pRay.tmax;
+		caustic = (caustic || !depth) && (sb.sampledFlags & (BSDF_SPECULAR | BSDF_FILTER));
+		close =  length < gatherDist;
+		do_bounce = caustic || close;
+	}
+	
+	if(did_hit)
+	{
+		p_mat->initBSDF(state, hit, matBSDFs);
+		if(matBSDFs & (BSDF_DIFFUSE | BSDF_GLOSSY))
+		{
+			vector3d_t sf = FACE_FORWARD(hit.Ng, hit.N, -pRay.dir);
+			const photon_t *nearest = session.radianceMap->findNearest(hit.P, sf, lookupRad);
+			if(nearest) lcol = nearest->color();
+			if(matBSDFs & BSDF_EMIT) lcol += p_mat->emit(state, hit, -pRay.dir);
+			pathCol += lcol * throughput;
+		}
+	}
+	state.userdata = first_udat;
+}
+
+color_t photonIntegrator_t::cachedFinalGathering(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const
+{
+	vector3d_t N = FACE_FORWARD(sp.Ng, sp.N, wo);
+	color_t E;
+	if(!irrCache->interpolate(sp.P, N, E))
+	{
+		// the record gathers four times the paths of a pixel, it is shared by many pixels
+		int M, Nphi;
+		irradianceCache_t::strata(4 * nPaths, M, Nphi);
+		std::vector<color_t> L(M * Nphi, color_t(0.f));
+		std::vector<float> dist(M * Nphi, std::numeric_limits<float>::max());
+		vector3d_t U, V;
+		createCS(N, U, V);
+		float cosNgN = sp.Ng * N;
+		colorPasses_t tmpColorPasses(scene->getRenderPasses());
+		unsigned int offs = (unsigned int)((*state.prng)() * 4294967295.0);
+
+		for(int j=0; j<M; ++j)
 		{
-			p_mat->initBSDF(state, hit, matBSDFs);
-			if(matBSDFs & (BSDF_DIFFUSE | BSDF_GLOSSY))
+			for(int k=0; k<Nphi; ++k)
 			{
-				vector3d_t sf = FACE_FORWARD(hit.Ng, hit.N, -pRay.dir);
-				const photon_t *nearest = session.radianceMap->findNearest(hit.P, sf, lookupRad);
-				if(nearest) lcol = nearest->color();
-				if(matBSDFs & BSDF_EMIT) lcol += p_mat->emit(state, hit, -pRay.dir);
-				pathCol += lcol * throughput;
+				ray_t pRay;
+				pRay.dir = irradianceCache_t::sampleDir(N, U, V, j, k, M, Nphi, (*state.prng)(), (*state.prng)());
+				// directions below the real surface see nothing
+				if((pRay.dir * sp.Ng) * cosNgN <= 0.f) continue;
+				pRay.tmin = scene->rayMinDist;
+				pRay.tmax = -1.0;
+				pRay.from = sp.P;
+				gatherPath(state, pRay, color_t(1.f), offs + j*Nphi + k, tmpColorPasses, L[j*Nphi + k], dist[j*Nphi + k]);
 			}
 		}
-		state.userdata = first_udat;
+		irradianceRecord_t rec = irrCache->makeRecord(sp.P, N, U, V, M, Nphi, &L[0], &dist[0]);
+		irrCache->add(rec);
+		E = rec.E;
 	}
-	return pathCol / (float)nSampl;
+	return sp.material->eval(state, sp, wo, N, BSDF_DIFFUSE) * E;
+}
+
+/*! Renders every step-th pixel of every step-th row without keeping the result,
+	so the irradiance records of the visible surfaces are made before the tiles
+	are rendered, by all the threads at once */
+void photonIntegrator_t::irradiancePrepassWorker(std::atomic<int> *nextRow, int step, int threadID)
+{
+	const camera_t *camera = scene->getCamera();
+	int x0 = imageFilm->getCX0(), y0 = imageFilm->getCY0();
+	int x1 = x0 + imageFilm->getWidth(), y1 = y0 + imageFilm->getHeight();
+	random_t prng(threadID * 2654435761u + 123);
+	renderState_t rstate(&prng);
+	rstate.threadID = threadID;
+	rstate.cam = camera;
+	colorPasses_t colorPasses(scene->getRenderPasses());
+	float wt;
+
+	for(int y = y0 + step/2 + step * (*nextRow)++; y < y1; y = y0 + step/2 + step * (*nextRow)++)
+	{
+		for(int x = x0 + step/2; x < x1; x += step)
+		{
+			if(scene->getSignals() & Y_SIG_ABORT) return;
+			rstate.setDefaults();
+			rstate.pixelNumber = camera->resX() * y + x;
+			rstate.samplingOffs = fnv_32a_buf(y * fnv_32a_buf(x));
+			rstate.pixelSample = 0;
+			rstate.time = 0.5f;
+			diffRay_t c_ray = camera->shootRay(x + 0.5f, y + 0.5f, 0.5f, 0.5f, wt);
+			if(wt == 0.f) continue;
+			c_ray.time = rstate.time;
+			colorPasses.reset_colors();
+			integrate(rstate, c_ray, colorPasses);
+		}
+	}
+}
+
+//! makes a new, empty irradiance cache for the photon maps just built or loaded
+void photonIntegrator_t::resetIrradianceCache()
+{
+	delete irrCache;
+	irrCache = nullptr;
+	if(!useIrradianceCache || !usePhotonDiffuse || !finalGather || showMap) return;
+
+	// records closer than the shortest final gather path would resolve detail the radiance map does not have
+	bound_t sceneBound = scene->getSceneBound();
+	float diag = (sceneBound.g - sceneBound.a).length();
+	sceneBound.grow(0.01f * diag);
+	irrCache = new irradianceCache_t(sceneBound, irrCacheError, 0.5f * gatherDist, 0.05f * diag);
+}
+
+//! seeds the irradiance cache from a coarse render of the image before the first AA pass
+void photonIntegrator_t::prePass(int samples, int offset, bool adaptive)
+{
+	if(!irrCache || adaptive || irrCachePrepass <= 0) return;
+
+	gTimer.addEvent("irradiancePrepass");
+	gTimer.start("irradiancePrepass");
+	int nThreads = scene->getNumThreads();
+	int nBefore = irrCache->nRecords();
+	std::atomic<int> nextRow(0);
+	std::vector<std::thread> threads;
+	for(int i=1; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::irradiancePrepassWorker, this, &nextRow, irrCachePrepass, i));
+	irradiancePrepassWorker(&nextRow, irrCachePrepass, 0);
+	for(auto& t : threads) t.join();
+	gTimer.stop("irradiancePrepass");
+
+	Y_INFO << integratorName << ": Irradiance cache prepass made " << irrCache->nRecords() - nBefore << " records in " << std::fixed << std::setprecision(1) << gTimer.getTime("irradiancePrepass") << "s (" << nThreads << " thread(s))" << yendl;
 }
 
 colorA_t photonIntegrator_t::integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &colorPasses, int additionalDepth /*=0*/) const
@@ -1466,7 +1595,11 @@ integrator_t* photonIntegrator_t::factory(paraMap_t &params, renderEnvironment_t
 	bool bg_transp_refract = false;
 	bool caustics = true;
 	bool diffuse = true;
+	bool fgCache = false;
+	float fgCacheError = 0.2f;
+	int fgCachePrepass = 8;
 	std::string photon_maps_processing_str = "generate";
+	std::string light_sampling_str = "all";
 	
 	params.getParam("caustics", caustics);
 	params.getParam("diffuse", diffuse);
@@ -1487,6 +1620,9 @@ integrator_t* photonIntegrator_t::factory(paraMap_t &params, renderEnvironment_t
 	params.getParam("fg_bounces", fgBounces);
 	gatherDist = dsRad;
 	params.getParam("fg_min_pathlen", gatherDist);
+	params.getParam("fg_cache", fgCache);
+	params.getParam("fg_cache_error", fgCacheError);
+	params.getParam("fg_cache_prepass", fgCachePrepass);
 	params.getParam("show_map", show_map);
 	params.getParam("bg_transp", bg_transp);
 	params.getParam("bg_transp_refract", bg_transp_refract);
@@ -1495,6 +1631,7 @@ integrator_t* photonIntegrator_t::factory(paraMap_t &params, renderEnvironment_t
 	params.getParam("AO_distance", AO_dist);
 	params.getParam("AO_color", AO_col);
 	params.getParam("photon_maps_processing", photon_maps_processing_str);
+	params.getParam("light_sampling", light_sampling_str);
 	
 	photonIntegrator_t* ite = new photonIntegrator_t(numPhotons, numCPhotons, transpShad, shadowDepth, dsRad, cRad);
 	
@@ -1511,6 +1648,9 @@ integrator_t* photonIntegrator_t::factory(paraMap_t &params, renderEnvironment_t
 	ite->gatherBounces = fgBounces;
 	ite->showMap = show_map;
 	ite->gatherDist = gatherDist;
+	ite->useIrradianceCache = fgCache;
+	ite->irrCacheError = std::max(0.01f, fgCacheError);
+	ite->irrCachePrepass = fgCachePrepass;
 	// Background settings
 	ite->transpBackground = bg_transp;
 	ite->transpRefractedBackground = bg_transp_refract;
@@ -1524,6 +1664,9 @@ integrator_t* photonIntegrator_t::factory(paraMap_t &params, renderEnvironment_t
 	else if(photon_maps_processing_str == "load") ite->photonMapProcessing = PHOTONS_LOAD;
 	else if(photon_maps_processing_str == "reuse-previous") ite->photonMapProcessing = PHOTONS_REUSE;
 	else ite->photonMapProcessing = PHOTONS_GENERATE_ONLY;
+
+	if(light_sampling_str == "uniform") ite->lightSampling = LIGHTS_UNIFORM;
+	else if(light_sampling_str == "tree") ite->lightSampling = LIGHTS_TREE;
 	
 	return ite;
 }
@@ -3,10 +3,59 @@
 #include <sstream>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <thread>
 
 __BEGIN_YAFRAY
 
-const int nMaxGather = 1000; //used to gather all the photon in the radius. seems could get a better way to do that
+#define VISIBLE_GRID_RADIUS_PERCENTILE 0.9f //!< the hash cells of the visible points are sized from this percentile of their search radius
+
+//! C++11 has no fetch_add for floats
+static inline void atomicAdd(std::atomic<float> &a, float v)
+{
+	float old = a.load(std::memory_order_relaxed);
+	while(!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed));
+}
+
+//! scales the visible points a branch of the eye path appended since first, as the branch's gathered flux and photon count were scaled before
+static void scaleVisiblePoints(VisibleRow &vps, size_t first, const color_t &c, float countScale = 1.f)
+{
+	for(size_t i=first; i<vps.size(); ++i)
+	{
+		vps.points[i].weight *= c;
+		vps.points[i].countWeight *= countScale;
+	}
+}
+
+//! adds a photon to the pixel of every visible point it lands on, evaluating the BSDF of the point towards the photon
+struct photonSplat_t
+{
+	photonSplat_t(const VisiblePoints &v, std::atomic<float> *acc, bool causticPhotons): vps(v), passPhotons(acc), caustic(causticPhotons), state(&prng)
+	{
+		state.userdata = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
+	}
+	void operator()(u_int32 i)
+	{
+		if(caustic && !vps.caustics[i]) return;
+		// materials may use their data as scratch space, every evaluation gets its own copy
+		std::memcpy(state.userdata, &vps.userdata[vps.udat[i]], vps.udat[i+1] - vps.udat[i]);
+		const surfacePoint_t &sp = vps.sp[i];
+		color_t w = vps.weight[i] * sp.material->eval(state, sp, vps.wo[i], wi, caustic ? BSDF_ALL : BSDF_DIFFUSE);
+		std::atomic<float> *acc = passPhotons + 4 * vps.pixel[i];
+		atomicAdd(acc[0], w.R * col.R);
+		atomicAdd(acc[1], w.G * col.G);
+		atomicAdd(acc[2], w.B * col.B);
+		atomicAdd(acc[3], vps.countWeight[i]);
+	}
+	const VisiblePoints &vps;
+	std::atomic<float> *passPhotons;
+	bool caustic;
+	vector3d_t wi;
+	color_t col;
+	random_t prng;
+	renderState_t state;
+	unsigned char userdata[USER_DATA_SIZE+7];
+};
 
 SPPM::SPPM(unsigned int dPhotons, int _passnum, bool transpShad, int shadowDepth)
 {
@@ -141,6 +190,7 @@ bool SPPM::render(int numView, yafaray::imageFilm_t *image)
 		Y_INFO <<  integratorName << ": This pass refined " << nRefined << " of " << hpNum << " pixels." << yendl;
 	}
 	maxDepth = 0.f;
+	threadPool.reset();
 	gTimer.stop("rendert");
 	gTimer.stop("imagesAutoSaveTimer");
 	gTimer.stop("filmAutoSaveTimer");
@@ -165,20 +215,9 @@ bool SPPM::render(int numView, yafaray::imageFilm_t *image)
 
 bool SPPM::renderTile(int numView, renderArea_t &a, int n_samples, int offset, bool adaptive, int threadID, int AA_pass_number)
 {
-	int x;
 	const camera_t* camera = scene->getCamera();
-	x=camera->resX();
-	diffRay_t c_ray;
-	ray_t d_ray;
-	float dx=0.5, dy=0.5, d1=1.0/(float)n_samples;
-	float lens_u=0.5f, lens_v=0.5f;
-	float wt, wt_dummy;
-	random_t prng(rand()+offset*(x*a.Y+a.X)+123);
-	renderState_t rstate(&prng);
-	rstate.threadID = threadID;
-	rstate.cam = camera;
-	bool sampleLns = camera->sampleLense();
-	int pass_offs=offset, end_x=a.X+a.W, end_y=a.Y+a.H;
+	int x=camera->resX();
+	int end_x=a.X+a.W, end_y=a.Y+a.H;
 	
 	int AA_max_possible_samples = AA_samples;
 	
@@ -192,6 +231,8 @@ bool SPPM::renderTile(int numView, renderArea_t &a, int n_samples, int offset, b
 	colorPasses_t colorPasses(scene->getRenderPasses());
 
 	colorPasses_t tmpPassesZero(scene->getRenderPasses());
+
+	int nPasses = colorPasses.size();
 	
 	for(int i=a.Y; i<end_y; ++i)
 	{
@@ -199,75 +240,45 @@ bool SPPM::renderTile(int numView, renderArea_t &a, int n_samples, int offset, b
 		{
 			if(scene->getSignals() & Y_SIG_ABORT) break;
 
-			rstate.pixelNumber = x*i+j;
-			rstate.samplingOffs = fnv_32a_buf(i*fnv_32a_buf(j));//fnv_32a_buf(rstate.pixelNumber);
-			float toff = scrHalton(5, pass_offs+rstate.samplingOffs); // **shall be just the pass number...**
+			int index = i*x + j;
+			const EyeSample &es = eyeSamples[index];
 
-			for(int sample=0; sample<n_samples; ++sample) //set n_samples = 1.
+			for(int sample=0; sample<n_samples; ++sample) //set n_samples = 1, prePass traced the camera ray and splatted the photons
 			{
-				colorPasses.reset_colors();
-				
-				rstate.setDefaults();
-				rstate.pixelSample = pass_offs+sample;
-				rstate.time = addMod1((float)sample*d1, toff); //(0.5+(float)sample)*d1;
-				// the (1/n, Larcher&Pillichshammer-Seq.) only gives good coverage when total sample count is known
-				// hence we use scrambled (Sobol, van-der-Corput) for multipass AA
-
-				dx = RI_vdC(rstate.pixelSample, rstate.samplingOffs);
-				dy = RI_S(rstate.pixelSample, rstate.samplingOffs);
-
-				if(sampleLns)
-				{
-					lens_u = scrHalton(3, rstate.pixelSample+rstate.samplingOffs);
-					lens_v = scrHalton(4, rstate.pixelSample+rstate.samplingOffs);
-				}
-				c_ray = camera->shootRay(j+dx, i+dy, lens_u, lens_v, wt); // wt need to be considered
-				if(wt==0.0)
+				if(es.wt==0.0)
 				{
-					imageFilm->addSample(tmpPassesZero, j, i, dx, dy, &a); //maybe not need
+					imageFilm->addSample(tmpPassesZero, j, i, es.dx, es.dy, &a); //maybe not need
 					continue;
 				}
-				if(diffRaysEnabled)
-				{
-					//setup ray differentials
-					d_ray = camera->shootRay(j+1+dx, i+dy, lens_u, lens_v, wt_dummy);
-					c_ray.xfrom = d_ray.from;
-					c_ray.xdir = d_ray.dir;
-					d_ray = camera->shootRay(j+dx, i+1+dy, lens_u, lens_v, wt_dummy);
-					c_ray.yfrom = d_ray.from;
-					c_ray.ydir = d_ray.dir;
-					c_ray.hasDifferentials = true;
-					// col = T * L_o + L_v
-				}
-				
-				c_ray.time = rstate.time;
+				for(int idx = 0; idx < nPasses; ++idx) colorPasses(idx) = eyePasses[(size_t)index*nPasses + idx];
 
 				//for sppm progressive
-				int index = i*camera->resX() + j;
-				HitPoint &hp = hitPoints[index];
-
-				GatherInfo gInfo = traceGatherRay(rstate, c_ray, hp, colorPasses);
-				hp.constantRandiance += gInfo.constantRandiance; // accumulate the constant radiance for later usage.
+				const std::atomic<float> *splat = &passPhotons[4*(size_t)index];
+				colorA_t photonFlux(splat[0].load(std::memory_order_relaxed), splat[1].load(std::memory_order_relaxed), splat[2].load(std::memory_order_relaxed), 0.f);
+				int64_t photonCount = (int64_t)splat[3].load(std::memory_order_relaxed);
+				float &radius2 = hitPoints.radius2[index];
+				int64_t &accPhotonCount = hitPoints.accPhotonCount[index];
+				colorA_t &accPhotonFlux = hitPoints.accPhotonFlux[index];
 
 				// progressive refinement
 				const float _alpha = 0.7f; // another common choice is 0.8, seems not changed much.
 
 				// The author's refine formular
-				if(gInfo.photonCount > 0)
+				if(photonCount > 0)
 				{
-					float g = std::min((hp.accPhotonCount + _alpha * gInfo.photonCount) / (hp.accPhotonCount + gInfo.photonCount), 1.0f);
-					hp.radius2 *= g;
-					hp.accPhotonCount += gInfo.photonCount * _alpha;
-					hp.accPhotonFlux = (hp.accPhotonFlux + gInfo.photonFlux) * g;
+					float g = std::min((accPhotonCount + _alpha * photonCount) / (accPhotonCount + photonCount), 1.0f);
+					radius2 *= g;
+					accPhotonCount += photonCount * _alpha;
+					accPhotonFlux = (accPhotonFlux + photonFlux) * g;
 					nRefined++; // record the pixel that has refined.
 				}
 
 				//radiance estimate
-				//colorPasses.probe_mult(PASS_INT_DIFFUSE_INDIRECT, 1.f / (hp.radius2 * M_PI * totalnPhotons));
-				colorA_t color = colorPasses.probe_set(PASS_INT_INDIRECT, hp.accPhotonFlux / (hp.radius2 * M_PI * totalnPhotons));
-				color += gInfo.constantRandiance;
-				color.A = gInfo.constantRandiance.A; //the alpha value is hold in the constantRadiance variable
-				if(colorPasses.enabled(PASS_INT_INDIRECT)) colorPasses(PASS_INT_INDIRECT).A = gInfo.constantRandiance.A;
+				//colorPasses.probe_mult(PASS_INT_DIFFUSE_INDIRECT, 1.f / (radius2 * M_PI * totalnPhotons));
+				colorA_t color = colorPasses.probe_set(PASS_INT_INDIRECT, accPhotonFlux / (radius2 * M_PI * totalnPhotons));
+				color += es.constantRandiance;
+				color.A = es.constantRandiance.A; //the alpha value is hold in the constantRadiance variable
+				if(colorPasses.enabled(PASS_INT_INDIRECT)) colorPasses(PASS_INT_INDIRECT).A = es.constantRandiance.A;
 
 				colorPasses.probe_set(PASS_INT_COMBINED, color);
 
@@ -278,16 +289,16 @@ bool SPPM::renderTile(int numView, renderArea_t &a, int n_samples, int offset, b
 
 					if(colorPasses.enabled(PASS_INT_Z_DEPTH_NORM) || colorPasses.enabled(PASS_INT_MIST))
 					{
-						if(c_ray.tmax > 0.f)
+						if(es.depth > 0.f)
 						{
-							depth_norm = 1.f - (c_ray.tmax - minDepth) * maxDepth; // Distance normalization
+							depth_norm = 1.f - (es.depth - minDepth) * maxDepth; // Distance normalization
 						}
 						colorPasses.probe_set(PASS_INT_Z_DEPTH_NORM, colorA_t(depth_norm));
 						colorPasses.probe_set(PASS_INT_MIST, colorA_t(1.f-depth_norm));
 					}
 					if(colorPasses.enabled(PASS_INT_Z_DEPTH_ABS))
 					{
-						depth_abs = c_ray.tmax;
+						depth_abs = es.depth;
 						if(depth_abs <= 0.f)
 						{
 							depth_abs = 99999997952.f;
@@ -351,193 +362,156 @@ bool SPPM::renderTile(int numView, renderArea_t &a, int n_samples, int offset, b
                         }
                         break;
                         
-                    default: colorPasses(idx) *= wt; break;
+                    default: colorPasses(idx) *= es.wt; break;
 					}				
 				}
 
-				imageFilm->addSample(colorPasses, j, i, dx, dy, &a, sample, AA_pass_number, inv_AA_max_possible_samples);
+				imageFilm->addSample(colorPasses, j, i, es.dx, es.dy, &a, sample, AA_pass_number, inv_AA_max_possible_samples);
             }
 		}
 	}
 	return true;
 }
 
-void SPPM::photonWorker(photonMap_t * diffuseMap, photonMap_t * causticMap, int threadID, const scene_t *scene, unsigned int nPhotons, const pdf1D_t *lightPowerD, int numDLights, const std::string &integratorName, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot, int maxBounces, random_t & prng)
+void SPPM::photonWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &diffuseSlots, chunkSlots_t<photon_t> &causticSlots, const scene_t *scene, const pdf1D_t *lightPowerD, int numDLights, const std::vector<light_t *> &tmplights, progressBar_t *pb, int pbStep, int maxBounces, unsigned int halStart, unsigned int seed)
 {
 	ray_t ray;
 	float lightNumPdf, lightPdf, s1, s2, s3, s4, s5, s6, s7, sL;
 	color_t pcol;
 
-	//shoot photons
-	bool done=false;
-	unsigned int curr=0;
-	
 	surfacePoint_t sp;
+	random_t prng;
 	renderState_t state(&prng);
 	unsigned char userdata[USER_DATA_SIZE+7];
 	state.userdata = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
 	state.cam = scene->getCamera();
-	
-	float fNumLights = (float)numDLights;
-
-	unsigned int nPhotons_thread = 1 + ( (nPhotons - 1) / scene->getNumThreadsPhotons() );
 
-	std::vector<photon_t> localCausticPhotons;
-	localCausticPhotons.clear();
-	localCausticPhotons.reserve(nPhotons_thread);
+	float fNumLights = (float)numDLights;
 
-	std::vector<photon_t> localDiffusePhotons;
-	localDiffusePhotons.clear();
-	localDiffusePhotons.reserve(nPhotons_thread);
-		
 	//Pregather  photons
-	float invDiffPhotons = 1.f / (float)nPhotons;
+	float invDiffPhotons = 1.f / (float)chunks.nPaths;
 
-	unsigned int ndPhotonStored = 0;
-//	unsigned int ncPhotonStored = 0;
-
-	while(!done)
+	unsigned int chunk, start, end;
+	while(chunks.take(chunk, start, end))
 	{
-		unsigned int haltoncurr = curr + nPhotons_thread * threadID;
+		if(scene->getSignals() & Y_SIG_ABORT) return;
 
-		state.chromatic = true;
-		state.wavelength = scrHalton(5, haltoncurr);
+		std::vector<photon_t> &localDiffusePhotons = diffuseSlots[chunk];
+		std::vector<photon_t> &localCausticPhotons = causticSlots[chunk];
 
-	   // Tried LD, get bad and strange results for some stategy.
-	   s1 = hal1.getNext();
-	   s2 = hal2.getNext();
-	   s3 = hal3.getNext();
-	   s4 = hal4.getNext();
+		// the sequences continue where the previous chunk of the pass would have left them,
+		// so the samples of a chunk do not depend on the thread shooting it
+		Halton h1(2), h2(3), h3(5), h4(7);
+		h1.setStart(halStart + start);
+		h2.setStart(halStart + start);
+		h3.setStart(halStart + start);
+		h4.setStart(halStart + start);
+		prng = random_t(seed + chunk * 2654435761u);
 
-		sL = float(haltoncurr) * invDiffPhotons; // Does sL also need more random for each pass?
-		int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
-		if(lightNum >= numDLights)
+		for(unsigned int haltoncurr = start; haltoncurr < end; ++haltoncurr)
 		{
-			diffuseMap->mutx.lock();
-			Y_ERROR << integratorName << ": lightPDF sample error! "<<sL<<"/"<<lightNum<<"\n";
-			diffuseMap->mutx.unlock();
-			return;
-		}
-
-		pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
-		ray.tmin = scene->rayMinDist;
-		ray.tmax = -1.0;
-		pcol *= fNumLights*lightPdf/lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
-
-		if(pcol.isBlack())
-		{
-			++curr;
-			done = (curr >= nPhotons);
-			continue;
-		}
+			state.chromatic = true;
+			state.wavelength = scrHalton(5, haltoncurr);
 
-		int nBounces=0;
-		bool causticPhoton = false;
-		bool directPhoton = true;
-		const material_t *material = nullptr;
-		BSDF_t bsdfs;
+		   // Tried LD, get bad and strange results for some stategy.
+		   s1 = h1.getNext();
+		   s2 = h2.getNext();
+		   s3 = h3.getNext();
+		   s4 = h4.getNext();
 
-		while( scene->intersect(ray, sp) ) //scatter photons.
-		{
-			if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
+			sL = float(haltoncurr) * invDiffPhotons; // Does sL also need more random for each pass?
+			int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
+			if(lightNum >= numDLights)
 			{
-				diffuseMap->mutx.lock();
-				Y_WARNING << integratorName << ": NaN  on photon color for light" << lightNum + 1 << "." << yendl;
-				diffuseMap->mutx.unlock();
-				continue;
+				chunks.sampleError = true;
+				return;
 			}
 
-			color_t transm(1.f);
-			color_t vcol(0.f);
-			const volumeHandler_t* vol;
+			pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
+			ray.tmin = scene->rayMinDist;
+			ray.tmax = -1.0;
+			pcol *= fNumLights*lightPdf/lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
+			if(pcol.isBlack()) continue;
+
+			int nBounces=0;
+			bool causticPhoton = false;
+			bool directPhoton = true;
+			const material_t *material = nullptr;
+			BSDF_t bsdfs;
 
-			if(material)
+			while( scene->intersect(ray, sp) ) //scatter photons.
 			{
-				if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * -ray.dir < 0)))
+				if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
 				{
-					if(vol->transmittance(state, ray, vcol)) transm = vcol;
+					++chunks.nanPaths;
+					break;
 				}
-			}
 
-			vector3d_t wi = -ray.dir, wo;
-			material = sp.material;
-			material->initBSDF(state, sp, bsdfs);
+				color_t transm(1.f);
+				color_t vcol(0.f);
+				const volumeHandler_t* vol;
 
-			//deposit photon on diffuse surface, now we only have one map for all, elimate directPhoton for we estimate it directly
-			if(!directPhoton && !causticPhoton && (bsdfs & (BSDF_DIFFUSE)))
-			{
-				photon_t np(wi, sp.P, pcol);// pcol used here
+				if(material)
+				{
+					if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * -ray.dir < 0)))
+					{
+						if(vol->transmittance(state, ray, vcol)) transm = vcol;
+					}
+				}
 
-				if(bHashgrid) photonGrid.pushPhoton(np);
-				else
+				vector3d_t wi = -ray.dir, wo;
+				material = sp.material;
+				material->initBSDF(state, sp, bsdfs);
+
+				//deposit photon on diffuse surface, now we only have one map for all, elimate directPhoton for we estimate it directly
+				if(!directPhoton && !causticPhoton && (bsdfs & (BSDF_DIFFUSE)))
 				{
+					photon_t np(wi, sp.P, pcol);// pcol used here
 					localDiffusePhotons.push_back(np);
 				}
-				ndPhotonStored++;
-			}
-			// add caustic photon
-			if(!directPhoton && causticPhoton && (bsdfs & (BSDF_DIFFUSE | BSDF_GLOSSY)))
-			{
-				photon_t np(wi, sp.P, pcol);// pcol used here
-
-				if(bHashgrid) photonGrid.pushPhoton(np);
-				else
+				// add caustic photon
+				if(!directPhoton && causticPhoton && (bsdfs & (BSDF_DIFFUSE | BSDF_GLOSSY)))
 				{
+					photon_t np(wi, sp.P, pcol);// pcol used here
 					localCausticPhotons.push_back(np);
 				}
-				ndPhotonStored++;
-			}
 
-			// need to break in the middle otherwise we scatter the photon and then discard it => redundant
-			if(nBounces == maxBounces) break;
+				// need to break in the middle otherwise we scatter the photon and then discard it => redundant
+				if(nBounces == maxBounces) break;
 
-			// scatter photon
-			s5 = ourRandom(); // now should use this to see correctness
-			s6 = ourRandom();
-			s7 = ourRandom();
+				// scatter photon, with the random numbers of the chunk instead of the shared ourRandom()
+				s5 = prng();
+				s6 = prng();
+				s7 = prng();
 
-			pSample_t sample(s5, s6, s7, BSDF_ALL, pcol, transm);
+				pSample_t sample(s5, s6, s7, BSDF_ALL, pcol, transm);
 
-			bool scattered = material->scatterPhoton(state, sp, wi, wo, sample);
-			if(!scattered) break; //photon was absorped.  actually based on russian roulette
+				bool scattered = material->scatterPhoton(state, sp, wi, wo, sample);
+				if(!scattered) break; //photon was absorped.  actually based on russian roulette
 
-			pcol = sample.color;
+				pcol = sample.color;
 
-			causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
-							((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
-			directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
+				causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
+								((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
+				directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
 
-			if(state.chromatic && (sample.sampledFlags & BSDF_DISPERSIVE))
-				{
-					state.chromatic=false;
-					color_t wl_col;
-					wl2rgb(state.wavelength, wl_col);
-					pcol *= wl_col;
-				}
-				
-			ray.from = sp.P;
-			ray.dir = wo;
-			ray.tmin = scene->rayMinDist;
-			ray.tmax = -1.0;
-			++nBounces;
-		}
-		++curr;
-		if(curr % pbStep == 0)
-		{
-			pb->mutx.lock();
-			pb->update();
-			pb->mutx.unlock();
-			if(scene->getSignals() & Y_SIG_ABORT) { return; }
+				if(state.chromatic && (sample.sampledFlags & BSDF_DISPERSIVE))
+					{
+						state.chromatic=false;
+						color_t wl_col;
+						wl2rgb(state.wavelength, wl_col);
+						pcol *= wl_col;
+					}
+
+				ray.from = sp.P;
+				ray.dir = wo;
+				ray.tmin = scene->rayMinDist;
+				ray.tmax = -1.0;
+				++nBounces;
+			}
 		}
-		done = (curr >= nPhotons_thread);
+		chunks.done(start, end, pb, pbStep);
 	}
-	diffuseMap->mutx.lock();
-	causticMap->mutx.lock();
-	diffuseMap->appendVector(localDiffusePhotons, curr);
-	causticMap->appendVector(localCausticPhotons, curr);
-	totalPhotonsShot += curr;
-	causticMap->mutx.unlock();
-	diffuseMap->mutx.unlock();
 }
 
 
@@ -549,19 +523,21 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 
 	Y_INFO << integratorName << ": Starting Photon tracing pass..." << yendl;
 
-	if(bHashgrid) photonGrid.clear();
-	else
+	// the photons are always collected in the photon maps, the hashgrid path moves them into the grids afterwards
+	if(bHashgrid)
 	{
-		session.diffuseMap->clear();
-		session.diffuseMap->setNumPaths(0);
-		session.diffuseMap->reserveMemory(nPhotons);
-		session.diffuseMap->setNumThreadsPKDtree(scene->getNumThreadsPhotons());
-
-		session.causticMap->clear();
-		session.causticMap->setNumPaths(0);
-		session.causticMap->reserveMemory(nPhotons);
-		session.causticMap->setNumThreadsPKDtree(scene->getNumThreadsPhotons());
+		photonGrid.clear();
+		causticGrid.clear();
 	}
+	session.diffuseMap->clear();
+	session.diffuseMap->setNumPaths(0);
+	session.diffuseMap->reserveMemory(nPhotons);
+	session.diffuseMap->setNumThreadsPKDtree(scene->getNumThreadsPhotons());
+
+	session.causticMap->clear();
+	session.causticMap->setNumPaths(0);
+	session.causticMap->reserveMemory(nPhotons);
+	session.causticMap->setNumThreadsPKDtree(scene->getNumThreadsPhotons());
 
 	background = scene->getBackground();
 	lights = scene->lights;
@@ -607,7 +583,8 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 	unsigned int curr=0;
 
 	surfacePoint_t sp;
-	random_t prng(rand()+offset*(4517)+123);
+	unsigned int seed = rand()+offset*(4517)+123;
+	random_t prng(seed);
 	renderState_t state(&prng);
 	unsigned char userdata[USER_DATA_SIZE+7];
 	state.userdata = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
@@ -625,8 +602,7 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 	}
 	else pb = new ConsoleProgressBar_t(80);
 
-	if(bHashgrid) Y_INFO << integratorName << ": Building photon hashgrid..." << yendl;
-	else Y_INFO << integratorName << ": Building photon map..." << yendl;
+	Y_INFO << integratorName << ": Building photon map..." << yendl;
 
 	pb->init(128);
 	pbStep = std::max(1U, nPhotons/128);
@@ -634,15 +610,27 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 
 	int nThreads = scene->getNumThreadsPhotons();
 
-	nPhotons = std::max((unsigned int) nThreads, (nPhotons / nThreads) * nThreads); //rounding the number of diffuse photons so it's a number divisible by the number of threads (distribute uniformly among the threads). At least 1 photon per thread
-	
-	Y_PARAMS << integratorName << ": Shooting "<<nPhotons<<" photons across " << nThreads << " threads (" << (nPhotons / nThreads) << " photons/thread)"<< yendl;
+	Y_PARAMS << integratorName << ": Shooting "<<nPhotons<<" photons across " << nThreads << " threads in chunks of " << PHOTON_CHUNK_SIZE << yendl;
 
 	if(nThreads >= 2)
 	{
+		photonChunks_t chunks(nPhotons);
+		chunkSlots_t<photon_t> diffuseSlots(chunks.nChunks);
+		chunkSlots_t<photon_t> causticSlots(chunks.nChunks);
 		std::vector<std::thread> threads;
-		for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&SPPM::photonWorker, this, session.diffuseMap, session.causticMap, i, scene, nPhotons, lightPowerD, numDLights, std::ref(integratorName), tmplights, pb, pbStep, std::ref(curr), maxBounces, std::ref(prng)));
+		for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&SPPM::photonWorker, this, std::ref(chunks), std::ref(diffuseSlots), std::ref(causticSlots), scene, lightPowerD, numDLights, tmplights, pb, pbStep, maxBounces, (unsigned int)totalnPhotons, seed));
 		for(auto& t : threads) t.join();
+
+		if(chunks.nanPaths > 0) Y_WARNING << integratorName << ": NaN  on photon color, " << chunks.nanPaths << " photon paths stopped." << yendl;
+		if(chunks.sampleError) { Y_ERROR << integratorName << ": lightPDF sample error! ... stopping now.\n"; delete lightPowerD; pb->done(); if(!intpb) delete pb; return; }
+		curr = chunks.shot;
+		session.diffuseMap->appendChunks(diffuseSlots, curr, nThreads);
+		session.causticMap->appendChunks(causticSlots, curr, nThreads);
+		// keep the sequences of the single threaded shooting in step
+		hal1.setStart(totalnPhotons + nPhotons);
+		hal2.setStart(totalnPhotons + nPhotons);
+		hal3.setStart(totalnPhotons + nPhotons);
+		hal4.setStart(totalnPhotons + nPhotons);
 	}
 	else
 	{
@@ -668,7 +656,7 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 
 			sL = float(curr) * invDiffPhotons; // Does sL also need more random for each pass?
 			int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
-			if(lightNum >= numDLights){ Y_ERROR << integratorName << ": lightPDF sample error! "<<sL<<"/"<<lightNum<<"... stopping now.\n"; delete lightPowerD; return; }
+			if(lightNum >= numDLights){ Y_ERROR << integratorName << ": lightPDF sample error! "<<sL<<"/"<<lightNum<<"... stopping now.\n"; delete lightPowerD; pb->done(); if(!intpb) delete pb; return; }
 
 			pcol = tmplights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
 			ray.tmin = scene->rayMinDist;
@@ -713,26 +701,16 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 				if(!directPhoton && !causticPhoton && (bsdfs & (BSDF_DIFFUSE)))
 				{
 					photon_t np(wi, sp.P, pcol);// pcol used here
-
-					if(bHashgrid) photonGrid.pushPhoton(np);
-					else
-					{
-						session.diffuseMap->pushPhoton(np);
-						session.diffuseMap->setNumPaths(curr);
-					}
+					session.diffuseMap->pushPhoton(np);
+					session.diffuseMap->setNumPaths(curr);
 					ndPhotonStored++;
 				}
 				// add caustic photon
 				if(!directPhoton && causticPhoton && (bsdfs & (BSDF_DIFFUSE | BSDF_GLOSSY)))
 				{
 					photon_t np(wi, sp.P, pcol);// pcol used here
-
-					if(bHashgrid) photonGrid.pushPhoton(np);
-					else
-					{
-						session.causticMap->pushPhoton(np);
-						session.causticMap->setNumPaths(curr);
-					}
+					session.causticMap->pushPhoton(np);
+					session.causticMap->setNumPaths(curr);
 					ndPhotonStored++;
 				}
 
@@ -786,30 +764,41 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 
 	Y_VERBOSE << integratorName << ": Stored photons: "<< session.diffuseMap->nPhotons() + session.causticMap->nPhotons() << yendl;
 
-	if(bHashgrid)
-	{
-		Y_INFO << integratorName << ": Building photons hashgrid:" << yendl;
-		photonGrid.updateGrid();
-		Y_VERBOSE << integratorName << ": Done." << yendl;
-	}
-	else
+	// only the initial radius estimate still searches the photons around a point, everything else splats them
+	bool initialEstimate = PM_IRE && samples > 0;
+	if(initialEstimate)
 	{
-		if(session.diffuseMap->nPhotons() > 0)
-		{
-			Y_INFO << integratorName << ": Building diffuse photons kd-tree:" << yendl;
-			session.diffuseMap->updateTree();
-			Y_VERBOSE << integratorName << ": Done." << yendl;
-		}
-		if(session.causticMap->nPhotons() > 0)
+		if(bHashgrid)
 		{
-			Y_INFO << integratorName << ": Building caustic photons kd-tree:" << yendl;
-			session.causticMap->updateTree();
+			Y_INFO << integratorName << ": Building photons hashgrid:" << yendl;
+			float cellSize = 2.f * dsRadius;
+			bound_t bBox = scene->getSceneBound();
+			std::vector<photon_t> mapPhotons;
+			session.diffuseMap->swapVector(mapPhotons);
+			photonGrid.swapVector(mapPhotons);
+			photonGrid.setParm(cellSize, bBox);
+			photonGrid.updateGrid(scene->getNumThreadsPhotons());
+			mapPhotons.clear();
+			session.causticMap->swapVector(mapPhotons);
+			causticGrid.swapVector(mapPhotons);
+			causticGrid.setParm(cellSize, bBox);
+			causticGrid.updateGrid(scene->getNumThreadsPhotons());
 			Y_VERBOSE << integratorName << ": Done." << yendl;
 		}
-		if(session.diffuseMap->nPhotons() < 50)
+		else
 		{
-			Y_ERROR << integratorName << ": Too few photons, stopping now." << yendl;
-			return;
+			if(session.diffuseMap->nPhotons() > 0)
+			{
+				Y_INFO << integratorName << ": Building diffuse photons kd-tree:" << yendl;
+				session.diffuseMap->updateTree();
+				Y_VERBOSE << integratorName << ": Done." << yendl;
+			}
+			if(session.causticMap->nPhotons() > 0)
+			{
+				Y_INFO << integratorName << ": Building caustic photons kd-tree:" << yendl;
+				session.causticMap->updateTree();
+				Y_VERBOSE << integratorName << ": Done." << yendl;
+			}
 		}
 	}
 
@@ -817,12 +806,99 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 
 	if(!intpb) delete pb;
 
+	if(samples > 0)
+	{
+		// eye pass: one camera sample per pixel, rows of the film are traced in parallel
+		int nRows = imageFilm->getHeight();
+		int nThreadsEye = scene->getNumThreads();
+		std::vector<VisibleRow> rows(nRows);
+		std::atomic<int> nextRow(0);
+		std::vector<std::thread> threads;
+		for(int i=1; i<nThreadsEye; ++i) threads.push_back(std::thread(&SPPM::eyeWorker, this, &nextRow, &rows, offset, seed, i));
+		eyeWorker(&nextRow, &rows, offset, seed, 0);
+		for(auto& t : threads) t.join();
+		threads.clear();
+
+		size_t nVisible = 0, nUserdata = 0;
+		for(int r=0; r<nRows; ++r)
+		{
+			nVisible += rows[r].size();
+			nUserdata += rows[r].userdata.size();
+		}
+		visiblePoints.resize(nVisible);
+		visiblePoints.userdata.resize(nUserdata);
+		size_t k = 0, u = 0;
+		for(int r=0; r<nRows; ++r)
+		{
+			for(const VisiblePoint &vp : rows[r].points)
+			{
+				visiblePoints.P[k] = vp.sp.P;
+				visiblePoints.radius2[k] = hitPoints.radius2[vp.pixel];
+				visiblePoints.sp[k] = vp.sp;
+				visiblePoints.wo[k] = vp.wo;
+				visiblePoints.weight[k] = vp.weight;
+				visiblePoints.countWeight[k] = vp.countWeight;
+				visiblePoints.pixel[k] = vp.pixel;
+				visiblePoints.caustics[k] = vp.caustics;
+				visiblePoints.udat[k] = u;
+				if(vp.udatSize) std::memcpy(&visiblePoints.userdata[u], &rows[r].userdata[vp.udat], vp.udatSize);
+				u += vp.udatSize;
+				++k;
+			}
+			std::vector<VisiblePoint>().swap(rows[r].points);
+			std::vector<unsigned char>().swap(rows[r].userdata);
+		}
+		visiblePoints.udat[nVisible] = u;
+
+		// the photons were left in the maps, or moved into the grids of the initial radius estimate
+		std::vector<photon_t> diffusePhotons, causticPhotons;
+		if(initialEstimate && bHashgrid)
+		{
+			photonGrid.swapVector(diffusePhotons);
+			causticGrid.swapVector(causticPhotons);
+			photonGrid.clear();
+			causticGrid.clear();
+		}
+		else
+		{
+			session.diffuseMap->swapVector(diffusePhotons);
+			session.causticMap->swapVector(causticPhotons);
+			session.diffuseMap->clear();
+			session.causticMap->clear();
+		}
+
+		if(diffusePhotons.size() < 50)
+		{
+			Y_ERROR << integratorName << ": Too few photons, skipping the photons of this pass." << yendl;
+		}
+		else if(nVisible > 0)
+		{
+			// cells of about the search diameter of most visible points, so a sphere overlaps few cells.
+			// The few with a larger radius go to the overflow list of the grid instead of filling many buckets
+			std::vector<float> radius2(visiblePoints.radius2.begin(), visiblePoints.radius2.begin() + nVisible);
+			std::vector<float>::iterator percentile = radius2.begin() + (size_t)(VISIBLE_GRID_RADIUS_PERCENTILE * (nVisible - 1));
+			std::nth_element(radius2.begin(), percentile, radius2.end());
+			float cellSize = 2.f * fSqrt(*percentile);
+			visibleGrid.build(&visiblePoints.P[0], &visiblePoints.radius2[0], nVisible, cellSize, scene->getSceneBound(), nThreads);
+
+			const std::vector<photon_t> *maps[2] = { &diffusePhotons, &causticPhotons };
+			for(int m=0; m<2; ++m)
+			{
+				u_int32 n = maps[m]->size();
+				u_int32 chunk = (n + nThreads - 1) / nThreads;
+				for(int t=1; t<nThreads; ++t) threads.push_back(std::thread(&SPPM::splatWorker, this, maps[m], std::min(n, t*chunk), std::min(n, (t+1)*chunk), m == 1));
+				splatWorker(maps[m], 0, std::min(n, chunk), m == 1);
+				for(auto& t : threads) t.join();
+				threads.clear();
+			}
+		}
+		visibleGrid.clear();
+		Y_VERBOSE << integratorName << ": " << nVisible << " visible points, " << diffusePhotons.size() + causticPhotons.size() << " photons splatted." << yendl;
+	}
+
 	gTimer.stop("prepass");
 
-	if(bHashgrid)
-		Y_INFO << integratorName << ": PhotonGrid building time: " << gTimer.getTime("prepass") << yendl;
-	else
-		Y_INFO << integratorName << ": PhotonMap building time: " << gTimer.getTime("prepass") << yendl;
+	Y_INFO << integratorName << ": Photon and eye pass time: " << gTimer.getTime("prepass") << yendl;
 
 	if(intpb) 
 	{
@@ -833,6 +909,105 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 	return;
 }
 
+//! the camera samples of whole rows, the same as the old per tile loop of renderTile
+void SPPM::eyeWorker(std::atomic<int> *nextRow, std::vector<VisibleRow> *rows, int offset, unsigned int seed, int threadID)
+{
+	const camera_t* camera = scene->getCamera();
+	int x = camera->resX();
+	int x0 = imageFilm->getCX0(), y0 = imageFilm->getCY0();
+	int end_x = x0 + imageFilm->getWidth();
+	int nRows = rows->size();
+	diffRay_t c_ray;
+	ray_t d_ray;
+	float dx=0.5, dy=0.5;
+	float lens_u=0.5f, lens_v=0.5f;
+	float wt, wt_dummy;
+	random_t prng;
+	renderState_t rstate(&prng);
+	rstate.threadID = threadID;
+	rstate.cam = camera;
+	bool sampleLns = camera->sampleLense();
+	int pass_offs=offset;
+
+	colorPasses_t colorPasses(scene->getRenderPasses());
+	int nPasses = colorPasses.size();
+
+	for(int r = (*nextRow)++; r < nRows; r = (*nextRow)++)
+	{
+		int i = y0 + r;
+		// seeded per row, so the image does not depend on the thread tracing a row
+		prng = random_t(seed + i * 2654435761u);
+		VisibleRow &vps = (*rows)[r];
+
+		for(int j=x0; j<end_x; ++j)
+		{
+			if(scene->getSignals() & Y_SIG_ABORT) return;
+
+			int index = x*i+j;
+			EyeSample &es = eyeSamples[index];
+			for(int c=0; c<4; ++c) passPhotons[4*(size_t)index + c].store(0.f, std::memory_order_relaxed);
+
+			rstate.pixelNumber = index;
+			rstate.samplingOffs = fnv_32a_buf(i*fnv_32a_buf(j));//fnv_32a_buf(rstate.pixelNumber);
+			float toff = scrHalton(5, pass_offs+rstate.samplingOffs); // **shall be just the pass number...**
+
+			colorPasses.reset_colors();
+			
+			rstate.setDefaults();
+			rstate.pixelSample = pass_offs;
+			rstate.time = toff;
+			// the (1/n, Larcher&Pillichshammer-Seq.) only gives good coverage when total sample count is known
+			// hence we use scrambled (Sobol, van-der-Corput) for multipass AA
+
+			dx = RI_vdC(rstate.pixelSample, rstate.samplingOffs);
+			dy = RI_S(rstate.pixelSample, rstate.samplingOffs);
+
+			if(sampleLns)
+			{
+				lens_u = scrHalton(3, rstate.pixelSample+rstate.samplingOffs);
+				lens_v = scrHalton(4, rstate.pixelSample+rstate.samplingOffs);
+			}
+			c_ray = camera->shootRay(j+dx, i+dy, lens_u, lens_v, wt); // wt need to be considered
+			es.dx = dx;
+			es.dy = dy;
+			es.wt = wt;
+			if(wt==0.0) continue;
+			if(diffRaysEnabled)
+			{
+				//setup ray differentials
+				d_ray = camera->shootRay(j+1+dx, i+dy, lens_u, lens_v, wt_dummy);
+				c_ray.xfrom = d_ray.from;
+				c_ray.xdir = d_ray.dir;
+				d_ray = camera->shootRay(j+dx, i+1+dy, lens_u, lens_v, wt_dummy);
+				c_ray.yfrom = d_ray.from;
+				c_ray.ydir = d_ray.dir;
+				c_ray.hasDifferentials = true;
+				// col = T * L_o + L_v
+			}
+			
+			c_ray.time = rstate.time;
+
+			GatherInfo gInfo = traceGatherRay(rstate, c_ray, index, vps, colorPasses);
+			hitPoints.constantRandiance[index] += gInfo.constantRandiance; // accumulate the constant radiance for later usage.
+			es.constantRandiance = gInfo.constantRandiance;
+			es.depth = c_ray.tmax;
+			for(int idx = 0; idx < nPasses; ++idx) eyePasses[(size_t)index*nPasses + idx] = colorPasses(idx);
+		}
+	}
+}
+
+void SPPM::splatWorker(const std::vector<photon_t> *photons, u_int32 start, u_int32 end, bool caustic)
+{
+	photonSplat_t proc(visiblePoints, &passPhotons[0], caustic);
+	for(u_int32 i=start; i<end; ++i)
+	{
+		const photon_t &photon = (*photons)[i];
+		proc.wi = photon.direction();
+		proc.col = photon.color();
+		visibleGrid.lookup(photon.pos, proc);
+	}
+}
+
 //now it's a dummy function
 colorA_t SPPM::integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &colorPasses, int additionalDepth /*=0*/ /*, sampler_t &sam*/) const
 {
@@ -840,11 +1015,8 @@ colorA_t SPPM::integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &co
 }
 
 
-GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_t &ray, yafaray::HitPoint &hp, colorPasses_t &colorPasses)
+GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_t &ray, u_int32 pixel, VisibleRow &vps, colorPasses_t &colorPasses)
 {
-	static int _nMax=0;
-	static int calls=0;
-	++calls;
 	color_t col(0.0);
 	GatherInfo gInfo;
 
@@ -888,107 +1060,52 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 			gInfo.constantRandiance += estimateAllDirectLight(state, sp, wo, colorPasses);
 		}
 
-		// estimate radiance using photon map
-		foundPhoton_t *gathered = new foundPhoton_t[nMaxGather];
-
 		//if PM_IRE is on. we should estimate the initial radius using the photonMaps. (PM_IRE is only for the first pass, so not consume much time)
-		if(PM_IRE && !hp.radiusSetted) // "waste" two gather here as it has two maps now. This make the logic simple.
+		if(PM_IRE && !hitPoints.radiusSetted[pixel]) // "waste" two gather here as it has two maps now. This make the logic simple.
 		{
+			foundPhoton_t *gathered = new foundPhoton_t[nSearch];
 			float radius_1 = dsRadius * dsRadius;
 			float radius_2 = radius_1;
 			int nGathered_1 = 0, nGathered_2 = 0;
 
-			if(session.diffuseMap->nPhotons() > 0)
-				nGathered_1 = session.diffuseMap->gather(sp.P, gathered, nSearch, radius_1);
-			if(session.causticMap->nPhotons() > 0)
-				nGathered_2 = session.causticMap->gather(sp.P, gathered, nSearch, radius_2);
-			if(nGathered_1 > 0 || nGathered_2 >0) // it none photon gathered, we just skip.
+			if(bHashgrid)
 			{
-				if(radius_1 < radius_2) // we choose the smaller one to be the initial radius.
-					hp.radius2 = radius_1;
-				else
-					hp.radius2 = radius_2;
-
-				hp.radiusSetted = true;
+				nGathered_1 = photonGrid.gather(sp.P, gathered, nSearch, radius_1);
+				nGathered_2 = causticGrid.gather(sp.P, gathered, nSearch, radius_2);
 			}
-		}
-
-		int nGathered=0;
-		float radius2 = hp.radius2;
-
-		if(bHashgrid)
-			nGathered = photonGrid.gather(sp.P, gathered, nMaxGather, radius2); // disable now
-		else
-		{
-			if(session.diffuseMap->nPhotons() > 0) // this is needed to avoid a runtime error.
+			else
 			{
-				nGathered = session.diffuseMap->gather(sp.P, gathered, nMaxGather, radius2); //we always collected all the photon inside the radius
+				if(session.diffuseMap->nPhotons() > 0)
+					nGathered_1 = session.diffuseMap->gather(sp.P, gathered, nSearch, radius_1);
+				if(session.causticMap->nPhotons() > 0)
+					nGathered_2 = session.causticMap->gather(sp.P, gathered, nSearch, radius_2);
 			}
-
-			if(nGathered > 0)
-			{
-				if(nGathered > _nMax)
-				{
-					_nMax = nGathered;
-					Y_DEBUG << "maximum Photons: "<<_nMax<<", radius2: "<<radius2<<"\n";
-					if(_nMax == 10) for(int j=0; j < nGathered; ++j ) Y_DEBUG <<"col:"<<gathered[j].photon->color()<<"\n";
-				}
-				for(int i=0; i<nGathered; ++i)
-				{
-					////test if the photon is in the ellipsoid
-					//vector3d_t scale  = sp.P - gathered[i].photon->pos;
-					//vector3d_t temp;
-					//temp.x = scale VDOT sp.NU;
-					//temp.y = scale VDOT sp.NV;
-					//temp.z = scale VDOT sp.N;
-
-					//double inv_radi = 1 / sqrt(radius2);
-					//temp.x  *= inv_radi; temp.y *= inv_radi; temp.z *=  1. / (2.f * scene->rayMinDist);
-					//if(temp.lengthSqr() > 1.)continue;
-
-					gInfo.photonCount++;
-					vector3d_t pdir = gathered[i].photon->direction();
-					color_t surfCol = material->eval(state, sp, wo, pdir, BSDF_DIFFUSE); // seems could speed up using rho, (something pbrt made)
-					gInfo.photonFlux += surfCol * gathered[i].photon->color();// * std::fabs(sp.N*pdir); //< wrong!?
-					//color_t  flux= surfCol * gathered[i].photon->color();// * std::fabs(sp.N*pdir); //< wrong!?
-
-					////start refine here
-					//double ALPHA = 0.7;
-					//double g = (hp.accPhotonCount*ALPHA+ALPHA) / (hp.accPhotonCount*ALPHA+1.0);
-					//hp.radius2 *= g;
-					//hp.accPhotonCount++;
-					//hp.accPhotonFlux=((color_t)hp.accPhotonFlux+flux)*g;
-				}
-			}
-
-			// gather caustics photons
-			if(bsdfs & BSDF_DIFFUSE && session.causticMap->ready())
+			if(nGathered_1 > 0 || nGathered_2 >0) // it none photon gathered, we just skip.
 			{
+				if(radius_1 < radius_2) // we choose the smaller one to be the initial radius.
+					hitPoints.radius2[pixel] = radius_1;
+				else
+					hitPoints.radius2[pixel] = radius_2;
 
-				radius2 = hp.radius2; //reset radius2 & nGathered
-				nGathered = session.causticMap->gather(sp.P, gathered, nMaxGather, radius2);
-				if(nGathered > 0)
-				{
-					color_t surfCol(0.f);
-					for(int i=0; i<nGathered; ++i)
-					{
-						vector3d_t pdir = gathered[i].photon->direction();
-						gInfo.photonCount++;
-						surfCol = material->eval(state, sp, wo, pdir, BSDF_ALL); // seems could speed up using rho, (something pbrt made)
-						gInfo.photonFlux += surfCol * gathered[i].photon->color();// * std::fabs(sp.N*pdir); //< wrong!?//gInfo.photonFlux += colorPasses.probe_add(PASS_INT_DIFFUSE_INDIRECT, surfCol * gathered[i].photon->color(), state.raylevel == 0);// * std::fabs(sp.N*pdir); //< wrong!?
-						//color_t  flux= surfCol * gathered[i].photon->color();// * std::fabs(sp.N*pdir); //< wrong!?
-
-						////start refine here
-						//double ALPHA = 0.7;
-						//double g = (hp.accPhotonCount*ALPHA+ALPHA) / (hp.accPhotonCount*ALPHA+1.0);
-						//hp.radius2 *= g;
-						//hp.accPhotonCount++;
-						//hp.accPhotonFlux=((color_t)hp.accPhotonFlux+flux)*g;
-					}
-				}
+				hitPoints.radiusSetted[pixel] = 1;
 			}
+			delete [] gathered;
 		}
-		delete [] gathered;
+
+		// the diffuse photons of the pass are splatted on this point later on, and the caustic photons if it is diffuse.
+		// The point keeps the material data so the BSDF is evaluated towards each photon
+		VisiblePoint vp;
+		vp.sp = sp;
+		vp.sp.ray = nullptr; // the ray is gone by the time the photons are splatted
+		vp.wo = wo;
+		vp.weight = color_t(1.f);
+		vp.countWeight = 1.f;
+		vp.pixel = pixel;
+		vp.caustics = (bsdfs & BSDF_DIFFUSE);
+		vp.udat = vps.userdata.size();
+		vp.udatSize = std::min(material->getUserDataSize(), (size_t)USER_DATA_SIZE);
+		vps.userdata.insert(vps.userdata.end(), (unsigned char *)state.userdata, (unsigned char *)state.userdata + vp.udatSize);
+		vps.points.push_back(vp);
 
 		state.raylevel++;
 		if(state.raylevel <= (rDepth + additionalDepth))
@@ -1014,6 +1131,7 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 				diffRay_t refRay;
 				float W = 0.f;
 				GatherInfo cing, t_cing; //Dispersive is different handled, not same as GLOSSY, at the BSDF_VOLUMETRIC part
+				size_t cFirst = vps.size();
 
 				for(int ns=0; ns<dsam; ++ns)
 				{
@@ -1032,8 +1150,9 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 						color_t wl_col;
 						wl2rgb(state.wavelength, wl_col);
 						refRay = diffRay_t(sp.P, wi, scene->rayMinDist);
-						t_cing = traceGatherRay(state, refRay, hp, tmpColorPasses);
-						t_cing.photonFlux *= mcol * wl_col * W;
+						size_t first = vps.size();
+						t_cing = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
+						scaleVisiblePoints(vps, first, mcol * wl_col * W);
 						t_cing.constantRandiance *= mcol * wl_col * W;
 						
 						tmpColorPasses.probe_add(PASS_INT_TRANS, t_cing.constantRandiance, state.raylevel == 1);
@@ -1045,13 +1164,12 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 				if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * refRay.dir < 0)))
 				{
 					vol->transmittance(state, refRay, vcol);
-					cing.photonFlux *= vcol;
+					scaleVisiblePoints(vps, cFirst, vcol);
 					cing.constantRandiance *= vcol;
 				}
 
 				gInfo.constantRandiance += cing.constantRandiance * d_1;
-				gInfo.photonFlux += cing.photonFlux * d_1;
-				gInfo.photonCount += cing.photonCount * d_1;
+				scaleVisiblePoints(vps, cFirst, color_t(d_1), d_1);
 
 				if(tmpColorPasses.size() > 1)
 				{
@@ -1084,6 +1202,7 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 				diffRay_t refRay;
 
 				GatherInfo ging, t_ging;
+				size_t gFirst = vps.size();
 
 				hal2.setStart(offs);
 				hal3.setStart(offs);
@@ -1124,8 +1243,9 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
                         }
                         
                         //gcol += tmpColorPasses.probe_add(PASS_INT_GLOSSY_INDIRECT, (color_t)integ * mcol * W, state.raylevel == 1);
-                        t_ging = traceGatherRay(state, refRay, hp, tmpColorPasses);
-						t_ging.photonFlux *=mcol * W;
+                        size_t first = vps.size();
+                        t_ging = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
+						scaleVisiblePoints(vps, first, mcol * W);
 						t_ging.constantRandiance *= mcol * W;
 						ging += t_ging;
                     }
@@ -1150,8 +1270,9 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
                             }
                             color_t colReflectFactor = mcol[0] * W[0];
                             
-                            t_ging = traceGatherRay(state, refRay, hp, tmpColorPasses);
-							t_ging.photonFlux *= colReflectFactor;
+                            size_t first = vps.size();
+                        t_ging = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
+							scaleVisiblePoints(vps, first, colReflectFactor);
 							t_ging.constantRandiance *= colReflectFactor;
 							
 							tmpColorPasses.probe_add(PASS_INT_TRANS, (color_t)t_ging.constantRandiance, state.raylevel == 1);
@@ -1170,8 +1291,9 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
                             
                             color_t colTransmitFactor = mcol[1] * W[1];
                             alpha = integ.A;
-                            t_ging = traceGatherRay(state, refRay, hp, tmpColorPasses);
-							t_ging.photonFlux *= colTransmitFactor;
+                            size_t first = vps.size();
+                        t_ging = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
+							scaleVisiblePoints(vps, first, colTransmitFactor);
 							t_ging.constantRandiance *= colTransmitFactor;
 							tmpColorPasses.probe_add(PASS_INT_GLOSSY_INDIRECT, (color_t)t_ging.constantRandiance, state.raylevel == 1);
                             ging += t_ging;
@@ -1187,8 +1309,9 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 							else if(s.sampledFlags & BSDF_TRANSMIT) spDiff.refractedRay(ray, refRay, material->getMatIOR());
 						}
 
-						t_ging = traceGatherRay(state, refRay, hp, tmpColorPasses);
-						t_ging.photonFlux *=mcol * W;
+						size_t first = vps.size();
+						t_ging = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
+						scaleVisiblePoints(vps, first, mcol * W);
 						t_ging.constantRandiance *= mcol * W;
 						tmpColorPasses.probe_add(PASS_INT_GLOSSY_INDIRECT, t_ging.constantRandiance, state.raylevel == 1);
 						ging += t_ging;
@@ -1198,7 +1321,7 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 					{
 						if(vol->transmittance(state, refRay, vcol))
 						{
-							ging.photonFlux *= vcol;
+							scaleVisiblePoints(vps, gFirst, vcol);
 							ging.constantRandiance *= vcol;
 							//tmpColorPasses.probe_add(PASS_INT_GLOSSY_INDIRECT, t_ging.constantRandiance, state.raylevel == 1);
 						}
@@ -1207,8 +1330,7 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 				}
 
 				gInfo.constantRandiance += ging.constantRandiance * d_1;
-				gInfo.photonFlux += ging.photonFlux * d_1;
-				gInfo.photonCount += ging.photonCount * d_1;
+				scaleVisiblePoints(vps, gFirst, color_t(d_1), d_1);
 
 				if(tmpColorPasses.size() > 1)
 				{
@@ -1236,35 +1358,35 @@ GatherInfo SPPM::traceGatherRay(yafaray::renderState_t &state, yafaray::diffRay_
 				{
 					diffRay_t refRay(sp.P, dir[0], scene->rayMinDist);
 					if(diffRaysEnabled) spDiff.reflectedRay(ray, refRay); // compute the ray differentaitl
-					GatherInfo refg = traceGatherRay(state, refRay, hp, tmpColorPasses);
+					size_t first = vps.size();
+					GatherInfo refg = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
 					if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * refRay.dir < 0)))
 					{
 						if(vol->transmittance(state, refRay, vcol))
 						{
 							refg.constantRandiance *= vcol;
-							refg.photonFlux *= vcol;
+							scaleVisiblePoints(vps, first, vcol);
 						}
 					}
 					gInfo.constantRandiance += colorPasses.probe_add(PASS_INT_REFLECT_PERFECT, refg.constantRandiance * colorA_t(rcol[0]), state.raylevel == 1);
-					gInfo.photonFlux += refg.photonFlux * colorA_t(rcol[0]);
-					gInfo.photonCount += refg.photonCount;
+					scaleVisiblePoints(vps, first, rcol[0]);
 				}
 				if(refract)
 				{
 					diffRay_t refRay(sp.P, dir[1], scene->rayMinDist);
 					if(diffRaysEnabled) spDiff.refractedRay(ray, refRay, material->getMatIOR());
-					GatherInfo refg = traceGatherRay(state, refRay, hp, tmpColorPasses);
+					size_t first = vps.size();
+					GatherInfo refg = traceGatherRay(state, refRay, pixel, vps, tmpColorPasses);
 					if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(sp.Ng * refRay.dir < 0)))
 					{
 						if(vol->transmittance(state, refRay, vcol))
 						{
 							refg.constantRandiance *= vcol;
-							refg.photonFlux *= vcol;
+							scaleVisiblePoints(vps, first, vcol);
 						}
 					}
 					gInfo.constantRandiance += colorPasses.probe_add(PASS_INT_REFRACT_PERFECT, refg.constantRandiance * colorA_t(rcol[1]), state.raylevel == 1);
-					gInfo.photonFlux += refg.photonFlux * colorA_t(rcol[1]);
-					gInfo.photonCount += refg.photonCount;
+					scaleVisiblePoints(vps, first, rcol[1]);
 					alpha = refg.constantRandiance.A;
 				}
 			}
@@ -1325,25 +1447,18 @@ void SPPM::initializePPM()
 	const camera_t* camera = scene->getCamera();
 	unsigned int resolution = camera->resX() * camera->resY();
 
-	hitPoints.reserve(resolution);
 	bound_t bBox = scene->getSceneBound(); // Now using Scene Bound, this could get a bigger initial radius, and need more tests
 
 	// initialize SPPM statistics
 	float initialRadius = ((bBox.longX() + bBox.longY() + bBox.longZ()) / 3.f) / ((camera->resX() + camera->resY()) / 2.0f) * 2.f ;
 	initialRadius = std::min(initialRadius, 1.f); //Fix the overflow bug
-	for(unsigned int i = 0; i < resolution; i++)
-	{
-		HitPoint hp;
-		hp.accPhotonFlux  = colorA_t(0.f);
-		hp.accPhotonCount = 0;
-		hp.radius2 = (initialRadius * initialFactor) * (initialRadius * initialFactor);
-		hp.constantRandiance = colorA_t(0.f);
-		hp.radiusSetted = false;	   // the flag used for IRE
-
-		hitPoints.push_back(hp);
-	}
+	hitPoints.resize(resolution, (initialRadius * initialFactor) * (initialRadius * initialFactor));
+
+	eyeSamples.resize(resolution);
+	eyePasses.resize((size_t)resolution * colorPasses_t(scene->getRenderPasses()).size());
+	std::vector<std::atomic<float> >(4 * (size_t)resolution).swap(passPhotons);
 
-	if(bHashgrid) photonGrid.setParm(initialRadius*2.f, nPhotons, bBox);
+	if(bHashgrid) photonGrid.setParm(initialRadius*2.f, bBox);
 
 }
 
@@ -1351,6 +1466,7 @@ integrator_t* SPPM::factory(paraMap_t &params, renderEnvironment_t &render)
 {
 	bool transpShad=false;
 	bool pmIRE = false;
+	bool hashgrid = true;
 	int shadowDepth=5; //may used when integrate Direct Light
 	int raydepth=5;
 	int _passNum = 1000;
@@ -1377,6 +1493,7 @@ integrator_t* SPPM::factory(paraMap_t &params, renderEnvironment_t &render)
 	params.getParam("photonRadius", dsRad);
 	params.getParam("searchNum", searchNum);
 	params.getParam("pmIRE", pmIRE);
+	params.getParam("hashgrid", hashgrid);
 
 	params.getParam("bg_transp", bg_transp);
 	params.getParam("bg_transp_refract", bg_transp_refract);
@@ -1393,6 +1510,7 @@ integrator_t* SPPM::factory(paraMap_t &params, renderEnvironment_t &render)
 	ite->dsRadius = dsRad; // under tests enable now
 	ite->nSearch = searchNum;
 	ite->PM_IRE = pmIRE;
+	ite->bHashgrid = hashgrid;
 	// Background settings
 	ite->transpBackground = bg_transp;
 	ite->transpRefractedBackground = bg_transp_refract;
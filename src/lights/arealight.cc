@@ -68,6 +68,19 @@ void areaLight_t::init(scene_t &scene)
 
 color_t areaLight_t::totalEnergy() const { return color * area; }
 
+bool areaLight_t::emissionBound(lightBound_t &b) const
+{
+	b.bound.set(corner, corner);
+	b.bound.include(c2);
+	b.bound.include(c3);
+	b.bound.include(c4);
+	b.axis = normal;
+	b.cosThetaO = 1.f;
+	b.cosThetaE = 0.f; // lambertian, single sided
+	b.twoSided = false;
+	return true;
+}
+
 bool areaLight_t::illumSample(const surfacePoint_t &sp, lSample_t &s, ray_t &wi) const
 {
 	if( photonOnly() ) return false;
@@ -22,13 +22,24 @@
 #include <lights/bglight.h>
 #include <core_api/background.h>
 #include <core_api/texture.h>
+#include <core_api/scene.h>
 #include <utilities/sample_utils.h>
+#include <utilities/hashUtils.h>
+#include <utilities/threadUtils.h>
+#include <yafraycore/timer.h>
+#include <list>
+#include <mutex>
 
 __BEGIN_YAFRAY
 
 #define MAX_VSAMPLES 360
 #define MAX_USAMPLES 720
 #define MIN_SAMPLES 16
+// limits of the table for a background with a resolution, like an image
+#define MIN_RES_VSAMPLES 64
+#define MAX_RES_VSAMPLES 1024
+#define MAX_RES_USAMPLES 2048
+#define DISTRIBUTION_CACHE_MEMORY (32 << 20) //!< bytes of tables kept for later renders
 
 #define SMPL_OFF 0.4999f
 
@@ -52,6 +63,81 @@ inline float sinSample(float s)
 	return fSin(s * M_PI);
 }
 
+/*! The sampling tables of a background: a pdf over u for each of the nv rows
+	and one over the rows */
+struct bgDistribution_t
+{
+	bgDistribution_t(int rows): nv(rows), uDist(new pdf1D_t*[rows]()), vDist(nullptr) {}
+	~bgDistribution_t()
+	{
+		for(int i = 0; i < nv; i++) delete uDist[i];
+		delete[] uDist;
+		delete vDist;
+	}
+	//! memory of the table, func, cdf, guide and alias arrays take 5 values per step
+	size_t bytes() const
+	{
+		size_t steps = vDist ? vDist->count : 0;
+		for(int i = 0; i < nv; i++) if(uDist[i]) steps += uDist[i]->count;
+		return steps * 5 * sizeof(float) + nv * sizeof(pdf1D_t);
+	}
+	int nv;
+	pdf1D_t **uDist;
+	pdf1D_t *vDist;
+};
+
+/*! Tables of the latest backgrounds with a content key, most recent first. Renders of the
+	same background, like the frames of an animation or repeated previews, build them once.
+	The oldest tables leave when the cache goes over DISTRIBUTION_CACHE_MEMORY */
+static std::list<std::pair<uint64_t, std::shared_ptr<const bgDistribution_t> > > distributionCache;
+static size_t distributionCacheBytes = 0;
+static std::mutex distributionCacheMutex;
+
+//! adds a table in front of the cache and drops the oldest ones until it fits the memory limit
+static void cacheDistribution(uint64_t key, const std::shared_ptr<const bgDistribution_t> &d)
+{
+	std::lock_guard<std::mutex> lock(distributionCacheMutex);
+	distributionCache.push_front(std::make_pair(key, d));
+	distributionCacheBytes += d->bytes();
+	while(!distributionCache.empty() && distributionCacheBytes > DISTRIBUTION_CACHE_MEMORY)
+	{
+		distributionCacheBytes -= distributionCache.back().second->bytes();
+		distributionCache.pop_back();
+	}
+}
+
+//! fills the rows first, first+step... of the table, rows near the poles have fewer samples
+static void buildRows(const background_t *background, bgDistribution_t *d, int maxU, int first, int step, float *fv)
+{
+	std::vector<float> fu(maxU);
+	ray_t ray;
+	ray.from = point3d_t(0.f);
+	float inv = 1.f / (float)d->nv;
+	
+	for (int y = first; y < d->nv; y += step)
+	{
+		float fy = ((float)y + 0.5f) * inv;
+		
+		float sintheta = sinSample(fy);
+		
+		int nu = MIN_SAMPLES + (int)(sintheta * (maxU - MIN_SAMPLES));
+		float inu = 1.f / (float)nu;
+		
+		for(int x = 0; x < nu; x++)
+		{
+			float fx = ((float)x + 0.5f) * inu;
+			
+			invSpheremap(fx, fy, ray.dir);
+			
+			fu[x] = background->eval(ray, true).energy() * sintheta;
+		}
+		
+		d->uDist[y] = new pdf1D_t(&fu[0], nu);
+		
+		fv[y] = d->uDist[y]->integral;
+	}
+}
+
 bgLight_t::bgLight_t(int sampl, bool absIntersect, bool bLightEnabled, bool bCastShadows):
 light_t(LIGHT_NONE), samples(sampl), absInter(absIntersect)
 {
@@ -64,56 +150,73 @@ light_t(LIGHT_NONE), samples(sampl), absInter(absIntersect)
 
 bgLight_t::~bgLight_t()
 {
-	for(int i = 0; i < vDist->count; i++) delete uDist[i];
-	if(uDist) delete[] uDist;
+	// the tables go with the last light holding them, or when they leave the cache
 	uDist = nullptr;
-	if(vDist) delete vDist;
 	vDist = nullptr;
 }
 
+/*! The table follows the resolution of the background, within limits, so small details of
+	an image are not lost between the samples. The rows are shared out among the render
+	threads, and tables of backgrounds with a content key are cached */
 void bgLight_t::init(scene_t &scene)
 {
-	float *fu = new float[MAX_USAMPLES];
-	float *fv = new float[MAX_VSAMPLES];
-	float inu = 0, inv = 0;
-	float fx = 0.f, fy = 0.f;
-	float sintheta = 0.f;
-	int nu = 0, nv = MAX_VSAMPLES;
-	
-	ray_t ray;
-	ray.from = point3d_t(0.f);
+	int nu = 0, nv = 0;
+	background->resolution(nu, nv);
+	if(nu > 0 && nv > 0)
+	{
+		nu = std::max(MIN_SAMPLES, std::min(nu, MAX_RES_USAMPLES));
+		nv = std::max(MIN_RES_VSAMPLES, std::min(nv, MAX_RES_VSAMPLES));
+	}
+	else
+	{
+		nu = MAX_USAMPLES;
+		nv = MAX_VSAMPLES;
+	}
 	
-	inv = 1.f / (float)nv;
+	uint64_t key = background->contentKey();
+	if(key) key = hashValue(nv, hashValue(nu, key));
 	
-	uDist = new pdf1D_t*[nv];
+	distribution.reset();
+	if(key)
+	{
+		std::lock_guard<std::mutex> lock(distributionCacheMutex);
+		for(auto i = distributionCache.begin(); i != distributionCache.end(); ++i)
+		{
+			if(i->first != key) continue;
+			distribution = i->second;
+			distributionCache.splice(distributionCache.begin(), distributionCache, i);
+			Y_VERBOSE << "BgLight: reusing the " << nu << "x" << nv << " sampling table of the background" << yendl;
+			break;
+		}
+	}
 	
-	for (int y = 0; y < nv; y++)
+	if(!distribution)
 	{
-		fy = ((float)y + 0.5f) * inv;
+		timer_t buildTimer;
+		buildTimer.addEvent("build");
+		buildTimer.start("build");
 		
-		sintheta = sinSample(fy);
-		
-		nu = MIN_SAMPLES + (int)(sintheta * (MAX_USAMPLES - MIN_SAMPLES));
-		inu = 1.f / (float)nu;
-		
-		for(int x = 0; x < nu; x++)
+		bgDistribution_t *d = new bgDistribution_t(nv);
+		std::vector<float> fv(nv);
+		int threads = std::max(1, std::min(scene.getNumThreads(), nv));
+		// rows are interleaved, the rows near the equator take longest
+		if(threads <= 1) buildRows(background, d, nu, 0, 1, &fv[0]);
+		else
 		{
-			fx = ((float)x + 0.5f) * inu;
-			
-			invSpheremap(fx, fy, ray.dir);
-			
-			fu[x] = background->eval(ray, true).energy() * sintheta;
+			threadPool_t pool(threads);
+			pool.run([&](int threadID) { buildRows(background, d, nu, threadID, threads, &fv[0]); });
+			pool.wait();
 		}
+		d->vDist = new pdf1D_t(&fv[0], nv);
+		distribution.reset(d);
 		
-		uDist[y] = new pdf1D_t(fu, nu);
+		buildTimer.stop("build");
+		Y_VERBOSE << "BgLight: " << nu << "x" << nv << " sampling table built in " << buildTimer.getTime("build") << "s with " << threads << " threads" << yendl;
 		
-		fv[y] = uDist[y]->integral;
+		if(key) cacheDistribution(key, distribution);
 	}
-	
-	vDist = new pdf1D_t(fv, nv);
-	
-	delete[] fv;
-	delete[] fu;
+	uDist = distribution->uDist;
+	vDist = distribution->vDist;
 
 	bound_t w=scene.getSceneBound();
 	worldCenter = 0.5 * (w.a + w.g);
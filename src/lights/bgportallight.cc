@@ -25,53 +25,31 @@
 #include <core_api/environment.h>
 #include <utilities/sample_utils.h>
 #include <utilities/mcqmc.h>
-#include <yafraycore/kdtree.h>
+#include <yafraycore/bvh.h>
 
 __BEGIN_YAFRAY
 
 bgPortalLight_t::bgPortalLight_t(unsigned int msh, int sampl, float pow, bool bLightEnabled, bool bCastShadows):
-	objID(msh), samples(sampl), power(pow), tree(nullptr)
+	objID(msh), samples(sampl), power(pow), shape(nullptr)
 {
     lLightEnabled = bLightEnabled;
     lCastShadows = bCastShadows;
     mesh = nullptr;
 	aPdf = 0.f;
-	areaDist = nullptr;
-	tris = nullptr;
 }
 
 bgPortalLight_t::~bgPortalLight_t()
 {
-	if(areaDist) delete areaDist;
-	areaDist = nullptr;
-	if(tris) delete[] tris;
-	tris = nullptr;
-	if(tree)
-	{
-		delete tree;
-		tree = nullptr;
-	}
+	// the shape belongs to the scene
+	shape = nullptr;
 }
 
-void bgPortalLight_t::initIS()
+void bgPortalLight_t::initIS(const meshShape_t *meshShape)
 {
-	nTris = mesh->numPrimitives();
-	tris = new const triangle_t*[nTris];
-	mesh->getPrimitives(tris);
-	float *areas = new float[nTris];
-	double totalArea = 0.0;
-	for(int i=0; i<nTris; ++i)
-	{
-		areas[i] = tris[i]->surfaceArea();
-		totalArea += areas[i];
-	}
-	areaDist = new pdf1D_t(areas, nTris);
-	area = (float)totalArea;
-	invArea = (float)(1.0/totalArea);
-	//delete[] tris;
-	delete[] areas;
-	if(tree) delete tree;
-	tree = new triKdTree_t(tris, nTris, -1, 1, 0.8, 0.33);
+	shape = meshShape;
+	nTris = shape->nTris();
+	area = (float)shape->area;
+	invArea = (float)(1.0/shape->area);
 }
 
 void bgPortalLight_t::init(scene_t &scene)
@@ -83,33 +61,34 @@ void bgPortalLight_t::init(scene_t &scene)
 	
 	worldCenter = 0.5 * (w.a + w.g);
 	mesh = scene.getMesh(objID);
+	shape = nullptr;
+	nTris = 0;
 	if(mesh)
 	{	
-		mesh->setVisibility(false);
-
-		initIS();
+		initIS(scene.getMeshShape(objID));
 		Y_VERBOSE << "bgPortalLight: Triangles:" << nTris << ", Area:" << area << yendl;
+	}
+}
+
+void bgPortalLight_t::postInit(scene_t &scene)
+{
+	if(mesh)
+	{
+		mesh->setVisibility(false);
 		mesh->setLight(this);
 	}
 }
 
 void bgPortalLight_t::sampleSurface(point3d_t &p, vector3d_t &n, float s1, float s2) const
 {
-	float primPdf;
-	int primNum = areaDist->DSample(s1, &primPdf);
-	if(primNum >= areaDist->count)
+	float primPdf, ss1;
+	int primNum = shape->areaDist->DSample(s1, &primPdf, &ss1);
+	if(primNum >= shape->areaDist->count)
 	{
 		Y_WARNING << "bgPortalLight: Sampling error!" << yendl;
 		return;
 	}
-	float ss1, delta = areaDist->cdf[primNum+1];
-	if(primNum > 0)
-	{
-		delta -= areaDist->cdf[primNum];
-		ss1 = (s1 - areaDist->cdf[primNum]) / delta;
-	}
-	else ss1 = s1 / delta;
-	tris[primNum]->sample(ss1, s2, p, n);
+	shape->tris[primNum]->sample(ss1, s2, p, n);
 }
 
 color_t bgPortalLight_t::totalEnergy() const
@@ -123,8 +102,8 @@ color_t bgPortalLight_t::totalEnergy() const
 		col = bg->eval(wo, true);
 		for(int j=0; j<nTris; j++)
 		{
-			float cos_n = -wo.dir * tris[j]->getNormal(); //not 100% sure about sign yet...
-			if(cos_n > 0) energy += col*cos_n*tris[j]->surfaceArea();
+			float cos_n = -wo.dir * shape->tris[j]->getNormal(); //not 100% sure about sign yet...
+			if(cos_n > 0) energy += col*cos_n*shape->tris[j]->surfaceArea();
 		}
 	}
 
@@ -195,14 +174,14 @@ color_t bgPortalLight_t::emitSample(vector3d_t &wo, lSample_t &s) const
 
 bool bgPortalLight_t::intersect(const ray_t &ray, float &t, color_t &col, float &ipdf) const
 {
-	if(!tree) return false;
+	if(!canIntersect()) return false;
 	float dis;
 	intersectData_t bary;
 	triangle_t *hitt=0;
 	if(ray.tmax<0) dis=std::numeric_limits<float>::infinity();
 	else dis=ray.tmax;
 	// intersect with tree:
-	if( ! tree->Intersect(ray, dis, &hitt, t, bary) ){ return false; }
+	if( ! shape->tree->Intersect(ray, dis, &hitt, t, bary) ){ return false; }
 	
 	vector3d_t n = hitt->getNormal();
 	float cos_angle = ray.dir*(-n);
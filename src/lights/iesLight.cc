@@ -48,6 +48,7 @@ class iesLight_t : public light_t
 
 		virtual color_t emitSample(vector3d_t &wo, lSample_t &s) const;
 		virtual void emitPdf(const surfacePoint_t &sp, const vector3d_t &wo, float &areaPdf, float &dirPdf, float &cos_wo) const;
+		virtual bool emissionBound(lightBound_t &b) const;
 		
 		bool isIESOk(){ return IESOk; };
 
@@ -96,6 +97,16 @@ iesLight_t::iesLight_t(const point3d_t &from, const point3d_t &to, const color_t
 	}
 }
 
+bool iesLight_t::emissionBound(lightBound_t &b) const
+{
+	b.bound.set(position, position);
+	b.axis = dir;
+	b.cosThetaO = cosEnd; // no light beyond the largest vertical angle of the profile
+	b.cosThetaE = 1.f;
+	b.twoSided = false;
+	return true;
+}
+
 void iesLight_t::getAngles(float &u, float &v, const vector3d_t &dir, const float &costheta) const
 {
 	u = (dir.z >= 1.f) ? 0.f : radToDeg(fAcos(dir.z));
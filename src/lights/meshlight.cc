@@ -25,84 +25,91 @@
 #include <core_api/texture.h>
 #include <core_api/environment.h>
 #include <utilities/sample_utils.h>
-#include <yafraycore/kdtree.h>
+#include <yafraycore/bvh.h>
 
 __BEGIN_YAFRAY
 
 meshLight_t::meshLight_t(unsigned int msh, const color_t &col, int sampl, bool dbl_s, bool bLightEnabled, bool bCastShadows):
-	objID(msh), doubleSided(dbl_s), color(col), samples(sampl), tree(nullptr)
+	objID(msh), doubleSided(dbl_s), color(col), samples(sampl), shape(nullptr)
 {
 	lLightEnabled = bLightEnabled;
     lCastShadows = bCastShadows;
     mesh = nullptr;
-    areaDist = nullptr;
-    tris = nullptr;
 	//initIS();
 }
 
 meshLight_t::~meshLight_t()
 {
-	if(areaDist) delete areaDist;
-	areaDist = nullptr;
-	if(tris) delete[] tris;
-	tris = nullptr;
-	if(tree) delete tree;
-	tree = nullptr;
+	// the shape belongs to the scene
+	shape = nullptr;
 }
 
-void meshLight_t::initIS()
+void meshLight_t::initIS(const meshShape_t *meshShape)
 {
-	nTris = mesh->numPrimitives();
-	tris = new const triangle_t*[nTris];
-	mesh->getPrimitives(tris);
-	float *areas = new float[nTris];
-	double totalArea = 0.0;
+	shape = meshShape;
+	nTris = shape->nTris();
+	const std::vector<const triangle_t *> &tris = shape->tris;
+	vector3d_t nSum(0.f);
 	for(int i=0; i<nTris; ++i)
 	{
-		areas[i] = tris[i]->surfaceArea();
-		totalArea += areas[i];
+		nSum += tris[i]->getNormal() * tris[i]->surfaceArea();
+		if(i == 0) emitBound.bound = tris[i]->getBound();
+		else emitBound.bound = bound_t(emitBound.bound, tris[i]->getBound());
 	}
-	areaDist = new pdf1D_t(areas, nTris);
-	area = (float)totalArea;
-	invArea = (float)(1.0/totalArea);
-	delete[] areas;
-	if(tree) delete tree;
-	tree = new triKdTree_t(tris, nTris, -1, 1, 0.8, 0.33);
+	// the area weighted mean normal, and the widest angle of a triangle normal to it
+	emitBound.axis = nSum;
+	emitBound.cosThetaO = -1.f;
+	if(emitBound.axis.normLen() > 0.f)
+	{
+		emitBound.cosThetaO = 1.f;
+		for(int i=0; i<nTris; ++i) emitBound.cosThetaO = std::min(emitBound.cosThetaO, tris[i]->getNormal() * emitBound.axis);
+	}
+	else emitBound.axis = vector3d_t(0.f, 0.f, 1.f);
+	emitBound.cosThetaE = 0.f;
+	emitBound.twoSided = doubleSided;
+	area = (float)shape->area;
+	invArea = (float)(1.0/shape->area);
 }
 
 void meshLight_t::init(scene_t &scene)
 {
 	mesh = scene.getMesh(objID);
+	shape = nullptr;
+	nTris = 0;
 	if(mesh)
 	{
-		initIS();
-		// tell the mesh that a meshlight is associated with it (not sure if this is the best place though):
-		mesh->setLight(this);
+		initIS(scene.getMeshShape(objID));
 
 		Y_VERBOSE << "MeshLight: triangles:" << nTris << ", double sided:" << doubleSided << ", area:" << area << " color:" << color << yendl;
 	}
 }
 
+void meshLight_t::postInit(scene_t &scene)
+{
+	// tell the mesh that a meshlight is associated with it
+	if(mesh) mesh->setLight(this);
+}
+
 void meshLight_t::sampleSurface(point3d_t &p, vector3d_t &n, float s1, float s2) const
 {
-	float primPdf;
-	int primNum = areaDist->DSample(s1, &primPdf);
-	if(primNum >= areaDist->count)
+	float primPdf, ss1;
+	int primNum = shape->areaDist->DSample(s1, &primPdf, &ss1);
+	if(primNum >= shape->areaDist->count)
 	{
 		Y_WARNING << "MeshLight: Sampling error!" << yendl;
 		return;
 	}
-	float ss1, delta = areaDist->cdf[primNum+1];
-	if(primNum > 0)
-	{
-		delta -= areaDist->cdf[primNum];
-		ss1 = (s1 - areaDist->cdf[primNum]) / delta;
-	}
-	else ss1 = s1 / delta;
-	tris[primNum]->sample(ss1, s2, p, n);
+	shape->tris[primNum]->sample(ss1, s2, p, n);
 //	++stats[primNum];
 }
 
+bool meshLight_t::emissionBound(lightBound_t &b) const
+{
+	if(!mesh || nTris == 0) return false;
+	b = emitBound;
+	return true;
+}
+
 color_t meshLight_t::totalEnergy() const { return (doubleSided ? 2.f*color*area : color*area); }
 
 bool meshLight_t::illumSample(const surfacePoint_t &sp, lSample_t &s, ray_t &wi) const
@@ -187,14 +194,14 @@ color_t meshLight_t::emitSample(vector3d_t &wo, lSample_t &s) const
 
 bool meshLight_t::intersect(const ray_t &ray, float &t, color_t &col, float &ipdf) const
 {
-	if(!tree) return false;
+	if(!canIntersect()) return false;
 	float dis;
 	intersectData_t bary;
 	triangle_t *hitt=0;
 	if(ray.tmax<0) dis=std::numeric_limits<float>::infinity();
 	else dis=ray.tmax;
 	// intersect with tree:
-	if( ! tree->Intersect(ray, dis, &hitt, t, bary) ){ return false; }
+	if( ! shape->tree->Intersect(ray, dis, &hitt, t, bary) ){ return false; }
 	
 	vector3d_t n = hitt->getNormal();
 	float cos_angle = ray.dir*(-n);
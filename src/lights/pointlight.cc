@@ -36,6 +36,7 @@ class pointLight_t : public light_t
 	virtual bool illumSample(const surfacePoint_t &sp, lSample_t &s, ray_t &wi) const;
 	virtual bool illuminate(const surfacePoint_t &sp, color_t &col, ray_t &wi) const;
 	virtual void emitPdf(const surfacePoint_t &sp, const vector3d_t &wo, float &areaPdf, float &dirPdf, float &cos_wo) const;
+	virtual bool emissionBound(lightBound_t &b) const;
 	static light_t *factory(paraMap_t &params, renderEnvironment_t &render);
   protected:
 	point3d_t position;
@@ -52,6 +53,16 @@ pointLight_t::pointLight_t(const point3d_t &pos, const color_t &col, float inte,
 	intensity = color.energy();
 }
 
+bool pointLight_t::emissionBound(lightBound_t &b) const
+{
+	b.bound.set(position, position);
+	b.axis = vector3d_t(0.f, 0.f, 1.f);
+	b.cosThetaO = -1.f; // all directions
+	b.cosThetaE = 0.f;
+	b.twoSided = false;
+	return true;
+}
+
 bool pointLight_t::illuminate(const surfacePoint_t &sp, color_t &col, ray_t &wi) const
 {	
 	if( photonOnly() ) return false;
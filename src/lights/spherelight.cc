@@ -50,6 +50,7 @@ class sphereLight_t : public light_t
 		virtual bool intersect(const ray_t &ray, float &t, color_t &col, float &ipdf) const;
 		virtual float illumPdf(const surfacePoint_t &sp, const surfacePoint_t &sp_light) const;
 		virtual void emitPdf(const surfacePoint_t &sp, const vector3d_t &wo, float &areaPdf, float &dirPdf, float &cos_wo) const;
+		virtual bool emissionBound(lightBound_t &b) const;
 		virtual int nSamples() const { return samples; }
 		static light_t *factory(paraMap_t &params, renderEnvironment_t &render);
 	protected:
@@ -87,6 +88,16 @@ void sphereLight_t::init(scene_t &scene)
 
 color_t sphereLight_t::totalEnergy() const { return color * area /* * M_PI */; }
 
+bool sphereLight_t::emissionBound(lightBound_t &b) const
+{
+	b.bound.set(center - vector3d_t(radius), center + vector3d_t(radius));
+	b.axis = vector3d_t(0.f, 0.f, 1.f);
+	b.cosThetaO = -1.f; // the normals of a sphere point everywhere
+	b.cosThetaE = 0.f;
+	b.twoSided = false;
+	return true;
+}
+
 inline bool sphereIntersect(const ray_t &ray, const point3d_t &c, float R2, float &d1, float &d2)
 {
 	vector3d_t vf=ray.from-c;
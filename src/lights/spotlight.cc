@@ -39,6 +39,7 @@ class spotLight_t : public light_t
 		virtual void emitPdf(const surfacePoint_t &sp, const vector3d_t &wo, float &areaPdf, float &dirPdf, float &cos_wo) const;
 		virtual bool canIntersect() const{ return softShadows; }
 		virtual bool intersect(const ray_t &ray, float &t, color_t &col, float &ipdf) const;
+		virtual bool emissionBound(lightBound_t &b) const;
 		static light_t *factory(paraMap_t &params, renderEnvironment_t &render);
 		virtual int nSamples() const { return samples; };
 	protected:
@@ -105,6 +106,17 @@ spotLight_t::~spotLight_t()
 	if(pdf) delete pdf;
 }
 
+bool spotLight_t::emissionBound(lightBound_t &b) const
+{
+	b.bound.set(position, position);
+	b.axis = dir;
+	// full intensity within the inner cone, the falloff reaches out to the outer one
+	b.cosThetaO = cosStart;
+	b.cosThetaE = fCos(fAcos(cosEnd) - fAcos(cosStart));
+	b.twoSided = false;
+	return true;
+}
+
 color_t spotLight_t::totalEnergy() const
 {
 	return color * M_2PI * (1.f - 0.5f*(cosStart+cosEnd));
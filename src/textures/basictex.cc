@@ -95,7 +95,11 @@ textureClouds_t::~textureClouds_t()
 
 float textureClouds_t::getFloat(const point3d_t &p, mipMapParams_t * mmParams) const
 {
-	float v = turbulence(nGen, p, depth, size, hard);
+	return applyBias(turbulence(nGen, p, depth, size, hard));
+}
+
+float textureClouds_t::applyBias(float v) const
+{
 	if (bias) {
 		v *= v;
 		if (bias==1) return -v;	// !!!
@@ -109,6 +113,22 @@ colorA_t textureClouds_t::getColor(const point3d_t &p, mipMapParams_t * mmParams
 	else return applyColorAdjustments(color_ramp->get_color_interpolated(getFloat(p)));
 }
 
+void textureClouds_t::getColors(const point3d_t *p, colorA_t *out, int n) const
+{
+	float v[NOISE_BATCH_SIZE];
+	for(int first = 0; first < n; first += NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n - first);
+		turbulence(nGen, p + first, v, m, depth, size, hard);
+		for(int i = 0; i < m; ++i)
+		{
+			float f = applyBias(v[i]);
+			if(!color_ramp) out[first + i] = applyColorAdjustments(color1 + f*(color2 - color1));
+			else out[first + i] = applyColorAdjustments(color_ramp->get_color_interpolated(f));
+		}
+	}
+}
+
 texture_t *textureClouds_t::factory(paraMap_t &params,
 		renderEnvironment_t &render)
 {
@@ -531,6 +551,24 @@ colorA_t textureMusgrave_t::getColor(const point3d_t &p, mipMapParams_t * mmPara
 	else return applyColorAdjustments(color_ramp->get_color_interpolated(getFloat(p)));
 }
 
+void textureMusgrave_t::getColors(const point3d_t *p, colorA_t *out, int n) const
+{
+	point3d_t tp[NOISE_BATCH_SIZE];
+	float v[NOISE_BATCH_SIZE];
+	for(int first = 0; first < n; first += NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n - first);
+		for(int i = 0; i < m; ++i) tp[i] = p[first + i] * size;
+		mGen->evaluate(tp, v, m);
+		for(int i = 0; i < m; ++i)
+		{
+			float f = applyIntensityContrastAdjustments(iscale * v[i]);
+			if(!color_ramp) out[first + i] = applyColorAdjustments(color1 + f*(color2 - color1));
+			else out[first + i] = applyColorAdjustments(color_ramp->get_color_interpolated(f));
+		}
+	}
+}
+
 texture_t *textureMusgrave_t::factory(paraMap_t &params, renderEnvironment_t &render)
 {
 	color_t col1(0.0), col2(1.0);
@@ -23,8 +23,10 @@
 #include <cctype>
 #include <sstream>
 #include <iomanip>
+#include <sys/stat.h>
 #include <textures/imagetex.h>
 #include <utilities/stringUtils.h>
+#include <utilities/hashUtils.h>
 
 __BEGIN_YAFRAY
 
@@ -724,6 +726,15 @@ texture_t *textureImage_t::factory(paraMap_t &params, renderEnvironment_t &rende
 	tex->ewa_max_anisotropy = ewa_max_anisotropy;
 
 	if(intp == INTP_MIPMAP_EWA) tex->generateEWALookupTable();
+
+	// the same file with the same parameters gives the same texture, unless the file was changed since
+	struct stat fileStat;
+	if(stat(name->c_str(), &fileStat) == 0)
+	{
+		uint64_t h = hashValue((int64_t)fileStat.st_mtime);
+		h = hashValue((int64_t)fileStat.st_size, h);
+		tex->content_key = params.hash(h);
+	}
 	
 	return tex;
 }
@@ -1,4 +1,5 @@
 #include <textures/noise.h>
+#include <algorithm>
 
 __BEGIN_YAFRAY
 
@@ -182,6 +183,44 @@ float newPerlin_t::operator() (const point3d_t &pt) const
 	return (0.5 + 0.5*nv);
 }
 
+void newPerlin_t::evaluate(const point3d_t *pts, float *out, int n) const
+{
+	float x[NOISE_BATCH_SIZE], y[NOISE_BATCH_SIZE], z[NOISE_BATCH_SIZE];
+	int h[8][NOISE_BATCH_SIZE];
+	for (int first=0; first<n; first+=NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n-first);
+		// the table lookups: unit cube and hashes of its 8 corners
+		for (int i=0; i<m; ++i)
+		{
+			const point3d_t &pt = pts[first+i];
+			float u=floor(pt.x), v=floor(pt.y), w=floor(pt.z);
+			int X=((int)u) & 255, Y=((int)v) & 255, Z=((int)w) & 255;
+			x[i] = pt.x-u;
+			y[i] = pt.y-v;
+			z[i] = pt.z-w;
+			int A=hash[X  ]+Y, AA=hash[A]+Z, AB=hash[A+1]+Z,
+			    B=hash[X+1]+Y, BA=hash[B]+Z, BB=hash[B+1]+Z;
+			h[0][i]=hash[AA  ]; h[1][i]=hash[BA  ]; h[2][i]=hash[AB  ]; h[3][i]=hash[BB  ];
+			h[4][i]=hash[AA+1]; h[5][i]=hash[BA+1]; h[6][i]=hash[AB+1]; h[7][i]=hash[BB+1];
+		}
+		// fade curves and blending, only arithmetic left so it vectorizes over the points
+		for (int i=0; i<m; ++i)
+		{
+			float u=fade(x[i]), v=fade(y[i]), w=fade(z[i]);
+			float nv = lerp(w, lerp(v, lerp(u, grad(h[0][i], x[i]  , y[i]  , z[i]  ),
+												grad(h[1][i], x[i]-1, y[i]  , z[i]  )),
+										lerp(u, grad(h[2][i], x[i]  , y[i]-1, z[i]  ),
+												grad(h[3][i], x[i]-1, y[i]-1, z[i]  ))),
+								lerp(v, lerp(u, grad(h[4][i], x[i]  , y[i]  , z[i]-1),
+												grad(h[5][i], x[i]-1, y[i]  , z[i]-1)),
+										lerp(u, grad(h[6][i], x[i]  , y[i]-1, z[i]-1),
+												grad(h[7][i], x[i]-1, y[i]-1, z[i]-1))));
+			out[first+i] = 0.5f + 0.5f*nv;
+		}
+	}
+}
+
 //------------------------------------------------------------------------------------
 // Standard (old) Perlin noise
 
@@ -456,40 +495,120 @@ float blenderNoise_t::operator() (const point3d_t &pt) const
 	return n;
 }
 
+void blenderNoise_t::evaluate(const point3d_t *pts, float *out, int n) const
+{
+	float o[3][NOISE_BATCH_SIZE];
+	float g[8][3][NOISE_BATCH_SIZE]; // gradients at the corners, corner bits are x,y,z from high to low
+	for (int first=0; first<n; first+=NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n-first);
+		// the table lookups: fractions and gradients of the 8 corners
+		for (int i=0; i<m; ++i)
+		{
+			const point3d_t &pt = pts[first+i];
+			int ix, iy, iz;
+			o[0][i]= (pt.x- (ix= (int)floor(pt.x)) );
+			o[1][i]= (pt.y- (iy= (int)floor(pt.y)) );
+			o[2][i]= (pt.z- (iz= (int)floor(pt.z)) );
+			int b[4];
+			b[0]= hash[ hash[ix & 255]+(iy & 255)];
+			b[1]= hash[ hash[ix & 255]+((iy+1) & 255)];
+			b[2]= hash[ hash[(ix+1) & 255]+(iy & 255)];
+			b[3]= hash[ hash[(ix+1) & 255]+((iy+1) & 255)];
+			for (int c=0; c<8; ++c)
+			{
+				const float *hv = hashvectf + 3*hash[((iz + (c&1)) & 255) + b[c>>1]];
+				g[c][0][i] = hv[0]; g[c][1][i] = hv[1]; g[c][2][i] = hv[2];
+			}
+		}
+		// weights and dot products, only arithmetic left so it vectorizes over the points
+		for (int i=0; i<m; ++i)
+		{
+			float ox=o[0][i], oy=o[1][i], oz=o[2][i];
+			float jx=ox-1, jy=oy-1, jz=oz-1;
+			float cn1= 1.f-3.f*ox*ox+2.f*ox*ox*ox;
+			float cn2= 1.f-3.f*oy*oy+2.f*oy*oy*oy;
+			float cn3= 1.f-3.f*oz*oz+2.f*oz*oz*oz;
+			float cn4= 1.f-3.f*jx*jx-2.f*jx*jx*jx;
+			float cn5= 1.f-3.f*jy*jy-2.f*jy*jy*jy;
+			float cn6= 1.f-3.f*jz*jz-2.f*jz*jz*jz;
+			float nv = 0.5f;
+			nv += cn1*cn2*cn3*(g[0][0][i]*ox+g[0][1][i]*oy+g[0][2][i]*oz);
+			nv += cn1*cn2*cn6*(g[1][0][i]*ox+g[1][1][i]*oy+g[1][2][i]*jz);
+			nv += cn1*cn5*cn3*(g[2][0][i]*ox+g[2][1][i]*jy+g[2][2][i]*oz);
+			nv += cn1*cn5*cn6*(g[3][0][i]*ox+g[3][1][i]*jy+g[3][2][i]*jz);
+			nv += cn4*cn2*cn3*(g[4][0][i]*jx+g[4][1][i]*oy+g[4][2][i]*oz);
+			nv += cn4*cn2*cn6*(g[5][0][i]*jx+g[5][1][i]*oy+g[5][2][i]*jz);
+			nv += cn4*cn5*cn3*(g[6][0][i]*jx+g[6][1][i]*jy+g[6][2][i]*oz);
+			nv += cn4*cn5*cn6*(g[7][0][i]*jx+g[7][1][i]*jy+g[7][2][i]*jz);
+			out[first+i] = std::min(1.f, std::max(0.f, nv));
+		}
+	}
+}
+
 //------------------------------------------------------------------------------------
 // Voronoi/Worley/Celullar basis
 
+// same search as voronoi_t::getFeatures, but only the distances and with the metric inlined
+template<distMetricFunc dist> static void featureDistances(const point3d_t &pt, float e, float da[4])
+{
+	float x=pt.x, y=pt.y, z=pt.z;
+	int xi = (int)(floor(x));
+	int yi = (int)(floor(y));
+	int zi = (int)(floor(z));
+	da[0] = da[1] = da[2] = da[3] = 1e10f;
+	for (int xx=xi-1;xx<=xi+1;xx++) {
+		for (int yy=yi-1;yy<=yi+1;yy++) {
+			for (int zz=zi-1;zz<=zi+1;zz++) {
+				const float *p = HASHPNT(xx, yy, zz);
+				float d = dist(x - (p[0] + xx), y - (p[1] + yy), z - (p[2] + zz), e);
+				if (d<da[0]) { da[3]=da[2];  da[2]=da[1];  da[1]=da[0];  da[0]=d; }
+				else if (d<da[1]) { da[3]=da[2];  da[2]=da[1];  da[1]=d; }
+				else if (d<da[2]) { da[3]=da[2];  da[2]=d; }
+				else if (d<da[3]) da[3]=d;
+			}
+		}
+	}
+}
+
 void voronoi_t::setDistM(dMetricType dm)
 {
 	switch(dm) {
 		case DIST_SQUARED:
 			//distfunc = new dist_Squared();
 			distfunc2 = dist_SquaredF;
+			featureDists = featureDistances<dist_SquaredF>;
 			break;
 		case DIST_MANHATTAN:
 			//distfunc = new dist_Squared();
 			distfunc2 = dist_SquaredF;
+			featureDists = featureDistances<dist_SquaredF>;
 			break;
 		case DIST_CHEBYCHEV:
 			//distfunc = new dist_Chebychev();
 			distfunc2 = dist_ChebychevF;
+			featureDists = featureDistances<dist_ChebychevF>;
 			break;
 		case DIST_MINKOVSKY_HALF:
 			//distfunc = new dist_MinkovskyH();
 			distfunc2 = dist_MinkovskyHF;
+			featureDists = featureDistances<dist_MinkovskyHF>;
 			break;
 		case DIST_MINKOVSKY_FOUR:
 			//distfunc = new dist_Minkovsky4();
 			distfunc2 = dist_Minkovsky4F;
+			featureDists = featureDistances<dist_Minkovsky4F>;
 			break;
 		case DIST_MINKOVSKY:
 			//distfunc = new dist_Minkovsky();
 			distfunc2 = dist_MinkovskyF;
+			featureDists = featureDistances<dist_MinkovskyF>;
 			break;
 		default:
 		case DIST_REAL:
 			//distfunc = new dist_Real();
 			distfunc2 = dist_RealF;
+			featureDists = featureDistances<dist_RealF>;
 			break;
 	}
 }
@@ -543,11 +662,8 @@ void voronoi_t::getFeatures(const point3d_t &pt, float da[4], point3d_t pa[4]) c
 	}
 }
 
-float voronoi_t::operator() (const point3d_t &pt) const
+float voronoi_t::featureValue(const float da[4]) const
 {
-	float da[4];
-	point3d_t pa[4];
-	getFeatures(pt, da, pa);
 	switch (vType) {
 		case V_F2:
 			return da[1];
@@ -567,6 +683,22 @@ float voronoi_t::operator() (const point3d_t &pt) const
 	}
 }
 
+float voronoi_t::operator() (const point3d_t &pt) const
+{
+	float da[4];
+	featureDists(pt, mk_exp, da);
+	return featureValue(da);
+}
+
+void voronoi_t::evaluate(const point3d_t *pts, float *out, int n) const
+{
+	float da[4];
+	for (int i=0; i<n; ++i) {
+		featureDists(pts[i], mk_exp, da);
+		out[i] = featureValue(da);
+	}
+}
+
 // Cell noise
 float cellNoise_t::operator() (const point3d_t &pt) const
 {
@@ -607,6 +739,32 @@ float fBm_t::operator() (const point3d_t &pt) const
 	return value;
 }
 
+// the octave loop is outside, so each octave is one batch call to the noise generator
+void fBm_t::evaluate(const point3d_t *pts, float *out, int n) const
+{
+	const float pwHL = fPow(lacunarity, -H);
+	const float rmd = octaves - floor(octaves);
+	const int octs = (int)octaves + ((rmd!=0.f) ? 1 : 0);
+	point3d_t tp[NOISE_BATCH_SIZE];
+	float noise[NOISE_BATCH_SIZE];
+	for (int first=0; first<n; first+=NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n-first);
+		float *value = out+first;
+		for (int i=0; i<m; ++i) { value[i] = 0.f; tp[i] = pts[first+i]; }
+		float pwr = 1;
+		for (int o=0; o<octs; ++o) {
+			nGen->evaluate(tp, noise, m);
+			const float amp = (o<(int)octaves) ? pwr : rmd*pwr;
+			for (int i=0; i<m; ++i) {
+				value[i] += ((float)2.0*noise[i] - (float)1.0) * amp;
+				tp[i] *= lacunarity;
+			}
+			pwr *= pwHL;
+		}
+	}
+}
+
 
 /*
  * Procedural multifractal evaluated at "point";
@@ -741,6 +899,37 @@ float ridgedMFractal_t::operator() (const point3d_t &pt) const
 
 }
 
+// the octave loop is outside, so each octave is one batch call to the noise generator
+void ridgedMFractal_t::evaluate(const point3d_t *pts, float *out, int n) const
+{
+	const float pwHL = fPow(lacunarity, -H);
+	point3d_t tp[NOISE_BATCH_SIZE];
+	float noise[NOISE_BATCH_SIZE], signal[NOISE_BATCH_SIZE];
+	for (int first=0; first<n; first+=NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n-first);
+		float *result = out+first;
+		for (int i=0; i<m; ++i) tp[i] = pts[first+i];
+		nGen->evaluate(tp, noise, m);
+		for (int i=0; i<m; ++i) {
+			float s = offset - std::fabs((float)2.0*noise[i] - (float)1.0);
+			signal[i] = result[i] = s*s;
+		}
+		float pwr = pwHL;
+		for (int o=1; o<(int)octaves; ++o) {
+			for (int i=0; i<m; ++i) tp[i] *= lacunarity;
+			nGen->evaluate(tp, noise, m);
+			for (int i=0; i<m; ++i) {
+				float weight = std::min((float)1.0, std::max((float)0.0, signal[i] * gain));
+				float s = offset - std::fabs((float)2.0*noise[i] - (float)1.0);
+				signal[i] = s*s*weight;
+				result[i] += signal[i] * pwr;
+			}
+			pwr *= pwHL;
+		}
+	}
+}
+
 //------------------------------------------------------------------------------------
 
 
@@ -768,4 +957,27 @@ float turbulence(const noiseGenerator_t* ngen, const point3d_t &pt, int oct, flo
 	return sum*((float)(1<<oct)/(float)((1<<(oct+1))-1));
 }
 
+void turbulence(const noiseGenerator_t* ngen, const point3d_t *pts, float *out, int n, int oct, float size, bool hard)
+{
+	const float norm = (float)(1<<oct)/(float)((1<<(oct+1))-1);
+	point3d_t tp[NOISE_BATCH_SIZE];
+	float val[NOISE_BATCH_SIZE];
+	for (int first=0; first<n; first+=NOISE_BATCH_SIZE)
+	{
+		const int m = std::min(NOISE_BATCH_SIZE, n-first);
+		float *sum = out+first;
+		for (int i=0; i<m; ++i) { sum[i] = 0.f; tp[i] = ngen->offset(pts[first+i])*size; }
+		float amp = 1;
+		for (int o=0; o<=oct; o++, amp*=0.5) {
+			ngen->evaluate(tp, val, m);
+			for (int i=0; i<m; ++i) {
+				float v = hard ? std::fabs(2.f*val[i]-1.f) : val[i];
+				sum[i] += amp*v;
+				tp[i] *= 2.0;
+			}
+		}
+		for (int i=0; i<m; ++i) sum[i] *= norm;
+	}
+}
+
 __END_YAFRAY
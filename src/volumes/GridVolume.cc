@@ -8,31 +8,29 @@
 #include <core_api/texture.h>
 #include <core_api/environment.h>
 #include <utilities/mcqmc.h>
+#include <utilities/hashUtils.h>
 
 #include <fstream>
 #include <cstdlib>
+#include <vector>
+#include <limits>
 
 __BEGIN_YAFRAY
 
 struct renderState_t;
 struct pSample_t;
 
+#define GRID_BRICK_SIZE 8 //!< voxels along each side of the bricks of the macro grid
+
 class GridVolume : public DensityVolume {
 	public:
 	
-		GridVolume(color_t sa, color_t ss, color_t le, float gg, point3d_t pmin, point3d_t pmax)
+		GridVolume(color_t sa, color_t ss, color_t le, float gg, point3d_t pmin, point3d_t pmax, int attgridScale,
+					const std::string &fileName, bool ratioTracking):
+			DensityVolume(sa, ss, le, gg, pmin, pmax, attgridScale), ratioTracking(ratioTracking)
 		{
-			bBox = bound_t(pmin, pmax);
-			s_a = sa;
-			s_s = ss;
-			l_e = le;
-			g = gg;
-			haveS_a = (s_a.energy() > 1e-4f);
-			haveS_s = (s_s.energy() > 1e-4f);
-			haveL_e = (l_e.energy() > 1e-4f);
-			
 			std::ifstream inputStream;
- 			inputStream.open("/home/public/3dkram/cloud2_3.df3");
+ 			inputStream.open(fileName.c_str(), std::ios::binary);
  			if(!inputStream) Y_ERROR << "GridVolume: Error opening input stream" << yendl;
 
 			inputStream.seekg(0, std::ios_base::beg);
@@ -51,71 +49,174 @@ class GridVolume : public DensityVolume {
 				dim[i] = (((unsigned short)i0 << 8) | (unsigned short)i1);
 			}
 			
-			int sizePerVoxel = fileSize / (dim[0] * dim[1] * dim[2]);
+			int sizePerVoxel = fileSize / std::max(1, dim[0] * dim[1] * dim[2]);
 
 			Y_VERBOSE << "GridVolume: " <<  dim[0] <<  " " << dim[1] <<  " " << dim[2] << " " << fileSize << " " << sizePerVoxel << yendl;
 
-			sizeX = dim[0];
-			sizeY = dim[1];
-			sizeZ = dim[2];
+			sizeX = std::max(1, dim[0]);
+			sizeY = std::max(1, dim[1]);
+			sizeZ = std::max(1, dim[2]);
 
-			/*
-			sizeX = 60;
-			sizeY = 60;
-			sizeZ = 60;
-			*/
-			
-			grid = (float***)malloc(sizeX * sizeof(float));
-			for (int x = 0; x < sizeX; ++x) {
-				grid[x] = (float**)malloc(sizeY * sizeof(float));
-				for (int y = 0; y < sizeY; ++y) {
-					grid[x][y] = (float*)malloc(sizeZ * sizeof(float));
-				}
-			}
+			// df3 stores x fastest, then y, then z: the order of the grid
+			grid.assign((size_t)sizeX * sizeY * sizeZ, 0.f);
+			std::vector<unsigned char> voxels(grid.size(), 0);
+			inputStream.read((char*)&voxels[0], voxels.size());
+			for (size_t i = 0; i < grid.size(); ++i) grid[i] = voxels[i] / 255.f;
+			// the file can change under the same name, so the key follows the voxels
+			content_key = hashValue(sizeX, hashValue(sizeY, hashValue(sizeZ)));
+			content_key = hashBytes(&voxels[0], voxels.size(), content_key);
 
-			for (int z = 0; z < sizeZ; ++z) {
-				for (int y = 0; y < sizeY; ++y) {
-					for (int x = 0; x < sizeX; ++x) {
-						int voxel = 0;
-						inputStream.read( (char*)&voxel, 1 );
-						grid[x][y][z] = voxel / 255.f;
-						/*
-						float r = sizeX / 2.f;
-						float r2 = r*r;
-						float dist = sqrt((x-r)*(x-r) + (y-r)*(y-r) + (z-r)*(z-r));
-						grid[x][y][z] = (dist < r) ? 1.f-dist/r : 0.0f;
-						*/
-					}
-				}
-			}
-			
-			Y_VERBOSE << "GridVolume: Vol.[" << s_a << ", " << s_s << ", " << l_e << "]" << yendl;
-		}
-		
-		~GridVolume() {
-			Y_VERBOSE << "GridVolume: Freeing grid data" << yendl;
-			
-			for (int x = 0; x < sizeX; ++x) {
-				for (int y = 0; y < sizeY; ++y) {
-					free(grid[x][y]);	
-				}
-				free(grid[x]);
-			}
-			free(grid);
+			buildMacroGrid();
+
+			Y_VERBOSE << "GridVolume: Vol.[" << s_a << ", " << s_s << ", " << l_e << "], " << bricksX << "x" << bricksY << "x" << bricksZ
+				<< " bricks, " << emptyBricks << " empty, " << (ratioTracking ? "ratio tracking" : "ray marching") << yendl;
 		}
 		
 		virtual float Density(point3d_t p);
+
+		/*! Same samples as DensityVolume::tau, but bricks without density are skipped. With ratio
+			tracking, the transmittance is estimated without bias using the brick maxima as majorants
+			and the optical thickness of that estimate is returned */
+		virtual color_t tau(const ray_t &ray, float stepSize, float offset);
 				
 		static VolumeRegion* factory(paraMap_t &params, renderEnvironment_t &render);
 	
 	protected:
-		float*** grid;
+		float voxel(int x, int y, int z) const { return grid[x + sizeX * (y + (size_t)sizeY * z)]; }
+		void buildMacroGrid();
+		/*! visits the bricks along the ray from t0 to t1 in order, calling visit(brick, tEnter, tExit)
+			with the index of the brick in brickMax */
+		template<class F> void walkBricks(const ray_t &ray, float t0, float t1, F visit) const;
+
+		std::vector<float> grid; //!< densities of the voxels, x varying fastest
 		int sizeX, sizeY, sizeZ;
+		/*! highest density that the trilinear lookup can return in each brick, so it also
+			covers the voxels next to the brick */
+		std::vector<float> brickMax;
+		int bricksX, bricksY, bricksZ;
+		int emptyBricks;
+		bool ratioTracking;
 };
 
 inline float min(float a, float b) { return (a > b) ? b : a; }
 inline float max(float a, float b) { return (a < b) ? b : a; }
 
+void GridVolume::buildMacroGrid()
+{
+	bricksX = (sizeX + GRID_BRICK_SIZE - 1) / GRID_BRICK_SIZE;
+	bricksY = (sizeY + GRID_BRICK_SIZE - 1) / GRID_BRICK_SIZE;
+	bricksZ = (sizeZ + GRID_BRICK_SIZE - 1) / GRID_BRICK_SIZE;
+	brickMax.assign((size_t)bricksX * bricksY * bricksZ, 0.f);
+	emptyBricks = 0;
+	for (int bz = 0; bz < bricksZ; ++bz) {
+		for (int by = 0; by < bricksY; ++by) {
+			for (int bx = 0; bx < bricksX; ++bx) {
+				float m = 0.f;
+				// one voxel more on each side, the lookups near the border interpolate with them
+				for (int z = std::max(0, bz * GRID_BRICK_SIZE - 1); z <= std::min(sizeZ - 1, (bz + 1) * GRID_BRICK_SIZE); ++z)
+					for (int y = std::max(0, by * GRID_BRICK_SIZE - 1); y <= std::min(sizeY - 1, (by + 1) * GRID_BRICK_SIZE); ++y)
+						for (int x = std::max(0, bx * GRID_BRICK_SIZE - 1); x <= std::min(sizeX - 1, (bx + 1) * GRID_BRICK_SIZE); ++x)
+							m = max(m, voxel(x, y, z));
+				brickMax[bx + bricksX * (by + bricksY * bz)] = m;
+				if (m <= 0.f) ++emptyBricks;
+			}
+		}
+	}
+}
+
+template<class F> void GridVolume::walkBricks(const ray_t &ray, float t0, float t1, F visit) const
+{
+	const int nBricks[3] = { bricksX, bricksY, bricksZ };
+	const int nVoxels[3] = { sizeX, sizeY, sizeZ };
+	point3d_t p = ray.from + t0 * ray.dir;
+	int cell[3], step[3];
+	float tNext[3], tDelta[3];
+	for (int k = 0; k < 3; ++k) {
+		float brickSize = (bBox.g[k] - bBox.a[k]) / nVoxels[k] * GRID_BRICK_SIZE;
+		cell[k] = (brickSize > 0.f) ? (int)std::floor((p[k] - bBox.a[k]) / brickSize) : 0;
+		cell[k] = std::max(0, std::min(nBricks[k] - 1, cell[k]));
+		if (ray.dir[k] > 0.f) {
+			step[k] = 1;
+			tNext[k] = t0 + (bBox.a[k] + (cell[k] + 1) * brickSize - p[k]) / ray.dir[k];
+			tDelta[k] = brickSize / ray.dir[k];
+		}
+		else if (ray.dir[k] < 0.f) {
+			step[k] = -1;
+			tNext[k] = t0 + (bBox.a[k] + cell[k] * brickSize - p[k]) / ray.dir[k];
+			tDelta[k] = -brickSize / ray.dir[k];
+		}
+		else {
+			step[k] = 0;
+			tNext[k] = std::numeric_limits<float>::infinity();
+			tDelta[k] = 0.f;
+		}
+	}
+
+	float t = t0;
+	while (t < t1) {
+		int k = (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2);
+		float tExit = std::min(std::max(tNext[k], t), t1);
+		visit(cell[0] + bricksX * (cell[1] + bricksY * cell[2]), t, tExit);
+		t = tExit;
+		cell[k] += step[k];
+		if (cell[k] < 0 || cell[k] >= nBricks[k]) break;
+		tNext[k] += tDelta[k];
+	}
+}
+
+color_t GridVolume::tau(const ray_t &ray, float stepSize, float offset)
+{
+	float t0 = -1, t1 = -1;
+	
+	// ray doesn't hit the BB
+	if (!intersect(ray, t0, t1)) return color_t(0.f);
+	
+	if (ray.tmax < t0 && ! (ray.tmax < 0)) return color_t(0.f);
+	
+	if (ray.tmax < t1 && ! (ray.tmax < 0)) t1 = ray.tmax;
+	
+	if (t0 < 0.f) t0 = 0.f;
+
+	// ratio tracking needs random numbers of its own for each ray, without them the samples
+	// would fall in the same places along every ray, so those rays are marched
+	if (ratioTracking && offset > 0.f) {
+		color_t sigma(0.f);
+		if (haveS_a) sigma += s_a;
+		if (haveS_s) sigma += s_s;
+		float sigmaE = sigma.energy();
+		random_t prng((unsigned int)(offset * 4294967295.0) ^ 0x9e3779b9u);
+		float Tr = 1.f;
+		walkBricks(ray, t0, t1, [&](int brick, float tEnter, float tExit) {
+			float majorant = sigmaE * brickMax[brick];
+			if (majorant <= 0.f || Tr <= 0.f) return;
+			float t = tEnter;
+			while (true) {
+				t -= std::log(1.f - (float)prng()) / majorant;
+				if (t >= tExit) break;
+				Tr *= 1.f - min(1.f, sigma_t(ray.from + ray.dir * t, ray.dir).energy() / majorant);
+			}
+		});
+		return color_t((Tr > 0.f) ? -std::log(Tr) : 1e10f);
+	}
+
+	// callers without a step length of their own, like the emission integrator, march one voxel at a time
+	if (stepSize <= 0.f) stepSize = std::min(bBox.longX() / sizeX, std::min(bBox.longY() / sizeY, bBox.longZ() / sizeZ));
+	if (!(stepSize > 0.f)) return color_t(0.f);
+
+	float pos = t0 + offset * stepSize;
+	color_t tauVal(0.f);
+	walkBricks(ray, t0, t1, [&](int brick, float tEnter, float tExit) {
+		if (pos >= tExit) return;
+		// the samples in an empty brick would all be 0, move on to the first one after it
+		if (brickMax[brick] <= 0.f) pos += std::ceil((tExit - pos) / stepSize) * stepSize;
+		else while (pos < tExit) {
+			tauVal += sigma_t(ray.from + (ray.dir * pos), ray.dir) * stepSize;
+			pos += stepSize;
+		}
+	});
+	
+	return tauVal;
+}
 
 float GridVolume::Density(const point3d_t p) {
 	float x = (p.x - bBox.a.x) / bBox.longX() * sizeX - .5f;
@@ -134,10 +235,16 @@ float GridVolume::Density(const point3d_t p) {
 	float yd = y - y0;
 	float zd = z - z0;
 	
-	float i1 = grid[x0][y0][z0] * (1-zd) + grid[x0][y0][z1] * zd;
-	float i2 = grid[x0][y1][z0] * (1-zd) + grid[x0][y1][z1] * zd;
-	float j1 = grid[x1][y0][z0] * (1-zd) + grid[x1][y0][z1] * zd;
-	float j2 = grid[x1][y1][z0] * (1-zd) + grid[x1][y1][z1] * zd;
+	// the corners of the cell, with x0 and x1 next to each other in memory
+	const float *c00 = &grid[sizeX * (y0 + (size_t)sizeY * z0)];
+	const float *c01 = &grid[sizeX * (y0 + (size_t)sizeY * z1)];
+	const float *c10 = &grid[sizeX * (y1 + (size_t)sizeY * z0)];
+	const float *c11 = &grid[sizeX * (y1 + (size_t)sizeY * z1)];
+
+	float i1 = c00[x0] * (1-zd) + c01[x0] * zd;
+	float i2 = c10[x0] * (1-zd) + c11[x0] * zd;
+	float j1 = c00[x1] * (1-zd) + c01[x1] * zd;
+	float j2 = c10[x1] * (1-zd) + c11[x1] * zd;
 	
 	float w1 = i1 * (1 - yd) + i2 * yd;
 	float w2 = j1 * (1 - yd) + j2 * yd;
@@ -154,6 +261,9 @@ VolumeRegion* GridVolume::factory(paraMap_t &params,renderEnvironment_t &render)
 	float g = .0f;
 	float min[] = {0, 0, 0};
 	float max[] = {0, 0, 0};
+	int attSc = 1;
+	std::string fileName = "/home/public/3dkram/cloud2_3.df3";
+	bool ratioTracking = false;
 	params.getParam("sigma_s", ss);
 	params.getParam("sigma_a", sa);
 	params.getParam("l_e", le);
@@ -164,9 +274,12 @@ VolumeRegion* GridVolume::factory(paraMap_t &params,renderEnvironment_t &render)
 	params.getParam("maxX", max[0]);
 	params.getParam("maxY", max[1]);
 	params.getParam("maxZ", max[2]);
+	params.getParam("attgridScale", attSc);
+	params.getParam("density_file", fileName); // df3 density grid
+	params.getParam("ratio_tracking", ratioTracking); // unbiased transmittance instead of ray marching
 	
 	GridVolume *vol = new GridVolume(color_t(sa), color_t(ss), color_t(le), g,
-						point3d_t(min[0], min[1], min[2]), point3d_t(max[0], max[1], max[2]));
+						point3d_t(min[0], min[1], min[2]), point3d_t(max[0], max[1], max[2]), attSc, fileName, ratioTracking);
 	return vol;
 }
 
@@ -17,6 +17,8 @@ __BEGIN_YAFRAY
 struct renderState_t;
 struct pSample_t;
 
+#define NOISE_VOLUME_BATCH 64 //!< ray march samples whose densities are looked up together
+
 class NoiseVolume : public DensityVolume {
 	public:
 	
@@ -30,6 +32,10 @@ class NoiseVolume : public DensityVolume {
 		}
 		
 		virtual float Density(point3d_t p);
+
+		/*! Same samples as DensityVolume::tau, but the noise texture is evaluated for
+			NOISE_VOLUME_BATCH samples at a time */
+		virtual color_t tau(const ray_t &ray, float stepSize, float offset);
 				
 		static VolumeRegion* factory(paraMap_t &params, renderEnvironment_t &render);
 	
@@ -50,6 +56,46 @@ float NoiseVolume::Density(const point3d_t p) {
 	return d;
 }
 
+color_t NoiseVolume::tau(const ray_t &ray, float stepSize, float offset)
+{
+	float t0 = -1, t1 = -1;
+	
+	// ray doesn't hit the BB
+	if (!intersect(ray, t0, t1)) return color_t(0.f);
+	
+	if (ray.tmax < t0 && ! (ray.tmax < 0)) return color_t(0.f);
+	
+	if (ray.tmax < t1 && ! (ray.tmax < 0)) t1 = ray.tmax;
+	
+	if (t0 < 0.f) t0 = 0.f;
+
+	color_t sigma(0.f);
+	if (haveS_a) sigma += s_a;
+	if (haveS_s) sigma += s_s;
+
+	point3d_t pts[NOISE_VOLUME_BATCH];
+	colorA_t cols[NOISE_VOLUME_BATCH];
+	float pos = t0 + offset * stepSize;
+	float densSum = 0.f;
+	while (pos < t1)
+	{
+		int n = 0;
+		for (; n < NOISE_VOLUME_BATCH && pos < t1; pos += stepSize)
+		{
+			point3d_t p = ray.from + (ray.dir * pos);
+			// sigma_t() is 0 outside the bound
+			if (bBox.includes(p)) pts[n++] = p * 0.1f;
+		}
+		texDistNoise->getColors(pts, cols, n);
+		for (int i = 0; i < n; ++i)
+		{
+			densSum += density / (1.0f + fExp(sharpness * (1.0f - cover - cols[i].energy())));
+		}
+	}
+	
+	return sigma * (densSum * stepSize);
+}
+
 VolumeRegion* NoiseVolume::factory(paraMap_t &params,renderEnvironment_t &render)
 {
 	float ss = .1f;
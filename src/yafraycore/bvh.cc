@@ -0,0 +1,759 @@
+#include <yafraycore/bvh.h>
+#include <yafraycore/timer.h>
+#include <core_api/material.h>
+#include <core_api/scene.h>
+#include <limits>
+
+#if Y_BVH_SSE
+	#include <emmintrin.h>
+#endif
+
+__BEGIN_YAFRAY
+
+#define BVH_MAX_STACK (BVH_WIDTH*BVH_MAX_DEPTH) //!< every node replaces itself by at most BVH_WIDTH children
+#define BVH_MAX_LEAF_PRIMS 16 //!< bigger nodes are always split
+#define BVH_FAR_SCALE 1.0000004f //!< widens the far box distance against rounding errors of the slab test
+
+/*! Node of the binary tree built first and then collapsed into bvhNode_t */
+struct triBVH_t::buildNode_t
+{
+	bound_t bound;
+	int child[2]; //!< -1 for leaves
+	u_int32 first, count; //!< range of the leaf in primIdx
+};
+
+/*! Ray data shared by the box and triangle tests */
+struct bvhRay_t
+{
+	bvhRay_t() {}
+	bvhRay_t(const ray_t &ray)
+	{
+		for(int i=0; i<3; ++i)
+		{
+			from[i] = ray.from[i];
+			dir[i] = ray.dir[i];
+			invDir[i] = 1.f/ray.dir[i];
+			nearSide[i] = (invDir[i] < 0.f) ? 1 : 0;
+		}
+	}
+	float from[3], dir[3], invDir[3];
+	int nearSide[3]; //!< 1 if the max side of a box is hit first along this axis
+};
+
+struct bvhStack_t
+{
+	int node;
+	float t; //!< entry distance of the node box
+};
+
+/*! Stack element of the stream traversal: a node and the rays that reach it */
+struct bvhStreamStack_t
+{
+	int node;
+	u_int32 first, count; //!< range of the ray indices in the index buffer
+};
+
+static inline float bvhArea(const bound_t &b)
+{
+	float dx = b.longX(), dy = b.longY(), dz = b.longZ();
+	return dx*dy + dx*dz + dy*dz;
+}
+
+/*! Slab test of one ray against the four child boxes of a node.
+	\return bit mask of the children overlapping [tMin, tMax], tNear gets their entry distances */
+static inline int intersectBoxes(const bvhNode_t &node, const bvhRay_t &r, float tMin, float tMax, float *tNear)
+{
+#if Y_BVH_SSE
+	__m128 tn = _mm_set1_ps(tMin);
+	__m128 tf = _mm_set1_ps(tMax);
+	for(int axis=0; axis<3; ++axis)
+	{
+		__m128 from = _mm_set1_ps(r.from[axis]);
+		__m128 inv = _mm_set1_ps(r.invDir[axis]);
+		__m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.nearSide[axis]][axis]), from), inv);
+		__m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1-r.nearSide[axis]][axis]), from), inv);
+		// NaNs from flat boxes parallel to the ray keep the previous distance
+		tn = _mm_max_ps(n, tn);
+		tf = _mm_min_ps(_mm_mul_ps(f, _mm_set1_ps(BVH_FAR_SCALE)), tf);
+	}
+	_mm_storeu_ps(tNear, tn);
+	return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+	int mask = 0;
+	for(int i=0; i<BVH_WIDTH; ++i)
+	{
+		float tn = tMin, tf = tMax;
+		for(int axis=0; axis<3; ++axis)
+		{
+			float n = (node.bounds[r.nearSide[axis]][axis][i] - r.from[axis]) * r.invDir[axis];
+			float f = (node.bounds[1-r.nearSide[axis]][axis][i] - r.from[axis]) * r.invDir[axis] * BVH_FAR_SCALE;
+			if(n > tn) tn = n;
+			if(f < tf) tf = f;
+		}
+		tNear[i] = tn;
+		if(tn <= tf) mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+/*! Möller-Trumbore test of one ray against the four triangles of a block,
+	doing the same operations in the same order as triangle_t::intersect.
+	\return bit mask of the triangles hit, t, u and v get the hit distances and barycentric coordinates */
+static inline int intersectBlock(const bvhTriBlock_t &block, const bvhRay_t &r, float *t, float *u, float *v)
+{
+#if Y_BVH_SSE
+	__m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+	__m128 e1x = _mm_load_ps(block.edge1[0]), e1y = _mm_load_ps(block.edge1[1]), e1z = _mm_load_ps(block.edge1[2]);
+	__m128 e2x = _mm_load_ps(block.edge2[0]), e2y = _mm_load_ps(block.edge2[1]), e2z = _mm_load_ps(block.edge2[2]);
+	__m128 eps = _mm_load_ps(block.epsilon);
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+	// pvec = dir ^ edge2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_sub_ps(zero, eps)), _mm_cmpge_ps(det, eps));
+	if(!_mm_movemask_ps(valid)) return 0;
+	__m128 invDet = _mm_div_ps(one, det);
+
+	// tvec = from - a
+	__m128 tx = _mm_sub_ps(_mm_set1_ps(r.from[0]), _mm_load_ps(block.a[0]));
+	__m128 ty = _mm_sub_ps(_mm_set1_ps(r.from[1]), _mm_load_ps(block.a[1]));
+	__m128 tz = _mm_sub_ps(_mm_set1_ps(r.from[2]), _mm_load_ps(block.a[2]));
+	__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+	if(!_mm_movemask_ps(valid)) return 0;
+
+	// qvec = tvec ^ edge1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+	__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, eps));
+
+	_mm_storeu_ps(t, tt);
+	_mm_storeu_ps(u, uu);
+	_mm_storeu_ps(v, vv);
+	return _mm_movemask_ps(valid);
+#else
+	int mask = 0;
+	for(int i=0; i<BVH_WIDTH; ++i)
+	{
+		if(!block.tri[i]) continue;
+		vector3d_t dir(r.dir[0], r.dir[1], r.dir[2]);
+		vector3d_t edge1(block.edge1[0][i], block.edge1[1][i], block.edge1[2][i]);
+		vector3d_t edge2(block.edge2[0][i], block.edge2[1][i], block.edge2[2][i]);
+		float epsilon = block.epsilon[i];
+
+		vector3d_t pvec = dir ^ edge2;
+		float det = edge1 * pvec;
+		if(det > -epsilon && det < epsilon) continue;
+		float inv_det = 1.f / det;
+		vector3d_t tvec(r.from[0] - block.a[0][i], r.from[1] - block.a[1][i], r.from[2] - block.a[2][i]);
+		u[i] = (tvec*pvec) * inv_det;
+		if (u[i] < 0.f || u[i] > 1.f) continue;
+		vector3d_t qvec = tvec^edge1;
+		v[i] = (dir*qvec) * inv_det;
+		if ((v[i]<0.f) || ((u[i]+v[i])>1.f) ) continue;
+		t[i] = edge2 * qvec * inv_det;
+		if(t[i] < epsilon) continue;
+		mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+/*! Pushes the inner children in mask onto the stack, farthest first so the nearest one is visited next */
+static inline void pushChildren(const bvhNode_t &node, int mask, const float *tNear, bvhStack_t *stack, int &top)
+{
+	int first = top;
+	for(int i=0; i<BVH_WIDTH; ++i)
+	{
+		if(!(mask & (1 << i)) || node.count[i] || node.child[i] < 0) continue;
+		// insertion sort by descending entry distance
+		int j = top++;
+		for(; j > first && stack[j-1].t < tNear[i]; --j) stack[j] = stack[j-1];
+		stack[j].node = node.child[i];
+		stack[j].t = tNear[i];
+	}
+}
+
+triBVH_t::triBVH_t(const triangle_t **v, int np, float cost_ratio, int quality, int bins)
+	: costRatio(cost_ratio), quality(quality), nodes(nullptr), blocks(nullptr), nNodes(0), nBlocks(0), deepestLeaf(0), nLeaves(0), sahCost(0.0)
+{
+	switch(quality)
+	{
+		case KD_QUALITY_FAST: numBins = 8; break;
+		case KD_QUALITY_MEDIUM: numBins = 16; break;
+		default: numBins = 32; break;
+	}
+	if(bins > 0) numBins = std::max(2, bins);
+
+	Y_INFO << "BVH: Starting build (" << np << " prims, cr:" << costRatio << ")" << yendl;
+	// a timer of its own, BVHs of mesh lights are built by several threads at once
+	timer_t buildTimer;
+	buildTimer.addEvent("bvh");
+	buildTimer.start("bvh");
+
+	binCount.resize(numBins);
+	binBound.resize(numBins);
+	rightArea.resize(numBins);
+	rightCount.resize(numBins);
+	primIdx.resize(np);
+	primBounds.resize(np);
+	centroids.resize(np);
+	for(int i=0; i<np; ++i)
+	{
+		primIdx[i] = i;
+		primBounds[i] = v[i]->getBound();
+		centroids[i] = primBounds[i].center();
+		if(i == 0) treeBound = primBounds[i];
+		else treeBound = bound_t(treeBound, primBounds[i]);
+	}
+	//slightly(!) increase tree bound to prevent errors with prims
+	//lying in a bound plane (still slight bug with trees where one dim. is 0 though...)
+	double foo;
+	for(int i=0;i<3;i++)
+	{
+		foo = (treeBound.g[i] - treeBound.a[i])*0.001;
+		treeBound.a[i] -= foo, treeBound.g[i] += foo;
+	}
+
+	std::vector<buildNode_t> bnodes;
+	std::vector<bvhNode_t> qnodes;
+	std::vector<bvhTriBlock_t> qblocks;
+	if(np > 0)
+	{
+		bnodes.reserve(2*np);
+		buildBinary(bnodes, 0, np, treeBound, 0);
+		collapse(bnodes, 0, v, qnodes, qblocks);
+	}
+
+	nNodes = qnodes.size();
+	nBlocks = qblocks.size();
+	nodes = (bvhNode_t *) y_memalign(64, std::max<u_int32>(nNodes, 1) * sizeof(bvhNode_t));
+	blocks = (bvhTriBlock_t *) y_memalign(64, std::max<u_int32>(nBlocks, 1) * sizeof(bvhTriBlock_t));
+	std::copy(qnodes.begin(), qnodes.end(), nodes);
+	std::copy(qblocks.begin(), qblocks.end(), blocks);
+
+	float rootArea = bvhArea(treeBound);
+	if(rootArea > 0.f) sahCost /= rootArea;
+
+	// free working memory
+	std::vector<u_int32>().swap(primIdx);
+	std::vector<bound_t>().swap(primBounds);
+	std::vector<point3d_t>().swap(centroids);
+	std::vector<u_int32>().swap(binCount);
+	std::vector<bound_t>().swap(binBound);
+	std::vector<float>().swap(rightArea);
+	std::vector<u_int32>().swap(rightCount);
+
+	buildTimer.stop("bvh");
+	Y_VERBOSE << "BVH: binary nodes: " << bnodes.size() << ", leaves: " << nLeaves << yendl;
+	Y_VERBOSE << "BVH: 4-wide nodes: " << nNodes << ", triangle blocks: " << nBlocks
+		<< " (" << 100.f * float(np) / (BVH_WIDTH * std::max<u_int32>(nBlocks, 1)) << "% lanes used)" << yendl;
+	Y_INFO << "BVH: Built in " << 1000.0 * buildTimer.getTime("bvh") << "ms (quality: " << kdBuildQualityName(quality) << ", bins: " << numBins
+		<< "): " << nNodes << " nodes, max depth: " << deepestLeaf << ", SAH cost: " << sahCost << yendl;
+}
+
+triBVH_t::~triBVH_t()
+{
+	Y_INFO << "BVH: Freeing nodes..." << yendl;
+	y_free(nodes);
+	y_free(blocks);
+	Y_VERBOSE << "BVH: Done" << yendl;
+}
+
+/*! Recursive binned SAH build of the binary tree over primIdx[first, last).
+	\return index of the new node in bnodes */
+int triBVH_t::buildBinary(std::vector<buildNode_t> &bnodes, u_int32 first, u_int32 last, const bound_t &nodeBound, int depth)
+{
+	int nodeIdx = bnodes.size();
+	buildNode_t bn;
+	bn.bound = nodeBound;
+	bn.child[0] = bn.child[1] = -1;
+	bn.first = first;
+	bn.count = last - first;
+	bnodes.push_back(bn);
+
+	u_int32 nPrims = last - first;
+	float nodeArea = bvhArea(nodeBound);
+
+	bound_t centBound(centroids[primIdx[first]], centroids[primIdx[first]]);
+	for(u_int32 i=first+1; i<last; ++i) centBound.include(centroids[primIdx[i]]);
+
+	// find the best binned split over all axes
+	int bestAxis = -1, bestBin = 0;
+	float bestCost = std::numeric_limits<float>::infinity();
+	if(nPrims > 1 && depth < BVH_MAX_DEPTH)
+	{
+		for(int axis=0; axis<3; ++axis)
+		{
+			float cMin = centBound.a[axis], extent = centBound.g[axis] - centBound.a[axis];
+			if(extent <= 0.f) continue;
+			float scale = numBins / extent;
+			std::fill(binCount.begin(), binCount.end(), 0);
+			for(u_int32 i=first; i<last; ++i)
+			{
+				u_int32 p = primIdx[i];
+				int b = std::min(numBins-1, int((centroids[p][axis] - cMin) * scale));
+				binBound[b] = binCount[b] ? bound_t(binBound[b], primBounds[p]) : primBounds[p];
+				++binCount[b];
+			}
+			// sweep from the right to get the areas of all right sides
+			bound_t acc;
+			u_int32 count = 0;
+			for(int b=numBins-1; b>0; --b)
+			{
+				if(binCount[b]) acc = count ? bound_t(acc, binBound[b]) : binBound[b];
+				count += binCount[b];
+				rightCount[b] = count;
+				rightArea[b] = count ? bvhArea(acc) : 0.f;
+			}
+			// sweep from the left and evaluate the split after each bin
+			count = 0;
+			for(int b=0; b<numBins-1; ++b)
+			{
+				if(binCount[b]) acc = count ? bound_t(acc, binBound[b]) : binBound[b];
+				count += binCount[b];
+				if(!count || !rightCount[b+1]) continue;
+				float cost = costRatio + (bvhArea(acc) * count + rightArea[b+1] * rightCount[b+1]) / nodeArea;
+				if(cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+	}
+
+	bool makeLeaf = (bestAxis < 0) || (nPrims <= BVH_MAX_LEAF_PRIMS && float(nPrims) <= bestCost);
+	if(makeLeaf && bestAxis < 0 && nPrims > BVH_MAX_LEAF_PRIMS && depth < BVH_MAX_DEPTH)
+	{
+		// all centroids coincide, split in the middle to keep the leaves small
+		makeLeaf = false;
+	}
+	if(makeLeaf)
+	{
+		++nLeaves;
+		deepestLeaf = std::max(deepestLeaf, depth);
+		sahCost += nodeArea * nPrims;
+		return nodeIdx;
+	}
+
+	u_int32 mid;
+	if(bestAxis >= 0)
+	{
+		float cMin = centBound.a[bestAxis], scale = numBins / (centBound.g[bestAxis] - centBound.a[bestAxis]);
+		mid = std::partition(primIdx.begin() + first, primIdx.begin() + last, [&](u_int32 p)
+		{
+			return std::min(numBins-1, int((centroids[p][bestAxis] - cMin) * scale)) <= bestBin;
+		}) - primIdx.begin();
+	}
+	else mid = first + nPrims/2;
+
+	bound_t bound[2];
+	for(int side=0; side<2; ++side)
+	{
+		u_int32 from = side ? mid : first, to = side ? last : mid;
+		bound[side] = primBounds[primIdx[from]];
+		for(u_int32 i=from+1; i<to; ++i) bound[side] = bound_t(bound[side], primBounds[primIdx[i]]);
+	}
+
+	sahCost += nodeArea * costRatio;
+	int left = buildBinary(bnodes, first, mid, bound[0], depth+1);
+	int right = buildBinary(bnodes, mid, last, bound[1], depth+1);
+	bnodes[nodeIdx].child[0] = left;
+	bnodes[nodeIdx].child[1] = right;
+	return nodeIdx;
+}
+
+/*! Collapses the binary subtree at bIdx into 4-wide nodes by repeatedly opening
+	the inner child with the biggest surface, and packs the leaf triangles into blocks.
+	\return index of the new node in qnodes */
+int triBVH_t::collapse(const std::vector<buildNode_t> &bnodes, int bIdx, const triangle_t **v,
+		std::vector<bvhNode_t> &qnodes, std::vector<bvhTriBlock_t> &qblocks)
+{
+	int slots[BVH_WIDTH];
+	int nSlots = 0;
+	if(bnodes[bIdx].child[0] < 0) slots[nSlots++] = bIdx; // the root is a leaf
+	else
+	{
+		slots[nSlots++] = bnodes[bIdx].child[0];
+		slots[nSlots++] = bnodes[bIdx].child[1];
+	}
+	while(nSlots < BVH_WIDTH)
+	{
+		int best = -1;
+		float bestArea = -1.f;
+		for(int i=0; i<nSlots; ++i)
+		{
+			const buildNode_t &bn = bnodes[slots[i]];
+			if(bn.child[0] >= 0 && bvhArea(bn.bound) > bestArea)
+			{
+				best = i;
+				bestArea = bvhArea(bn.bound);
+			}
+		}
+		if(best < 0) break;
+		int open = slots[best];
+		slots[best] = bnodes[open].child[0];
+		slots[nSlots++] = bnodes[open].child[1];
+	}
+
+	int nodeIdx = qnodes.size();
+	qnodes.push_back(bvhNode_t());
+	for(int i=0; i<BVH_WIDTH; ++i)
+	{
+		int child = -1;
+		u_int32 count = 0;
+		for(int axis=0; axis<3; ++axis)
+		{
+			qnodes[nodeIdx].bounds[0][axis][i] = std::numeric_limits<float>::infinity();
+			qnodes[nodeIdx].bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+		}
+		if(i < nSlots)
+		{
+			const buildNode_t &bn = bnodes[slots[i]];
+			for(int axis=0; axis<3; ++axis)
+			{
+				qnodes[nodeIdx].bounds[0][axis][i] = bn.bound.a[axis];
+				qnodes[nodeIdx].bounds[1][axis][i] = bn.bound.g[axis];
+			}
+			if(bn.child[0] >= 0) child = collapse(bnodes, slots[i], v, qnodes, qblocks);
+			else
+			{
+				child = qblocks.size();
+				count = (bn.count + BVH_WIDTH - 1) / BVH_WIDTH;
+				for(u_int32 b=0; b<count; ++b)
+				{
+					bvhTriBlock_t block;
+					for(int lane=0; lane<BVH_WIDTH; ++lane)
+					{
+						u_int32 k = b * BVH_WIDTH + lane;
+						if(k < bn.count)
+						{
+							packedTriangle_t packed;
+							packed.set(v[primIdx[bn.first + k]]);
+							for(int axis=0; axis<3; ++axis)
+							{
+								block.a[axis][lane] = packed.a[axis];
+								block.edge1[axis][lane] = packed.edge1[axis];
+								block.edge2[axis][lane] = packed.edge2[axis];
+							}
+							block.epsilon[lane] = packed.epsilon;
+							block.tri[lane] = packed.tri;
+						}
+						else
+						{
+							for(int axis=0; axis<3; ++axis) block.a[axis][lane] = block.edge1[axis][lane] = block.edge2[axis][lane] = 0.f;
+							block.epsilon[lane] = std::numeric_limits<float>::infinity();
+							block.tri[lane] = nullptr;
+						}
+					}
+					qblocks.push_back(block);
+				}
+			}
+		}
+		qnodes[nodeIdx].child[i] = child;
+		qnodes[nodeIdx].count[i] = count;
+	}
+	return nodeIdx;
+}
+
+/*! Fills the intersection data packedTriangle_t::intersect would return for this hit */
+static inline void setHitData(const bvhTriBlock_t &block, int lane, float u, float v, intersectData_t &data)
+{
+	data.b1 = u;
+	data.b2 = v;
+	data.b0 = 1 - u - v;
+	data.edge1 = vector3d_t(block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane]);
+	data.edge2 = vector3d_t(block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane]);
+}
+
+//============================
+/*! The standard intersect function,
+	returns the closest hit within dist
+*/
+
+bool triBVH_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float &Z, intersectData_t &data) const
+{
+	Z=dist;
+	float a, b;
+	if(!nNodes || !treeBound.cross(ray, a, b, dist)) return false;
+
+	bvhRay_t r(ray);
+	bvhStack_t stack[BVH_MAX_STACK];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].t = a;
+	++top;
+
+	const bvhTriBlock_t *hitBlock = nullptr;
+	int hitLane = 0;
+	float hitU = 0.f, hitV = 0.f;
+	float tNear[BVH_WIDTH], t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+
+	while(top > 0)
+	{
+		const bvhStack_t &entry = stack[--top];
+		if(entry.t > Z) continue;
+		const bvhNode_t &node = nodes[entry.node];
+		int mask = intersectBoxes(node, r, ray.tmin, Z, tNear);
+		if(!mask) continue;
+
+		// leaf children are tested right away, they can only shorten Z
+		for(int i=0; i<BVH_WIDTH; ++i)
+		{
+			if(!(mask & (1 << i)) || !node.count[i]) continue;
+			for(u_int32 bl=0; bl<node.count[i]; ++bl)
+			{
+				const bvhTriBlock_t &block = blocks[node.child[i] + bl];
+				int hits = intersectBlock(block, r, t, u, v);
+				for(int lane=0; hits; ++lane, hits >>= 1)
+				{
+					if(!(hits & 1)) continue;
+					if(t[lane] < Z && t[lane] >= ray.tmin)
+					{
+						const material_t *mat = block.tri[lane]->getMaterial();
+
+						if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == VISIBLE_NO_SHADOWS)
+						{
+							Z = t[lane];
+							hitBlock = &block;
+							hitLane = lane;
+							hitU = u[lane];
+							hitV = v[lane];
+						}
+					}
+				}
+			}
+		}
+		pushChildren(node, mask, tNear, stack, top);
+	}
+
+	if(!hitBlock) return false;
+	*tr = const_cast<triangle_t *>(hitBlock->tri[hitLane]);
+	setHitData(*hitBlock, hitLane, hitU, hitV, data);
+	return true;
+}
+
+bool triBVH_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, float shadow_bias) const
+{
+	float a, b;
+	if(!nNodes || !treeBound.cross(ray, a, b, dist)) return false;
+
+	bvhRay_t r(ray);
+	bvhStack_t stack[BVH_MAX_STACK];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].t = a;
+	++top;
+
+	float tNear[BVH_WIDTH], t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+
+	while(top > 0)
+	{
+		const bvhNode_t &node = nodes[stack[--top].node];
+		int mask = intersectBoxes(node, r, 0.f, dist, tNear);
+		if(!mask) continue;
+
+		for(int i=0; i<BVH_WIDTH; ++i)
+		{
+			if(!(mask & (1 << i)) || !node.count[i]) continue;
+			for(u_int32 bl=0; bl<node.count[i]; ++bl)
+			{
+				const bvhTriBlock_t &block = blocks[node.child[i] + bl];
+				int hits = intersectBlock(block, r, t, u, v);
+				for(int lane=0; hits; ++lane, hits >>= 1)
+				{
+					if(!(hits & 1)) continue;
+					if(t[lane] < dist && t[lane] >= 0.f)
+					{
+						const material_t *mat = block.tri[lane]->getMaterial();
+
+						if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
+						{
+							*tr = const_cast<triangle_t *>(block.tri[lane]);
+							return true;
+						}
+					}
+				}
+			}
+		}
+		pushChildren(node, mask, tNear, stack, top);
+	}
+
+	return false;
+}
+
+void triBVH_t::IntersectS(int n, const ray_t *rays, const float *dist, triangle_t **tr, bool *occluded, float shadow_bias) const
+{
+	if(!nNodes) return;
+
+	bvhRay_t r[BVH_STREAM_SIZE];
+	// ray indices of all stack entries, the children of a node write theirs behind the ones of the node
+	unsigned char idxBuf[BVH_STREAM_SIZE * (BVH_MAX_STACK + BVH_WIDTH)];
+	bvhStreamStack_t stack[BVH_MAX_STACK];
+	int top = 0;
+	u_int32 count = 0;
+	float a, b;
+	for(int k=0; k<n; ++k)
+	{
+		if(occluded[k] || !treeBound.cross(rays[k], a, b, dist[k])) continue;
+		r[k] = bvhRay_t(rays[k]);
+		idxBuf[count++] = k;
+	}
+	if(!count) return;
+	stack[top].node = 0;
+	stack[top].first = 0;
+	stack[top].count = count;
+	++top;
+
+	float tNear[BVH_WIDTH], t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+	unsigned char masks[BVH_STREAM_SIZE];
+
+	while(top > 0)
+	{
+		const bvhStreamStack_t entry = stack[--top];
+		const bvhNode_t &node = nodes[entry.node];
+		const unsigned char *idx = idxBuf + entry.first;
+		int nodeMask = 0;
+		for(u_int32 j=0; j<entry.count; ++j)
+		{
+			int k = idx[j];
+			masks[j] = occluded[k] ? 0 : intersectBoxes(node, r[k], 0.f, dist[k], tNear);
+			nodeMask |= masks[j];
+		}
+		if(!nodeMask) continue;
+
+		u_int32 next = entry.first + entry.count;
+		for(int i=0; i<BVH_WIDTH; ++i)
+		{
+			if(!(nodeMask & (1 << i))) continue;
+			if(!node.count[i])
+			{
+				// inner child: push the rays that reach it
+				if(node.child[i] < 0) continue;
+				u_int32 childCount = 0;
+				for(u_int32 j=0; j<entry.count; ++j)
+				{
+					if(masks[j] & (1 << i)) idxBuf[next + childCount++] = idx[j];
+				}
+				stack[top].node = node.child[i];
+				stack[top].first = next;
+				stack[top].count = childCount;
+				++top;
+				next += childCount;
+				continue;
+			}
+			for(u_int32 j=0; j<entry.count; ++j)
+			{
+				int k = idx[j];
+				if(!(masks[j] & (1 << i)) || occluded[k]) continue;
+				for(u_int32 bl=0; bl<node.count[i] && !occluded[k]; ++bl)
+				{
+					const bvhTriBlock_t &block = blocks[node.child[i] + bl];
+					int hits = intersectBlock(block, r[k], t, u, v);
+					for(int lane=0; hits; ++lane, hits >>= 1)
+					{
+						if(!(hits & 1)) continue;
+						if(t[lane] < dist[k] && t[lane] >= 0.f)
+						{
+							const material_t *mat = block.tri[lane]->getMaterial();
+
+							if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
+							{
+								tr[k] = const_cast<triangle_t *>(block.tri[lane]);
+								occluded[k] = true;
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/*=============================================================
+	allow for transparent shadows.
+=============================================================*/
+
+bool triBVH_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias,
+	const triangleObjectInstance_t *instance, int *layers) const
+{
+	float a, b;
+	if(!nNodes || !treeBound.cross(ray, a, b, dist)) return false;
+
+	bvhRay_t r(ray);
+	bvhStack_t stack[BVH_MAX_STACK];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].t = a;
+	++top;
+
+	float tNear[BVH_WIDTH], t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+	intersectData_t bary;
+	int depth=0;
+
+	// every triangle is referenced only once, so no need to filter hits we already had
+	while(top > 0)
+	{
+		const bvhNode_t &node = nodes[stack[--top].node];
+		int mask = intersectBoxes(node, r, ray.tmin, dist, tNear);
+		if(!mask) continue;
+
+		for(int i=0; i<BVH_WIDTH; ++i)
+		{
+			if(!(mask & (1 << i)) || !node.count[i]) continue;
+			for(u_int32 bl=0; bl<node.count[i]; ++bl)
+			{
+				const bvhTriBlock_t &block = blocks[node.child[i] + bl];
+				int hits = intersectBlock(block, r, t, u, v);
+				for(int lane=0; hits; ++lane, hits >>= 1)
+				{
+					if(!(hits & 1)) continue;
+					if(t[lane] < dist && t[lane] >= ray.tmin)
+					{
+						const triangle_t *mp = block.tri[lane];
+						const material_t *mat = mp->getMaterial();
+
+						if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
+						{
+							*tr = const_cast<triangle_t *>(mp);
+
+							if(!mat->isTransparent() ) return true;
+
+							if(depth>=maxDepth) return true;
+							point3d_t h=ray.from + t[lane]*ray.dir;
+							vector3d_t wo=ray.dir;
+							surfacePoint_t sp;
+							setHitData(block, lane, u[lane], v[lane], bary);
+							if(instance)
+							{
+								h = instance->getObjToWorld() * h;
+								wo = instance->getObjToWorld() * wo;
+								instance->getSurface(sp, mp, h, bary);
+							}
+							else mp->getSurface(sp, h, bary);
+							filt *= mat->getTransparency(state, sp, wo);
+							++depth;
+						}
+					}
+				}
+			}
+		}
+		pushChildren(node, mask, tNear, stack, top);
+	}
+
+	if(layers) *layers = depth;
+	return false;
+}
+
+__END_YAFRAY
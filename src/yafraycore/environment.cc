@@ -42,6 +42,7 @@
 #include <core_api/object3d.h>
 #include <core_api/volume.h>
 #include <yafraycore/std_primitives.h>
+#include <yafraycore/kdtree.h>
 #include <string>
 #include <sstream>
 
@@ -115,6 +116,7 @@ void renderEnvironment_t::clearAll()
 
 	light_table.clear();
 	texture_table.clear();
+	texture_hashes.clear();
 	material_table.clear();
 	object_table.clear();
 	camera_table.clear();
@@ -297,6 +299,7 @@ texture_t* renderEnvironment_t::createTexture(const std::string &name, paraMap_t
 	if(texture)
 	{
 		texture_table[name] = texture;
+		texture_hashes[name] = paramsHash(params, texture->contentKey());
 		InfoVerboseSuccess(name, type);
 		return texture;
 	}
@@ -333,6 +336,23 @@ shaderNode_t* renderEnvironment_t::createShaderNode(const std::string &name, par
 	return nullptr;
 }
 
+/*! hash of the parameters, continuing the hash h. Parameters naming a texture or a material
+	also hash what they name, so a material changes its hash with the textures it uses */
+uint64_t renderEnvironment_t::paramsHash(const paraMap_t &params, uint64_t h) const
+{
+	h = params.hash(h);
+	for(const auto &p : *params.getDict())
+	{
+		const std::string *s = nullptr;
+		if(!p.second.getVal(s)) continue;
+		auto t = texture_hashes.find(*s);
+		if(t != texture_hashes.end()) h = hashValue(t->second, h);
+		auto m = material_table.find(*s);
+		if(m != material_table.end()) h = hashValue(m->second->getParamsHash(), h);
+	}
+	return h;
+}
+
 material_t* renderEnvironment_t::createMaterial(const std::string &name, paraMap_t &params, std::list<paraMap_t> &eparams)
 {
 	std::string pname = "Material";
@@ -355,6 +375,9 @@ material_t* renderEnvironment_t::createMaterial(const std::string &name, paraMap
 	}
 	if(material)
 	{
+		uint64_t h = paramsHash(params, Y_HASH_SEED);
+		for(const paraMap_t &ep : eparams) h = paramsHash(ep, h);
+		material->setParamsHash(h);
 		material_table[name] = material;
 		InfoVerboseSuccess(name, type);
 		return material;
@@ -803,6 +826,7 @@ VolumeRegion* renderEnvironment_t::createVolumeRegion(const std::string &name, p
 	}
 	if(volumeregion)
 	{
+		volumeregion->content_key = paramsHash(params, volumeregion->content_key);
 		volumeregion_table[name] = volumeregion;
 		InfoVerboseSuccess(name, type);
 		return volumeregion;
@@ -876,6 +900,9 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	float AA_clamp_samples = 0.f;
 	float AA_clamp_indirect = 0.f;
 	
+	std::string kdtree_build_quality = "high";
+	const std::string *accelerator = nullptr;
+	int kdtree_bins = 0;
 	bool adv_auto_shadow_bias_enabled=true;
 	float adv_shadow_bias_value=YAF_SHADOW_BIAS;
 	bool adv_auto_min_raydist_enabled=true;
@@ -948,6 +975,9 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	nthreads_photons = nthreads;	//if no "threads_photons" parameter exists, make "nthreads_photons" equal to render threads
 	
 	params.getParam("threads_photons", nthreads_photons); // number of threads for photon mapping, -1 = auto detection
+	params.getParam("kdtree_build_quality", kdtree_build_quality); // fast, medium or high
+	params.getParam("kdtree_bins", kdtree_bins); // bins per axis for the binned split search, 0 = default of the build quality
+	params.getParam("accelerator", accelerator); // kdtree or bvh, overrides the scene setting if present
 	params.getParam("adv_auto_shadow_bias_enabled", adv_auto_shadow_bias_enabled);
 	params.getParam("adv_shadow_bias_value", adv_shadow_bias_value);
 	params.getParam("adv_auto_min_raydist_enabled", adv_auto_min_raydist_enabled);
@@ -979,6 +1009,22 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	scene.setAntialiasing(AA_samples, AA_passes, AA_inc_samples, AA_threshold, AA_resampled_floor, AA_sample_multiplier_factor, AA_light_sample_multiplier_factor, AA_indirect_sample_multiplier_factor, AA_detect_color_noise, AA_dark_detection_type, AA_dark_threshold_factor, AA_variance_edge_size, AA_variance_pixels, AA_clamp_samples, AA_clamp_indirect);
 	scene.setNumThreads(nthreads);
 	scene.setNumThreadsPhotons(nthreads_photons);
+	if(kdtree_build_quality == "fast") scene.setKdTreeBuildQuality(KD_QUALITY_FAST, kdtree_bins);
+	else if(kdtree_build_quality == "medium") scene.setKdTreeBuildQuality(KD_QUALITY_MEDIUM, kdtree_bins);
+	else
+	{
+		if(kdtree_build_quality != "high") Y_WARN_ENV << "Unknown kdtree_build_quality '" << kdtree_build_quality << "', using 'high'. Valid values are: fast, medium, high" << yendl;
+		scene.setKdTreeBuildQuality(KD_QUALITY_HIGH, kdtree_bins);
+	}
+	if(accelerator)
+	{
+		if(*accelerator == "bvh") scene.setAccelerator(ACCEL_BVH);
+		else
+		{
+			if(*accelerator != "kdtree") Y_WARN_ENV << "Unknown accelerator '" << *accelerator << "', using 'kdtree'. Valid values are: kdtree, bvh" << yendl;
+			scene.setAccelerator(ACCEL_KDTREE);
+		}
+	}
 	if(backg) scene.setBackground(backg);
 	scene.shadowBiasAuto = adv_auto_shadow_bias_enabled;
 	scene.shadowBias = adv_shadow_bias_value;
@@ -1,24 +1,31 @@
 #include <yafraycore/hashgrid.h>
+#include <algorithm>
+#include <thread>
 
 __BEGIN_YAFRAY
 
-hashGrid_t::hashGrid_t(double _cellSize, unsigned int _gridSize, yafaray::bound_t _bBox)
-:cellSize(_cellSize), gridSize(_gridSize), bBox(_bBox)
+#define HASHGRID_MAX_CELLS 64 //!< cells of a gather tested without allocating
+#define HASHGRID_MIN_THREAD_PHOTONS 65536
+#define HITPOINTGRID_MAX_CELLS 27 //!< cells a hit point is stored in, hit points with larger search spheres go to the overflow list
+
+hashGrid_t::hashGrid_t(float _cellSize, yafaray::bound_t _bBox)
+:cellSize(_cellSize), gridSize(0), bBox(_bBox)
 {
-	invcellSize = 1. / cellSize;
+	invcellSize = 1.f / cellSize;
 }
 
-void hashGrid_t::setParm(double _cellSize, unsigned int _gridSize, bound_t _bBox)
+void hashGrid_t::setParm(float _cellSize, bound_t _bBox)
 {
 	cellSize = _cellSize;
-	invcellSize = 1. / cellSize;
-	gridSize = _gridSize;
+	invcellSize = 1.f / cellSize;
 	bBox = _bBox;
 }
 
 void hashGrid_t::clear()
 {
 	photons.clear();
+	cellStart.clear();
+	gridSize = 0;
 }
 
 void hashGrid_t::pushPhoton(photon_t &p)
@@ -26,81 +33,242 @@ void hashGrid_t::pushPhoton(photon_t &p)
 	photons.push_back(p);
 }
 
+void hashGrid_t::countWorker(u_int32 start, u_int32 end, u_int32 *cellIndex, u_int32 *counts) const
+{
+	for(u_int32 i=start; i<end; ++i)
+	{
+		const point3d_t &p = photons[i].pos;
+		u_int32 index = Hash(cellCoord(p.x, bBox.a.x), cellCoord(p.y, bBox.a.y), cellCoord(p.z, bBox.a.z));
+		cellIndex[i] = index;
+		++counts[index];
+	}
+}
+
+void hashGrid_t::scatterWorker(u_int32 start, u_int32 end, const u_int32 *cellIndex, u_int32 *offsets, photon_t *sorted) const
+{
+	for(u_int32 i=start; i<end; ++i) sorted[offsets[cellIndex[i]]++] = photons[i];
+}
 
-void hashGrid_t::updateGrid()
+/*! Counting sort of the photons by bucket: each thread counts the buckets of its
+	part of the photons, the counts give every thread its own write position in each
+	bucket, then each thread copies its photons. The order within a bucket is the input order */
+void hashGrid_t::updateGrid(int threads)
 {
+	u_int32 n = photons.size();
+	// about one photon per bucket
+	gridSize = 1;
+	while(gridSize < n) gridSize <<= 1;
+
+	threads = std::max(1, std::min(threads, (int)(n / HASHGRID_MIN_THREAD_PHOTONS)));
+	u_int32 chunk = (n + threads - 1) / threads;
+	std::vector<u_int32> cellIndex(n);
+	std::vector<u_int32> counts((size_t)threads * gridSize, 0);
 
-	if (!hashGrid)
+	std::vector<std::thread> workers;
+	for(int t=1; t<threads; ++t)
 	{
-		hashGrid = new std::list<photon_t *>*[gridSize];
+		workers.push_back(std::thread(&hashGrid_t::countWorker, this, std::min(n, t*chunk), std::min(n, (t+1)*chunk), &cellIndex[0], &counts[(size_t)t*gridSize]));
+	}
+	if(n) countWorker(0, std::min(n, chunk), &cellIndex[0], &counts[0]);
+	for(auto& w : workers) w.join();
+	workers.clear();
 
-		for (unsigned int i = 0; i < gridSize; ++i)
-			hashGrid[i] = nullptr;
-	} 
-	else 
+	cellStart.resize(gridSize + 1);
+	u_int32 sum = 0;
+	unsigned int notused = 0;
+	for(u_int32 b=0; b<gridSize; ++b)
 	{
-		for (unsigned int i = 0; i < gridSize; ++i) 
-		{	
-			if( hashGrid[i])
-			{
-				//delete hashGrid[i];
-				hashGrid[i]->clear(); // fix me! too many time consumed here
-				//hashGrid[i] = nullptr;
-			}
+		cellStart[b] = sum;
+		for(int t=0; t<threads; ++t)
+		{
+			u_int32 &c = counts[(size_t)t*gridSize + b];
+			u_int32 count = c;
+			c = sum;
+			sum += count;
 		}
+		if(cellStart[b] == sum) notused++;
 	}
+	cellStart[gridSize] = sum;
 
-	//travel the vector to build the Grid
-	for(auto itr = photons.begin(); itr != photons.end(); ++itr)
+	std::vector<photon_t> sorted(n);
+	for(int t=1; t<threads; ++t)
 	{
-		point3d_t hashindex  =  ( (*itr).pos - bBox.a) * invcellSize;
+		workers.push_back(std::thread(&hashGrid_t::scatterWorker, this, std::min(n, t*chunk), std::min(n, (t+1)*chunk), &cellIndex[0], &counts[(size_t)t*gridSize], &sorted[0]));
+	}
+	if(n) scatterWorker(0, std::min(n, chunk), &cellIndex[0], &counts[0], &sorted[0]);
+	for(auto& w : workers) w.join();
+	photons.swap(sorted);
+
+	Y_VERBOSE << "HashGrid: " << n << " photons in " << gridSize << " buckets, " << notused << " buckets not used" << yendl;
+}
 
-		int ix = abs(int(hashindex.x));
-		int iy = abs(int(hashindex.y));
-		int iz = abs(int(hashindex.z));
+unsigned int hashGrid_t::gather(const point3d_t &P, foundPhoton_t *found, unsigned int K, float &sqRadius) const
+{
+	if(photons.empty()) return 0;
+	photonGather_t proc(K, P);
+	proc.photons = found;
 
-		unsigned int index = Hash(ix,iy,iz);
+	float radius = fSqrt(sqRadius);
+	int ix0 = cellCoord(P.x - radius, bBox.a.x), ix1 = cellCoord(P.x + radius, bBox.a.x);
+	int iy0 = cellCoord(P.y - radius, bBox.a.y), iy1 = cellCoord(P.y + radius, bBox.a.y);
+	int iz0 = cellCoord(P.z - radius, bBox.a.z), iz1 = cellCoord(P.z + radius, bBox.a.z);
 
-		if(hashGrid[index] == nullptr)
-			hashGrid[index] = new std::list<photon_t*>();
+	size_t nCells = (size_t)(ix1 - ix0 + 1) * (iy1 - iy0 + 1) * (iz1 - iz0 + 1);
+	if(nCells >= gridSize)
+	{
+		// the radius covers more cells than there are buckets
+		for(u_int32 i=0; i<photons.size(); ++i)
+		{
+			float dist2 = (photons[i].pos - P).lengthSqr();
+			if(dist2 < sqRadius) proc(&photons[i], dist2, sqRadius);
+		}
+		return proc.foundPhotons;
+	}
 
-		hashGrid[index]->push_front(&(*itr));
+	// different cells may share a bucket, each bucket has to be tested once
+	u_int32 localBuckets[HASHGRID_MAX_CELLS];
+	std::vector<u_int32> manyBuckets;
+	u_int32 *buckets = localBuckets;
+	if(nCells > HASHGRID_MAX_CELLS)
+	{
+		manyBuckets.resize(nCells);
+		buckets = &manyBuckets[0];
 	}
-	unsigned int notused = 0;
-	for (unsigned int i = 0; i < gridSize; ++i)
+	u_int32 nBuckets = 0;
+	for(int iz = iz0; iz <= iz1; ++iz)
+		for(int iy = iy0; iy <= iy1; ++iy)
+			for(int ix = ix0; ix <= ix1; ++ix)
+				buckets[nBuckets++] = Hash(ix, iy, iz);
+	std::sort(buckets, buckets + nBuckets);
+	nBuckets = std::unique(buckets, buckets + nBuckets) - buckets;
+
+	for(u_int32 b=0; b<nBuckets; ++b)
+	{
+		for(u_int32 i=cellStart[buckets[b]], end=cellStart[buckets[b]+1]; i<end; ++i)
+		{
+			float dist2 = (photons[i].pos - P).lengthSqr();
+			if(dist2 < sqRadius) proc(&photons[i], dist2, sqRadius);
+		}
+	}
+	return proc.foundPhotons;
+}
+
+void hitPointGrid_t::clear()
+{
+	x.clear(); y.clear(); z.clear(); r2.clear();
+	index.clear();
+	cellStart.clear();
+	gridSize = 0;
+}
+
+/*! the buckets of the cells the sphere overlaps, each bucket once since a photon must not find a hit point twice.
+	0 if the sphere overlaps more than HITPOINTGRID_MAX_CELLS cells, the hit point then goes to the overflow list */
+u_int32 hitPointGrid_t::buckets(const point3d_t &P, float radius2, std::vector<u_int32> &out) const
+{
+	float radius = fSqrt(radius2);
+	int ix0 = cellCoord(P.x - radius, bBox.a.x), ix1 = cellCoord(P.x + radius, bBox.a.x);
+	int iy0 = cellCoord(P.y - radius, bBox.a.y), iy1 = cellCoord(P.y + radius, bBox.a.y);
+	int iz0 = cellCoord(P.z - radius, bBox.a.z), iz1 = cellCoord(P.z + radius, bBox.a.z);
+
+	size_t nCells = (size_t)(ix1 - ix0 + 1) * (iy1 - iy0 + 1) * (iz1 - iz0 + 1);
+	if(nCells > HITPOINTGRID_MAX_CELLS) return 0;
+	if(nCells >= gridSize)
+	{
+		out.resize(gridSize);
+		for(u_int32 b=0; b<gridSize; ++b) out[b] = b;
+		return gridSize;
+	}
+	if(out.size() < nCells) out.resize(nCells);
+	u_int32 n = 0;
+	for(int iz = iz0; iz <= iz1; ++iz)
+		for(int iy = iy0; iy <= iy1; ++iy)
+			for(int ix = ix0; ix <= ix1; ++ix)
+				out[n++] = Hash(ix, iy, iz);
+	std::sort(out.begin(), out.begin() + n);
+	return std::unique(out.begin(), out.begin() + n) - out.begin();
+}
+
+void hitPointGrid_t::countWorker(u_int32 start, u_int32 end, const point3d_t *P, const float *radius2, u_int32 *counts, std::vector<u_int32> *overflow) const
+{
+	std::vector<u_int32> bucketList(HASHGRID_MAX_CELLS);
+	for(u_int32 i=start; i<end; ++i)
 	{
-		if(!hashGrid[i] || hashGrid[i]->size() == 0) notused++;
+		u_int32 n = buckets(P[i], radius2[i], bucketList);
+		if(!n) overflow->push_back(i);
+		for(u_int32 b=0; b<n; ++b) ++counts[bucketList[b]];
 	}
-	Y_VERBOSE<<"HashGrid: there are " << notused << " enties not used!"<<std::endl;
 }
 
-unsigned int hashGrid_t::gather(const point3d_t &P, foundPhoton_t *found, unsigned int K, float sqRadius)
+void hitPointGrid_t::scatterWorker(u_int32 start, u_int32 end, const point3d_t *P, const float *radius2, u_int32 *offsets)
 {
-	unsigned int count = 0;
-	float radius = sqrt(sqRadius);
-
-	point3d_t rad(radius, radius, radius);
-	point3d_t bMin = ((P - rad) - bBox.a) * invcellSize;
-	point3d_t bMax = ((P + rad) - bBox.a) * invcellSize;
-
-	for (int iz = abs(int(bMin.z)); iz <= abs(int(bMax.z)); iz++) {
-		for (int iy = abs(int(bMin.y)); iy <= abs(int(bMax.y)); iy++) {
-			for (int ix = abs(int(bMin.x)); ix <= abs(int(bMax.x)); ix++) {
-				int hv = Hash(ix, iy, iz);
-
-				if(hashGrid[hv] == nullptr) continue;
-
-				for(auto itr = hashGrid[hv]->begin(); itr != hashGrid[hv]->end(); ++itr)
-				{
-					if( ( (*itr)->pos- P).lengthSqr() < sqRadius)
-					{
-						found[count++] = foundPhoton_t((*itr),sqRadius);
-					}
-				}
-			}
+	std::vector<u_int32> bucketList(HASHGRID_MAX_CELLS);
+	for(u_int32 i=start; i<end; ++i)
+	{
+		u_int32 n = buckets(P[i], radius2[i], bucketList);
+		for(u_int32 b=0; b<n; ++b) setEntry(offsets[bucketList[b]]++, P[i], radius2[i], i);
+	}
+}
+
+/*! Same counting sort as hashGrid_t::updateGrid, only a hit point makes one entry per
+	bucket it overlaps. About one bucket per hit point, with search spheres of about
+	the cell size a bucket then holds a few entries. A hit point overlapping more than
+	HITPOINTGRID_MAX_CELLS cells would fill many buckets, so it is put once in the overflow
+	list after the buckets instead, which every photon tests */
+void hitPointGrid_t::build(const point3d_t *P, const float *radius2, u_int32 n, float _cellSize, const bound_t &_bBox, int threads)
+{
+	cellSize = _cellSize;
+	invcellSize = 1.f / cellSize;
+	bBox = _bBox;
+	gridSize = 1;
+	while(gridSize < n) gridSize <<= 1;
+
+	threads = std::max(1, std::min(threads, (int)(n / HASHGRID_MIN_THREAD_PHOTONS)));
+	u_int32 chunk = (n + threads - 1) / threads;
+	std::vector<u_int32> counts((size_t)threads * gridSize, 0);
+	std::vector< std::vector<u_int32> > overflow(threads);
+
+	std::vector<std::thread> workers;
+	for(int t=1; t<threads; ++t)
+	{
+		workers.push_back(std::thread(&hitPointGrid_t::countWorker, this, std::min(n, t*chunk), std::min(n, (t+1)*chunk), P, radius2, &counts[(size_t)t*gridSize], &overflow[t]));
+	}
+	if(n) countWorker(0, std::min(n, chunk), P, radius2, &counts[0], &overflow[0]);
+	for(auto& w : workers) w.join();
+	workers.clear();
+
+	cellStart.resize(gridSize + 1);
+	u_int32 sum = 0;
+	for(u_int32 b=0; b<gridSize; ++b)
+	{
+		cellStart[b] = sum;
+		for(int t=0; t<threads; ++t)
+		{
+			u_int32 &c = counts[(size_t)t*gridSize + b];
+			u_int32 count = c;
+			c = sum;
+			sum += count;
 		}
 	}
-	return count;
+	cellStart[gridSize] = sum;
+
+	u_int32 total = sum;
+	for(int t=0; t<threads; ++t) total += overflow[t].size();
+	x.resize(total); y.resize(total); z.resize(total); r2.resize(total);
+	index.resize(total);
+	for(int t=1; t<threads; ++t)
+	{
+		workers.push_back(std::thread(&hitPointGrid_t::scatterWorker, this, std::min(n, t*chunk), std::min(n, (t+1)*chunk), P, radius2, &counts[(size_t)t*gridSize]));
+	}
+	if(n) scatterWorker(0, std::min(n, chunk), P, radius2, &counts[0]);
+	for(auto& w : workers) w.join();
+
+	u_int32 e = sum;
+	for(int t=0; t<threads; ++t)
+	{
+		for(u_int32 i : overflow[t]) setEntry(e++, P[i], radius2[i], i);
+	}
+
+	Y_VERBOSE << "HitPointGrid: " << n << " hit points in " << total << " entries, " << sum << " in " << gridSize << " buckets and " << total - sum << " in the overflow list" << yendl;
 }
 
-__END_YAFRAY
\ No newline at end of file
+__END_YAFRAY
@@ -120,6 +120,34 @@ float Lanczos2(float dx, float dy)
 	return 0.f;
 }
 
+/*! Per-tile sample accumulation buffer covering a render area plus the filter margin around it.
+	Only the thread rendering the area writes to it, so samples can be added without locking. */
+class filmTileBuffer_t
+{
+	public:
+		void init(const renderArea_t &a, int margin, int cx0, int cy0, int cx1, int cy1, size_t numPasses)
+		{
+			x0 = std::max(cx0, a.X - margin);
+			y0 = std::max(cy0, a.Y - margin);
+			x1 = std::min(cx1, a.X + a.W + margin);
+			y1 = std::min(cy1, a.Y + a.H + margin);
+			width = x1 - x0;
+			passSize = (size_t) width * (y1 - y0);
+			pixels.assign(passSize * numPasses, pixel_t());
+		}
+		bool contains(int xmin, int ymin, int xmax, int ymax) const
+		{
+			return xmin >= x0 && ymin >= y0 && xmax < x1 && ymax < y1;
+		}
+		pixel_t &operator()(size_t pass, int x, int y) { return pixels[pass * passSize + (size_t) (y - y0) * width + (x - x0)]; }
+
+		int x0, y0, x1, y1; //!< buffer extent in film coordinates, x1 and y1 excluded
+	protected:
+		int width;
+		size_t passSize;
+		std::vector<pixel_t> pixels; //!< image passes followed by auxiliary passes, each one stored in rows
+};
+
 imageFilm_t::imageFilm_t (int width, int height, int xstart, int ystart, colorOutput_t &out, float filterSize, filterType filt,
 						  renderEnvironment_t *e, bool showSamMask, int tSize, imageSpliter_t::tilesOrderType tOrder, bool pmA):
 	w(width), h(height), cx0(xstart), cy0(ystart), filterw(filterSize*0.5), output(&out),
@@ -172,6 +200,7 @@ imageFilm_t::imageFilm_t (int width, int height, int xstart, int ystart, colorOu
 		}
 	}
 
+	filterMargin = (int) ceil(filterw);
 	tableScale = 0.9999 * FILTER_TABLE_SIZE/filterw;
 	area_cnt = 0;
 
@@ -187,6 +216,8 @@ imageFilm_t::imageFilm_t (int width, int height, int xstart, int ystart, colorOu
 
 imageFilm_t::~imageFilm_t ()
 {
+	imagesSaveWait();
+	imageFilmSaveWait();
 	
 	//Deletion of the image buffers for the additional render passes
 	for(size_t idx = 0; idx < imagePasses.size(); ++idx)
@@ -208,6 +239,13 @@ imageFilm_t::~imageFilm_t ()
 	}
 	auxImagePasses.clear();
 
+	releaseTileBuffers();
+	for(size_t idx = 0; idx < freeTileBuffers.size(); ++idx)
+	{
+		delete(freeTileBuffers[idx]);
+	}
+	freeTileBuffers.clear();
+
 	if(densityImage) delete densityImage;
 	delete[] filterTable;
 	if(splitter) delete splitter;
@@ -233,15 +271,20 @@ void imageFilm_t::init(int numPasses)
 	// Setup the bucket splitter
 	if(split)
 	{
-		next_area = 0;
 		scene_t *scene = env->getScene();
 		int nThreads = 1;
 		if(scene) nThreads = scene->getNumThreads();
 		splitter = new imageSpliter_t(w, h, cx0, cy0, tileSize, tilesOrder, nThreads);
 		area_cnt = splitter->size();
+		areaQueues = std::vector<areaQueue_t>(std::max(1, nThreads));
 	}
 	else area_cnt = 1;
 
+	releaseTileBuffers();
+	tileBuffers.assign(area_cnt, nullptr);
+
+	if(split) scheduleAreas(false);
+
 	if(pbar) pbar->init(w * h);
 	session.setStatusCurrentPassPercent(pbar->getPercent());
 
@@ -271,9 +314,7 @@ void imageFilm_t::init(int numPasses)
 
 int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorName, bool skipNextPass)
 {
-	splitterMutex.lock();
-	next_area = 0;
-	splitterMutex.unlock();
+	releaseTileBuffers();	//Areas handed out but never finished (for example after an abort) must not keep their buffers
 	nPass++;
 	imagesAutoSavePassCounter++;
 	filmAutoSavePassCounter++;
@@ -299,7 +340,7 @@ int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorN
 		{
 			if((output && output->isImageOutput()) || (out2 && out2->isImageOutput()))
 			{
-				imageFilmSave();
+				imageFilmSaveAsync();
 				filmAutoSavePassCounter = 0;
 			}
 		}
@@ -477,11 +518,58 @@ int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorN
 		pbar->setTag(passString.str().c_str());
 	}
 	completed_cnt = 0;
+
+	if(split) scheduleAreas(adaptive_AA && AA_thesh > 0.f);
 	
 	return n_resample;
 }
 
-bool imageFilm_t::nextArea(int numView, renderArea_t &a)
+/*! Distributes the areas of the pass among the thread queues in contiguous chunks of similar cost.
+	The cost of an area is its number of pixels, or its number of pixels flagged for resampling in adaptive passes.
+	Areas without any pixel to render are not scheduled at all. */
+void imageFilm_t::scheduleAreas(bool useFlags)
+{
+	int nAreas = splitter->size();
+	std::vector<int> areaCost(nAreas, 0);
+	long long totalCost = 0;
+
+	for(int n = 0; n < nAreas; ++n)
+	{
+		renderArea_t r;
+		splitter->getArea(n, r);
+
+		if(useFlags && flags)
+		{
+			for(int j = r.Y - cy0; j < r.Y - cy0 + r.H; ++j)
+			{
+				for(int i = r.X - cx0; i < r.X - cx0 + r.W; ++i)
+				{
+					if(flags->getBit(i, j)) ++areaCost[n];
+				}
+			}
+		}
+		else areaCost[n] = r.W * r.H;
+
+		totalCost += areaCost[n];
+	}
+
+	int nQueues = (int) areaQueues.size();
+	long long accumCost = 0;
+	area_cnt = 0;
+
+	for(int q = 0; q < nQueues; ++q) areaQueues[q].areas.clear();
+
+	for(int n = 0; n < nAreas; ++n)
+	{
+		if(areaCost[n] <= 0) continue;
+		int q = std::min(nQueues - 1, (int) ((accumCost * nQueues) / totalCost));
+		areaQueues[q].areas.push_back(n);
+		accumCost += areaCost[n];
+		++area_cnt;
+	}
+}
+
+bool imageFilm_t::nextArea(int numView, renderArea_t &a, int threadID)
 {
 	if(abort) return false;
 
@@ -489,17 +577,35 @@ bool imageFilm_t::nextArea(int numView, renderArea_t &a)
 
 	if(split)
 	{
-		int n;
-		splitterMutex.lock();
-		n = next_area++;
-		splitterMutex.unlock();
+		int n = -1;
+		int nQueues = (int) areaQueues.size();
+
+		// take the next area of our own queue; if it is empty, steal the last area of the next non-empty queue
+		for(int k = 0; k < nQueues && n < 0; ++k)
+		{
+			areaQueue_t &queue = areaQueues[(threadID + k) % nQueues];
+			std::lock_guard<std::mutex> lk(queue.mutx);
+			if(queue.areas.empty()) continue;
+			if(k == 0)
+			{
+				n = queue.areas.front();
+				queue.areas.pop_front();
+			}
+			else
+			{
+				n = queue.areas.back();
+				queue.areas.pop_back();
+			}
+		}
 
-		if(	splitter->getArea(n, a) )
+		if(n >= 0 && splitter->getArea(n, a))
 		{
 			a.sx0 = a.X + ifilterw;
 			a.sx1 = a.X + a.W - ifilterw;
 			a.sy0 = a.Y + ifilterw;
 			a.sy1 = a.Y + a.H - ifilterw;
+			a.id = n;
+			tileBuffers[n] = acquireTileBuffer(a);
 
 			if(session.isInteractive())
 			{
@@ -523,69 +629,145 @@ bool imageFilm_t::nextArea(int numView, renderArea_t &a)
 		a.sx1 = a.X + a.W - ifilterw;
 		a.sy0 = a.Y + ifilterw;
 		a.sy1 = a.Y + a.H - ifilterw;
+		a.id = 0;
+		tileBuffers[0] = acquireTileBuffer(a);
 		++area_cnt;
 		return true;
 	}
 	return false;
 }
 
+filmTileBuffer_t *imageFilm_t::acquireTileBuffer(const renderArea_t &a)
+{
+	filmTileBuffer_t *tile = nullptr;
+
+	splitterMutex.lock();
+	if(!freeTileBuffers.empty())
+	{
+		tile = freeTileBuffers.back();
+		freeTileBuffers.pop_back();
+	}
+	splitterMutex.unlock();
+
+	if(!tile) tile = new filmTileBuffer_t;
+	tile->init(a, filterMargin, cx0, cy0, cx1, cy1, imagePasses.size() + auxImagePasses.size());
+
+	return tile;
+}
+
+void imageFilm_t::mergeTileBuffer(const renderArea_t &a)
+{
+	if(a.id < 0 || a.id >= (int) tileBuffers.size() || !tileBuffers[a.id]) return;
+
+	filmTileBuffer_t *tile = tileBuffers[a.id];
+	tileBuffers[a.id] = nullptr;
+
+	size_t numPasses = imagePasses.size();
+	size_t numAuxPasses = auxImagePasses.size();
+
+	//Pixels in the filter margin are shared with the neighbour tiles, so the merge is done under the image lock. It is taken once per tile instead of once per sample.
+	imageMutex.lock();
+	for(int j = tile->y0; j < tile->y1; ++j)
+	{
+		for(int i = tile->x0; i < tile->x1; ++i)
+		{
+			for(size_t idx = 0; idx < numPasses; ++idx)
+			{
+				const pixel_t &src = (*tile)(idx, i, j);
+				pixel_t &pixel = (*imagePasses[idx])(i - cx0, j - cy0);
+				pixel.col += src.col;
+				pixel.weight += src.weight;
+			}
+			for(size_t idx = 0; idx < numAuxPasses; ++idx)
+			{
+				const pixel_t &src = (*tile)(numPasses + idx, i, j);
+				pixel_t &pixel = (*auxImagePasses[idx])(i - cx0, j - cy0);
+				pixel.col += src.col;
+				pixel.weight += src.weight;
+			}
+		}
+	}
+	imageMutex.unlock();
+
+	splitterMutex.lock();
+	freeTileBuffers.push_back(tile);
+	splitterMutex.unlock();
+}
+
+void imageFilm_t::releaseTileBuffers()
+{
+	splitterMutex.lock();
+	for(size_t idx = 0; idx < tileBuffers.size(); ++idx)
+	{
+		if(tileBuffers[idx]) freeTileBuffers.push_back(tileBuffers[idx]);
+		tileBuffers[idx] = nullptr;
+	}
+	splitterMutex.unlock();
+}
+
 void imageFilm_t::finishArea(int numView, renderArea_t &a)
 {
 	outMutex.lock();
 
+	mergeTileBuffer(a);
+
     const renderPasses_t * renderPasses = env->getRenderPasses();
     
 	int end_x = a.X+a.W-cx0, end_y = a.Y+a.H-cy0;
 
-    std::vector<colorA_t> colExtPasses(imagePasses.size(), colorA_t(0.f));
-
-	for(int j=a.Y-cy0; j<end_y; ++j)
+	//Image outputs are only encoded when the images are saved, which writes all the pixels again, so the tiles are not copied to them
+	if(!output->isImageOutput())
 	{
-		for(int i=a.X-cx0; i<end_x; ++i)
+	    std::vector<colorA_t> colExtPasses(imagePasses.size(), colorA_t(0.f));
+
+		for(int j=a.Y-cy0; j<end_y; ++j)
 		{
-			for(size_t idx = 0; idx < imagePasses.size(); ++idx)
+			for(int i=a.X-cx0; i<end_x; ++i)
 			{
-				if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_AA_SAMPLES)
-				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).weight;
-				}
-				else if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_AUTO_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_AUTO_ABS
-                        )
+				for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
-                    colExtPasses[idx].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
+					if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_AA_SAMPLES)
+					{
+						colExtPasses[idx] = (*imagePasses[idx])(i, j).weight;
+					}
+					else if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_ABS ||
+	                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_AUTO_ABS ||
+	                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_ABS ||
+	                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_AUTO_ABS
+	                        )
+					{
+						colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
+	                    colExtPasses[idx].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
+					}
+	                else
+	                {
+	                    colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
+	                }
+
+					colExtPasses[idx].clampRGB0();
+					colExtPasses[idx].ColorSpace_from_linearRGB(colorSpace, gamma);//FIXME DAVID: what passes must be corrected and what do not?
+					if(premultAlpha && idx == 0) colExtPasses[idx].alphaPremultiply();
+
+					//To make sure we don't have any weird Alpha values outside the range [0.f, +1.f]
+					if(colExtPasses[idx].A < 0.f) colExtPasses[idx].A = 0.f;
+					else if(colExtPasses[idx].A > 1.f) colExtPasses[idx].A = 1.f;
 				}
-                else
-                {
-                    colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
-                }
-
-				colExtPasses[idx].clampRGB0();
-				colExtPasses[idx].ColorSpace_from_linearRGB(colorSpace, gamma);//FIXME DAVID: what passes must be corrected and what do not?
-				if(premultAlpha && idx == 0) colExtPasses[idx].alphaPremultiply();
 
-				//To make sure we don't have any weird Alpha values outside the range [0.f, +1.f]
-				if(colExtPasses[idx].A < 0.f) colExtPasses[idx].A = 0.f;
-				else if(colExtPasses[idx].A > 1.f) colExtPasses[idx].A = 1.f;
+				if( !output->putPixel(numView, i, j, renderPasses, colExtPasses) ) abort=true;
 			}
-
-			if( !output->putPixel(numView, i, j, renderPasses, colExtPasses) ) abort=true;
 		}
-	}
 
-	for(size_t idx = 1; idx < imagePasses.size(); ++idx)
-	{
-		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_FACES_EDGES)
+		for(size_t idx = 1; idx < imagePasses.size(); ++idx)
 		{
-			generateDebugFacesEdges(numView, idx, a.X-cx0, end_x, a.Y-cy0, end_y, true, output);
-		}
-		
-		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_OBJECTS_EDGES || renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_TOON)
-		{
-			generateToonAndDebugObjectEdges(numView, idx, a.X-cx0, end_x, a.Y-cy0, end_y, true, output);
+			if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_FACES_EDGES)
+			{
+				generateDebugFacesEdges(numView, idx, a.X-cx0, end_x, a.Y-cy0, end_y, true, output);
+			}
+
+			if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_OBJECTS_EDGES || renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_TOON)
+			{
+				generateToonAndDebugObjectEdges(numView, idx, a.X-cx0, end_x, a.Y-cy0, end_y, true, output);
+			}
 		}
 	}
 
@@ -608,8 +790,8 @@ void imageFilm_t::finishArea(int numView, renderArea_t &a)
 		if((imagesAutoSaveIntervalType == AUTOSAVE_TIME_INTERVAL) && (imagesAutoSaveTimer > imagesAutoSaveIntervalSeconds))
 		{
 			Y_DEBUG << "imagesAutoSaveTimer="<<imagesAutoSaveTimer<<yendl;
-			if(output && output->isImageOutput()) this->flush(numView, IF_ALL, output);
-			else if(out2 && out2->isImageOutput()) this->flush(numView, IF_ALL, out2);
+			if(output && output->isImageOutput()) imagesSaveAsync(numView, output);
+			else if(out2 && out2->isImageOutput()) imagesSaveAsync(numView, out2);
 			resetImagesAutoSaveTimer();
 		}
 
@@ -618,7 +800,7 @@ void imageFilm_t::finishArea(int numView, renderArea_t &a)
 			Y_DEBUG << "filmAutoSaveTimer="<<filmAutoSaveTimer<<yendl;
 			if((output && output->isImageOutput()) || (out2 && out2->isImageOutput()))
 			{
-				imageFilmSave();
+				imageFilmSaveAsync();
 			}
 			resetFilmAutoSaveTimer();
 		}
@@ -634,8 +816,46 @@ void imageFilm_t::finishArea(int numView, renderArea_t &a)
 	outMutex.unlock();
 }
 
+/*! Copy of the film buffers, serialized like imageFilm_t::save() so the saved files can be loaded
+	back normally. It allows writing the film while the render keeps adding samples. */
+struct imageFilm_t::filmSnapshot_t
+{
+	~filmSnapshot_t()
+	{
+		for(size_t idx = 0; idx < imagePasses.size(); ++idx) delete(imagePasses[idx]);
+		for(size_t idx = 0; idx < auxImagePasses.size(); ++idx) delete(auxImagePasses[idx]);
+		if(densityImage) delete densityImage;
+	}
+
+	filmload_check_t filmload_check;
+	unsigned int samplingOffset;
+	unsigned int baseSamplingOffset;
+	unsigned int computerNode;
+	std::vector<rgba2DImage_t*> imagePasses;
+	std::vector<rgba2DImage_t*> auxImagePasses;
+	rgb2DImage_nw_t *densityImage = nullptr;	//!< only copied for the images autosave, the film file does not keep it
+	int numDensitySamples = 0;
+
+	friend class boost::serialization::access;
+	template<class Archive> void serialize(Archive & ar, const unsigned int version)
+	{
+		ar & BOOST_SERIALIZATION_NVP(filmload_check);
+		imageFilm_t::serializeFilmData(ar, *this);
+	}
+};
+
 void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 {
+	imagesSaveWait();
+	writeImages(numView, flags, out, nullptr);
+}
+
+/*! Writes the film, or a snapshot of it taken by imagesSaveAsync(), to the outputs. The snapshot
+	is written from the images autosave thread, so it leaves the progress bar alone. */
+void imageFilm_t::writeImages(int numView, int flags, colorOutput_t *out, const filmSnapshot_t *snapshot)
+{
+	const std::vector<rgba2DImage_t*> &passes = snapshot ? snapshot->imagePasses : imagePasses;
+	const rgb2DImage_nw_t *density = snapshot ? snapshot->densityImage : densityImage;
     const renderPasses_t * renderPasses = env->getRenderPasses();
     
 	if(session.renderFinished())
@@ -724,7 +944,8 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 	float densityFactor = 0.f;
 
-	if(estimateDensity && numDensitySamples > 0) densityFactor = (float) (w * h) / (float) numDensitySamples;
+	int densitySamples = snapshot ? snapshot->numDensitySamples : numDensitySamples;
+	if(estimateDensity && density && densitySamples > 0) densityFactor = (float) (w * h) / (float) densitySamples;
 
     std::vector<colorA_t> colExtPasses(imagePasses.size(), colorA_t(0.f));
 
@@ -745,7 +966,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 			{
 				if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_AA_SAMPLES)
 				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).weight;
+					colExtPasses[idx] = (*passes[idx])(i, j).weight;
 				}
 				else if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_ABS ||
                         renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_AUTO_ABS ||
@@ -753,16 +974,16 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
                         renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_AUTO_ABS
                         )
 				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
+					colExtPasses[idx] = (*passes[idx])(i, j).normalized();
                     colExtPasses[idx].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
 				}
                 else
                 {
-                    if(flags & IF_IMAGE) colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
+                    if(flags & IF_IMAGE) colExtPasses[idx] = (*passes[idx])(i, j).normalized();
                     else colExtPasses[idx] = colorA_t(0.f);
                 }
 								
-				if(estimateDensity && (flags & IF_DENSITYIMAGE) && idx == 0 && densityFactor > 0.f) colExtPasses[idx] += colorA_t((*densityImage)(i, j) * densityFactor, 0.f);
+				if(estimateDensity && (flags & IF_DENSITYIMAGE) && idx == 0 && densityFactor > 0.f) colExtPasses[idx] += colorA_t((*density)(i, j) * densityFactor, 0.f);
                 
 				colExtPasses[idx].clampRGB0();
 				
@@ -802,12 +1023,12 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 	{
 		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_FACES_EDGES)
 		{
-			generateDebugFacesEdges(numView, idx, 0, w, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight);
+			generateDebugFacesEdges(numView, idx, 0, w, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight, snapshot);
 		}
 		
 		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_OBJECTS_EDGES || renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_TOON)
 		{
-			generateToonAndDebugObjectEdges(numView, idx, 0, w, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight);
+			generateToonAndDebugObjectEdges(numView, idx, 0, w, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight, snapshot);
 		}
 	}
 	
@@ -865,7 +1086,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		std::string oldTag;
 
-		if(pbar)
+		if(pbar && !snapshot)
 		{
 			oldTag = pbar->getTag();
 			pbar->setTag(passString.str().c_str());
@@ -873,7 +1094,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		out1->flush(numView, renderPasses);
 		
-		if(pbar) pbar->setTag(oldTag);
+		if(pbar && !snapshot) pbar->setTag(oldTag);
 	}
 	
 	if(out2 && out2->isImageOutput())
@@ -885,7 +1106,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		std::string oldTag;
 
-		if(pbar)
+		if(pbar && !snapshot)
 		{
 			oldTag = pbar->getTag();
 			pbar->setTag(passString.str().c_str());
@@ -893,7 +1114,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		out2->flush(numView, renderPasses);
 
-		if(pbar) pbar->setTag(oldTag);
+		if(pbar && !snapshot) pbar->setTag(oldTag);
 	}
 
 	if(session.renderFinished())
@@ -958,7 +1179,12 @@ void imageFilm_t::addSample(colorPasses_t &colorPasses, int x, int y, float dx,
 	x0 = x+dx0; x1 = x+dx1;
 	y0 = y+dy0; y1 = y+dy1;
 
-	imageMutex.lock();
+	// samples of an area handed out by nextArea go to its own tile buffer, only the rest needs the image lock
+	filmTileBuffer_t *tile = nullptr;
+	if(a && a->id >= 0 && a->id < (int) tileBuffers.size()) tile = tileBuffers[a->id];
+	if(tile && !tile->contains(x0, y0, x1, y1)) tile = nullptr;
+
+	if(!tile) imageMutex.lock();
 
 	for (int j = y0; j <= y1; ++j)
 	{
@@ -975,7 +1201,7 @@ void imageFilm_t::addSample(colorPasses_t &colorPasses, int x, int y, float dx,
 				
 				col.clampProportionalRGB(AA_clamp_samples);
 
-				pixel_t &pixel = (*imagePasses[idx])(i - cx0, j - cy0);
+				pixel_t &pixel = tile ? (*tile)(idx, i, j) : (*imagePasses[idx])(i - cx0, j - cy0);
 
 				if(premultAlpha) col.alphaPremultiply();
 
@@ -995,7 +1221,7 @@ void imageFilm_t::addSample(colorPasses_t &colorPasses, int x, int y, float dx,
 				
 				col.clampProportionalRGB(AA_clamp_samples);
 
-				pixel_t &pixel = (*auxImagePasses[idx])(i - cx0, j - cy0);
+				pixel_t &pixel = tile ? (*tile)(imagePasses.size() + idx, i, j) : (*auxImagePasses[idx])(i - cx0, j - cy0);
 
 				if(premultAlpha) col.alphaPremultiply();
 
@@ -1012,7 +1238,7 @@ void imageFilm_t::addSample(colorPasses_t &colorPasses, int x, int y, float dx,
 		}
 	}
 
-	imageMutex.unlock();
+	if(!tile) imageMutex.unlock();
 }
 
 void imageFilm_t::addDensitySample(const color_t& c, int x, int y, float dx, float dy, const renderArea_t *a)
@@ -1465,24 +1691,36 @@ void imageFilm_t::imageFilmLoadAllInFolder()
 }
 
 
-bool imageFilm_t::imageFilmSave()
+imageFilm_t::filmSnapshot_t *imageFilm_t::takeFilmSnapshot(bool withDensity)
 {
-	bool debugXMLformat = false;	//Enable only for debugging purposes
-	
-	std::stringstream passString;
-	passString << "Saving internal ImageFilm file";
+	Y_DEBUG<<"FilmSave computerNode="<<computerNode<<" baseSamplingOffset="<<baseSamplingOffset<<" samplingOffset="<<samplingOffset<<yendl;
 
-	Y_INFO << passString.str() << yendl;
+	filmSnapshot_t *snapshot = new filmSnapshot_t;
+	snapshot->filmload_check = filmload_check;
+	snapshot->samplingOffset = samplingOffset;
+	snapshot->baseSamplingOffset = baseSamplingOffset;
+	snapshot->computerNode = computerNode;
 
-	std::string oldTag;
+	imageMutex.lock();
+	for(size_t idx = 0; idx < imagePasses.size(); ++idx) snapshot->imagePasses.push_back(new rgba2DImage_t(*imagePasses[idx]));
+	for(size_t idx = 0; idx < auxImagePasses.size(); ++idx) snapshot->auxImagePasses.push_back(new rgba2DImage_t(*auxImagePasses[idx]));
+	imageMutex.unlock();
 
-	if(pbar)
+	if(withDensity && estimateDensity && densityImage)
 	{
-		oldTag = pbar->getTag();
-		pbar->setTag(passString.str().c_str());
+		densityImageMutex.lock();
+		snapshot->densityImage = new rgb2DImage_nw_t(*densityImage);
+		snapshot->numDensitySamples = numDensitySamples;
+		densityImageMutex.unlock();
 	}
 
-	std::string filmPath = getFilmPath();
+	return snapshot;
+}
+
+//! writes the film itself, or a snapshot of it, to the film file
+template<class Film> bool imageFilm_t::writeFilmFile(const Film &film, const std::string &filmPath) const
+{
+	bool debugXMLformat = false;	//Enable only for debugging purposes
 
 	try
 	{
@@ -1492,28 +1730,27 @@ bool imageFilm_t::imageFilmSave()
 		{
 			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in XML format" << yendl;
 			boost::archive::xml_oarchive oa(ofs);
-			oa << BOOST_SERIALIZATION_NVP(*this);
+			oa << boost::serialization::make_nvp("*this", film);
 			ofs.close();
 		}
 		else if(filmFileSaveBinaryFormat)
 		{
 			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in Binary (non portable) format" << yendl;
 			boost::archive::binary_oarchive oa(ofs);
-			oa << BOOST_SERIALIZATION_NVP(*this);
+			oa << boost::serialization::make_nvp("*this", film);
 			ofs.close();
 		}
 		else
 		{
 			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in Text format" << yendl;
 			boost::archive::text_oarchive oa(ofs);
-			oa << BOOST_SERIALIZATION_NVP(*this);
+			oa << boost::serialization::make_nvp("*this", film);
 			ofs.close();
 		}
 	Y_VERBOSE << "imageFilm: Film saved to file." << yendl;
 	}
 	catch(std::exception& ex){
         Y_WARNING << "imageFilm: error '" << ex.what() << "' while saving ImageFilm file: '" << filmPath << "'" << yendl;
-		if(pbar) pbar->setTag(oldTag);
 		return false;
     }
     
@@ -1527,9 +1764,91 @@ bool imageFilm_t::imageFilmSave()
 		Y_WARNING << "imageFilm: file operation error \"" << e.what() << yendl;
 	}
 
+	return true;
+}
+
+bool imageFilm_t::imageFilmSave()
+{
+	imageFilmSaveWait();
+
+	std::stringstream passString;
+	passString << "Saving internal ImageFilm file";
+
+	Y_INFO << passString.str() << yendl;
+
+	std::string oldTag;
+
+	if(pbar)
+	{
+		oldTag = pbar->getTag();
+		pbar->setTag(passString.str().c_str());
+	}
+
+	// nothing renders any more, so the film is written directly instead of through a copy
+	bool result = writeFilmFile(*this, getFilmPath());
+
 	if(pbar) pbar->setTag(oldTag);
 	
-	return true;
+	return result;
+}
+
+/*! Saves the film from a background thread, working on a snapshot of the film buffers.
+	If the previous autosave is still being written, this one is skipped instead of waiting for it. */
+void imageFilm_t::imageFilmSaveAsync()
+{
+	if(filmSaveInProgress)
+	{
+		Y_VERBOSE << "imageFilm: previous film autosave still in progress, skipping this one" << yendl;
+		return;
+	}
+	if(filmSaveThread.joinable()) filmSaveThread.join();
+
+	Y_INFO << "Saving internal ImageFilm file in the background" << yendl;
+
+	filmSaveInProgress = true;
+	filmSnapshot_t *snapshot = takeFilmSnapshot();
+	filmSaveThread = std::thread(&imageFilm_t::filmSaveWorker, this, snapshot, getFilmPath());
+}
+
+void imageFilm_t::imageFilmSaveWait()
+{
+	if(filmSaveThread.joinable()) filmSaveThread.join();
+}
+
+void imageFilm_t::filmSaveWorker(filmSnapshot_t *snapshot, std::string filmPath)
+{
+	writeFilmFile(*snapshot, filmPath);
+	delete snapshot;
+	filmSaveInProgress = false;
+}
+
+/*! Autosaves the images from a background thread, working on a snapshot of the film buffers, so the
+	render threads do not wait for the images to be encoded and written.
+	If the previous autosave is still being written, this one is skipped instead of waiting for it. */
+void imageFilm_t::imagesSaveAsync(int numView, colorOutput_t *out)
+{
+	if(imagesSaveInProgress)
+	{
+		Y_VERBOSE << "imageFilm: previous images autosave still in progress, skipping this one" << yendl;
+		return;
+	}
+	if(imagesSaveThread.joinable()) imagesSaveThread.join();
+
+	imagesSaveInProgress = true;
+	filmSnapshot_t *snapshot = takeFilmSnapshot(true);
+	imagesSaveThread = std::thread(&imageFilm_t::imagesSaveWorker, this, numView, out, snapshot);
+}
+
+void imageFilm_t::imagesSaveWait()
+{
+	if(imagesSaveThread.joinable()) imagesSaveThread.join();
+}
+
+void imageFilm_t::imagesSaveWorker(int numView, colorOutput_t *out, filmSnapshot_t *snapshot)
+{
+	writeImages(numView, IF_ALL, out, snapshot);
+	delete snapshot;
+	imagesSaveInProgress = false;
 }
 
 void imageFilm_t::imageFilmFileBackup() const
@@ -1662,15 +1981,15 @@ void imageFilm_t::edgeImageDetection(std::vector<cv::Mat> & imageMat, float edge
 	if(smoothness > 0.f) cv::GaussianBlur( imageMat.at(0), imageMat.at(0), cv::Size(3,3), /*sigmaX=*/ smoothness );
 }
 
-void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement)
+void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement, const filmSnapshot_t *snapshot)
 {
 	const renderPasses_t * renderPasses = env->getRenderPasses();
 	const int facesEdgeThickness = renderPasses->facesEdgeThickness;
 	const float facesEdgeThreshold = renderPasses->facesEdgeThreshold;
 	const float facesEdgeSmoothness = renderPasses->facesEdgeSmoothness;
 
-    rgba2DImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_GEOM);
-    rgba2DImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM);
+    rgba2DImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_GEOM, snapshot);
+    rgba2DImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM, snapshot);
 
 	if(normalImagePass && zDepthImagePass)
 	{
@@ -1708,7 +2027,7 @@ void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart,
 	}
 }
 
-void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement)
+void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement, const filmSnapshot_t *snapshot)
 {
 	const renderPasses_t * renderPasses = env->getRenderPasses();
 	const float toonPreSmooth = renderPasses->toonPreSmooth;
@@ -1719,8 +2038,9 @@ void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int
 	const float objectEdgeThreshold = renderPasses->objectEdgeThreshold;
 	const float objectEdgeSmoothness = renderPasses->objectEdgeSmoothness;
 	
-    rgba2DImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_SMOOTH);
-    rgba2DImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM);
+    rgba2DImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_SMOOTH, snapshot);
+    rgba2DImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM, snapshot);
+	const rgba2DImage_t * combinedImagePass = snapshot ? snapshot->imagePasses[0] : imagePasses[0];
 	
 	if(normalImagePass && zDepthImagePass)
 	{
@@ -1737,9 +2057,9 @@ void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int
 				colNormal = (*normalImagePass)(i, j).normalized();
 				zDepth = (*zDepthImagePass)(i, j).normalized().A;
 
-				imageMatCombinedVec(j, i)[0] = (*imagePasses[0])(i, j).normalized().B;
-				imageMatCombinedVec(j, i)[1] = (*imagePasses[0])(i, j).normalized().G;
-				imageMatCombinedVec(j, i)[2] = (*imagePasses[0])(i, j).normalized().R;
+				imageMatCombinedVec(j, i)[0] = (*combinedImagePass)(i, j).normalized().B;
+				imageMatCombinedVec(j, i)[1] = (*combinedImagePass)(i, j).normalized().G;
+				imageMatCombinedVec(j, i)[2] = (*combinedImagePass)(i, j).normalized().R;
 										
 				imageMat.at(0).at<float>(j, i) = colNormal.getR();
 				imageMat.at(1).at<float>(j, i) = colNormal.getG();
@@ -1814,23 +2134,26 @@ void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int
 
 #else   //If not built with OpenCV, these functions will do nothing
 
-void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement) { }
+void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement, const filmSnapshot_t *snapshot) { }
 
-void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement) { }
+void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement, colorOutput_t * out2, int out2displacement, const filmSnapshot_t *snapshot) { }
 
 #endif
 
 
-rgba2DImage_t * imageFilm_t::getImagePassFromIntPassType(int intPassType)
+rgba2DImage_t * imageFilm_t::getImagePassFromIntPassType(int intPassType, const filmSnapshot_t *snapshot)
 {
-    for(size_t idx = 1; idx < imagePasses.size(); ++idx)
+	const std::vector<rgba2DImage_t*> &passes = snapshot ? snapshot->imagePasses : imagePasses;
+	const std::vector<rgba2DImage_t*> &auxPasses = snapshot ? snapshot->auxImagePasses : auxImagePasses;
+
+    for(size_t idx = 1; idx < passes.size(); ++idx)
 	{
-		if(env->getScene()->getRenderPasses()->intPassTypeFromExtPassIndex(idx) == intPassType) return imagePasses[idx];
+		if(env->getScene()->getRenderPasses()->intPassTypeFromExtPassIndex(idx) == intPassType) return passes[idx];
 	}
     
-	for(size_t idx = 0; idx < auxImagePasses.size(); ++idx)
+	for(size_t idx = 0; idx < auxPasses.size(); ++idx)
 	{
-		if(env->getScene()->getRenderPasses()->intPassTypeFromAuxPassIndex(idx) == intPassType) return auxImagePasses[idx];
+		if(env->getScene()->getRenderPasses()->intPassTypeFromAuxPassIndex(idx) == intPassType) return auxPasses[idx];
 	}
     
     return nullptr;
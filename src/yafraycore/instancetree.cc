@@ -0,0 +1,311 @@
+#include <yafraycore/instancetree.h>
+#include <yafraycore/bvh.h>
+#include <yafraycore/timer.h>
+#include <core_api/scene.h>
+#include <algorithm>
+
+__BEGIN_YAFRAY
+
+#define INST_LEAF_SIZE 2
+#define INST_MAX_STACK 64
+
+struct instStack_t
+{
+	u_int32 node;
+	float t; //!< entry distance of the node bound
+};
+
+triInstanceTree_t::triInstanceTree_t(const std::vector<const triangleObjectInstance_t *> &insts, int accelerator, int threads, int quality, int bins)
+	: deepestLeaf(0)
+{
+	Y_INFO << "Instances: Starting build (" << insts.size() << " instances)" << yendl;
+	gTimer.addEvent("instances");
+	gTimer.start("instances");
+
+	size_t uniquePrims = 0, instancedPrims = 0;
+	instances.reserve(insts.size());
+	for(size_t i=0; i<insts.size(); ++i)
+	{
+		const triangleObjectInstance_t *obj = insts[i];
+		triangleObject_t *baseObj = obj->getBase();
+		int nprims = baseObj->numPrimitives();
+		if(nprims <= 0) continue;
+
+		matrix4x4_t worldToObj = obj->getObjToWorld();
+		worldToObj.inverse();
+		if(worldToObj.invalid())
+		{
+			Y_WARNING << "Instances: skipping instance with a singular transform" << yendl;
+			continue;
+		}
+
+		auto b = baseTrees.find(baseObj);
+		if(b == baseTrees.end())
+		{
+			// object space tree of the base mesh, built once for all its instances
+			const triangle_t **tris = new const triangle_t*[nprims];
+			baseObj->getPrimitives(tris);
+			baseTree_t base;
+			base.tree = nullptr, base.bvh = nullptr;
+			if(accelerator == ACCEL_BVH) base.bvh = new triBVH_t(tris, nprims, 1.f, quality, bins);
+			else base.tree = new triKdTree_t(tris, nprims, -1, 1, 0.8, 0.33, threads, quality, bins);
+			delete [] tris;
+			b = baseTrees.insert(std::make_pair(baseObj, base)).first;
+			uniquePrims += nprims;
+		}
+		instancedPrims += nprims;
+
+		instance_t inst;
+		inst.obj = obj;
+		inst.base = &b->second;
+		inst.worldToObj = worldToObj;
+		// world bound from the eight transformed corners of the object space bound
+		bound_t objBound = b->second.bvh ? b->second.bvh->getBound() : b->second.tree->getBound();
+		const matrix4x4_t &objToWorld = obj->getObjToWorld();
+		for(int c=0; c<8; ++c)
+		{
+			point3d_t p((c & 1) ? objBound.g.x : objBound.a.x, (c & 2) ? objBound.g.y : objBound.a.y, (c & 4) ? objBound.g.z : objBound.a.z);
+			p = objToWorld * p;
+			if(c == 0) inst.bound.set(p, p);
+			else inst.bound.include(p);
+		}
+		inst.center = inst.bound.center();
+		instances.push_back(inst);
+	}
+
+	if(!instances.empty())
+	{
+		nodes.reserve(2 * instances.size());
+		buildTree(0, instances.size(), 0);
+		treeBound = nodes[0].bound;
+	}
+
+	gTimer.stop("instances");
+	Y_INFO << "Instances: Built in " << 1000.0 * gTimer.getTime("instances") << "ms: " << instances.size() << " instances of "
+		<< baseTrees.size() << " base meshes, " << uniquePrims << " unique of " << instancedPrims << " instanced prims, "
+		<< nodes.size() << " nodes, max depth: " << deepestLeaf << yendl;
+}
+
+triInstanceTree_t::~triInstanceTree_t()
+{
+	for(auto i=baseTrees.begin(); i!=baseTrees.end(); ++i)
+	{
+		if(i->second.tree) delete i->second.tree;
+		if(i->second.bvh) delete i->second.bvh;
+	}
+}
+
+/*! Median split along the longest axis of the instance centers.
+	\return index of the new node */
+u_int32 triInstanceTree_t::buildTree(u_int32 first, u_int32 last, int depth)
+{
+	u_int32 nodeIdx = nodes.size();
+	nodes.push_back(node_t());
+	bound_t nodeBound = instances[first].bound;
+	bound_t centBound(instances[first].center, instances[first].center);
+	for(u_int32 i=first+1; i<last; ++i)
+	{
+		nodeBound = bound_t(nodeBound, instances[i].bound);
+		centBound.include(instances[i].center);
+	}
+	nodes[nodeIdx].bound = nodeBound;
+	nodes[nodeIdx].rightChild = 0;
+	nodes[nodeIdx].first = first;
+	nodes[nodeIdx].count = last - first;
+
+	if(last - first <= INST_LEAF_SIZE || depth >= INST_MAX_STACK - 2)
+	{
+		deepestLeaf = std::max(deepestLeaf, depth);
+		return nodeIdx;
+	}
+
+	int axis = centBound.largestAxis();
+	u_int32 mid = first + (last - first) / 2;
+	std::nth_element(instances.begin() + first, instances.begin() + mid, instances.begin() + last,
+		[axis](const instance_t &l, const instance_t &r) { return l.center[axis] < r.center[axis]; });
+
+	buildTree(first, mid, depth+1);
+	u_int32 right = buildTree(mid, last, depth+1);
+	nodes[nodeIdx].rightChild = right;
+	return nodeIdx;
+}
+
+/*! The direction is transformed but not normalized, so distances along
+	the object space ray are the same as along the world space ray */
+inline void triInstanceTree_t::toObject(const instance_t &inst, const ray_t &ray, ray_t &objRay) const
+{
+	objRay.from = inst.worldToObj * ray.from;
+	objRay.dir = inst.worldToObj * ray.dir;
+	objRay.tmin = ray.tmin;
+	objRay.tmax = ray.tmax;
+	objRay.time = ray.time;
+}
+
+bool triInstanceTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, const triangleObjectInstance_t **inst, float &Z, intersectData_t &data) const
+{
+	Z=dist;
+	float a, b;
+	if(nodes.empty() || !treeBound.cross(ray, a, b, dist)) return false;
+
+	instStack_t stack[INST_MAX_STACK];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].t = a;
+	++top;
+	bool hit = false;
+	ray_t objRay;
+
+	while(top > 0)
+	{
+		const instStack_t &entry = stack[--top];
+		if(entry.t > Z) continue;
+		u_int32 nodeIdx = entry.node;
+		const node_t &node = nodes[nodeIdx];
+
+		if(!node.rightChild)
+		{
+			for(u_int32 i=node.first; i<node.first+node.count; ++i)
+			{
+				const instance_t &in = instances[i];
+				if(!in.bound.cross(ray, a, b, Z)) continue;
+				toObject(in, ray, objRay);
+				triangle_t *hitt = nullptr;
+				float z;
+				intersectData_t d;
+				bool h = in.base->bvh ? in.base->bvh->Intersect(objRay, Z, &hitt, z, d) : in.base->tree->Intersect(objRay, Z, &hitt, z, d);
+				if(h && z < Z)
+				{
+					Z = z;
+					*tr = hitt;
+					*inst = in.obj;
+					data = d;
+					hit = true;
+				}
+			}
+			continue;
+		}
+
+		// push the farther child first
+		float la = 0.f, lb = 0.f, ra = 0.f, rb = 0.f;
+		bool hitL = nodes[nodeIdx+1].bound.cross(ray, la, lb, Z);
+		bool hitR = nodes[node.rightChild].bound.cross(ray, ra, rb, Z);
+		u_int32 right = node.rightChild;
+		if(hitL && hitR)
+		{
+			bool leftFirst = la <= ra;
+			stack[top].node = leftFirst ? right : nodeIdx+1;
+			stack[top].t = leftFirst ? ra : la;
+			++top;
+			stack[top].node = leftFirst ? nodeIdx+1 : right;
+			stack[top].t = leftFirst ? la : ra;
+			++top;
+		}
+		else if(hitL)
+		{
+			stack[top].node = nodeIdx+1;
+			stack[top].t = la;
+			++top;
+		}
+		else if(hitR)
+		{
+			stack[top].node = right;
+			stack[top].t = ra;
+			++top;
+		}
+	}
+
+	return hit;
+}
+
+bool triInstanceTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, const triangleObjectInstance_t **inst, float shadow_bias) const
+{
+	float a, b;
+	if(nodes.empty() || !treeBound.cross(ray, a, b, dist)) return false;
+
+	u_int32 stack[INST_MAX_STACK];
+	int top = 0;
+	stack[top++] = 0;
+	ray_t objRay;
+
+	while(top > 0)
+	{
+		u_int32 nodeIdx = stack[--top];
+		const node_t &node = nodes[nodeIdx];
+
+		if(!node.rightChild)
+		{
+			for(u_int32 i=node.first; i<node.first+node.count; ++i)
+			{
+				const instance_t &in = instances[i];
+				if(!in.bound.cross(ray, a, b, dist)) continue;
+				toObject(in, ray, objRay);
+				triangle_t *hitt = nullptr;
+				bool h = in.base->bvh ? in.base->bvh->IntersectS(objRay, dist, &hitt, shadow_bias) : in.base->tree->IntersectS(objRay, dist, &hitt, shadow_bias);
+				if(h)
+				{
+					*tr = hitt;
+					*inst = in.obj;
+					return true;
+				}
+			}
+			continue;
+		}
+
+		if(nodes[nodeIdx+1].bound.cross(ray, a, b, dist)) stack[top++] = nodeIdx+1;
+		if(nodes[node.rightChild].bound.cross(ray, a, b, dist)) stack[top++] = node.rightChild;
+	}
+
+	return false;
+}
+
+/*=============================================================
+	allow for transparent shadows.
+=============================================================*/
+
+bool triInstanceTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, const triangleObjectInstance_t **inst,
+	color_t &filt, float shadow_bias) const
+{
+	float a, b;
+	if(nodes.empty() || !treeBound.cross(ray, a, b, dist)) return false;
+
+	u_int32 stack[INST_MAX_STACK];
+	int top = 0;
+	stack[top++] = 0;
+	ray_t objRay;
+	int depth = 0; // transparent surfaces passed in the instances traced so far
+
+	while(top > 0)
+	{
+		u_int32 nodeIdx = stack[--top];
+		const node_t &node = nodes[nodeIdx];
+
+		if(!node.rightChild)
+		{
+			for(u_int32 i=node.first; i<node.first+node.count; ++i)
+			{
+				const instance_t &in = instances[i];
+				if(!in.bound.cross(ray, a, b, dist)) continue;
+				toObject(in, ray, objRay);
+				triangle_t *hitt = nullptr;
+				int layers = 0;
+				bool h = in.base->bvh ? in.base->bvh->IntersectTS(state, objRay, maxDepth - depth, dist, &hitt, filt, shadow_bias, in.obj, &layers)
+					: in.base->tree->IntersectTS(state, objRay, maxDepth - depth, dist, &hitt, filt, shadow_bias, in.obj, &layers);
+				if(hitt)
+				{
+					*tr = hitt;
+					*inst = in.obj;
+				}
+				if(h) return true;
+				depth += layers;
+			}
+			continue;
+		}
+
+		if(nodes[nodeIdx+1].bound.cross(ray, a, b, dist)) stack[top++] = nodeIdx+1;
+		if(nodes[node.rightChild].bound.cross(ray, a, b, dist)) stack[top++] = node.rightChild;
+	}
+
+	return false;
+}
+
+__END_YAFRAY
@@ -49,7 +49,7 @@ void tiledIntegrator_t::renderWorker(int mNumView, tiledIntegrator_t *integrator
 {
 	renderArea_t a;
 
-	while(imageFilm->nextArea(mNumView, a))
+	while(imageFilm->nextArea(mNumView, a, threadID))
 	{
 		if(scene->getSignals() & Y_SIG_ABORT) break;
 		integrator->preTile(a, samples, offset, adaptive, threadID);
@@ -250,6 +250,7 @@ bool tiledIntegrator_t::render(int numView, imageFilm_t *image)
 		} 
 	}
 	maxDepth = 0.f;
+	threadPool.reset();
 	gTimer.stop("rendert");
 	session.setStatusRenderFinished();
 	Y_INFO << integratorName << ": Overall rendertime: " << gTimer.getTime("rendert") << "s" << yendl;
@@ -271,25 +272,30 @@ bool tiledIntegrator_t::renderPass(int numView, int samples, int offset, bool ad
 
 	if(nthreads>1)
 	{
+		if(!threadPool || threadPool->size() != nthreads) threadPool.reset(new threadPool_t(nthreads));
+
 		threadControl_t tc;
-		std::vector<std::thread> threads;
-		for(int i=0;i<nthreads;++i)
-		{
-			threads.push_back(std::thread(&tiledIntegrator_t::renderWorker, this, numView, this, scene, imageFilm, &tc, i, samples, (offset + imageFilm->getBaseSamplingOffset()), adaptive, AA_pass_number));
-		}
+		threadPool->run(std::bind(&tiledIntegrator_t::renderWorker, this, numView, this, scene, imageFilm, &tc, std::placeholders::_1, samples, (offset + imageFilm->getBaseSamplingOffset()), adaptive, AA_pass_number));
 
+		//This thread does the output of the finished areas. The queue is unlocked while the areas are being finished, so the render threads never wait for the color conversion, image output or autosaving
+		std::vector<renderArea_t> finishedAreas;
 		std::unique_lock<std::mutex> lk(tc.m);
-		while(tc.finishedThreads < nthreads)
+		while(true)
 		{
-			tc.c.wait(lk);
-			for(size_t i=0; i<tc.areas.size(); ++i)
+			while(tc.areas.empty() && tc.finishedThreads < nthreads) tc.c.wait(lk);
+			if(tc.areas.empty()) break;
+
+			finishedAreas.swap(tc.areas);
+			lk.unlock();
+			for(size_t i=0; i<finishedAreas.size(); ++i)
 			{				
-				imageFilm->finishArea(numView, tc.areas[i]);
+				imageFilm->finishArea(numView, finishedAreas[i]);
 			}
-			tc.areas.clear();
+			finishedAreas.clear();
+			lk.lock();
 		}
 
-		for(auto& t : threads) t.join();	//join all threads (although they probably have exited already, but not necessarily):
+		threadPool->wait();	//make sure all the workers are idle (although they probably are already, but not necessarily) before the next pass
 	}
 	else
 	{
@@ -0,0 +1,144 @@
+#include <yafraycore/irradiancecache.h>
+
+__BEGIN_YAFRAY
+
+struct irradianceLookup_t
+{
+	irradianceLookup_t(const vector3d_t &n, float error): N(n), a(error), invA(1.f / error), E(0.f), wSum(0.f) {}
+	bool operator()(const point3d_t &P, const irradianceRecord_t &rec)
+	{
+		if(N * rec.N < 0.01f) return true;
+		vector3d_t d = P - rec.P;
+		// skip records in front of P, they may see light P does not
+		if(d * (N + rec.N) * 0.5f < -0.05f * rec.R) return true;
+		float err = d.length() / rec.R + fSqrt(std::max(0.f, 1.f - N * rec.N));
+		if(err >= a) return true;
+		// falls to zero at the error threshold, so records do not pop in and out
+		float w = 1.f / std::max(err, 1e-4f) - invA;
+		vector3d_t rot = rec.N ^ N;
+		E.R += w * (rec.E.R + rot * rec.rotGrad[0] + d * rec.transGrad[0]);
+		E.G += w * (rec.E.G + rot * rec.rotGrad[1] + d * rec.transGrad[1]);
+		E.B += w * (rec.E.B + rot * rec.rotGrad[2] + d * rec.transGrad[2]);
+		wSum += w;
+		return true;
+	}
+	const vector3d_t &N;
+	float a, invA;
+	color_t E;
+	float wSum;
+};
+
+irradianceCache_t::irradianceCache_t(const bound_t &sceneBound, float error, float _minSpacing, float _maxSpacing):
+	tree(sceneBound), a(error), invA(1.f / error), minSpacing(_minSpacing), maxSpacing(_maxSpacing), records(0)
+{
+}
+
+bool irradianceCache_t::interpolate(const point3d_t &P, const vector3d_t &N, color_t &E) const
+{
+	irradianceLookup_t proc(N, a);
+	tree.lookup(P, proc);
+	if(proc.wSum <= 0.f) return false;
+	E = proc.E / proc.wSum;
+	E.R = std::max(E.R, 0.f);
+	E.G = std::max(E.G, 0.f);
+	E.B = std::max(E.B, 0.f);
+	return true;
+}
+
+void irradianceCache_t::strata(int samples, int &M, int &N)
+{
+	// about pi times more phi than theta strata keeps the strata square on the hemisphere
+	M = std::max(2, (int)(fSqrt((float)samples / M_PI) + 0.5f));
+	N = std::max(3, (int)(M_PI * M + 0.5f));
+}
+
+vector3d_t irradianceCache_t::sampleDir(const vector3d_t &N, const vector3d_t &U, const vector3d_t &V, int j, int k, int M, int Nphi, float s1, float s2)
+{
+	float u = ((float)j + s1) / (float)M;
+	float sinTheta = fSqrt(u), cosTheta = fSqrt(1.f - u);
+	float phi = M_2PI * ((float)k + s2) / (float)Nphi;
+	return (U * fCos(phi) + V * fSin(phi)) * sinTheta + N * cosTheta;
+}
+
+/*! The gradients follow Ward & Heckbert, using the centers and borders of the strata.
+	Both are divided by pi like E */
+irradianceRecord_t irradianceCache_t::makeRecord(const point3d_t &P, const vector3d_t &N, const vector3d_t &U, const vector3d_t &V,
+		int M, int Nphi, const color_t *L, const float *dist) const
+{
+	irradianceRecord_t rec;
+	rec.P = P;
+	rec.N = N;
+	rec.E = color_t(0.f);
+	float invDistSum = 0.f;
+	for(int c=0; c<3; ++c) rec.rotGrad[c] = rec.transGrad[c] = vector3d_t(0.f);
+
+	float invSamples = 1.f / (float)(M * Nphi);
+	float dPhi = M_2PI / (float)Nphi;
+	for(int k=0; k<Nphi; ++k)
+	{
+		float phi = dPhi * ((float)k + 0.5f);
+		vector3d_t uk = U * fCos(phi) + V * fSin(phi);
+		vector3d_t vk = V * fCos(phi) - U * fSin(phi);
+		float phiMinus = dPhi * (float)k;
+		vector3d_t vkMinus = V * fCos(phiMinus) - U * fSin(phiMinus);
+		int kPrev = (k + Nphi - 1) % Nphi;
+
+		color_t rot(0.f), transU(0.f), transV(0.f);
+		for(int j=0; j<M; ++j)
+		{
+			const color_t &Ljk = L[j*Nphi + k];
+			float djk = dist[j*Nphi + k];
+			rec.E += Ljk;
+			invDistSum += 1.f / djk;
+
+			float u = ((float)j + 0.5f) / (float)M;
+			rot -= Ljk * fSqrt(u / (1.f - u)); // tan of the stratum center
+
+			float sinMinus = fSqrt((float)j / (float)M);
+			if(j > 0)
+			{
+				float cos2Minus = 1.f - (float)j / (float)M;
+				transU += (Ljk - L[(j-1)*Nphi + k]) * (sinMinus * cos2Minus / std::min(djk, dist[(j-1)*Nphi + k]));
+			}
+			float sinPlus = fSqrt((float)(j + 1) / (float)M);
+			transV += (Ljk - L[j*Nphi + kPrev]) * ((sinPlus - sinMinus) / std::min(djk, dist[j*Nphi + kPrev]));
+		}
+		transU *= dPhi;
+		rec.rotGrad[0] += vk * rot.R;
+		rec.rotGrad[1] += vk * rot.G;
+		rec.rotGrad[2] += vk * rot.B;
+		rec.transGrad[0] += uk * transU.R + vkMinus * transV.R;
+		rec.transGrad[1] += uk * transU.G + vkMinus * transV.G;
+		rec.transGrad[2] += uk * transU.B + vkMinus * transV.B;
+	}
+	rec.E *= invSamples;
+	for(int c=0; c<3; ++c)
+	{
+		rec.rotGrad[c] *= invSamples;
+		rec.transGrad[c] *= (float)M_1_PI;
+	}
+
+	rec.R = (invDistSum > 0.f) ? (float)(M * Nphi) / invDistSum : maxSpacing;
+	// a steep translational gradient means the irradiance changes faster than the distances tell
+	float gradE = ((rec.transGrad[0] + rec.transGrad[1] + rec.transGrad[2]) * 0.333333f).length();
+	if(gradE * rec.R > rec.E.energy()) rec.R = rec.E.energy() / gradE;
+	rec.R = std::min(std::max(rec.R, minSpacing), maxSpacing);
+	// within a*R the gradient must not change a channel by more than a times its value
+	const float E[3] = { rec.E.R, rec.E.G, rec.E.B };
+	for(int c=0; c<3; ++c)
+	{
+		float g = rec.transGrad[c].length() * rec.R;
+		if(g > E[c]) rec.transGrad[c] *= E[c] / g;
+	}
+	return rec;
+}
+
+void irradianceCache_t::add(const irradianceRecord_t &rec)
+{
+	float r = a * rec.R;
+	bound_t b(rec.P - vector3d_t(r), rec.P + vector3d_t(r));
+	tree.add(rec, b);
+	++records;
+}
+
+__END_YAFRAY
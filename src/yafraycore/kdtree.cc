@@ -1,6 +1,7 @@
 // search for "todo" and "IMPLEMENT" and "<<" or ">>"...
 
 #include <yafraycore/kdtree.h>
+#include <yafraycore/timer.h>
 #include <core_api/material.h>
 #include <core_api/scene.h>
 #include <stdexcept>
@@ -8,8 +9,6 @@
 #include <limits>
 #include <set>
 
-#include <time.h>
-
 __BEGIN_YAFRAY
 
 #define LOWER_B 0
@@ -23,6 +22,10 @@ __BEGIN_YAFRAY
 
 #define KD_MAX_STACK 64
 
+#define KD_TASK_MIN_PRIMS 4096 //!< smallest subtree worth building as a separate task
+#define KD_TASKS_PER_THREAD 64
+#define KD_PARALLEL_BINNING_PRIMS 65536 //!< bin the three axes in parallel for nodes at least this big
+
 #if (defined(_M_IX86) || defined(i386) || defined(_X86_))
 	#define Y_FAST_INT 1
 #else
@@ -50,21 +53,18 @@ inline int Y_Float2Int(double val) {
 #endif
 }
 
-int Kd_inodes=0, Kd_leaves=0, _emptyKd_leaves=0, Kd_prims=0, _clip=0, _bad_clip=0, _null_clip=0, _early_out=0;
-
 triKdTree_t::triKdTree_t(const triangle_t **v, int np, int depth, int leafSize,
-			float cost_ratio, float emptyBonus)
-	: costRatio(cost_ratio), eBonus(emptyBonus), maxDepth(depth)
+			float cost_ratio, float emptyBonus, int threads, int quality, int bins)
+	: costRatio(cost_ratio), eBonus(emptyBonus), maxDepth(depth), nodes(nullptr), packedPrims(nullptr), buildThreads(threads), taskMinPrims(0), buildQueue(nullptr)
 {
 	Y_INFO << "Kd-Tree: Starting build (" << np << " prims, cr:" << costRatio << " eb:" << eBonus << ")" << yendl;
-	clock_t c_start, c_end;
-	c_start = clock();
-	Kd_inodes=0, Kd_leaves=0, _emptyKd_leaves=0, Kd_prims=0, depthLimitReached=0, NumBadSplits=0,
-		_clip=0, _bad_clip=0, _null_clip=0, _early_out=0;
+	timer_t buildTimer; // gTimer is not thread safe, trees may be built concurrently
+	buildTimer.addEvent("kdtree");
+	buildTimer.start("kdtree");
+	depthLimitReached=0, NumBadSplits=0;
 	totalPrims = np;
 	nextFreeNode = 0;
-	allocatedNodesCount = 256;
-	nodes = (kdTreeNode*)y_memalign(64, 256 * sizeof(kdTreeNode));
+	allocatedNodesCount = 0;
 	if(maxDepth <= 0) maxDepth = int( 7.0f + 1.66f * log(float(totalPrims)) );
 	double logLeaves = 1.442695f * log(double(totalPrims)); // = base2 log
 	if(leafSize <= 0)
@@ -77,11 +77,13 @@ triKdTree_t::triKdTree_t(const triangle_t **v, int np, int depth, int leafSize,
 	if(maxDepth>KD_MAX_STACK) maxDepth = KD_MAX_STACK; //to prevent our stack to overflow
 	//experiment: add penalty to cost ratio to reduce memory usage on huge scenes
 	if( logLeaves > 16.0 ) costRatio += 0.25*( logLeaves - 16.0 );
-	allBounds = new bound_t[totalPrims + TRI_CLIP_THRESH+1];
+	allBounds = new bound_t[totalPrims];
+	packedPrims = (packedTriangle_t *)y_memalign(64, totalPrims * sizeof(packedTriangle_t));
 	Y_VERBOSE << "Kd-Tree: Getting triangle bounds..." << yendl;
 	for(u_int32 i=0; i<totalPrims; i++)
 	{
 		allBounds[i] = v[i]->getBound();
+		packedPrims[i].set(v[i]);
 		/* calc tree bound. Remember to upgrade bound_t class... */
 		if(i) treeBound = bound_t(treeBound, allBounds[i]);
 		else treeBound = allBounds[i];
@@ -94,51 +96,140 @@ triKdTree_t::triKdTree_t(const triangle_t **v, int np, int depth, int leafSize,
 		treeBound.a[i] -= foo, treeBound.g[i] += foo;
 	}
 	Y_VERBOSE << "Kd-Tree: Done." << yendl;
-	// get working memory for tree construction
-	boundEdge *edges[3];
-	u_int32 rMemSize = 3*totalPrims; // (maxDepth+1)*totalPrims;
-	u_int32 *leftPrims = new u_int32[std::max( (u_int32)2*TRI_CLIP_THRESH, totalPrims )];
-	u_int32 *rightPrims = new u_int32[rMemSize]; //just a rough guess, allocating worst case is insane!
-	for (int i = 0; i < 3; ++i) edges[i] = new boundEdge[514/*2*totalPrims*/];
-	clip = new int[maxDepth+2];
-	cdata = (char*)y_memalign(64, (maxDepth+2)*TRI_CLIP_THRESH*CLIP_DATA_SIZE);
 	
-	// prepare data
-	for (u_int32 i = 0; i < totalPrims; i++) leftPrims[i] = i;//primNums[i] = i;
-	for (int i = 0; i < maxDepth+2; i++) clip[i] = -1;
+	switch(quality)
+	{
+		case KD_QUALITY_FAST: numBins = 32; sweepMaxPrims = TRI_CLIP_THRESH; break;
+		case KD_QUALITY_MEDIUM: numBins = 256; sweepMaxPrims = 64; break;
+		default: numBins = KD_BINS; sweepMaxPrims = 128; break; // edges[] working memory holds up to 128 prims
+	}
+	if(bins > 0) numBins = std::min(bins, KD_BINS);
+	
+	if(buildThreads < 1) buildThreads = 1;
+	if(buildThreads > 1 && totalPrims >= KD_TASK_MIN_PRIMS)
+	{
+		// enough tasks per thread to balance the load, but not so many that the splicing shows up
+		taskMinPrims = std::max( (u_int32)KD_TASK_MIN_PRIMS, totalPrims / (KD_TASKS_PER_THREAD * buildThreads) );
+	}
+	else buildThreads = 1;
+	for(int i=0; i<buildThreads; ++i) primsArenas.push_back(std::unique_ptr<MemoryArena>(new MemoryArena));
+	
+	kdBuildQueue_t<kdTreeNode> queue;
+	buildQueue = &queue;
+	kdBuildTask_t<kdTreeNode> *root = queue.newTask();
+	root->primNums.resize(totalPrims);
+	for (u_int32 i = 0; i < totalPrims; i++) root->primNums[i] = i;
+	root->bound = treeBound;
 	
 	/* build tree */
 	prims = v;
-	Y_VERBOSE << "Kd-Tree: Starting recursive build..." << yendl;
-	buildTree(totalPrims, treeBound, leftPrims,
-			  leftPrims, rightPrims, edges, // <= working memory
-			  rMemSize, 0, 0 );
+	Y_VERBOSE << "Kd-Tree: Starting recursive build (" << buildThreads << " threads)..." << yendl;
+	if(buildThreads == 1) buildTask(*root, *primsArenas[0]);
+	else
+	{
+		queue.push(root);
+		threadPool_t pool(buildThreads);
+		pool.run([this, &queue](int threadID)
+		{
+			while(kdBuildTask_t<kdTreeNode> *task = queue.pop())
+			{
+				buildTask(*task, *primsArenas[threadID]);
+				queue.finished();
+			}
+		});
+		pool.wait();
+	}
+	
+	// gather the nodes of all tasks in one array
+	if(root->subtrees.empty())
+	{
+		nodes = root->nodes;
+		nextFreeNode = root->nextFreeNode;
+		allocatedNodesCount = root->allocatedNodesCount;
+		root->nodes = nullptr;
+	}
+	else
+	{
+		allocatedNodesCount = root->totalNodes();
+		nodes = (kdTreeNode*)y_memalign(64, allocatedNodesCount * sizeof(kdTreeNode));
+		kdSpliceTask(*root, nodes, nextFreeNode);
+	}
+	kdBuildStats_t stats;
+	for(auto &task : queue.tasks) stats.add(task.stats);
+	buildQueue = nullptr;
+	depthLimitReached = stats.depthLimitReached, NumBadSplits = stats.badSplits;
 	
 	// free working memory
-	delete[] leftPrims;
-	delete[] rightPrims;
 	delete[] allBounds;
-	for (int i = 0; i < 3; ++i) delete[] edges[i];
-	delete[] clip;
-	y_free(cdata);
 	//print some stats:
-	c_end = clock() - c_start;
-	Y_VERBOSE << "Kd-Tree: Stats ("<< float(c_end) / (float)CLOCKS_PER_SEC <<"s)" << yendl;
+	buildTimer.stop("kdtree");
+	Y_VERBOSE << "Kd-Tree: Stats ("<< buildTimer.getTime("kdtree") <<"s, " << queue.tasks.size() << " build tasks)" << yendl;
 	Y_VERBOSE << "Kd-Tree: used/allocated nodes: " << nextFreeNode << "/" << allocatedNodesCount
 		<< " (" << 100.f * float(nextFreeNode)/allocatedNodesCount << "%)" << yendl;
 	Y_VERBOSE << "Kd-Tree: Primitives in tree: " << totalPrims << yendl;
-	Y_VERBOSE << "Kd-Tree: Interior nodes: " << Kd_inodes << " / " << "leaf nodes: " << Kd_leaves
-		<< " (empty: " << _emptyKd_leaves << " = " << 100.f * float(_emptyKd_leaves)/Kd_leaves << "%)" << yendl;
-	Y_VERBOSE << "Kd-Tree: Leaf prims: " << Kd_prims << " (" << float(Kd_prims) / totalPrims << " x prims in tree, leaf size: " << maxLeafSize << ")" << yendl;
-	Y_VERBOSE << "Kd-Tree: => " << float(Kd_prims)/ (Kd_leaves-_emptyKd_leaves) << " prims per non-empty leaf" << yendl;
+	Y_VERBOSE << "Kd-Tree: Interior nodes: " << stats.inodes << " / " << "leaf nodes: " << stats.leaves
+		<< " (empty: " << stats.emptyLeaves << " = " << 100.f * float(stats.emptyLeaves)/stats.leaves << "%)" << yendl;
+	Y_VERBOSE << "Kd-Tree: Leaf prims: " << stats.prims << " (" << float(stats.prims) / totalPrims << " x prims in tree, leaf size: " << maxLeafSize << ")" << yendl;
+	Y_VERBOSE << "Kd-Tree: => " << float(stats.prims)/ (stats.leaves-stats.emptyLeaves) << " prims per non-empty leaf" << yendl;
 	Y_VERBOSE << "Kd-Tree: Leaves due to depth limit/bad splits: " << depthLimitReached << "/" << NumBadSplits << yendl;
-	Y_VERBOSE << "Kd-Tree: clipped triangles: " << _clip << " (" <<_bad_clip << " bad clips, " << _null_clip << " null clips)" << yendl;
+	Y_VERBOSE << "Kd-Tree: clipped triangles: " << stats.clip << " (" << stats.badClip << " bad clips, " << stats.nullClip << " null clips)" << yendl;
+	Y_INFO << "Kd-Tree: Built in " << 1000.0 * buildTimer.getTime("kdtree") << "ms (quality: " << kdBuildQualityName(quality) << ", bins: " << numBins
+		<< "): " << nextFreeNode << " nodes, max depth: " << stats.deepestLeaf << ", SAH cost: " << kdTreeSAHCost(nodes, treeBound, costRatio) << yendl;
+}
+
+/*! Builds the subtree of a task, allocating the working memory it needs */
+void triKdTree_t::buildTask(kdBuildTask_t<kdTreeNode> &task, MemoryArena &arena)
+{
+	u_int32 nPrims = task.primNums.size();
+	boundEdge *edges[3];
+	u_int32 rMemSize = 3*nPrims; // (maxDepth+1)*nPrims;
+	u_int32 *leftPrims = new u_int32[std::max( (u_int32)2*TRI_CLIP_THRESH, nPrims )];
+	u_int32 *rightPrims = new u_int32[rMemSize]; //just a rough guess, allocating worst case is insane!
+	for (int i = 0; i < 3; ++i) edges[i] = new boundEdge[514/*2*nPrims*/];
+	task.arena = &arena;
+	task.clip = new int[maxDepth+2];
+	task.cdata = (char*)y_memalign(64, (maxDepth+2)*TRI_CLIP_THRESH*CLIP_DATA_SIZE);
+	task.clipBounds = new bound_t[TRI_CLIP_THRESH+1];
+	
+	// prepare data
+	std::copy(task.primNums.begin(), task.primNums.end(), leftPrims);
+	std::vector<u_int32>().swap(task.primNums);
+	for (int i = 0; i < maxDepth+2; i++) task.clip[i] = -1;
+	
+	buildTree(task, nPrims, task.bound, leftPrims,
+			  leftPrims, rightPrims, edges, // <= working memory
+			  rMemSize, task.depth, task.badRefines );
+	
+	// free working memory
+	delete[] leftPrims;
+	delete[] rightPrims;
+	for (int i = 0; i < 3; ++i) delete[] edges[i];
+	delete[] task.clip;
+	y_free(task.cdata);
+	delete[] task.clipBounds;
+	task.clip = nullptr, task.cdata = nullptr, task.clipBounds = nullptr, task.arena = nullptr;
+}
+
+/*! Leaves a placeholder node for a child and queues it to be built as a separate task */
+void triKdTree_t::deferSubtree(kdBuildTask_t<kdTreeNode> &task, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		int depth, int badRefines)
+{
+	kdBuildTask_t<kdTreeNode> *sub = buildQueue->newTask();
+	sub->primNums.assign(primNums, primNums + nPrims);
+	sub->bound = nodeBound;
+	sub->depth = depth;
+	sub->badRefines = badRefines;
+	task.reserveNode();
+	task.subtrees[task.nextFreeNode] = sub;
+	++task.nextFreeNode;
+	buildQueue->push(sub);
 }
 
 triKdTree_t::~triKdTree_t()
 {
 	Y_INFO << "Kd-Tree: Freeing nodes..." << yendl;
 	y_free(nodes);
+	y_free(packedPrims);
 	Y_VERBOSE << "Kd-Tree: Done" << yendl;
 }
 
@@ -149,9 +240,9 @@ triKdTree_t::~triKdTree_t()
 */
 
 
-void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, splitCost_t &split)
+void triKdTree_t::pigeonAxisCost(int axis, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float bonus, splitCost_t &split)
 {
-	bin_t bin[ KD_BINS+1 ];
+	bin_t bin[ KD_BINS+1 ]; // sized for the maximum bin count
 	float d[3];
 	d[0] = nodeBound.longX();
 	d[1] = nodeBound.longY();
@@ -162,135 +253,151 @@ void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *pri
 	float t_low, t_up;
 	int b_left, b_right;
 	
-	for(int axis=0;axis<3;axis++)
+	float s = numBins/d[axis];
+	float min = nodeBound.a[axis];
+	// pigeonhole sort:
+	for(unsigned int i=0; i<nPrims; ++i)
 	{
-		float s = KD_BINS/d[axis];
-		float min = nodeBound.a[axis];
-		// pigeonhole sort:
-		for(unsigned int i=0; i<nPrims; ++i)
-		{
-			const bound_t &bbox = allBounds[ primIdx[i] ];
-			t_low = bbox.a[axis];
-			t_up  = bbox.g[axis];
-			b_left = (int)((t_low - min)*s);
-			b_right = (int)((t_up - min)*s);
+		const bound_t &bbox = allBounds[ primIdx[i] ];
+		t_low = bbox.a[axis];
+		t_up  = bbox.g[axis];
+		b_left = (int)((t_low - min)*s);
+		b_right = (int)((t_up - min)*s);
 
-			if(b_left<0) b_left=0;
-			else if(b_left > KD_BINS) b_left = KD_BINS;
-			
-			if(b_right<0) b_right=0;
-			else if(b_right > KD_BINS) b_right = KD_BINS;
-			
-			if(t_low == t_up)
+		if(b_left<0) b_left=0;
+		else if(b_left > numBins) b_left = numBins;
+		
+		if(b_right<0) b_right=0;
+		else if(b_right > numBins) b_right = numBins;
+		
+		if(t_low == t_up)
+		{
+			if(bin[b_left].empty() || (t_low >= bin[b_left].t && !bin[b_left].empty() ) )
 			{
-				if(bin[b_left].empty() || (t_low >= bin[b_left].t && !bin[b_left].empty() ) )
-				{
-					bin[b_left].t = t_low;
-					bin[b_left].c_both++;
-				}
-				else
-				{
-					bin[b_left].c_left++;
-					bin[b_left].c_right++;
-				}
-				bin[b_left].n += 2;
+				bin[b_left].t = t_low;
+				bin[b_left].c_both++;
 			}
 			else
-			{	
-				if(bin[b_left].empty() || (t_low > bin[b_left].t  && !bin[b_left].empty() ) )
-				{
-					bin[b_left].t = t_low;
-					bin[b_left].c_left += bin[b_left].c_both + bin[b_left].c_bleft;
-					bin[b_left].c_right += bin[b_left].c_both;
-					bin[b_left].c_both = bin[b_left].c_bleft = 0;
-					bin[b_left].c_bleft++;
-				}
-				else if(t_low == bin[b_left].t)
-				{
-					bin[b_left].c_bleft++;
-				}
-				else bin[b_left].c_left++;
-				bin[b_left].n++;
-				
-				bin[b_right].c_right++;
-				if(bin[b_right].empty() || t_up > bin[b_right].t)
-				{
-					bin[b_right].t = t_up;
-					bin[b_right].c_left += bin[b_right].c_both + bin[b_right].c_bleft;
-					bin[b_right].c_right += bin[b_right].c_both;
-					bin[b_right].c_both = bin[b_right].c_bleft = 0;
-				}
-				bin[b_right].n++;
+			{
+				bin[b_left].c_left++;
+				bin[b_left].c_right++;
 			}
-
+			bin[b_left].n += 2;
+		}
+		else
+		{	
+			if(bin[b_left].empty() || (t_low > bin[b_left].t  && !bin[b_left].empty() ) )
+			{
+				bin[b_left].t = t_low;
+				bin[b_left].c_left += bin[b_left].c_both + bin[b_left].c_bleft;
+				bin[b_left].c_right += bin[b_left].c_both;
+				bin[b_left].c_both = bin[b_left].c_bleft = 0;
+				bin[b_left].c_bleft++;
+			}
+			else if(t_low == bin[b_left].t)
+			{
+				bin[b_left].c_bleft++;
+			}
+			else bin[b_left].c_left++;
+			bin[b_left].n++;
+			
+			bin[b_right].c_right++;
+			if(bin[b_right].empty() || t_up > bin[b_right].t)
+			{
+				bin[b_right].t = t_up;
+				bin[b_right].c_left += bin[b_right].c_both + bin[b_right].c_bleft;
+				bin[b_right].c_right += bin[b_right].c_both;
+				bin[b_right].c_both = bin[b_right].c_bleft = 0;
+			}
+			bin[b_right].n++;
 		}
-		
-		const int axisLUT[3][3] = { {0,1,2}, {1,2,0}, {2,0,1} };
-		float capArea = d[ axisLUT[1][axis] ] * d[ axisLUT[2][axis] ];
-		float capPerim = d[ axisLUT[1][axis] ] + d[ axisLUT[2][axis] ];
-		
-		unsigned int nBelow=0, nAbove=nPrims;
-		// cumulate prims and evaluate cost
-		for(int i=0; i<KD_BINS+1; ++i)
-		{
-			if(!bin[i].empty())
-			{	
-				nBelow += bin[i].c_left;
-				nAbove -= bin[i].c_right;
-				// cost:
-				float edget = bin[i].t;
-				if (edget > nodeBound.a[axis] && edget < nodeBound.g[axis])
-				{
-					// Compute cost for split at _i_th edge
-					float l1 = edget - nodeBound.a[axis];
-					float l2 = nodeBound.g[axis] - edget;
-					float belowSA = capArea + l1*capPerim;
-					float aboveSA = capArea + l2*capPerim;
-					float rawCosts = (belowSA * nBelow + aboveSA * nAbove);
-					float eb;
 
-					if(nAbove == 0) eb = (0.1f + l2/d[axis])*eBonus*rawCosts;
-					else if(nBelow == 0) eb = (0.1f + l1/d[axis])*eBonus*rawCosts;
-					else eb = 0.0f;
+	}
+	
+	const int axisLUT[3][3] = { {0,1,2}, {1,2,0}, {2,0,1} };
+	float capArea = d[ axisLUT[1][axis] ] * d[ axisLUT[2][axis] ];
+	float capPerim = d[ axisLUT[1][axis] ] + d[ axisLUT[2][axis] ];
+	
+	unsigned int nBelow=0, nAbove=nPrims;
+	// cumulate prims and evaluate cost
+	for(int i=0; i<numBins+1; ++i)
+	{
+		if(!bin[i].empty())
+		{	
+			nBelow += bin[i].c_left;
+			nAbove -= bin[i].c_right;
+			// cost:
+			float edget = bin[i].t;
+			if (edget > nodeBound.a[axis] && edget < nodeBound.g[axis])
+			{
+				// Compute cost for split at _i_th edge
+				float l1 = edget - nodeBound.a[axis];
+				float l2 = nodeBound.g[axis] - edget;
+				float belowSA = capArea + l1*capPerim;
+				float aboveSA = capArea + l2*capPerim;
+				float rawCosts = (belowSA * nBelow + aboveSA * nAbove);
+				float eb;
 
-					float cost = costRatio + invTotalSA * (rawCosts - eb);
+				if(nAbove == 0) eb = (0.1f + l2/d[axis])*bonus*rawCosts;
+				else if(nBelow == 0) eb = (0.1f + l1/d[axis])*bonus*rawCosts;
+				else eb = 0.0f;
 
-					// Update best split if this is lowest cost so far
-					if (cost < split.bestCost)
-					{
-						split.t = edget;
-						split.bestCost = cost;
-						split.bestAxis = axis;
-						split.bestOffset = i; // kinda useless...
-						split.nBelow = nBelow;
-						split.nAbove = nAbove;
-					}
+				float cost = costRatio + invTotalSA * (rawCosts - eb);
+
+				// Update best split if this is lowest cost so far
+				if (cost < split.bestCost)
+				{
+					split.t = edget;
+					split.bestCost = cost;
+					split.bestAxis = axis;
+					split.bestOffset = i; // kinda useless...
+					split.nBelow = nBelow;
+					split.nAbove = nAbove;
 				}
-				nBelow += bin[i].c_both + bin[i].c_bleft;
-				nAbove -= bin[i].c_both;
 			}
-		} // for all bins
-		if(nBelow != nPrims || nAbove != 0)
-		{
-			int c1=0, c2=0, c3=0, c4=0, c5=0;
-			std::cout << "SCREWED!!\n";
-			for(int i=0;i<KD_BINS+1;i++){ c1+= bin[i].n; std::cout << bin[i].n << " ";}
-			std::cout << "\nn total: "<< c1 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c2+= bin[i].c_left; std::cout << bin[i].c_left << " ";}
-			std::cout << "\nc_left total: "<< c2 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c3+= bin[i].c_bleft; std::cout << bin[i].c_bleft << " ";}
-			std::cout << "\nc_bleft total: "<< c3 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c4+= bin[i].c_both; std::cout << bin[i].c_both << " ";}
-			std::cout << "\nc_both total: "<< c4 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c5+= bin[i].c_right; std::cout << bin[i].c_right << " ";}
-			std::cout << "\nc_right total: "<< c5 << "\n";
-			std::cout << "\nnPrims: "<<nPrims<<" nBelow: "<<nBelow<<" nAbove: "<<nAbove<<"\n";
-			std::cout << "total left: " << c2 + c3 + c4 << "\ntotal right: " << c4 + c5 << "\n";
-			std::cout << "n/2: " << c1/2 << "\n";
-			throw std::logic_error("cost function mismatch");
+			nBelow += bin[i].c_both + bin[i].c_bleft;
+			nAbove -= bin[i].c_both;
 		}
-		for(int i=0;i<KD_BINS+1;i++) bin[i].reset();
-	} // for all axis
+	} // for all bins
+	if(nBelow != nPrims || nAbove != 0)
+	{
+		int c1=0, c2=0, c3=0, c4=0, c5=0;
+		std::cout << "SCREWED!!\n";
+		for(int i=0;i<numBins+1;i++){ c1+= bin[i].n; std::cout << bin[i].n << " ";}
+		std::cout << "\nn total: "<< c1 << "\n";
+		for(int i=0;i<numBins+1;i++){ c2+= bin[i].c_left; std::cout << bin[i].c_left << " ";}
+		std::cout << "\nc_left total: "<< c2 << "\n";
+		for(int i=0;i<numBins+1;i++){ c3+= bin[i].c_bleft; std::cout << bin[i].c_bleft << " ";}
+		std::cout << "\nc_bleft total: "<< c3 << "\n";
+		for(int i=0;i<numBins+1;i++){ c4+= bin[i].c_both; std::cout << bin[i].c_both << " ";}
+		std::cout << "\nc_both total: "<< c4 << "\n";
+		for(int i=0;i<numBins+1;i++){ c5+= bin[i].c_right; std::cout << bin[i].c_right << " ";}
+		std::cout << "\nc_right total: "<< c5 << "\n";
+		std::cout << "\nnPrims: "<<nPrims<<" nBelow: "<<nBelow<<" nAbove: "<<nAbove<<"\n";
+		std::cout << "total left: " << c2 + c3 + c4 << "\ntotal right: " << c4 + c5 << "\n";
+		std::cout << "n/2: " << c1/2 << "\n";
+		throw std::logic_error("cost function mismatch");
+	}
+}
+
+/*! Each axis is binned on its own; for big nodes build threads waiting for a task
+	help with the other axes. The best split is picked in axis order, like a single pass over all
+	axes would do, so the result doesn't depend on the thread count */
+void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float bonus, splitCost_t &split)
+{
+	splitCost_t axisSplit[3];
+	if(buildThreads > 1 && nPrims >= KD_PARALLEL_BINNING_PRIMS)
+	{
+		buildQueue->parallelFor(3, [&](int axis){ pigeonAxisCost(axis, nPrims, nodeBound, primIdx, bonus, axisSplit[axis]); });
+	}
+	else for(int axis=0;axis<3;axis++) pigeonAxisCost(axis, nPrims, nodeBound, primIdx, bonus, axisSplit[axis]);
+	
+	split.bestCost = std::numeric_limits<float>::infinity();
+	for(int axis=0;axis<3;axis++)
+	{
+		if(axisSplit[axis].bestCost < split.bestCost) split = axisSplit[axis];
+	}
+	split.oldCost = float(nPrims);
 }
 
 // ============================================================
@@ -299,7 +406,7 @@ void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *pri
 */
 
 void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
-		const bound_t *pBounds, boundEdge *edges[3], splitCost_t &split)
+		const bound_t *pBounds, boundEdge *edges[3], float bonus, kdBuildStats_t &stats, splitCost_t &split)
 {
 	float d[3];
 	d[0] = nodeBound.longX();
@@ -363,14 +470,14 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 			if(l1 > l2*float(nPrims) && l2 > 0.f)
 			{
 				float rawCosts = (capArea + l2*capPerim) * nPrims;
-				float cost = costRatio + invTotalSA * (rawCosts - eBonus); //todo: use proper ebonus...
+				float cost = costRatio + invTotalSA * (rawCosts - bonus); //todo: use proper ebonus...
 				//optimal cost is definitely here, and nowhere else!
 				if (cost < split.bestCost)  {
 					split.bestCost = cost;
 					split.bestAxis = axis;
 					split.bestOffset = 0;
 					split.nEdge = nEdge;
-					++_early_out;
+					++stats.earlyOut;
 				}
 				continue;
 			}
@@ -380,13 +487,13 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 			if(l2 > l1*float(nPrims) && l1 > 0.f)
 			{
 				float rawCosts = (capArea + l1*capPerim) * nPrims;
-				float cost = costRatio + invTotalSA * (rawCosts - eBonus); //todo: use proper ebonus...
+				float cost = costRatio + invTotalSA * (rawCosts - bonus); //todo: use proper ebonus...
 				if (cost < split.bestCost)  {
 					split.bestCost = cost;
 					split.bestAxis = axis;
 					split.bestOffset = nEdge-1;
 					split.nEdge = nEdge;
-					++_early_out;
+					++stats.earlyOut;
 				}
 				continue;
 			}
@@ -405,8 +512,8 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 				float rawCosts = (belowSA * nBelow + aboveSA * nAbove);
 				float eb;
 
-				if(nAbove == 0) eb = (0.1f + l2/d[axis])*eBonus*rawCosts;
-				else if(nBelow == 0) eb = (0.1f + l1/d[axis])*eBonus*rawCosts;
+				if(nAbove == 0) eb = (0.1f + l2/d[axis])*bonus*rawCosts;
+				else if(nBelow == 0) eb = (0.1f + l1/d[axis])*bonus*rawCosts;
 				else eb = 0.0f;
 
 				float cost = costRatio + invTotalSA * (rawCosts - eb);
@@ -439,19 +546,11 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 				2 when neither current nor subsequent split reduced cost
 */
 
-int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+int triKdTree_t::buildTree(kdBuildTask_t<kdTreeNode> &task, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
 		u_int32 *leftPrims, u_int32 *rightPrims, boundEdge *edges[3], //working memory
 		u_int32 rightMemSize, int depth, int badRefines ) // status
 {
-	if (nextFreeNode == allocatedNodesCount) {
-		int newCount = 2*allocatedNodesCount;
-		newCount = (newCount > 0x100000) ? allocatedNodesCount+0x80000 : newCount;
-		kdTreeNode 	*n = (kdTreeNode *) y_memalign(64, newCount * sizeof(kdTreeNode));
-		memcpy(n, nodes, allocatedNodesCount * sizeof(kdTreeNode));
-		y_free(nodes);
-		nodes = n;
-		allocatedNodesCount = newCount;
-	}	
+	task.reserveNode();
 
 #if _TRI_CLIP > 0
 	if(nPrims <= TRI_CLIP_THRESH)
@@ -466,20 +565,20 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 			b_ext[0][i] = nodeBound.a[i] - 0.021*bHalfSize[i] - 0.00001*temp;
 			b_ext[1][i] = nodeBound.g[i] + 0.021*bHalfSize[i] + 0.00001*temp;
 		}
-		char *c_old = cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * depth);
-		char *c_new = cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * (depth+1));
+		char *c_old = task.cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * depth);
+		char *c_new = task.cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * (depth+1));
 		for(unsigned int i=0; i<nPrims; ++i)
 		{
 			const triangle_t *ct = prims[ primNums[i] ];
 			u_int32 old_idx=0;
-			if(clip[depth] >= 0) old_idx = primNums[i+nPrims];
-			if( ct->clipToBound(b_ext, clip[depth], allBounds[totalPrims+nOverl],
+			if(task.clip[depth] >= 0) old_idx = primNums[i+nPrims];
+			if( ct->clipToBound(b_ext, task.clip[depth], task.clipBounds[nOverl],
 				c_old + old_idx*CLIP_DATA_SIZE, c_new + nOverl*CLIP_DATA_SIZE) )
 			{
-				++_clip;
+				++task.stats.clip;
 				oPrims[nOverl] = primNums[i]; nOverl++;
 			}
-			else ++_null_clip;
+			else ++task.stats.nullClip;
 		}
 		//copy back
 		memcpy(primNums, oPrims, nOverl*sizeof(u_int32));
@@ -489,31 +588,31 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	//	<< check if leaf criteria met >>
 	if(nPrims <= maxLeafSize || depth >= maxDepth)
 	{
-		nodes[nextFreeNode].createLeaf(primNums, nPrims, prims, primsArena);
-		nextFreeNode++;
-		if( depth >= maxDepth ) depthLimitReached++; //stat
+		task.nodes[task.nextFreeNode].createLeaf(primNums, nPrims, *task.arena, task.stats);
+		task.nextFreeNode++;
+		if( depth >= maxDepth ) task.stats.depthLimitReached++; //stat
+		if( depth > task.stats.deepestLeaf ) task.stats.deepestLeaf = depth; //stat
 		return 0;
 	}
 	
 	//<< calculate cost for all axes and chose minimum >>
 	splitCost_t split;
-	float baseBonus=eBonus;
-	eBonus *= 1.1 - (float)depth/(float)maxDepth;
-	if(nPrims > 128) pigeonMinCost(nPrims, nodeBound, primNums, split);
+	float bonus = eBonus * (1.1 - (float)depth/(float)maxDepth);
+	if(nPrims > sweepMaxPrims) pigeonMinCost(nPrims, nodeBound, primNums, bonus, split);
 #if _TRI_CLIP > 0
-	else if (nPrims > TRI_CLIP_THRESH) minimalCost(nPrims, nodeBound, primNums, allBounds, edges, split);
-	else minimalCost(nPrims, nodeBound, primNums, allBounds+totalPrims, edges, split);
+	else if (nPrims > TRI_CLIP_THRESH) minimalCost(nPrims, nodeBound, primNums, allBounds, edges, bonus, task.stats, split);
+	else minimalCost(nPrims, nodeBound, primNums, task.clipBounds, edges, bonus, task.stats, split);
 #else
-	else minimalCost(nPrims, nodeBound, primNums, allBounds, edges, split);
+	else minimalCost(nPrims, nodeBound, primNums, allBounds, edges, bonus, task.stats, split);
 #endif
-	eBonus=baseBonus; //restore eBonus
 	//<< if (minimum > leafcost) increase bad refines >>
 	if (split.bestCost > split.oldCost) ++badRefines;
 	if ((split.bestCost > 1.6f * split.oldCost && nPrims < 16) ||
 		split.bestAxis == -1 || badRefines == 2) {
-		nodes[nextFreeNode].createLeaf(primNums, nPrims, prims, primsArena);
-		nextFreeNode++;
-		if( badRefines == 2) ++NumBadSplits; //stat
+		task.nodes[task.nextFreeNode].createLeaf(primNums, nPrims, *task.arena, task.stats);
+		task.nextFreeNode++;
+		if( badRefines == 2) ++task.stats.badSplits; //stat
+		if( depth > task.stats.deepestLeaf ) task.stats.deepestLeaf = depth; //stat
 		return 0;
 	}
 	
@@ -535,7 +634,7 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	// Classify primitives with respect to split
 	float splitPos;
 	int n0 = 0, n1 = 0;
-	if(nPrims > 128) // we did pigeonhole
+	if(nPrims > sweepMaxPrims) // we did pigeonhole
 	{
 		int pn;
 		for (unsigned int i=0; i<nPrims; i++)
@@ -606,9 +705,9 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	//advance right prims pointer
 	remainingMem -= n1;
 	
-	u_int32 curNode = nextFreeNode;
-	nodes[curNode].createInterior(split.bestAxis, splitPos);
-	++nextFreeNode;
+	u_int32 curNode = task.nextFreeNode;
+	task.nodes[curNode].createInterior(split.bestAxis, splitPos, task.stats);
+	++task.nextFreeNode;
 	bound_t boundL = nodeBound, boundR = nodeBound;
 	switch(split.bestAxis){
 		case 0: boundL.setMaxX(splitPos); boundR.setMinX(splitPos); break;
@@ -621,22 +720,24 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	{
 		remainingMem -= n1;
 		//<< recurse below child >>
-		clip[depth+1] = split.bestAxis;
-		buildTree(n0, boundL, leftPrims, leftPrims, nRightPrims+2*n1, edges, remainingMem, depth+1, badRefines);
-		clip[depth+1] |= 1<<2;
+		task.clip[depth+1] = split.bestAxis;
+		buildTree(task, n0, boundL, leftPrims, leftPrims, nRightPrims+2*n1, edges, remainingMem, depth+1, badRefines);
+		task.clip[depth+1] |= 1<<2;
 		//<< recurse above child >>
-		nodes[curNode].setRightChild (nextFreeNode);
-		buildTree(n1, boundR, nRightPrims, leftPrims, nRightPrims+2*n1, edges, remainingMem, depth+1, badRefines);
-		clip[depth+1] = -1;
+		task.nodes[curNode].setRightChild (task.nextFreeNode);
+		buildTree(task, n1, boundR, nRightPrims, leftPrims, nRightPrims+2*n1, edges, remainingMem, depth+1, badRefines);
+		task.clip[depth+1] = -1;
 	}
 	else
 	{
 #endif
 		//<< recurse below child >>
-		buildTree(n0, boundL, leftPrims, leftPrims, nRightPrims+n1, edges, remainingMem, depth+1, badRefines);
+		if(taskMinPrims && (u_int32)n0 >= taskMinPrims) deferSubtree(task, n0, boundL, leftPrims, depth+1, badRefines);
+		else buildTree(task, n0, boundL, leftPrims, leftPrims, nRightPrims+n1, edges, remainingMem, depth+1, badRefines);
 		//<< recurse above child >>
-		nodes[curNode].setRightChild (nextFreeNode);
-		buildTree(n1, boundR, nRightPrims, leftPrims, nRightPrims+n1, edges, remainingMem, depth+1, badRefines);
+		task.nodes[curNode].setRightChild (task.nextFreeNode);
+		if(taskMinPrims && (u_int32)n1 >= taskMinPrims) deferSubtree(task, n1, boundR, nRightPrims, depth+1, badRefines);
+		else buildTree(task, n1, boundR, nRightPrims, leftPrims, nRightPrims+n1, edges, remainingMem, depth+1, badRefines);
 #if _TRI_CLIP > 0
 	}
 #endif
@@ -745,10 +846,11 @@ bool triKdTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float
 		
 		if (nPrimitives == 1)
 		{
-			triangle_t *mp = currNode->onePrimitive;
+			const packedTriangle_t &packed = packedPrims[currNode->onePrimitive];
 
-			if (mp->intersect(ray, &t_hit, tempData))
+			if (packed.intersect(ray, &t_hit, tempData))
 			{
+				triangle_t *mp = const_cast<triangle_t *>(packed.tri);
 				if(t_hit < Z && t_hit >= ray.tmin)
 				{
 					const material_t *mat = mp->getMaterial();
@@ -765,14 +867,15 @@ bool triKdTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float
 		}
 		else
 		{
-			triangle_t **prims = currNode->primitives;
+			const u_int32 *prims = currNode->primitives;
 			
 			for (u_int32 i = 0; i < nPrimitives; ++i)
 			{
-				triangle_t *mp = prims[i];
+				const packedTriangle_t &packed = packedPrims[prims[i]];
 
-				if (mp->intersect(ray, &t_hit, tempData))
+				if (packed.intersect(ray, &t_hit, tempData))
 				{
+					triangle_t *mp = const_cast<triangle_t *>(packed.tri);
 					if(t_hit < Z && t_hit >= ray.tmin)
 					{
 						const material_t *mat = mp->getMaterial();
@@ -900,9 +1003,10 @@ bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, floa
 		u_int32 nPrimitives = currNode->nPrimitives();
 		if (nPrimitives == 1)
 		{
-			triangle_t *mp = currNode->onePrimitive;
-			if (mp->intersect(ray, &t_hit, bary))
+			const packedTriangle_t &packed = packedPrims[currNode->onePrimitive];
+			if (packed.intersect(ray, &t_hit, bary))
 			{
+				triangle_t *mp = const_cast<triangle_t *>(packed.tri);
 				if(t_hit < dist && t_hit >= 0.f ) // '>=' ?
 				{
 					const material_t *mat = mp->getMaterial();
@@ -917,12 +1021,13 @@ bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, floa
 		}
 		else
 		{
-			triangle_t **prims = currNode->primitives;
+			const u_int32 *prims = currNode->primitives;
 			for (u_int32 i = 0; i < nPrimitives; ++i)
 			{
-				triangle_t *mp = prims[i];
-				if (mp->intersect(ray, &t_hit, bary))
+				const packedTriangle_t &packed = packedPrims[prims[i]];
+				if (packed.intersect(ray, &t_hit, bary))
 				{
+					triangle_t *mp = const_cast<triangle_t *>(packed.tri);
 					if(t_hit < dist && t_hit >= 0.f )
 					{
 						const material_t *mat = mp->getMaterial();
@@ -950,7 +1055,8 @@ bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, floa
 	allow for transparent shadows.
 =============================================================*/
 
-bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias) const
+bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias,
+	const triangleObjectInstance_t *instance, int *layers) const
 {
 	float a, b, t; // entry/exit/splitting plane signed distance
 	float t_hit;
@@ -1062,9 +1168,10 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 
 		if (nPrimitives == 1)
 		{
-			triangle_t *mp = currNode->onePrimitive;
-			if (mp->intersect(ray, &t_hit, bary))
+			const packedTriangle_t &packed = packedPrims[currNode->onePrimitive];
+			if (packed.intersect(ray, &t_hit, bary))
 			{
+				triangle_t *mp = const_cast<triangle_t *>(packed.tri);
 				if(t_hit < dist && t_hit >= ray.tmin ) // '>=' ?
 				{
 					const material_t *mat = mp->getMaterial();
@@ -1079,9 +1186,16 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 						{
 							if(depth>=maxDepth) return true;
 							point3d_t h=ray.from + t_hit*ray.dir;
+							vector3d_t wo=ray.dir;
 							surfacePoint_t sp;
-							mp->getSurface(sp, h, bary);
-							filt *= mat->getTransparency(state, sp, ray.dir);
+							if(instance)
+							{
+								h = instance->getObjToWorld() * h;
+								wo = instance->getObjToWorld() * wo;
+								instance->getSurface(sp, mp, h, bary);
+							}
+							else mp->getSurface(sp, h, bary);
+							filt *= mat->getTransparency(state, sp, wo);
 							++depth;
 						}
 					}
@@ -1090,12 +1204,13 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 		}
 		else
 		{
-			triangle_t **prims = currNode->primitives;
+			const u_int32 *prims = currNode->primitives;
 			for (u_int32 i = 0; i < nPrimitives; ++i)
 			{
-				triangle_t *mp = prims[i];
-				if (mp->intersect(ray, &t_hit, bary))
+				const packedTriangle_t &packed = packedPrims[prims[i]];
+				if (packed.intersect(ray, &t_hit, bary))
 				{
+					triangle_t *mp = const_cast<triangle_t *>(packed.tri);
 					if(t_hit < dist && t_hit >= ray.tmin)
 					{
 						const material_t *mat = mp->getMaterial();
@@ -1110,9 +1225,16 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 							{
 								if(depth>=maxDepth) return true;
 								point3d_t h=ray.from + t_hit*ray.dir;
+								vector3d_t wo=ray.dir;
 								surfacePoint_t sp;
-								mp->getSurface(sp, h, bary);
-								filt *= mat->getTransparency(state, sp, ray.dir);
+								if(instance)
+								{
+									h = instance->getObjToWorld() * h;
+									wo = instance->getObjToWorld() * wo;
+									instance->getSurface(sp, mp, h, bary);
+								}
+								else mp->getSurface(sp, h, bary);
+								filt *= mat->getTransparency(state, sp, wo);
 								++depth;
 							}
 						}
@@ -1127,6 +1249,7 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 				
 	} // while
 
+	if(layers) *layers = depth;
 	return false;
 }
 
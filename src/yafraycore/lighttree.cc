@@ -0,0 +1,271 @@
+#include <yafraycore/lighttree.h>
+#include <algorithm>
+#include <limits>
+
+__BEGIN_YAFRAY
+
+#define LIGHTTREE_BUCKETS 12 //!< split candidates per axis
+
+//! cos(a-b), or 1 if b is the larger angle so the difference can not go below zero
+static inline float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+	return (cosA > cosB) ? 1.f : cosA * cosB + sinA * sinB;
+}
+
+static inline float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+	return (cosA > cosB) ? 0.f : sinA * cosB - cosA * sinB;
+}
+
+static inline float sinFromCos(float c)
+{
+	return fSqrt(std::max(0.f, 1.f - c*c));
+}
+
+//! rotates v by theta around the normalized axis a
+static inline vector3d_t rotate(const vector3d_t &v, const vector3d_t &a, float theta)
+{
+	float c = fCos(theta), s = fSin(theta);
+	return v * c + (a ^ v) * s + a * ((a * v) * (1.f - c));
+}
+
+void lightTreeBound_t::include(const lightTreeBound_t &b)
+{
+	bound = bound_t(bound, b.bound);
+	power += b.power;
+	cosThetaE = std::min(cosThetaE, b.cosThetaE);
+	twoSided = twoSided || b.twoSided;
+
+	float thetaA = fAcos(cosThetaO), thetaB = fAcos(b.cosThetaO);
+	float thetaD = fAcos(axis * b.axis);
+	// one cone holds the other
+	if(std::min(thetaD + thetaB, (float)M_PI) <= thetaA) return;
+	if(std::min(thetaD + thetaA, (float)M_PI) <= thetaB)
+	{
+		axis = b.axis;
+		cosThetaO = b.cosThetaO;
+		return;
+	}
+	// the new cone touches both, its axis is turned from axis towards b.axis
+	float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+	vector3d_t turn = axis ^ b.axis;
+	if(thetaO >= M_PI || turn.normLen() == 0.f)
+	{
+		cosThetaO = -1.f;
+		return;
+	}
+	axis = rotate(axis, turn, thetaO - thetaA);
+	cosThetaO = fCos(thetaO);
+}
+
+float lightTreeBound_t::importance(const point3d_t &P, const vector3d_t &N) const
+{
+	vector3d_t wi = P - bound.center();
+	float d2 = wi.lengthSqr();
+	float r2 = 0.25f * (bound.g - bound.a).lengthSqr();
+	// the angle the bounding sphere covers seen from P
+	float cosThetaB = -1.f, sinThetaB = 0.f;
+	if(d2 > r2)
+	{
+		sinThetaB = fSqrt(r2 / d2);
+		cosThetaB = sinFromCos(sinThetaB);
+	}
+	if(d2 > 0.f) wi *= 1.f / fSqrt(d2);
+	// inside the bound the distance means little, it must not go towards zero
+	d2 = std::max(d2, std::max(r2, 1e-8f));
+
+	float cosThetaW = axis * wi;
+	if(twoSided) cosThetaW = std::fabs(cosThetaW);
+	float sinThetaW = sinFromCos(cosThetaW);
+
+	// the smallest angle between the emission cone and the directions towards P
+	float sinThetaO = sinFromCos(cosThetaO);
+	float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+	float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+	float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+	if(cosThetaP < cosThetaE) return 0.f;
+
+	float imp = power * cosThetaP / d2;
+	if(N.x != 0.f || N.y != 0.f || N.z != 0.f)
+	{
+		float cosThetaI = std::fabs(wi * N);
+		float sinThetaI = sinFromCos(cosThetaI);
+		imp *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+	}
+	return std::max(imp, 0.f);
+}
+
+//! the solid angle measure of the emission cone used by the split heuristic
+static float orientationMeasure(const lightTreeBound_t &b)
+{
+	float thetaO = fAcos(b.cosThetaO), thetaE = fAcos(b.cosThetaE);
+	float thetaW = std::min(thetaO + thetaE, (float)M_PI);
+	float sinThetaO = sinFromCos(b.cosThetaO);
+	return M_2PI * (1.f - b.cosThetaO) + 0.5f * M_PI * (2.f * thetaW * sinThetaO - fCos(thetaO - 2.f * thetaW) - 2.f * thetaO * sinThetaO + b.cosThetaO);
+}
+
+static float surfaceArea(const bound_t &b)
+{
+	vector3d_t d = b.g - b.a;
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+lightTree_t::lightTree_t(const std::vector<light_t *> &lights): treeLights(0)
+{
+	std::vector<buildLight_t> bLights;
+	for(u_int32 i=0; i<lights.size(); ++i)
+	{
+		// photon only lights do not light anything directly
+		if(lights[i]->photonOnly()) continue;
+		buildLight_t l;
+		if(!lights[i]->emissionBound(l.bound))
+		{
+			infiniteLights.push_back(i);
+			continue;
+		}
+		l.bound.power = lights[i]->totalEnergy().energy();
+		if(l.bound.power <= 0.f) continue;
+		l.centroid = l.bound.bound.center();
+		l.light = i;
+		bLights.push_back(l);
+	}
+	treeLights = bLights.size();
+	if(treeLights)
+	{
+		nodes.reserve(2 * treeLights - 1);
+		build(&bLights[0], treeLights);
+	}
+}
+
+/*! Splits at the bucket border with the lowest surface area orientation heuristic over all
+	three axes. The first child is stored right after the node, so the lights are built depth first */
+u_int32 lightTree_t::build(buildLight_t *lights, u_int32 n)
+{
+	u_int32 nodeIndex = nodes.size();
+	nodes.push_back(lightTreeNode_t());
+	if(n == 1)
+	{
+		nodes[nodeIndex].bound = lights[0].bound;
+		nodes[nodeIndex].child = lights[0].light;
+		nodes[nodeIndex].leaf = true;
+		return nodeIndex;
+	}
+
+	bound_t bound = lights[0].bound.bound;
+	bound_t centroids(lights[0].centroid, lights[0].centroid);
+	for(u_int32 i=1; i<n; ++i)
+	{
+		bound = bound_t(bound, lights[i].bound.bound);
+		centroids.include(lights[i].centroid);
+	}
+	vector3d_t extent = bound.g - bound.a;
+	float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+
+	float minCost = std::numeric_limits<float>::infinity();
+	int splitAxis = -1, splitBucket = -1;
+	for(int axis=0; axis<3; ++axis)
+	{
+		float lo = centroids.a[axis], hi = centroids.g[axis];
+		if(hi <= lo) continue;
+		float scale = LIGHTTREE_BUCKETS / (hi - lo);
+		lightTreeBound_t buckets[LIGHTTREE_BUCKETS];
+		int counts[LIGHTTREE_BUCKETS] = {0};
+		for(u_int32 i=0; i<n; ++i)
+		{
+			int b = std::min((int)((lights[i].centroid[axis] - lo) * scale), LIGHTTREE_BUCKETS - 1);
+			if(counts[b]++) buckets[b].include(lights[i].bound);
+			else buckets[b] = lights[i].bound;
+		}
+		// a thin axis is stretched, thin clusters should rather be split across
+		float kr = (extent[axis] > 0.f) ? maxExtent / extent[axis] : 1.f;
+
+		// costs of the lights below each border, then the lights above it
+		float below[LIGHTTREE_BUCKETS - 1];
+		lightTreeBound_t acc;
+		int accCount = 0;
+		for(int b=0; b<LIGHTTREE_BUCKETS - 1; ++b)
+		{
+			if(counts[b]) { if(accCount) acc.include(buckets[b]); else acc = buckets[b]; accCount += counts[b]; }
+			below[b] = accCount ? acc.power * orientationMeasure(acc) * surfaceArea(acc.bound) : -1.f;
+		}
+		accCount = 0;
+		for(int b=LIGHTTREE_BUCKETS - 1; b>0; --b)
+		{
+			if(counts[b]) { if(accCount) acc.include(buckets[b]); else acc = buckets[b]; accCount += counts[b]; }
+			if(!accCount || below[b-1] < 0.f) continue;
+			float cost = kr * (below[b-1] + acc.power * orientationMeasure(acc) * surfaceArea(acc.bound));
+			if(cost < minCost)
+			{
+				minCost = cost;
+				splitAxis = axis;
+				splitBucket = b - 1;
+			}
+		}
+	}
+
+	// with all centroids in one place any split is as good as another
+	u_int32 mid = n / 2;
+	if(splitAxis >= 0)
+	{
+		float lo = centroids.a[splitAxis];
+		float scale = LIGHTTREE_BUCKETS / (centroids.g[splitAxis] - lo);
+		buildLight_t *m = std::partition(lights, lights + n, [&](const buildLight_t &l)
+		{
+			return std::min((int)((l.centroid[splitAxis] - lo) * scale), LIGHTTREE_BUCKETS - 1) <= splitBucket;
+		});
+		mid = m - lights;
+		if(mid == 0 || mid == n) mid = n / 2;
+	}
+
+	build(lights, mid);
+	u_int32 second = build(lights + mid, n - mid);
+	lightTreeBound_t b = nodes[nodeIndex + 1].bound;
+	b.include(nodes[second].bound);
+	nodes[nodeIndex].bound = b;
+	nodes[nodeIndex].child = second;
+	nodes[nodeIndex].leaf = false;
+	return nodeIndex;
+}
+
+int lightTree_t::sample(const point3d_t &P, const vector3d_t &N, float s, float &pdf) const
+{
+	u_int32 nInfinite = infiniteLights.size();
+	float pInfinite = (float)nInfinite / (float)(nInfinite + (treeLights ? 1 : 0));
+	if(s < pInfinite)
+	{
+		u_int32 i = std::min((u_int32)(s * (nInfinite + (treeLights ? 1 : 0))), nInfinite - 1);
+		pdf = pInfinite / (float)nInfinite;
+		return infiniteLights[i];
+	}
+	if(!treeLights) return -1;
+
+	// the sample is rescaled at each choice so it stays uniform for the next one
+	s = std::min((s - pInfinite) / (1.f - pInfinite), 0.99999994f);
+	pdf = 1.f - pInfinite;
+	u_int32 node = 0;
+	while(!nodes[node].leaf)
+	{
+		u_int32 c0 = node + 1, c1 = nodes[node].child;
+		float i0 = nodes[c0].bound.importance(P, N);
+		float i1 = nodes[c1].bound.importance(P, N);
+		if(i0 <= 0.f && i1 <= 0.f) return -1;
+		float p0 = i0 / (i0 + i1);
+		if(s < p0)
+		{
+			node = c0;
+			s = std::min(s / p0, 0.99999994f);
+			pdf *= p0;
+		}
+		else
+		{
+			node = c1;
+			s = std::min((s - p0) / (1.f - p0), 0.99999994f);
+			pdf *= 1.f - p0;
+		}
+	}
+	// a lone light in the tree was not weighed against a sibling
+	if(node == 0 && nodes[0].bound.importance(P, N) <= 0.f) return -1;
+	return nodes[node].child;
+}
+
+__END_YAFRAY
@@ -46,14 +46,14 @@ matrix4x4_t::matrix4x4_t(const matrix4x4_t & source):_invalid(source._invalid)
 			matrix[i][j]=source[i][j];
 }
 
-matrix4x4_t::matrix4x4_t(const float source[4][4])
+matrix4x4_t::matrix4x4_t(const float source[4][4]):_invalid(0)
 {
 	for(int i=0;i<4;i++)
 		for(int j=0;j<4;j++)
 			matrix[i][j]=source[i][j];
 }
 
-matrix4x4_t::matrix4x4_t(const double source[4][4])
+matrix4x4_t::matrix4x4_t(const double source[4][4]):_invalid(0)
 {
 	for(int i=0;i<4;i++)
 		for(int j=0;j<4;j++)
@@ -25,6 +25,7 @@
 #include <core_api/light.h>
 #include <yafraycore/photon.h>
 #include <yafraycore/scr_halton.h>
+#include <yafraycore/lighttree.h>
 #include <yafraycore/spectrum.h>
 #include <utilities/mcqmc.h>
 #include <core_api/renderpasses.h>
@@ -42,6 +43,19 @@ __BEGIN_YAFRAY
 
 inline color_t mcIntegrator_t::estimateAllDirectLight(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo, colorPasses_t &colorPasses) const
 {
+	if(lightSampling != LIGHTS_ALL)
+	{
+		int lnum;
+		float weight;
+		if(!pickLight(state, sp, lnum, weight)) return color_t(0.f);
+		color_t col = doLightEstimation(state, lights[lnum], sp, wo, lnum, colorPasses) * weight;
+		// the light passes hold the one light that was estimated, they are scaled like col
+		const intPassTypes_t lightPasses[] = { PASS_INT_DIFFUSE, PASS_INT_DIFFUSE_NO_SHADOW, PASS_INT_GLOSSY, PASS_INT_DEBUG_LIGHT_ESTIMATION_LIGHT_DIRAC,
+			PASS_INT_DEBUG_LIGHT_ESTIMATION_LIGHT_SAMPLING, PASS_INT_DEBUG_LIGHT_ESTIMATION_MAT_SAMPLING };
+		for(auto p : lightPasses) colorPasses.probe_mult(p, weight, state.raylevel == 0);
+		return col;
+	}
+
 	color_t col;
 	unsigned int loffs = 0;
 	for(auto l=lights.begin(); l!=lights.end(); ++l)
@@ -56,19 +70,40 @@ inline color_t mcIntegrator_t::estimateAllDirectLight(renderState_t &state, cons
 }
 
 inline color_t mcIntegrator_t::estimateOneDirectLight(renderState_t &state, const surfacePoint_t &sp, vector3d_t wo, int n, colorPasses_t &colorPasses) const
+{
+	int lnum;
+	float weight;
+	if(!pickLight(state, sp, lnum, weight)) return color_t(0.f);
+	
+	return doLightEstimation(state, lights[lnum], sp, wo, lnum, colorPasses) * weight;
+}
+
+bool mcIntegrator_t::pickLight(renderState_t &state, const surfacePoint_t &sp, int &lnum, float &weight) const
 {
 	int lightNum = lights.size();
 
-	if(lightNum == 0) return color_t(0.f); //??? if you get this far the lights must be >= 1 but, what the hell... :)
+	if(lightNum == 0) return false; //??? if you get this far the lights must be >= 1 but, what the hell... :)
 
 	Halton hal2(2);
 
 	hal2.setStart(imageFilm->getBaseSamplingOffset() + correlativeSampleNumber[state.threadID]-1); //Probably with this change the parameter "n" is no longer necessary, but I will keep it just in case I have to revert back this change!
-	int lnum = std::min((int)(hal2.getNext() * (float)lightNum), lightNum - 1);
+	float s = hal2.getNext();
 
 	++correlativeSampleNumber[state.threadID];
-	
-	return doLightEstimation(state, lights[lnum], sp, wo, lnum, colorPasses) * lightNum;
+
+	const lightTree_t *lightTree = scene->getLightTree();
+	if(lightSampling == LIGHTS_TREE && lightTree)
+	{
+		float lightPdf;
+		lnum = lightTree->sample(sp.P, sp.N, s, lightPdf);
+		if(lnum < 0) return false;
+		weight = 1.f / lightPdf;
+		return true;
+	}
+
+	lnum = std::min((int)(s * (float)lightNum), lightNum - 1);
+	weight = (float)lightNum;
+	return true;
 }
 
 inline color_t mcIntegrator_t::doLightEstimation(renderState_t &state, light_t *light, const surfacePoint_t &sp, const vector3d_t &wo, const unsigned int  &loffs, colorPasses_t &colorPasses) const
@@ -151,24 +186,49 @@ inline color_t mcIntegrator_t::doLightEstimation(renderState_t &state, light_t *
 		bool canIntersect=light->canIntersect();
 		color_t ccol(0.0);
 		lSample_t ls;
+		// the samples are taken in chunks, so the shadow rays of a chunk can be traced as one stream
+		lSample_t lss[RAY_STREAM_SIZE];
+		ray_t lightRays[RAY_STREAM_SIZE];
+		bool illum[RAY_STREAM_SIZE], traced[RAY_STREAM_SIZE], shadowedS[RAY_STREAM_SIZE];
+		color_t scols[RAY_STREAM_SIZE];
+		float objIdx[RAY_STREAM_SIZE], matIdx[RAY_STREAM_SIZE];
 
 		hal2.setStart(offs-1);
 		hal3.setStart(offs-1);
 
-		for(int i=0; i<n; ++i)
+		for(int first=0; first<n; first+=RAY_STREAM_SIZE)
 		{
-			// ...get sample val...
-			ls.s1 = hal2.getNext();
-			ls.s2 = hal3.getNext();
+			int count = std::min(n - first, RAY_STREAM_SIZE);
+			for(int j=0; j<count; ++j)
+			{
+				// ...get sample val...
+				ls.s1 = hal2.getNext();
+				ls.s2 = hal3.getNext();
+
+				illum[j] = light->illumSample (sp, ls, lightRay);
+				if(illum[j])
+				{
+					if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
+					else  lightRay.tmin = scene->shadowBias;
+				}
+				traced[j] = illum[j] && castShadows;
+				lss[j] = ls;
+				lightRays[j] = lightRay;
+			}
+			ray_t lastRay = lightRay;
 
-			if( light->illumSample (sp, ls, lightRay) )
+			// ...shadowed...
+			traceShadowStream(state, count, lightRays, traced, trShad, shadowedS, scols, mask_obj_index, mask_mat_index, objIdx, matIdx);
+
+			for(int j=0; j<count; ++j)
 			{
-				// ...shadowed...
-				if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
-				else  lightRay.tmin = scene->shadowBias;
-				
-				if (castShadows) shadowed = (trShad) ? scene->isShadowed(state, lightRay, sDepth, scol, mask_obj_index, mask_mat_index) : scene->isShadowed(state, lightRay, mask_obj_index, mask_mat_index);
-				else shadowed = false;
+				if(!illum[j]) continue;
+				ls = lss[j];
+				lightRay = lightRays[j];
+				shadowed = shadowedS[j];
+				scol = scols[j];
+				mask_obj_index = objIdx[j];
+				mask_mat_index = matIdx[j];
 
 				if((!shadowed && ls.pdf > 1e-6f) || colorPasses.enabled(PASS_INT_DIFFUSE_NO_SHADOW))
 				{
@@ -249,6 +309,7 @@ inline color_t mcIntegrator_t::doLightEstimation(renderState_t &state, light_t *
 						&& mask_obj_index == colorPasses.get_pass_mask_obj_index()) colShadowObjMask += color_t(1.f);
 				}
 			}
+			lightRay = lastRay;
 		}
 		
 		col += ccol * invNS;
@@ -336,18 +397,12 @@ inline color_t mcIntegrator_t::doLightEstimation(renderState_t &state, light_t *
 	return col;
 }
 
-void mcIntegrator_t::causticWorker(photonMap_t * causticMap, int threadID, const scene_t *scene, unsigned int nCausPhotons, pdf1D_t *lightPowerD, int numLights, const std::string &integratorName, const std::vector<light_t *> &causLights, int causDepth, progressBar_t *pb, int pbStep, unsigned int &totalPhotonsShot)
+void mcIntegrator_t::causticWorker(photonChunks_t &chunks, chunkSlots_t<photon_t> &causticSlots, const scene_t *scene, pdf1D_t *lightPowerD, int numLights, const std::vector<light_t *> &causLights, int causDepth, progressBar_t *pb, int pbStep)
 {
-	bool done=false;
 	float s1, s2, s3, s4, s5, s6, s7, sL;
 	float fNumLights = (float)numLights;
 	float lightNumPdf, lightPdf;
 
-	unsigned int curr = 0;
-	unsigned int nCausPhotons_thread = 1 + ( (nCausPhotons - 1) / scene->getNumThreadsPhotons() );
-
-	std::vector<photon_t> localCausticPhotons;
-
 	surfacePoint_t sp1, sp2;
 	surfacePoint_t *hit=&sp1, *hit2=&sp2;
 	ray_t ray;
@@ -357,131 +412,114 @@ void mcIntegrator_t::causticWorker(photonMap_t * causticMap, int threadID, const
 	unsigned char userdata[USER_DATA_SIZE+7];
 	state.userdata = (void *)( &userdata[7] - ( ((size_t)&userdata[7])&7 ) ); // pad userdata to 8 bytes
 
-	localCausticPhotons.clear();
-	localCausticPhotons.reserve(nCausPhotons_thread);
-
-	while(!done)
+	unsigned int chunk, start, end;
+	while(chunks.take(chunk, start, end))
 	{
-		unsigned int haltoncurr = curr + nCausPhotons_thread * threadID;
+		if(scene->getSignals() & Y_SIG_ABORT) return;
 
-		state.chromatic = true;
-		state.wavelength = RI_S(haltoncurr);
-		
-		s1 = RI_vdC(haltoncurr);
-		s2 = scrHalton(2, haltoncurr);
-		s3 = scrHalton(3, haltoncurr);
-		s4 = scrHalton(4, haltoncurr);
+		std::vector<photon_t> &localCausticPhotons = causticSlots[chunk];
 
-		sL = float(haltoncurr) / float(nCausPhotons);
+		for(unsigned int haltoncurr = start; haltoncurr < end; ++haltoncurr)
+		{
+			state.chromatic = true;
+			state.wavelength = RI_S(haltoncurr);
 
-		int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
+			s1 = RI_vdC(haltoncurr);
+			s2 = scrHalton(2, haltoncurr);
+			s3 = scrHalton(3, haltoncurr);
+			s4 = scrHalton(4, haltoncurr);
 
-		if(lightNum >= numLights)
-		{
-			causticMap->mutx.lock();
-			Y_ERROR << integratorName << ": lightPDF sample error! " << sL << "/" << lightNum << yendl;
-			causticMap->mutx.unlock();
-			return;
-		}
+			sL = float(haltoncurr) / float(chunks.nPaths);
 
-		color_t pcol = causLights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
-		ray.tmin = scene->rayMinDist;
-		ray.tmax = -1.0;
-		pcol *= fNumLights * lightPdf / lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
-		if(pcol.isBlack())
-		{
-			++curr;
-			done = (curr >= nCausPhotons_thread);
-			continue;
-		}
-		BSDF_t bsdfs = BSDF_NONE;
-		int nBounces = 0;
-		bool causticPhoton = false;
-		bool directPhoton = true;
-		const material_t *material = nullptr;
-		const volumeHandler_t *vol = nullptr;
-
-		while( scene->intersect(ray, *hit2) )
-		{
-			if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
+			int lightNum = lightPowerD->DSample(sL, &lightNumPdf);
+
+			if(lightNum >= numLights)
 			{
-				causticMap->mutx.lock();
-				Y_WARNING << integratorName << ": NaN (photon color)" << yendl;
-				causticMap->mutx.unlock();
-				break;
+				chunks.sampleError = true;
+				return;
 			}
-			color_t transm(1.f), vcol;
-			// check for volumetric effects
-			if(material)
+
+			color_t pcol = causLights[lightNum]->emitPhoton(s1, s2, s3, s4, ray, lightPdf);
+			ray.tmin = scene->rayMinDist;
+			ray.tmax = -1.0;
+			pcol *= fNumLights * lightPdf / lightNumPdf; //remember that lightPdf is the inverse of th pdf, hence *=...
+			if(pcol.isBlack()) continue;
+
+			BSDF_t bsdfs = BSDF_NONE;
+			int nBounces = 0;
+			bool causticPhoton = false;
+			bool directPhoton = true;
+			const material_t *material = nullptr;
+			const volumeHandler_t *vol = nullptr;
+
+			while( scene->intersect(ray, *hit2) )
 			{
-				if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(hit->Ng * ray.dir < 0)))
+				if(std::isnan(pcol.R) || std::isnan(pcol.G) || std::isnan(pcol.B))
 				{
-					vol->transmittance(state, ray, vcol);
-					transm = vcol;
+					++chunks.nanPaths;
+					break;
 				}
-			}
-			std::swap(hit, hit2);
-			vector3d_t wi = -ray.dir, wo;
-			material = hit->material;
-			material->initBSDF(state, *hit, bsdfs);
-			if(bsdfs & (BSDF_DIFFUSE | BSDF_GLOSSY))
-			{
-				//deposit caustic photon on surface
-				if(causticPhoton)
+				color_t transm(1.f), vcol;
+				// check for volumetric effects
+				if(material)
 				{
-					photon_t np(wi, hit->P, pcol);
-					localCausticPhotons.push_back(np);
+					if((bsdfs&BSDF_VOLUMETRIC) && (vol=material->getVolumeHandler(hit->Ng * ray.dir < 0)))
+					{
+						vol->transmittance(state, ray, vcol);
+						transm = vcol;
+					}
 				}
+				std::swap(hit, hit2);
+				vector3d_t wi = -ray.dir, wo;
+				material = hit->material;
+				material->initBSDF(state, *hit, bsdfs);
+				if(bsdfs & (BSDF_DIFFUSE | BSDF_GLOSSY))
+				{
+					//deposit caustic photon on surface
+					if(causticPhoton)
+					{
+						photon_t np(wi, hit->P, pcol);
+						localCausticPhotons.push_back(np);
+					}
+				}
+				// need to break in the middle otherwise we scatter the photon and then discard it => redundant
+				if(nBounces == causDepth) break;
+				// scatter photon
+				int d5 = 3*nBounces + 5;
+				//int d6 = d5 + 1;
+
+				s5 = scrHalton(d5, haltoncurr);
+				s6 = scrHalton(d5+1, haltoncurr);
+				s7 = scrHalton(d5+2, haltoncurr);
+
+				pSample_t sample(s5, s6, s7, BSDF_ALL_SPECULAR | BSDF_GLOSSY | BSDF_FILTER | BSDF_DISPERSIVE, pcol, transm);
+				bool scattered = material->scatterPhoton(state, *hit, wi, wo, sample);
+				if(!scattered) break; //photon was absorped.
+				pcol = sample.color;
+				// hm...dispersive is not really a scattering qualifier like specular/glossy/diffuse or the special case filter...
+				causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
+								((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
+				// light through transparent materials can be calculated by direct lighting, so still consider them direct!
+				directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
+				// caustic-only calculation can be stopped if:
+				if(!(causticPhoton || directPhoton)) break;
+
+				if(state.chromatic && (sample.sampledFlags & BSDF_DISPERSIVE))
+				{
+					state.chromatic=false;
+					color_t wl_col;
+					wl2rgb(state.wavelength, wl_col);
+					pcol *= wl_col;
+				}
+				ray.from = hit->P;
+				ray.dir = wo;
+				ray.tmin = scene->rayMinDist;
+				ray.tmax = -1.0;
+				++nBounces;
 			}
-			// need to break in the middle otherwise we scatter the photon and then discard it => redundant
-			if(nBounces == causDepth) break;
-			// scatter photon
-			int d5 = 3*nBounces + 5;
-			//int d6 = d5 + 1;
-
-			s5 = scrHalton(d5, haltoncurr);
-			s6 = scrHalton(d5+1, haltoncurr);
-			s7 = scrHalton(d5+2, haltoncurr);
-			
-			pSample_t sample(s5, s6, s7, BSDF_ALL_SPECULAR | BSDF_GLOSSY | BSDF_FILTER | BSDF_DISPERSIVE, pcol, transm);
-			bool scattered = material->scatterPhoton(state, *hit, wi, wo, sample);
-			if(!scattered) break; //photon was absorped.
-			pcol = sample.color;
-			// hm...dispersive is not really a scattering qualifier like specular/glossy/diffuse or the special case filter...
-			causticPhoton = ((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_DISPERSIVE)) && directPhoton) ||
-							((sample.sampledFlags & (BSDF_GLOSSY | BSDF_SPECULAR | BSDF_FILTER | BSDF_DISPERSIVE)) && causticPhoton);
-			// light through transparent materials can be calculated by direct lighting, so still consider them direct!
-			directPhoton = (sample.sampledFlags & BSDF_FILTER) && directPhoton;
-			// caustic-only calculation can be stopped if:
-			if(!(causticPhoton || directPhoton)) break;
-
-			if(state.chromatic && (sample.sampledFlags & BSDF_DISPERSIVE))
-			{
-				state.chromatic=false;
-				color_t wl_col;
-				wl2rgb(state.wavelength, wl_col);
-				pcol *= wl_col;
-			}
-			ray.from = hit->P;
-			ray.dir = wo;
-			ray.tmin = scene->rayMinDist;
-			ray.tmax = -1.0;
-			++nBounces;
 		}
-		++curr;
-		if(curr % pbStep == 0)
-		{
-			pb->mutx.lock();
-			pb->update();
-			pb->mutx.unlock();
-			if(scene->getSignals() & Y_SIG_ABORT) { return; }
-		}
-		done = (curr >= nCausPhotons_thread);
+		chunks.done(start, end, pb, pbStep);
 	}
-	causticMap->mutx.lock();
-	causticMap->appendVector(localCausticPhotons, curr);
-	totalPhotonsShot += curr;
-	causticMap->mutx.unlock();
 }
 
 bool mcIntegrator_t::createCausticMap()
@@ -490,12 +528,16 @@ bool mcIntegrator_t::createCausticMap()
 	if(intpb) pb = intpb;
 	else pb = new ConsoleProgressBar_t(80);
 
+	std::stringstream photonParams;
+	photonParams << "caustics " << nCausPhotons << " " << causDepth;
+	uint64_t fingerprint = photonMapFingerprint(scene, photonParams.str());
+
 	if(photonMapProcessing == PHOTONS_LOAD)
 	{
 		pb->setTag("Loading caustic photon map from file...");
 		std::string filename = session.getPathImageOutput() + "_caustic.photonmap";
-		Y_INFO << integratorName << ": Loading caustic photon map from: " << filename << ". If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!" << yendl;
-		if(photonMapLoad(session.causticMap, filename))
+		Y_INFO << integratorName << ": Loading caustic photon map from: " << filename << yendl;
+		if(photonMapLoad(session.causticMap, filename, fingerprint))
 		{
 			Y_VERBOSE << integratorName << ": Caustic map loaded." << yendl;
 			return true;
@@ -509,12 +551,17 @@ bool mcIntegrator_t::createCausticMap()
 	
 	if(photonMapProcessing == PHOTONS_REUSE)
 	{
-		Y_INFO << integratorName << ": Reusing caustics photon map from memory. If it does not match the scene you could have crashes and/or incorrect renders, USE WITH CARE!" << yendl;
+		Y_INFO << integratorName << ": Reusing caustics photon map from memory." << yendl;
 		if(session.causticMap->nPhotons() == 0)
 		{
 			photonMapProcessing = PHOTONS_GENERATE_ONLY;
 			Y_WARNING << integratorName << ": One of the photon maps in memory was empty, they cannot be reused: changing to Generate mode." << yendl;
 		}
+		else if(session.causticMap->getFingerprint() != fingerprint)
+		{
+			photonMapProcessing = PHOTONS_GENERATE_ONLY;
+			Y_WARNING << integratorName << ": The caustic photon map in memory was made for a different scene or photon settings, it cannot be reused: changing to Generate mode." << yendl;
+		}
 		else return true;
 	}
 		
@@ -567,15 +614,25 @@ bool mcIntegrator_t::createCausticMap()
 
 		int nThreads = scene->getNumThreadsPhotons();
 
-		nCausPhotons = std::max((unsigned int) nThreads, (nCausPhotons / nThreads) * nThreads); //rounding the number of diffuse photons so it's a number divisible by the number of threads (distribute uniformly among the threads). At least 1 photon per thread
-		
-		Y_PARAMS << integratorName << ": Shooting "<<nCausPhotons<<" photons across " << nThreads << " threads (" << (nCausPhotons / nThreads) << " photons/thread)"<< yendl;
+		Y_PARAMS << integratorName << ": Shooting "<<nCausPhotons<<" photons across " << nThreads << " threads in chunks of " << PHOTON_CHUNK_SIZE << yendl;
 
 		if(nThreads >= 2)
 		{
+			photonChunks_t chunks(nCausPhotons);
+			chunkSlots_t<photon_t> causticSlots(chunks.nChunks);
 			std::vector<std::thread> threads;
-			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&mcIntegrator_t::causticWorker, this, session.causticMap, i, scene, nCausPhotons, lightPowerD, numLights, std::ref(integratorName), causLights, causDepth, pb, pbStep, std::ref(curr)));		
+			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&mcIntegrator_t::causticWorker, this, std::ref(chunks), std::ref(causticSlots), scene, lightPowerD, numLights, causLights, causDepth, pb, pbStep));
 			for(auto& t : threads) t.join();
+
+			if(chunks.nanPaths > 0) Y_WARNING << integratorName << ": NaN (photon color), " << chunks.nanPaths << " photon paths stopped." << yendl;
+			if(chunks.sampleError)
+			{
+				Y_ERROR << integratorName << ": lightPDF sample error!" << yendl;
+				delete lightPowerD;
+				return false;
+			}
+			curr = chunks.shot;
+			session.causticMap->appendChunks(causticSlots, curr, nThreads);
 		}
 		else		
 		{
@@ -714,6 +771,7 @@ bool mcIntegrator_t::createCausticMap()
 			session.causticMap->updateTree();
 			Y_VERBOSE << integratorName << ": Done." << yendl;
 		}
+		session.causticMap->setFingerprint(fingerprint);
 
 		if(photonMapProcessing == PHOTONS_GENERATE_AND_SAVE)
 		{
@@ -1011,138 +1069,83 @@ inline void mcIntegrator_t::recursiveRaytrace(renderState_t &state, diffRay_t &r
 	--state.raylevel;
 }
 
-color_t mcIntegrator_t::sampleAmbientOcclusion(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const
+/*! Shadow tests of up to RAY_STREAM_SIZE rays; rays that are not active are unshadowed.
+	Opaque shadows are traced as one stream if rayStreams is set and the scene uses the BVH,
+	which traverses the rays of a stream together, otherwise ray by ray.
+	obj_index and mat_index carry the mask indices from ray to ray like consecutive
+	single ray tests would, objIdx and matIdx get their value after each ray */
+void mcIntegrator_t::traceShadowStream(renderState_t &state, int n, const ray_t *rays, const bool *active, bool transparent,
+	bool *shadowed, color_t *scol, float &obj_index, float &mat_index, float *objIdx, float *matIdx) const
 {
-	color_t col(0.f), surfCol(0.f), scol(0.f);
-	bool shadowed;
-	const material_t *material = sp.material;
-	ray_t lightRay;
-	lightRay.from = sp.P;
-	lightRay.dir = vector3d_t(0.f);
-	float mask_obj_index = 0.f, mask_mat_index = 0.f;
-
-	int n = aoSamples;//(int) ceilf(aoSamples*getSampleMultiplier());
-	if(state.rayDivision > 1) n = std::max(1, n / state.rayDivision);
-
-	unsigned int offs = n * state.pixelSample + state.samplingOffs;
-
-	Halton hal2(2);
-	Halton hal3(3);
-
-	hal2.setStart(offs-1);
-	hal3.setStart(offs-1);
-
-	for(int i = 0; i < n; ++i)
+	if(rayStreams && !transparent && scene->tracesRayStreams())
 	{
-		float s1 = hal2.getNext();
-		float s2 = hal3.getNext();
-
-		if(state.rayDivision > 1)
+		ray_t sRays[RAY_STREAM_SIZE];
+		bool sShadowed[RAY_STREAM_SIZE];
+		float sObj[RAY_STREAM_SIZE], sMat[RAY_STREAM_SIZE];
+		int m = 0;
+		for(int k=0; k<n; ++k)
 		{
-			s1 = addMod1(s1, state.dc1);
-			s2 = addMod1(s2, state.dc2);
+			if(!active[k]) continue;
+			sRays[m] = rays[k];
+			sObj[m] = obj_index;
+			sMat[m] = mat_index;
+			++m;
 		}
-
-		if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
-		else lightRay.tmin = scene->shadowBias;
-		
-		lightRay.tmax = aoDist;
-
-		float W = 0.f;
-
-		sample_t s(s1, s2, BSDF_GLOSSY | BSDF_DIFFUSE | BSDF_REFLECT );
-		surfCol = material->sample(state, sp, wo, lightRay.dir, s, W);
-
-		if(material->getFlags() & BSDF_EMIT)
+		if(m) scene->isShadowed(state, m, sRays, sShadowed, sObj, sMat);
+		m = 0;
+		for(int k=0; k<n; ++k)
 		{
-			col += material->emit(state, sp, wo) * s.pdf;
+			shadowed[k] = false;
+			if(active[k])
+			{
+				shadowed[k] = sShadowed[m];
+				// only shadowed rays change the indices
+				if(shadowed[k]) obj_index = sObj[m], mat_index = sMat[m];
+				++m;
+			}
+			objIdx[k] = obj_index;
+			matIdx[k] = mat_index;
 		}
+		return;
+	}
 
-		shadowed = (trShad) ? scene->isShadowed(state, lightRay, sDepth, scol, mask_obj_index, mask_mat_index) : scene->isShadowed(state, lightRay, mask_obj_index, mask_mat_index);
-
-		if(!shadowed)
-		{
-			float cos = std::fabs(sp.N * lightRay.dir);
-			if(trShad) col += aoCol * scol * surfCol * cos * W;
-			else col += aoCol * surfCol * cos * W;
-		}
+	for(int k=0; k<n; ++k)
+	{
+		if(!active[k]) shadowed[k] = false;
+		else if(transparent) shadowed[k] = scene->isShadowed(state, rays[k], sDepth, scol[k], obj_index, mat_index);
+		else shadowed[k] = scene->isShadowed(state, rays[k], obj_index, mat_index);
+		objIdx[k] = obj_index;
+		matIdx[k] = mat_index;
 	}
+}
 
-	return col / (float)n;
+color_t mcIntegrator_t::sampleAmbientOcclusion(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const
+{
+	return traceAmbientOcclusion(state, sp, wo, false, trShad);
 }
 
 color_t mcIntegrator_t::sampleAmbientOcclusionPass(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const
 {
-	color_t col(0.f), surfCol(0.f), scol(0.f);
-	bool shadowed;
-	const material_t *material = sp.material;
-	ray_t lightRay;
-	lightRay.from = sp.P;
-	lightRay.dir = vector3d_t(0.f);
-	float mask_obj_index = 0.f, mask_mat_index = 0.f;
-
-	int n = aoSamples;//(int) ceilf(aoSamples*getSampleMultiplier());
-	if(state.rayDivision > 1) n = std::max(1, n / state.rayDivision);
-
-	unsigned int offs = n * state.pixelSample + state.samplingOffs;
-
-	Halton hal2(2);
-	Halton hal3(3);
-
-	hal2.setStart(offs-1);
-	hal3.setStart(offs-1);
-
-	for(int i = 0; i < n; ++i)
-	{
-		float s1 = hal2.getNext();
-		float s2 = hal3.getNext();
-
-		if(state.rayDivision > 1)
-		{
-			s1 = addMod1(s1, state.dc1);
-			s2 = addMod1(s2, state.dc2);
-		}
-
-		if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
-		else lightRay.tmin = scene->shadowBias;
-		
-		lightRay.tmax = aoDist;
-
-		float W = 0.f;
-
-		sample_t s(s1, s2, BSDF_GLOSSY | BSDF_DIFFUSE | BSDF_REFLECT );
-		surfCol = material->sample(state, sp, wo, lightRay.dir, s, W);
-
-		if(material->getFlags() & BSDF_EMIT)
-		{
-			col += material->emit(state, sp, wo) * s.pdf;
-		}
-
-		shadowed = scene->isShadowed(state, lightRay, mask_obj_index, mask_mat_index);
-
-		if(!shadowed)
-		{
-			float cos = std::fabs(sp.N * lightRay.dir);
-			//if(trShad) col += aoCol * scol * surfCol * cos * W;
-			col += aoCol * surfCol * cos * W;
-		}
-	}
-
-	return col / (float)n;
+	return traceAmbientOcclusion(state, sp, wo, false, false);
 }
 
-
 color_t mcIntegrator_t::sampleAmbientOcclusionPassClay(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const
 {
-	color_t col(0.f), surfCol(0.f), scol(0.f);
-	bool shadowed;
+	return traceAmbientOcclusion(state, sp, wo, true, false);
+}
+
+/*! AO samples shared by the AO passes; clay samples the clay material instead of the surface
+	material, transparent uses transparent shadows */
+color_t mcIntegrator_t::traceAmbientOcclusion(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo, bool clay, bool transparent) const
+{
+	color_t col(0.f);
 	const material_t *material = sp.material;
 	ray_t lightRay;
 	lightRay.from = sp.P;
 	lightRay.dir = vector3d_t(0.f);
 	float mask_obj_index = 0.f, mask_mat_index = 0.f;
 
-	int n = aoSamples;
+	int n = aoSamples;//(int) ceilf(aoSamples*getSampleMultiplier());
 	if(state.rayDivision > 1) n = std::max(1, n / state.rayDivision);
 
 	unsigned int offs = n * state.pixelSample + state.samplingOffs;
@@ -1153,40 +1156,64 @@ color_t mcIntegrator_t::sampleAmbientOcclusionPassClay(renderState_t &state, con
 	hal2.setStart(offs-1);
 	hal3.setStart(offs-1);
 
-	for(int i = 0; i < n; ++i)
-	{
-		float s1 = hal2.getNext();
-		float s2 = hal3.getNext();
+	if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
+	else lightRay.tmin = scene->shadowBias;
+
+	lightRay.tmax = aoDist;
 
-		if(state.rayDivision > 1)
+	ray_t aoRays[RAY_STREAM_SIZE];
+	bool active[RAY_STREAM_SIZE], shadowedS[RAY_STREAM_SIZE];
+	color_t surfCols[RAY_STREAM_SIZE], emitCols[RAY_STREAM_SIZE], scols[RAY_STREAM_SIZE];
+	float Ws[RAY_STREAM_SIZE], objIdx[RAY_STREAM_SIZE], matIdx[RAY_STREAM_SIZE];
+
+	for(int first = 0; first < n; first += RAY_STREAM_SIZE)
+	{
+		int count = std::min(n - first, RAY_STREAM_SIZE);
+		for(int j = 0; j < count; ++j)
 		{
-			s1 = addMod1(s1, state.dc1);
-			s2 = addMod1(s2, state.dc2);
-		}
+			float s1 = hal2.getNext();
+			float s2 = hal3.getNext();
 
-		if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
-		else lightRay.tmin = scene->shadowBias;
-		
-		lightRay.tmax = aoDist;
+			if(state.rayDivision > 1)
+			{
+				s1 = addMod1(s1, state.dc1);
+				s2 = addMod1(s2, state.dc2);
+			}
 
-		float W = 0.f;
+			float W = 0.f;
+			emitCols[j] = color_t(0.f);
 
-		sample_t s(s1, s2, BSDF_ALL );
-		surfCol = material->sampleClay(state, sp, wo, lightRay.dir, s, W);
-		s.pdf = 1.f;
+			if(clay)
+			{
+				sample_t s(s1, s2, BSDF_ALL );
+				surfCols[j] = material->sampleClay(state, sp, wo, lightRay.dir, s, W);
+				s.pdf = 1.f;
+				if(material->getFlags() & BSDF_EMIT) emitCols[j] = material->emit(state, sp, wo) * s.pdf;
+			}
+			else
+			{
+				sample_t s(s1, s2, BSDF_GLOSSY | BSDF_DIFFUSE | BSDF_REFLECT );
+				surfCols[j] = material->sample(state, sp, wo, lightRay.dir, s, W);
+				if(material->getFlags() & BSDF_EMIT) emitCols[j] = material->emit(state, sp, wo) * s.pdf;
+			}
 
-		if(material->getFlags() & BSDF_EMIT)
-		{
-			col += material->emit(state, sp, wo) * s.pdf;
+			aoRays[j] = lightRay;
+			Ws[j] = W;
+			active[j] = true;
 		}
 
-		shadowed = scene->isShadowed(state, lightRay, mask_obj_index, mask_mat_index);
+		traceShadowStream(state, count, aoRays, active, transparent, shadowedS, scols, mask_obj_index, mask_mat_index, objIdx, matIdx);
 
-		if(!shadowed)
+		for(int j = 0; j < count; ++j)
 		{
-			float cos = std::fabs(sp.N * lightRay.dir);
-			//if(trShad) col += aoCol * scol * surfCol * cos * W;
-			col += aoCol * surfCol * cos * W;
+			col += emitCols[j];
+
+			if(!shadowedS[j])
+			{
+				float cos = std::fabs(sp.N * aoRays[j].dir);
+				if(transparent) col += aoCol * scols[j] * surfCols[j] * cos * Ws[j];
+				else col += aoCol * surfCols[j] * cos * Ws[j];
+			}
 		}
 	}
 
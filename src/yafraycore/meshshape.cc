@@ -0,0 +1,29 @@
+#include <yafraycore/meshshape.h>
+#include <yafraycore/meshtypes.h>
+#include <yafraycore/bvh.h>
+#include <utilities/sample_utils.h>
+
+__BEGIN_YAFRAY
+
+meshShape_t::meshShape_t(triangleObject_t *mesh): areaDist(nullptr), area(0.0), tree(nullptr)
+{
+	tris.resize(mesh->numPrimitives());
+	if(tris.empty()) return;
+	mesh->getPrimitives(&tris[0]);
+	std::vector<float> areas(tris.size());
+	for(size_t i=0; i<tris.size(); ++i)
+	{
+		areas[i] = tris[i]->surfaceArea();
+		area += areas[i];
+	}
+	areaDist = new pdf1D_t(&areas[0], nTris());
+	tree = new triBVH_t(&tris[0], nTris());
+}
+
+meshShape_t::~meshShape_t()
+{
+	delete areaDist;
+	delete tree;
+}
+
+__END_YAFRAY
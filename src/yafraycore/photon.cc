@@ -1,8 +1,53 @@
 
 #include <yafraycore/photon.h>
+#include <core_api/scene.h>
+#include <core_api/light.h>
+#include <utilities/hashUtils.h>
+#include <yafraycore/timer.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstring>
 
 __BEGIN_YAFRAY
 
+#define PHOTONMAP_FILE_VERSION 1
+#define PHOTONMAP_FILE_ALIGN 64 //!< alignment of the arrays in a map file
+#define PHOTONMAP_BYTE_ORDER 0x01020304
+
+/*! Header of a binary photon map file. The photons in the leaf order of the tree,
+	the element positions and the nodes of the tree follow at the given offsets.
+	Nodes only refer to other nodes and to photons by index, so the file is mapped
+	into memory and used as it is. Maps saved without a tree have no nodes and positions */
+struct photonMapFileHeader_t
+{
+	char magic[8];
+	u_int32 version;
+	u_int32 byteOrder;
+	u_int32 photonSize, nodeSize, leafSize; //!< layout checks, these depend on the build options
+	u_int32 nPhotons, nNodes, nPositions;
+	int32_t paths;
+	float searchRadius;
+	float bound[6];
+	uint64_t fingerprint;
+	uint64_t photonOffset, positionOffset, nodeOffset, fileSize;
+};
+
+static const char photonMapMagic[8] = { 'Y', 'A', 'F', 'P', 'M', 'A', 'P', 0 };
+
+//! the mapping of a loaded map file, it stays open while the map uses the file
+struct photonMapFile_t
+{
+	photonMapFile_t(const std::string &filename): mapping(filename.c_str(), boost::interprocess::read_only),
+		region(mapping, boost::interprocess::read_only) {}
+	boost::interprocess::file_mapping mapping;
+	boost::interprocess::mapped_region region;
+};
+
+static uint64_t photonMapAlign(uint64_t offset)
+{
+	return (offset + PHOTONMAP_FILE_ALIGN - 1) & ~(uint64_t)(PHOTONMAP_FILE_ALIGN - 1);
+}
+
 YAFRAYCORE_EXPORT dirConverter_t dirconverter;
 
 dirConverter_t::dirConverter_t()
@@ -40,42 +85,130 @@ void photonGather_t::operator()(const photon_t *photon, float dist2, float &maxD
 		}
 	}
 	else {
-		// Remove most distant photon from heap and add new photon
-		std::pop_heap(&photons[0], &photons[nLookup]);
-		photons[nLookup-1] = foundPhoton_t(photon, dist2);
-		std::push_heap(&photons[0], &photons[nLookup]);
+		// Replace the most distant photon at the top of the heap and sift the new one down,
+		// it is closer than the top or the tree would not have handed it to us
+		foundPhoton_t newPhoton(photon, dist2);
+		u_int32 i = 0, child;
+		while((child = 2*i + 1) < nLookup)
+		{
+			if(child + 1 < nLookup && photons[child] < photons[child + 1]) ++child;
+			if(!(newPhoton < photons[child])) break;
+			photons[i] = photons[child];
+			i = child;
+		}
+		photons[i] = newPhoton;
 		maxDistSquared = photons[0].distSquare;
 	}
 }
 
-bool photonMapLoad(photonMap_t * map, const std::string &filename, bool debugXMLformat)
+uint64_t photonMapFingerprint(const scene_t *scene, const std::string &params)
 {
-	try
+	uint64_t h = hashBytes(params.data(), params.size());
+	h = hashValue(scene->geometryHash(), h);
+	h = hashValue(scene->materialHash(), h);
+	h = hashValue(scene->lights.size(), h);
+	for(const light_t *light : scene->lights)
 	{
-		std::ifstream ifs(filename, std::fstream::binary);
-		
-		if(debugXMLformat)
+		h = hashValue(light->totalEnergy(), h);
+		// photons emitted with fixed samples change when the light is moved or reshaped
+		for(int i=0; i<4; ++i)
+		{
+			float s = 0.125f + 0.25f * i;
+			ray_t ray;
+			float ipdf = 0.f;
+			color_t pcol = light->emitPhoton(s, 1.f - s, s, 1.f - s, ray, ipdf);
+			h = hashValue(pcol, h);
+			h = hashValue(ray.from, h);
+			h = hashValue(ray.dir, h);
+			h = hashValue(ipdf, h);
+		}
+	}
+	return h;
+}
+
+bool photonMapLoad(photonMap_t * map, const std::string &filename, uint64_t fingerprint, bool debugXMLformat)
+{
+	if(debugXMLformat)
+	{
+		try
 		{
+			std::ifstream ifs(filename, std::fstream::binary);
 			boost::archive::xml_iarchive ia(ifs);
 			map->clear();
 			ia >> BOOST_SERIALIZATION_NVP(*map);
 			ifs.close();
 		}
-		else
+		catch(std::exception& ex){
+			// elminate any dangling references
+			map->clear();
+			Y_WARNING << "PhotonMap: error '" << ex.what() << "' while loading photon map file: '" << filename << "'" << yendl;
+			return false;
+		}
+		if(map->fingerprint != fingerprint)
 		{
-			boost::archive::binary_iarchive ia(ifs);
 			map->clear();
-			ia >> BOOST_SERIALIZATION_NVP(*map);
-			ifs.close();
+			Y_WARNING << "PhotonMap: photon map file '" << filename << "' was made for a different scene or photon settings" << yendl;
+			return false;
 		}
 		return true;
 	}
+
+	map->clear();
+	photonMapFile_t *file = nullptr;
+	try
+	{
+		file = new photonMapFile_t(filename);
+	}
 	catch(std::exception& ex){
-        // elminate any dangling references
-        map->clear();
-        Y_WARNING << "PhotonMap: error '" << ex.what() << "' while loading photon map file: '" << filename << "'" << yendl;
+		Y_WARNING << "PhotonMap: error '" << ex.what() << "' while loading photon map file: '" << filename << "'" << yendl;
 		return false;
-    }
+	}
+
+	const char *data = (const char *)file->region.get_address();
+	size_t size = file->region.get_size();
+	const photonMapFileHeader_t *h = (const photonMapFileHeader_t *)data;
+	const char *error = nullptr;
+
+	if(size < sizeof(photonMapFileHeader_t) || std::memcmp(h->magic, photonMapMagic, sizeof(photonMapMagic)) != 0) error = "not a photon map file";
+	else if(h->version != PHOTONMAP_FILE_VERSION) error = "unsupported file version";
+	else if(h->byteOrder != PHOTONMAP_BYTE_ORDER || h->photonSize != sizeof(photon_t) ||
+			h->nodeSize != sizeof(kdtree::kdNode<photon_t>) || h->leafSize != PKD_LEAF_SIZE) error = "saved by an incompatible build";
+	else if(h->fileSize != size ||
+			h->photonOffset + (uint64_t)h->nPhotons * sizeof(photon_t) > size ||
+			h->positionOffset + (uint64_t)h->nPositions * sizeof(float) > size ||
+			h->nodeOffset + (uint64_t)h->nNodes * sizeof(kdtree::kdNode<photon_t>) > size) error = "file is truncated";
+	else if(h->nNodes > 0 && h->nPositions != 3 * (h->nPhotons + PKD_LEAF_SIZE)) error = "corrupted tree";
+	else if(h->fingerprint != fingerprint) error = "made for a different scene or photon settings";
+
+	if(error)
+	{
+		Y_WARNING << "PhotonMap: cannot use photon map file '" << filename << "': " << error << yendl;
+		delete file;
+		return false;
+	}
+
+	map->paths = h->paths;
+	map->searchRadius = h->searchRadius;
+	map->fingerprint = h->fingerprint;
+	const photon_t *photons = (const photon_t *)(data + h->photonOffset);
+
+	if(h->nNodes == 0)
+	{
+		// saved without a tree, build it from a copy of the photons
+		map->photons.assign(photons, photons + h->nPhotons);
+		delete file;
+		map->updateTree();
+		return true;
+	}
+
+	bound_t bound(point3d_t(h->bound[0], h->bound[1], h->bound[2]), point3d_t(h->bound[3], h->bound[4], h->bound[5]));
+	map->file = file;
+	map->filePhotons = photons;
+	map->nFilePhotons = h->nPhotons;
+	map->tree = new kdtree::pointKdTree<photon_t>((const kdtree::kdNode<photon_t> *)(data + h->nodeOffset), h->nNodes,
+			photons, (const float *)(data + h->positionOffset), h->nPhotons, bound);
+	map->updated = true;
+	return true;
 }
 
 bool photonMapSave(const photonMap_t * map, const std::string &filename, bool debugXMLformat)
@@ -83,19 +216,54 @@ bool photonMapSave(const photonMap_t * map, const std::string &filename, bool de
 	try
 	{
 		std::ofstream ofs(filename, std::fstream::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
 
 		if(debugXMLformat)
 		{
 			boost::archive::xml_oarchive oa(ofs);
 			oa << BOOST_SERIALIZATION_NVP(*map);
 			ofs.close();
+			return true;
 		}
-		else
+
+		// the photons are in leaf order once the tree is built, see updateTree()
+		const kdtree::pointKdTree<photon_t> *tree = map->ready() ? map->tree : nullptr;
+		const photon_t *photons = map->file ? map->filePhotons : map->photons.data();
+
+		photonMapFileHeader_t h;
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, photonMapMagic, sizeof(photonMapMagic));
+		h.version = PHOTONMAP_FILE_VERSION;
+		h.byteOrder = PHOTONMAP_BYTE_ORDER;
+		h.photonSize = sizeof(photon_t);
+		h.nodeSize = sizeof(kdtree::kdNode<photon_t>);
+		h.leafSize = PKD_LEAF_SIZE;
+		h.nPhotons = map->nPhotons();
+		h.nNodes = tree ? tree->nNodes() : 0;
+		h.nPositions = tree ? tree->nPositions() : 0;
+		h.paths = map->paths;
+		h.searchRadius = map->searchRadius;
+		if(tree)
 		{
-			boost::archive::binary_oarchive oa(ofs);
-			oa << BOOST_SERIALIZATION_NVP(*map);
-			ofs.close();
+			const bound_t &b = tree->getBound();
+			float bound[6] = { b.a.x, b.a.y, b.a.z, b.g.x, b.g.y, b.g.z };
+			std::memcpy(h.bound, bound, sizeof(bound));
 		}
+		h.fingerprint = map->fingerprint;
+		h.photonOffset = photonMapAlign(sizeof(h));
+		h.positionOffset = photonMapAlign(h.photonOffset + (uint64_t)h.nPhotons * sizeof(photon_t));
+		h.nodeOffset = photonMapAlign(h.positionOffset + (uint64_t)h.nPositions * sizeof(float));
+		h.fileSize = h.nodeOffset + (uint64_t)h.nNodes * sizeof(kdtree::kdNode<photon_t>);
+
+		const char zeros[PHOTONMAP_FILE_ALIGN] = { 0 };
+		ofs.write((const char *)&h, sizeof(h));
+		ofs.write(zeros, h.photonOffset - sizeof(h));
+		ofs.write((const char *)photons, (uint64_t)h.nPhotons * sizeof(photon_t));
+		ofs.write(zeros, h.positionOffset - (h.photonOffset + (uint64_t)h.nPhotons * sizeof(photon_t)));
+		if(tree) ofs.write((const char *)tree->getPositions(), (uint64_t)h.nPositions * sizeof(float));
+		ofs.write(zeros, h.nodeOffset - (h.positionOffset + (uint64_t)h.nPositions * sizeof(float)));
+		if(tree) ofs.write((const char *)tree->getNodes(), (uint64_t)h.nNodes * sizeof(kdtree::kdNode<photon_t>));
+		ofs.close();
 		return true;
 	}
 	catch(std::exception& ex){
@@ -104,15 +272,58 @@ bool photonMapSave(const photonMap_t * map, const std::string &filename, bool de
     }
 }
 
+photonMap_t::~photonMap_t()
+{
+	clear();
+	delete spareTree;
+}
+
+void photonMap_t::clear()
+{
+	photons.clear();
+	// a built tree keeps its arrays for the next updateTree(), unless they belong to a mapped file
+	if(tree && !file)
+	{
+		delete spareTree;
+		spareTree = tree;
+	}
+	else delete tree;
+	tree = nullptr;
+	delete file;
+	file = nullptr;
+	filePhotons = nullptr;
+	nFilePhotons = 0;
+	fingerprint = 0;
+	updated=false;
+}
+
 void photonMap_t::updateTree()
 {
-	if(tree) delete tree;
+	if(file) return; // the tree of a mapped file is complete
+	if(!tree)
+	{
+		tree = spareTree;
+		spareTree = nullptr;
+	}
 	if(photons.size() > 0)
 	{
-		tree = new kdtree::pointKdTree<photon_t>(photons, name, threadsPKDtree);
+		timer_t buildTimer;
+		buildTimer.addEvent("build");
+		buildTimer.start("build");
+		if(tree) tree->build(photons, name, threadsPKDtree);
+		else tree = new kdtree::pointKdTree<photon_t>(photons, name, threadsPKDtree);
+		// photons found together are stored together
+		tree->reorder(photons);
+		buildTimer.stop("build");
+		Y_INFO << "photonMap: " << name << " kd-tree over " << photons.size() << " photons built in " << buildTimer.getTime("build") << "s" << yendl;
 		updated = true;
 	}
-	else tree=0;
+	else if(tree)
+	{
+		delete spareTree;
+		spareTree = tree;
+		tree = nullptr;
+	}
 }
 
 int photonMap_t::gather(const point3d_t &P, foundPhoton_t *found, unsigned int K, float &sqRadius) const
@@ -30,13 +30,20 @@
 #include <yafraycore/triangle.h>
 #include <yafraycore/kdtree.h>
 #include <yafraycore/ray_kdtree.h>
+#include <yafraycore/bvh.h>
+#include <yafraycore/instancetree.h>
+#include <yafraycore/lighttree.h>
+#include <yafraycore/meshshape.h>
 #include <yafraycore/timer.h>
 #include <yafraycore/scr_halton.h>
 #include <utilities/mcqmc.h>
 #include <utilities/sample_utils.h>
+#include <utilities/hashUtils.h>
 #ifdef __APPLE__
 	#include <sys/sysctl.h>
 #endif
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <limits>
 #include <sstream>
@@ -46,7 +53,7 @@
 
 __BEGIN_YAFRAY
 
-scene_t::scene_t(const renderEnvironment_t *render_environment):  volIntegrator(nullptr), camera(nullptr), imageFilm(nullptr), tree(nullptr), vtree(nullptr), background(nullptr), surfIntegrator(nullptr),	AA_samples(1), AA_passes(1), AA_threshold(0.05), nthreads(1), nthreads_photons(1), mode(1), signals(0), env(render_environment)
+scene_t::scene_t(const renderEnvironment_t *render_environment):  volIntegrator(nullptr), camera(nullptr), imageFilm(nullptr), tree(nullptr), bvh(nullptr), instTree(nullptr), vtree(nullptr), lightTree(nullptr), background(nullptr), surfIntegrator(nullptr),	AA_samples(1), AA_passes(1), AA_threshold(0.05), nthreads(1), nthreads_photons(1), kdBuildQuality(KD_QUALITY_HIGH), kdBuildBins(0), mode(1), accelerator(ACCEL_KDTREE), signals(0), env(render_environment)
 {
 	state.changes = C_ALL;
 	state.stack.push_front(READY);
@@ -68,7 +75,11 @@ scene_t::scene_t(const renderEnvironment_t *render_environment):  volIntegrator(
 scene_t::~scene_t()
 {
 	if(tree) delete tree;
+	if(bvh) delete bvh;
+	if(instTree) delete instTree;
 	if(vtree) delete vtree;
+	if(lightTree) delete lightTree;
+	for(auto &slot : meshShapes) delete slot.second.shape;
 	for(auto i = meshes.begin(); i != meshes.end(); ++i)
 	{
 		if(i->second.type == TRIM)
@@ -422,6 +433,19 @@ void scene_t::setNumThreadsPhotons(int threads_photons)
 	Y_PARAMS << "Using for Photon Mapping [" << nthreads_photons << "] Threads." << yendl;
 }
 
+void scene_t::setAccelerator(int accel)
+{
+	accelerator = accel;
+	Y_PARAMS << "Scene: ray accelerator: " << ((accelerator == ACCEL_BVH) ? "BVH" : "Kd-Tree") << yendl;
+}
+
+void scene_t::setKdTreeBuildQuality(int quality, int bins)
+{
+	kdBuildQuality = quality;
+	kdBuildBins = bins;
+	Y_PARAMS << "Kd-Tree build quality: " << kdBuildQualityName(kdBuildQuality) << " (" << (kdBuildBins > 0 ? std::to_string(kdBuildBins) : "default") << " bins)" << yendl;
+}
+
 #define prepareEdges(q, v1, v2) e1 = vertices[v1] - vertices[q]; \
 			e2 = vertices[v2] - vertices[q];
 
@@ -779,6 +803,19 @@ triangleObject_t* scene_t::getMesh(objID_t id) const
 	return (i==meshes.end()) ? 0 : i->second.obj;
 }
 
+const meshShape_t* scene_t::getMeshShape(objID_t id)
+{
+	triangleObject_t *mesh = getMesh(id);
+	if(!mesh) return nullptr;
+	meshShapeSlot_t *slot;
+	{
+		std::lock_guard<std::mutex> lock(meshShapesMutex);
+		slot = &meshShapes[id];
+	}
+	std::call_once(slot->built, [slot, mesh]() { slot->shape = new meshShape_t(mesh); });
+	return slot->shape;
+}
+
 object3d_t* scene_t::getObject(objID_t id) const
 {
 	auto i = meshes.find(id);
@@ -800,6 +837,79 @@ bound_t scene_t::getSceneBound() const
 	return sceneBound;
 }
 
+uint64_t scene_t::geometryHash() const
+{
+	uint64_t h = hashValue(meshes.size());
+	for(auto &m : meshes)
+	{
+		h = hashValue(m.first, h);
+		const triangleObject_t *obj = m.second.obj;
+		const meshObject_t *mobj = m.second.mobj;
+		if(obj && obj->isInstance())
+		{
+			// the base mesh is hashed by its own entry
+			const triangleObjectInstance_t *inst = static_cast<const triangleObjectInstance_t *>(obj);
+			h = hashValue(inst->getObjToWorld(), h);
+			h = hashValue(inst->mBase->points.size(), h);
+		}
+		else if(obj)
+		{
+			if(!obj->points.empty()) h = hashBytes(&obj->points[0], obj->points.size() * sizeof(point3d_t), h);
+			if(!obj->normals.empty()) h = hashBytes(&obj->normals[0], obj->normals.size() * sizeof(normal_t), h);
+			for(const triangle_t &t : obj->triangles)
+			{
+				int idx[3] = { t.pa, t.pb, t.pc };
+				h = hashValue(idx, h);
+			}
+		}
+		else if(mobj)
+		{
+			if(!mobj->points.empty()) h = hashBytes(&mobj->points[0], mobj->points.size() * sizeof(point3d_t), h);
+			if(!mobj->normals.empty()) h = hashBytes(&mobj->normals[0], mobj->normals.size() * sizeof(normal_t), h);
+			for(const vTriangle_t &t : mobj->triangles)
+			{
+				int idx[3] = { t.pa, t.pb, t.pc };
+				h = hashValue(idx, h);
+			}
+			for(const bsTriangle_t &t : mobj->s_triangles)
+			{
+				int idx[3] = { t.pa, t.pb, t.pc };
+				h = hashValue(idx, h);
+			}
+		}
+	}
+	h = hashValue(objects.size(), h);
+	return hashValue(sceneBound, h);
+}
+
+//! hash of a material assignment, by the parameters of the material
+static inline uint64_t hashMaterial(const material_t *mat, uint64_t h)
+{
+	return hashValue(mat ? mat->getParamsHash() : 0, h);
+}
+
+uint64_t scene_t::materialHash() const
+{
+	uint64_t h = hashValue(meshes.size());
+	for(auto &m : meshes)
+	{
+		h = hashValue(m.first, h);
+		const triangleObject_t *obj = m.second.obj;
+		const meshObject_t *mobj = m.second.mobj;
+		// instances use the materials of their base mesh, hashed by its own entry
+		if(obj && !obj->isInstance())
+		{
+			for(const triangle_t &t : obj->triangles) h = hashMaterial(t.getMaterial(), h);
+		}
+		else if(mobj)
+		{
+			for(const vTriangle_t &t : mobj->triangles) h = hashMaterial(t.getMaterial(), h);
+			for(const bsTriangle_t &t : mobj->s_triangles) h = hashMaterial(t.getMaterial(), h);
+		}
+	}
+	return h;
+}
+
 void scene_t::setAntialiasing(int numSamples, int numPasses, int incSamples, double threshold, float resampled_floor, float sample_multiplier_factor, float light_sample_multiplier_factor, float indirect_sample_multiplier_factor, bool detect_color_noise, int dark_detection_type, float dark_threshold_factor, int variance_edge_size, int variance_pixels, float clamp_samples, float clamp_indirect)
 {
 	AA_samples = std::max(1, numSamples);
@@ -830,11 +940,17 @@ bool scene_t::update()
 	if(state.changes & C_GEOM)
 	{
 		if(tree) delete tree;
+		if(bvh) delete bvh;
+		if(instTree) delete instTree;
 		if(vtree) delete vtree;
-		tree = nullptr, vtree = nullptr;
+		tree = nullptr, bvh = nullptr, instTree = nullptr, vtree = nullptr;
+		for(auto &slot : meshShapes) delete slot.second.shape;
+		meshShapes.clear();
 		int nprims=0;
 		if(mode==0)
 		{
+			// instances are not flattened, they share the tree of their base mesh
+			std::vector<const triangleObjectInstance_t *> insts;
 			for(auto i=meshes.begin(); i!=meshes.end(); ++i)
 			{
                 objData_t &dat = (*i).second;
@@ -842,7 +958,8 @@ bool scene_t::update()
                 if (!dat.obj->isVisible()) continue;
                 if (dat.obj->isBaseObject()) continue;
 
-				if(dat.type == TRIM) nprims += dat.obj->numPrimitives();
+				if(dat.obj->isInstance()) insts.push_back(static_cast<const triangleObjectInstance_t *>(dat.obj));
+				else if(dat.type == TRIM) nprims += dat.obj->numPrimitives();
 			}
 			if(nprims > 0)
 			{
@@ -854,12 +971,30 @@ bool scene_t::update()
 
 					if (!dat.obj->isVisible()) continue;
 					if (dat.obj->isBaseObject()) continue;
+					if (dat.obj->isInstance()) continue;
 
 					if(dat.type == TRIM) insert += dat.obj->getPrimitives(insert);
 				}
-				tree = new triKdTree_t(tris, nprims, -1, 1, 0.8, 0.33 /* -1, 1.2, 0.40 */ );
+				if(accelerator == ACCEL_BVH)
+				{
+					bvh = new triBVH_t(tris, nprims, 1.f, kdBuildQuality, kdBuildBins);
+					sceneBound = bvh->getBound();
+				}
+				else
+				{
+					tree = new triKdTree_t(tris, nprims, -1, 1, 0.8, 0.33 /* -1, 1.2, 0.40 */, nthreads, kdBuildQuality, kdBuildBins);
+					sceneBound = tree->getBound();
+				}
 				delete [] tris;
-				sceneBound = tree->getBound();
+			}
+			if(!insts.empty())
+			{
+				instTree = new triInstanceTree_t(insts, accelerator, nthreads, kdBuildQuality, kdBuildBins);
+				if(nprims > 0) sceneBound = bound_t(sceneBound, instTree->getBound());
+				else sceneBound = instTree->getBound();
+			}
+			if(nprims > 0 || !insts.empty())
+			{
 				Y_VERBOSE << "Scene: New scene bound is:" <<
 				"(" << sceneBound.a.x << ", " << sceneBound.a.y << ", " << sceneBound.a.z << "), (" <<
 				sceneBound.g.x << ", " << sceneBound.g.y << ", " << sceneBound.g.z << ")" << yendl;
@@ -873,6 +1008,7 @@ bool scene_t::update()
 		}
 		else
 		{
+			if(accelerator == ACCEL_BVH) Y_WARNING << "Scene: BVH is only supported in triangle mode, using the kd-tree" << yendl;
 			for(auto i=meshes.begin(); i!=meshes.end(); ++i)
 			{
 				objData_t &dat = (*i).second;
@@ -896,7 +1032,7 @@ bool scene_t::update()
 				{
 					insert += i->second->getPrimitives(insert);
 				}
-				vtree = new kdTree_t<primitive_t>(tris, nprims, -1, 1, 0.8, 0.33 /* -1, 1.2, 0.40 */ );
+				vtree = new kdTree_t<primitive_t>(tris, nprims, -1, 1, 0.8, 0.33 /* -1, 1.2, 0.40 */, nthreads, kdBuildQuality, kdBuildBins);
 				delete [] tris;
 				sceneBound = vtree->getBound();
 				Y_VERBOSE << "Scene: New scene bound is:" << yendl <<
@@ -913,7 +1049,33 @@ bool scene_t::update()
 		}
 	}
 
-	for(unsigned int i=0; i<lights.size(); ++i) lights[i]->init(*this);
+	if(background) background->init(*this);
+	// lights that only prepare their own data (mesh lights building their BVH) share out the work
+	std::vector<light_t *> parallelLights;
+	for(unsigned int i=0; i<lights.size(); ++i)
+	{
+		if(lights[i]->initInParallel()) parallelLights.push_back(lights[i]);
+		else lights[i]->init(*this);
+	}
+	int initThreads = std::min<int>(nthreads, parallelLights.size());
+	if(initThreads > 1)
+	{
+		std::atomic<size_t> next(0);
+		threadPool_t pool(initThreads);
+		pool.run([this, &parallelLights, &next](int threadID)
+		{
+			for(size_t i = next++; i < parallelLights.size(); i = next++) parallelLights[i]->init(*this);
+		});
+		pool.wait();
+	}
+	else for(auto light : parallelLights) light->init(*this);
+	// changes to the meshes shared with the scene happen one light at a time
+	for(auto light : lights) light->postInit(*this);
+
+	// the emission bounds of mesh lights are known after init()
+	if(lightTree) delete lightTree;
+	lightTree = new lightTree_t(lights);
+	Y_VERBOSE << "Scene: Light tree: " << lightTree->nTreeLights() << " lights in " << lightTree->nNodes() << " nodes, " << lightTree->nInfiniteLights() << " lights without bound" << yendl;
 
 	if(!surfIntegrator)
 	{
@@ -944,11 +1106,26 @@ bool scene_t::intersect(const ray_t &ray, surfacePoint_t &sp) const
 	// intersect with tree:
 	if(mode == 0)
 	{
-		if(!tree) return false;
 		triangle_t *hitt=0;
-		if( ! tree->Intersect(ray, dis, &hitt, Z, data) ){ return false; }
+		bool hit = false;
+		if(bvh) hit = bvh->Intersect(ray, dis, &hitt, Z, data);
+		else if(tree) hit = tree->Intersect(ray, dis, &hitt, Z, data);
+		const triangleObjectInstance_t *hitInst=nullptr;
+		if(instTree)
+		{
+			triangle_t *instHitt=0;
+			float instZ;
+			intersectData_t instData;
+			if(instTree->Intersect(ray, hit ? Z : dis, &instHitt, &hitInst, instZ, instData))
+			{
+				hitt = instHitt, Z = instZ, data = instData;
+				hit = true;
+			}
+		}
+		if(!hit) return false;
 		point3d_t h=ray.from + Z*ray.dir;
-		hitt->getSurface(sp, h, data);
+		if(hitInst) hitInst->getSurface(sp, hitt, h, data);
+		else hitt->getSurface(sp, h, data);
 		sp.origin = hitt;
 		sp.data = data;
 		sp.ray = nullptr;
@@ -977,11 +1154,26 @@ bool scene_t::intersect(const diffRay_t &ray, surfacePoint_t &sp) const
 	// intersect with tree:
 	if(mode == 0)
 	{
-		if(!tree) return false;
 		triangle_t *hitt=0;
-		if( ! tree->Intersect(ray, dis, &hitt, Z, data) ){ return false; }
+		bool hit = false;
+		if(bvh) hit = bvh->Intersect(ray, dis, &hitt, Z, data);
+		else if(tree) hit = tree->Intersect(ray, dis, &hitt, Z, data);
+		const triangleObjectInstance_t *hitInst=nullptr;
+		if(instTree)
+		{
+			triangle_t *instHitt=0;
+			float instZ;
+			intersectData_t instData;
+			if(instTree->Intersect(ray, hit ? Z : dis, &instHitt, &hitInst, instZ, instData))
+			{
+				hitt = instHitt, Z = instZ, data = instData;
+				hit = true;
+			}
+		}
+		if(!hit) return false;
 		point3d_t h=ray.from + Z*ray.dir;
-		hitt->getSurface(sp, h, data);
+		if(hitInst) hitInst->getSurface(sp, hitt, h, data);
+		else hitt->getSurface(sp, h, data);
 		sp.origin = hitt;
 		sp.data = data;
 		sp.ray = &ray;
@@ -1013,11 +1205,15 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, float &obj_inde
 	if(mode==0)
 	{
 		triangle_t *hitt=0;
-		if(!tree) return false;
-		bool shadowed = tree->IntersectS(sray, dis, &hitt, shadowBias);
+		const triangleObjectInstance_t *hitInst=nullptr;
+		bool shadowed = false;
+		if(bvh) shadowed = bvh->IntersectS(sray, dis, &hitt, shadowBias);
+		else if(tree) shadowed = tree->IntersectS(sray, dis, &hitt, shadowBias);
+		if(!shadowed && instTree) shadowed = instTree->IntersectS(sray, dis, &hitt, &hitInst, shadowBias);
 		if(hitt)
 		{
-			if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+			if(hitInst) obj_index = hitInst->getAbsObjectIndex();	//Object index of the object casting the shadow
+			else if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
 			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
 		}
 		return shadowed;
@@ -1050,14 +1246,17 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, c
 	if(mode==0)
 	{
 		triangle_t *hitt=0;
-		if(tree) 
+		const triangleObjectInstance_t *hitInst=nullptr;
+		int layers = 0;
+		if(bvh) isect = bvh->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias, nullptr, &layers);
+		else if(tree) isect = tree->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias, nullptr, &layers);
+		// the transparency of the instances multiplies into the same filter, with the depth left
+		if(!isect && instTree) isect = instTree->IntersectTS(state, sray, maxDepth - layers, dis, &hitt, &hitInst, filt, shadowBias);
+		if(hitt)
 		{
-			isect = tree->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
-			if(hitt)
-			{
-				if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
-				if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
-			}
+			if(hitInst) obj_index = hitInst->getAbsObjectIndex();	//Object index of the object casting the shadow
+			else if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
 		}
 	}
 	else
@@ -1076,6 +1275,79 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, c
 	return isect;
 }
 
+static inline int rayOctant(const vector3d_t &d)
+{
+	return (d.x < 0.f) | ((d.y < 0.f) << 1) | ((d.z < 0.f) << 2);
+}
+
+/*! Orders the n rays of a stream by the octant of their direction, keeping their order within an octant.
+	octStart gets the start of each octant in order, octStart[8] is n */
+static void rayStreamOrder(int n, const ray_t *rays, int *order, int *octStart)
+{
+	int oct[RAY_STREAM_SIZE];
+	for(int i=0; i<9; ++i) octStart[i] = 0;
+	for(int k=0; k<n; ++k)
+	{
+		oct[k] = rayOctant(rays[k].dir);
+		++octStart[oct[k]+1];
+	}
+	for(int i=1; i<9; ++i) octStart[i] += octStart[i-1];
+	int pos[8];
+	for(int i=0; i<8; ++i) pos[i] = octStart[i];
+	for(int k=0; k<n; ++k) order[pos[oct[k]]++] = k;
+}
+
+void scene_t::isShadowed(renderState_t &state, int n, const ray_t *rays, bool *shadowed, float *obj_index, float *mat_index) const
+{
+	// only the BVH has a stream traversal, the other trees trace the rays one by one
+	if(!tracesRayStreams())
+	{
+		for(int k=0; k<n; ++k) shadowed[k] = isShadowed(state, rays[k], obj_index[k], mat_index[k]);
+		return;
+	}
+
+	// RAY_STREAM_SIZE must not exceed BVH_STREAM_SIZE
+	int order[RAY_STREAM_SIZE], octStart[9];
+	ray_t srays[RAY_STREAM_SIZE];
+	float dist[RAY_STREAM_SIZE];
+	triangle_t *hitt[RAY_STREAM_SIZE];
+	bool occluded[RAY_STREAM_SIZE];
+	for(int first=0; first<n; first+=RAY_STREAM_SIZE)
+	{
+		int count = std::min(n - first, RAY_STREAM_SIZE);
+		rayStreamOrder(count, rays + first, order, octStart);
+		for(int j=0; j<count; ++j)
+		{
+			const ray_t &ray = rays[first + order[j]];
+			srays[j] = ray;
+			srays[j].from += ray.dir * ray.tmin;
+			srays[j].time = state.time;
+			if(ray.tmax<0) dist[j] = std::numeric_limits<float>::infinity();
+			else dist[j] = ray.tmax - 2*ray.tmin;
+			hitt[j] = nullptr;
+			occluded[j] = false;
+		}
+		for(int o=0; o<8; ++o)
+		{
+			int s = octStart[o], on = octStart[o+1] - s;
+			if(on) bvh->IntersectS(on, srays + s, dist + s, hitt + s, occluded + s, shadowBias);
+		}
+		for(int j=0; j<count; ++j)
+		{
+			int k = first + order[j];
+			const triangleObjectInstance_t *hitInst=nullptr;
+			if(!occluded[j] && instTree) occluded[j] = instTree->IntersectS(srays[j], dist[j], &hitt[j], &hitInst, shadowBias);
+			shadowed[k] = occluded[j];
+			if(hitt[j])
+			{
+				if(hitInst) obj_index[k] = hitInst->getAbsObjectIndex();	//Object index of the object casting the shadow
+				else if(hitt[j]->getMesh()) obj_index[k] = hitt[j]->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+				if(hitt[j]->getMaterial()) mat_index[k] = hitt[j]->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
+			}
+		}
+	}
+}
+
 bool scene_t::render()
 {
 	sig_mutex.lock();
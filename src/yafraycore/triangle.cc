@@ -367,6 +367,17 @@ inline void triangleInstance_t::sample(float s1, float s2, point3d_t &p, vector3
 	n = getNormal();
 }
 
+// triangleObjectInstance_t Methods
+
+void triangleObjectInstance_t::getSurface(surfacePoint_t &sp, const triangle_t *tri, const point3d_t &hit, intersectData_t &data) const
+{
+	// the base tree returns object space edges
+	data.edge1 = objToWorld * data.edge1;
+	data.edge2 = objToWorld * data.edge2;
+	triangleInstance_t instTri(const_cast<triangle_t *>(tri), const_cast<triangleObjectInstance_t *>(this));
+	instTri.getSurface(sp, hit, data);
+}
+
 //==========================================
 // vTriangle_t methods, mosty c&p...
 //==========================================
@@ -4,6 +4,8 @@
 
 __BEGIN_YAFRAY
 
+#define DENSITY_DEFAULT_STEPS 16 //!< samples along the ray if tau() is not given a step length
+
 color_t DensityVolume::tau(const ray_t &ray, float stepSize, float offset)
 {
 		float t0 = -1, t1 = -1;
@@ -22,6 +24,9 @@ color_t DensityVolume::tau(const ray_t &ray, float stepSize, float offset)
 		
 		// distance travelled in the volume
 		float step = stepSize; // length between two sample points along the ray
+		// callers without a step length of their own, like the emission integrator, take a fixed number of samples
+		if (step <= 0.f) step = (t1 - t0) / DENSITY_DEFAULT_STEPS;
+		if (!(step > 0.f)) return color_t(0.f);
 		float pos = t0 + offset * step;
 		color_t tauVal(0.f);
 
@@ -73,42 +78,44 @@ inline double cosInter(double y1, double y2, double mu)
 	return y1 * (1.0f - mu2) + y2 * mu2;
 }
 
-float VolumeRegion::attenuation(const point3d_t p, light_t *l)
+float VolumeRegion::attenuation(const point3d_t p, const light_t *l) const
 {
-	if (attenuationGridMap.find(l) == attenuationGridMap.end())
+	auto g = attenuationGridMap.find(l);
+	if (g == attenuationGridMap.end() || g->second.values.empty())
 	{
 		Y_WARNING << "VolumeRegion: Attenuation Map is missing" << yendl;
+		return 0.f;
 	}
 
-	float* attenuationGrid = attenuationGridMap[l];
+	const attenuationGrid_t &grid = g->second;
 
-	float x = (p.x - bBox.a.x) / bBox.longX() * attGridX - 0.5f;
-	float y = (p.y - bBox.a.y) / bBox.longY() * attGridY - 0.5f;
-	float z = (p.z - bBox.a.z) / bBox.longZ() * attGridZ - 0.5f;
+	float x = (p.x - bBox.a.x) / bBox.longX() * grid.nx - 0.5f;
+	float y = (p.y - bBox.a.y) / bBox.longY() * grid.ny - 0.5f;
+	float z = (p.z - bBox.a.z) / bBox.longZ() * grid.nz - 0.5f;
 
 	//Check that the point is within the bounding box, return 0 if outside the box
 	if(x < -0.5f || y < -0.5f || z < -0.5f) return 0.f;
-	else if(x > (attGridX - 0.5f) || y > (attGridY - 0.5f) || z > (attGridZ - 0.5f)) return 0.f;
+	else if(x > (grid.nx - 0.5f) || y > (grid.ny - 0.5f) || z > (grid.nz - 0.5f)) return 0.f;
 
-	// cell vertices in which p lies
+	// cell centers around p, the border cells are extended to the bound
 	int x0 = max(0, floor(x));
 	int y0 = max(0, floor(y));
 	int z0 = max(0, floor(z));
 
-	int x1 = min(attGridX - 1, ceil(x));
-	int y1 = min(attGridY - 1, ceil(y));
-	int z1 = min(attGridZ - 1, ceil(z));
+	int x1 = min(grid.nx - 1, x0 + 1);
+	int y1 = min(grid.ny - 1, y0 + 1);
+	int z1 = min(grid.nz - 1, z0 + 1);
 
 	// offsets
-	float xd = x - x0;
-	float yd = y - y0;
-	float zd = z - z0;
+	float xd = max(0.f, min(1.f, x - x0));
+	float yd = max(0.f, min(1.f, y - y0));
+	float zd = max(0.f, min(1.f, z - z0));
 	
 	// trilinear combination
-	float i1 = attenuationGrid[x0 + y0 * attGridX + attGridY * attGridX * z0] * (1-zd) + attenuationGrid[x0 + y0 * attGridX + attGridY * attGridX * z1] * zd;
-	float i2 = attenuationGrid[x0 + y1 * attGridX + attGridY * attGridX * z0] * (1-zd) + attenuationGrid[x0 + y1 * attGridX + attGridY * attGridX * z1] * zd;
-	float j1 = attenuationGrid[x1 + y0 * attGridX + attGridY * attGridX * z0] * (1-zd) + attenuationGrid[x1 + y0 * attGridX + attGridY * attGridX * z1] * zd;
-	float j2 = attenuationGrid[x1 + y1 * attGridX + attGridY * attGridX * z0] * (1-zd) + attenuationGrid[x1 + y1 * attGridX + attGridY * attGridX * z1] * zd;
+	float i1 = grid.at(x0, y0, z0) * (1-zd) + grid.at(x0, y0, z1) * zd;
+	float i2 = grid.at(x0, y1, z0) * (1-zd) + grid.at(x0, y1, z1) * zd;
+	float j1 = grid.at(x1, y0, z0) * (1-zd) + grid.at(x1, y0, z1) * zd;
+	float j2 = grid.at(x1, y1, z0) * (1-zd) + grid.at(x1, y1, z1) * zd;
 	
 	float w1 = i1 * (1 - yd) + i2 * yd;
 	float w2 = j1 * (1 - yd) + j2 * yd;
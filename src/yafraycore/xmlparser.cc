@@ -293,6 +293,13 @@ void startEl_document(xmlParser_t &parser, const char *element, const char **att
 				if		(val == "triangle")  parser.scene->setMode(0);
 				else if	(val == "universal") parser.scene->setMode(1);
 			}
+			else if(!strcmp(attrs[0], "accelerator") )
+			{
+				std::string val(attrs[1]);
+				if		(val == "kdtree") parser.scene->setAccelerator(ACCEL_KDTREE);
+				else if	(val == "bvh")    parser.scene->setAccelerator(ACCEL_BVH);
+				else Y_WARNING << "XMLParser: unknown accelerator \"" << val << "\", using kdtree. Valid values are: kdtree, bvh" << yendl;
+			}
 		}
 		parser.pushState(startEl_scene, endEl_scene);
 	}